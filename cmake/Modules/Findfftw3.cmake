@@ -16,6 +16,9 @@ IF(WIN32)
 ELSEIF(UNIX)
 	find_library(FFTW3_LIBS fftw3 HINTS $ENV{HOME}/lib /usr/lib)
 	find_library(FFTW3F_LIBS fftw3f HINTS $ENV{HOME}/lib /usr/lib)
+	# optional: threaded FFTs for very large single wave functions
+	find_library(FFTW3F_THREADS_LIBS fftw3f_threads HINTS $ENV{HOME}/lib /usr/lib)
+	find_library(FFTW3_THREADS_LIBS fftw3_threads HINTS $ENV{HOME}/lib /usr/lib)
 ENDIF(WIN32)
 
 set(FFTW3_FOUND TRUE)
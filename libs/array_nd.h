@@ -0,0 +1,250 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARRAY_ND_H
+#define ARRAY_ND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "memory_arena.h"
+
+/**************************************************************
+ * Contiguous 2D and 3D arrays.
+ *
+ * Unlike the row pointer arrays of memory_fftw3 (float2D,
+ * complex2Df, ...) the elements are stored in one block aligned
+ * to ARRAY_ALIGNMENT bytes (enough for AVX-512 and for FFTW's
+ * SIMD alignment), and a[ix][iy] is computed as data[ix*ny+iy],
+ * without loading a row pointer, so that inner loops over iy can
+ * be vectorized.  a[ix] returns a pointer to row ix, so existing
+ * code using a[ix][iy], a[0][i] or a[ix][iy][0] (complex) keeps
+ * compiling unchanged.  Routines that still expect a row pointer
+ * array (T**) get one from Rows().  The memory is booked under the
+ * message tag (see memory_arena.h).
+ *
+ * Array2D<fftwf_complex> wave(nx,ny,"wave");
+ * wave[ix][iy][0] = 1;                        // real part
+ * Array2DView<fftwf_complex> w = trans[islice].Window(posx,posy,nx,ny);
+ * imageIO->WriteComplexImage((void **)wave.Rows(),fileName);
+ **************************************************************/
+
+/* a 2D window into an array: element [ix][iy] is origin[ix*stride+iy] */
+template <typename T>
+class Array2DView {
+	T *m_origin;
+	int m_nx,m_ny;
+	ptrdiff_t m_stride;
+public:
+	Array2DView() : m_origin(NULL), m_nx(0), m_ny(0), m_stride(0) {}
+	Array2DView(T *origin, int nx, int ny, ptrdiff_t stride) :
+		m_origin(origin), m_nx(nx), m_ny(ny), m_stride(stride) {}
+
+	T *operator[](int ix) const { return m_origin+ix*m_stride; }
+	T *Data() const { return m_origin; }
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	ptrdiff_t Stride() const { return m_stride; }
+	bool Contiguous() const { return m_stride == m_ny; }
+
+	/* window of nx x ny elements starting at [x0][y0] */
+	Array2DView<T> Window(int x0, int y0, int nx, int ny) const {
+		return Array2DView<T>(m_origin+x0*m_stride+y0,nx,ny,m_stride);
+	}
+};
+
+template <typename T>
+class Array2D {
+	T *m_data;
+	T **m_rows;
+	int m_nx,m_ny;
+
+	void Allocate(int nx, int ny, const char *message) {
+		m_nx = nx;
+		m_ny = ny;
+		m_data = NULL;
+		m_rows = NULL;
+		if ((nx <= 0) || (ny <= 0)) return;
+		m_data = (T *)alignedMalloc((size_t)nx*ny*sizeof(T),message);
+		m_rows = (T **)malloc(nx*sizeof(T *));
+		if (m_rows == NULL) {
+			printf("cannot allocate row pointers, size=%d: %s\n",nx,message);
+			exit(0);
+		}
+		for (int ix=0;ix<nx;ix++) m_rows[ix] = m_data+(size_t)ix*ny;
+	}
+public:
+	Array2D() : m_data(NULL), m_rows(NULL), m_nx(0), m_ny(0) {}
+	Array2D(int nx, int ny, const char *message = "Array2D") {
+		Allocate(nx,ny,message);
+		Zero();
+	}
+	Array2D(const Array2D<T> &other) {
+		Allocate(other.m_nx,other.m_ny,"Array2D copy");
+		if (m_data != NULL) memcpy(m_data,other.m_data,Size()*sizeof(T));
+	}
+	Array2D<T> &operator=(const Array2D<T> &other) {
+		if (this != &other) {
+			Free();
+			Allocate(other.m_nx,other.m_ny,"Array2D copy");
+			if (m_data != NULL) memcpy(m_data,other.m_data,Size()*sizeof(T));
+		}
+		return *this;
+	}
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1600))
+	Array2D(Array2D<T> &&other) :
+		m_data(other.m_data), m_rows(other.m_rows), m_nx(other.m_nx), m_ny(other.m_ny) {
+		other.m_data = NULL;
+		other.m_rows = NULL;
+		other.m_nx = other.m_ny = 0;
+	}
+	Array2D<T> &operator=(Array2D<T> &&other) {
+		if (this != &other) {
+			Free();
+			m_data = other.m_data; m_rows = other.m_rows;
+			m_nx = other.m_nx;     m_ny = other.m_ny;
+			other.m_data = NULL;   other.m_rows = NULL;
+			other.m_nx = other.m_ny = 0;
+		}
+		return *this;
+	}
+#endif
+	~Array2D() { Free(); }
+
+	/* (re)allocates the array, the contents are set to 0 */
+	void Resize(int nx, int ny, const char *message = "Array2D") {
+		Free();
+		Allocate(nx,ny,message);
+		Zero();
+	}
+	void Free() {
+		alignedFree(m_data);
+		free(m_rows);
+		m_data = NULL;
+		m_rows = NULL;
+		m_nx = m_ny = 0;
+	}
+	void Zero() { if (m_data != NULL) memset(m_data,0,Size()*sizeof(T)); }
+
+	T *operator[](int ix) { return m_data+(size_t)ix*m_ny; }
+	const T *operator[](int ix) const { return m_data+(size_t)ix*m_ny; }
+	T *Data() { return m_data; }
+	const T *Data() const { return m_data; }
+	/* row pointer array for routines that have not been converted yet */
+	T **Rows() const { return m_rows; }
+	bool Empty() const { return m_data == NULL; }
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	size_t Size() const { return (size_t)m_nx*m_ny; }
+
+	Array2DView<T> View() const { return Array2DView<T>(m_data,m_nx,m_ny,m_ny); }
+	Array2DView<T> Window(int x0, int y0, int nx, int ny) const { return View().Window(x0,y0,nx,ny); }
+};
+
+/* nz slices of nx x ny elements, a[iz] is a view of slice iz */
+template <typename T>
+class Array3D {
+	T *m_data;
+	T **m_rows;
+	int m_nz,m_nx,m_ny;
+
+	void Allocate(int nz, int nx, int ny, const char *message) {
+		m_nz = nz;
+		m_nx = nx;
+		m_ny = ny;
+		m_data = NULL;
+		m_rows = NULL;
+		if ((nz <= 0) || (nx <= 0) || (ny <= 0)) return;
+		m_data = (T *)alignedMalloc((size_t)nz*nx*ny*sizeof(T),message);
+		m_rows = (T **)malloc((size_t)nz*nx*sizeof(T *));
+		if (m_rows == NULL) {
+			printf("cannot allocate row pointers, size=%d: %s\n",nz*nx,message);
+			exit(0);
+		}
+		for (int i=0;i<nz*nx;i++) m_rows[i] = m_data+(size_t)i*ny;
+	}
+public:
+	Array3D() : m_data(NULL), m_rows(NULL), m_nz(0), m_nx(0), m_ny(0) {}
+	Array3D(int nz, int nx, int ny, const char *message = "Array3D") {
+		Allocate(nz,nx,ny,message);
+		Zero();
+	}
+	Array3D(const Array3D<T> &other) {
+		Allocate(other.m_nz,other.m_nx,other.m_ny,"Array3D copy");
+		if (m_data != NULL) memcpy(m_data,other.m_data,Size()*sizeof(T));
+	}
+	Array3D<T> &operator=(const Array3D<T> &other) {
+		if (this != &other) {
+			Free();
+			Allocate(other.m_nz,other.m_nx,other.m_ny,"Array3D copy");
+			if (m_data != NULL) memcpy(m_data,other.m_data,Size()*sizeof(T));
+		}
+		return *this;
+	}
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1600))
+	Array3D(Array3D<T> &&other) :
+		m_data(other.m_data), m_rows(other.m_rows), m_nz(other.m_nz), m_nx(other.m_nx), m_ny(other.m_ny) {
+		other.m_data = NULL;
+		other.m_rows = NULL;
+		other.m_nz = other.m_nx = other.m_ny = 0;
+	}
+	Array3D<T> &operator=(Array3D<T> &&other) {
+		if (this != &other) {
+			Free();
+			m_data = other.m_data; m_rows = other.m_rows;
+			m_nz = other.m_nz; m_nx = other.m_nx; m_ny = other.m_ny;
+			other.m_data = NULL;   other.m_rows = NULL;
+			other.m_nz = other.m_nx = other.m_ny = 0;
+		}
+		return *this;
+	}
+#endif
+	~Array3D() { Free(); }
+
+	/* (re)allocates the array, the contents are set to 0 */
+	void Resize(int nz, int nx, int ny, const char *message = "Array3D") {
+		Free();
+		Allocate(nz,nx,ny,message);
+		Zero();
+	}
+	void Free() {
+		alignedFree(m_data);
+		free(m_rows);
+		m_data = NULL;
+		m_rows = NULL;
+		m_nz = m_nx = m_ny = 0;
+	}
+	void Zero() { if (m_data != NULL) memset(m_data,0,Size()*sizeof(T)); }
+
+	Array2DView<T> operator[](int iz) const {
+		return Array2DView<T>(m_data+(size_t)iz*m_nx*m_ny,m_nx,m_ny,m_ny);
+	}
+	T *Data() { return m_data; }
+	const T *Data() const { return m_data; }
+	/* row pointer array of slice iz for routines that have not been converted yet */
+	T **Rows(int iz) const { return m_rows+(size_t)iz*m_nx; }
+	bool Empty() const { return m_data == NULL; }
+	int Nz() const { return m_nz; }
+	int Nx() const { return m_nx; }
+	int Ny() const { return m_ny; }
+	size_t Size() const { return (size_t)m_nz*m_nx*m_ny; }
+};
+
+#endif // ARRAY_ND_H
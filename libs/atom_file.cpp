@@ -0,0 +1,400 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "atom_file.h"
+#include "fileio_fftw3.h"
+
+#define ATOM_CACHE_MAGIC "QSTEMAC1"
+#define ATOM_CACHE_VERSION 1
+#define CFG_CHUNK_BYTES (1 << 20)   /* files are split into chunks of at least this size */
+
+/* header of the sidecar, followed by x,y,z,dw,occ,q (float) and Znum (int) of natom atoms */
+typedef struct atomCacheHeaderStruct {
+	char magic[8];
+	int version;
+	int natom;
+	double sourceSize;     // size and modification time of the structure file
+	double sourceTime;
+	double Mm[9];
+} atomCacheHeader;
+
+int mapFile(const char *fileName, mappedFile *file) {
+	file->data = NULL;
+	file->size = 0;
+	file->handle = NULL;
+#ifndef _WIN32
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(fileName,O_RDONLY)) < 0) return 0;
+	if (fstat(fd,&st) != 0) {
+		close(fd);
+		return 0;
+	}
+	file->size = (size_t)st.st_size;
+	if (file->size == 0) {
+		close(fd);
+		return 1;
+	}
+	p = mmap(NULL,file->size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		file->size = 0;
+		return 0;
+	}
+	madvise(p,file->size,MADV_WILLNEED);
+	file->data = (const char *)p;
+	return 1;
+#else
+	// no mmap: read the whole file
+	FILE *fp;
+	long size;
+
+	if ((fp = fopen(fileName,"rb")) == NULL) return 0;
+	fseek(fp,0,SEEK_END);
+	size = ftell(fp);
+	fseek(fp,0,SEEK_SET);
+	if ((size < 0) || ((file->handle = malloc(size+1)) == NULL) ||
+		(fread(file->handle,1,size,fp) != (size_t)size)) {
+		fclose(fp);
+		free(file->handle);
+		file->handle = NULL;
+		return 0;
+	}
+	fclose(fp);
+	file->data = (const char *)file->handle;
+	file->size = (size_t)size;
+	return 1;
+#endif
+}
+
+void unmapFile(mappedFile *file) {
+#ifndef _WIN32
+	if (file->data != NULL) munmap((void *)file->data,file->size);
+#else
+	free(file->handle);
+#endif
+	file->data = NULL;
+	file->size = 0;
+	file->handle = NULL;
+}
+
+int parseNumber(const char *&p, const char *end, double *value) {
+	static const double pow10[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,
+		1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+	const char *s = p,*t;
+	double m = 0;
+	int digits = 0,exp10 = 0,e = 0,neg = 0,eneg = 0;
+
+	while ((s < end) && ((*s == ' ') || (*s == '\t'))) s++;
+	if ((s < end) && ((*s == '-') || (*s == '+'))) neg = (*s++ == '-');
+	for (;(s < end) && (*s >= '0') && (*s <= '9');s++,digits++) m = 10*m+(*s-'0');
+	if ((s < end) && (*s == '.')) {
+		for (s++;(s < end) && (*s >= '0') && (*s <= '9');s++,digits++,exp10--) m = 10*m+(*s-'0');
+	}
+	if (digits == 0) return 0;
+	// exponent, only if it has digits
+	if ((s < end) && ((*s == 'e') || (*s == 'E') || (*s == 'd') || (*s == 'D'))) {
+		t = s+1;
+		if ((t < end) && ((*t == '-') || (*t == '+'))) eneg = (*t++ == '-');
+		if ((t < end) && (*t >= '0') && (*t <= '9')) {
+			for (;(t < end) && (*t >= '0') && (*t <= '9');t++) e = 10*e+(*t-'0');
+			exp10 += eneg ? -e : e;
+			s = t;
+		}
+	}
+	if (exp10 < 0) m = (exp10 >= -22) ? m/pow10[-exp10] : m*pow(10.0,exp10);
+	else if (exp10 > 0) m = (exp10 <= 22) ? m*pow10[exp10] : m*pow(10.0,exp10);
+	*value = neg ? -m : m;
+	p = s;
+	return 1;
+}
+
+static const char *endOfLine(const char *p, const char *end) {
+	const char *eol = (const char *)memchr(p,'\n',end-p);
+	return (eol == NULL) ? end : eol;
+}
+
+static const char *nextLine(const char *eol, const char *end) {
+	return (eol < end) ? eol+1 : end;
+}
+
+/* data lines of a CFG file between begin and end (both at line starts) */
+typedef struct cfgChunkStruct {
+	const char *begin,*end;
+	std::vector<atom> atoms;
+	int element;           // last element line of this chunk, 0 if none
+	double mass;           // last mass line of this chunk, 0 if none
+	size_t noElement;      // number of atoms before the first element line
+	size_t noMass;         // number of atoms before the first mass line
+	const char *badLine;   // incomplete data line, or NULL
+} cfgChunk;
+
+/* entryCount values per atom line, the Debye-Waller factor, occupancy and
+ * charge follow the positions (and velocities) if there are enough values */
+static void parseCFGChunk(cfgChunk *c, int entryCount, int dwIndex) {
+	const char *p,*s,*eol;
+	std::vector<double> v(entryCount);
+	char elem[4];
+	int n;
+	atom a;
+
+	c->element = 0;
+	c->mass = 0;
+	c->badLine = NULL;
+	for (p=c->begin;p<c->end;p=nextLine(eol,c->end)) {
+		eol = endOfLine(p,c->end);
+		for (s=p;(s < eol) && ((*s == ' ') || (*s == '\t'));s++);
+		if ((s == eol) || (*s == '\r') || (*s == '#')) continue;
+		// element line
+		if (isalpha((unsigned char)*s)) {
+			elem[0] = s[0];
+			elem[1] = (s+1 < eol) ? s[1] : '\0';
+			elem[2] = '\0';
+			if (c->element == 0) c->noElement = c->atoms.size();
+			c->element = getZNumber(elem);
+			if (c->element == 0) c->element = -1;   // unknown element, caught by the caller
+			continue;
+		}
+		for (n=0;(n < entryCount) && parseNumber(s,eol,&v[n]);n++);
+		// mass line
+		if (n == 1) {
+			if (c->mass == 0) c->noMass = c->atoms.size();
+			c->mass = v[0];
+			continue;
+		}
+		if (n < entryCount) {
+			c->badLine = p;
+			return;
+		}
+		a.Znum = c->element;
+		a.x    = (float)v[0];
+		a.y    = (float)v[1];
+		a.z    = (float)v[2];
+		a.dw   = (dwIndex < entryCount) ? (float)v[dwIndex] : ((c->mass > 0) ? (float)(0.45*28.0/c->mass) : 0.0f);
+		a.occ  = (dwIndex+1 < entryCount) ? (float)v[dwIndex+1] : 1.0f;
+		a.q    = (dwIndex+2 < entryCount) ? (float)v[dwIndex+2] : 0.0f;
+		c->atoms.push_back(a);
+	}
+	if (c->element == 0) c->noElement = c->atoms.size();
+	if (c->mass == 0) c->noMass = c->atoms.size();
+}
+
+int readCFGAtoms(const char *fileName, std::vector<atom> &atoms, double Mm[9]) {
+	mappedFile file;
+	const char *p,*s,*eol,*end,*eq,*data;
+	std::vector<cfgChunk> chunks;
+	int ncoord = 0,noVelocityFlag = 0,entryCount = 3,element,i,j,nChunks,nThreads = 1;
+	double lengthScale = 1,mass,value;
+	size_t k,n;
+
+	if (!mapFile(fileName,&file)) {
+		printf("Could not open CFG input file %s\n",fileName);
+		return 0;
+	}
+	memset(Mm,0,9*sizeof(double));
+	end = file.data+file.size;
+	/* header: key = value lines, .NO_VELOCITY. and comments up to the first data line */
+	for (p=file.data;p<end;p=nextLine(eol,end)) {
+		eol = endOfLine(p,end);
+		for (s=p;(s < eol) && ((*s == ' ') || (*s == '\t'));s++);
+		if ((s == eol) || (*s == '\r') || (*s == '#')) continue;
+		if (*s == '.') {
+			if (strncmp(s,".NO_VELOCITY.",13) == 0) noVelocityFlag = 1;
+			continue;
+		}
+		if ((eq = (const char *)memchr(s,'=',eol-s)) == NULL) break;
+		data = eq+1;
+		if (!parseNumber(data,eol,&value)) continue;
+		if (strncmp(s,"Number of particles",19) == 0) ncoord = (int)value;
+		else if ((s[0] == 'A') && ((s[1] == ' ') || (s[1] == '='))) lengthScale = value;
+		else if ((strncmp(s,"H0(",3) == 0) && (sscanf(s+3,"%d,%d",&i,&j) == 2) &&
+			(i >= 1) && (i <= 3) && (j >= 1) && (j <= 3)) Mm[3*(i-1)+(j-1)] = value;
+		else if (strncmp(s,"entry_count",11) == 0) entryCount = (int)value;
+	}
+	if (!noVelocityFlag) entryCount += 3;
+	for (i=0;i<9;i++) Mm[i] *= lengthScale;
+	if (ncoord < 1) {
+		printf("Number of atoms in CFG file not specified!\n");
+		unmapFile(&file);
+		return 0;
+	}
+
+	/* split the data lines into chunks at line boundaries */
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	nChunks = (int)((end-p)/CFG_CHUNK_BYTES);
+	if (nChunks > 4*nThreads) nChunks = 4*nThreads;
+	if (nChunks < 1) nChunks = 1;
+	chunks.resize(nChunks);
+	for (i=0;i<nChunks;i++) {
+		chunks[i].begin = (i == 0) ? p : chunks[i-1].end;
+		chunks[i].end = (i == nChunks-1) ? end : p+(size_t)(end-p)*(i+1)/nChunks;
+		if (chunks[i].end < chunks[i].begin) chunks[i].end = chunks[i].begin;
+		if (chunks[i].end < end) chunks[i].end = nextLine(endOfLine(chunks[i].end,end),end);
+		chunks[i].atoms.reserve((size_t)((double)ncoord*(chunks[i].end-chunks[i].begin)/(end-p+1))+16);
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (i=0;i<nChunks;i++) parseCFGChunk(&chunks[i],entryCount,3+3*(1-noVelocityFlag));
+
+	/* the element and mass of the atoms at the start of a chunk are
+	 * given by the last element and mass lines before it */
+	element = 1;
+	mass = 28;
+	n = 0;
+	for (i=0;i<nChunks;i++) {
+		if (chunks[i].badLine != NULL) {
+			printf("readCFGAtoms: Error: incomplete data line: >%.*s<\n",
+				(int)(endOfLine(chunks[i].badLine,end)-chunks[i].badLine),chunks[i].badLine);
+			unmapFile(&file);
+			return 0;
+		}
+		for (k=0;k<chunks[i].noElement;k++) chunks[i].atoms[k].Znum = element;
+		if (3+3*(1-noVelocityFlag) >= entryCount)
+			for (k=0;k<chunks[i].noMass;k++) chunks[i].atoms[k].dw = (float)(0.45*28.0/mass);
+		if (chunks[i].element != 0) element = chunks[i].element;
+		if (chunks[i].mass != 0) mass = chunks[i].mass;
+		n += chunks[i].atoms.size();
+	}
+	unmapFile(&file);
+	if (n < (size_t)ncoord) {
+		printf("number of atoms does not agree with atoms in file!\n");
+		return 0;
+	}
+	atoms.resize(ncoord);
+	for (i=0,k=0;(i<nChunks) && (k<(size_t)ncoord);i++) {
+		n = chunks[i].atoms.size();
+		if (n > ncoord-k) n = ncoord-k;
+		if (n > 0) memcpy(&atoms[k],&chunks[i].atoms[0],n*sizeof(atom));
+		k += n;
+	}
+	return ncoord;
+}
+
+void atomCacheName(const char *fileName, char *cacheName) {
+	sprintf(cacheName,"%s.qac",fileName);
+}
+
+int fileStamp(const char *fileName, double *size, double *time) {
+	struct stat st;
+
+	if (stat(fileName,&st) != 0) return 0;
+	*size = (double)st.st_size;
+	*time = (double)st.st_mtime;
+	return 1;
+}
+
+int readAtomCache(const char *cacheName, const char *sourceName, std::vector<atom> &atoms, double Mm[9]) {
+	mappedFile file;
+	atomCacheHeader header;
+	double size,time;
+	const float *x,*y,*z,*dw,*occ,*q;
+	const int *Znum;
+	size_t n;
+	int i;
+
+	if (!fileStamp(sourceName,&size,&time) || !mapFile(cacheName,&file)) return 0;
+	if (file.size < sizeof(header)) {
+		unmapFile(&file);
+		return 0;
+	}
+	memcpy(&header,file.data,sizeof(header));
+	n = (header.natom > 0) ? (size_t)header.natom : 0;
+	if ((memcmp(header.magic,ATOM_CACHE_MAGIC,8) != 0) || (header.version != ATOM_CACHE_VERSION) ||
+		(header.natom < 1) || (file.size != sizeof(header)+n*(6*sizeof(float)+sizeof(int))) ||
+		(header.sourceSize != size) || (header.sourceTime != time)) {
+		unmapFile(&file);
+		return 0;
+	}
+	x   = (const float *)(file.data+sizeof(header));
+	y   = x+n;    z = y+n;
+	dw  = z+n;  occ = dw+n;
+	q   = occ+n;
+	Znum = (const int *)(q+n);
+	atoms.resize(n);
+	for (i=0;i<header.natom;i++) {
+		atoms[i].x = x[i];   atoms[i].y = y[i];     atoms[i].z = z[i];
+		atoms[i].dw = dw[i]; atoms[i].occ = occ[i]; atoms[i].q = q[i];
+		atoms[i].Znum = Znum[i];
+	}
+	memcpy(Mm,header.Mm,9*sizeof(double));
+	unmapFile(&file);
+	return 1;
+}
+
+int writeAtomCache(const char *cacheName, const char *sourceName, const std::vector<atom> &atoms, const double Mm[9]) {
+	atomCacheHeader header;
+	char tmpName[1040];
+	std::vector<float> buf;
+	FILE *fp;
+	size_t i,i0,n = atoms.size(),block = 65536;
+	int field,ok = 1;
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,ATOM_CACHE_MAGIC,8);
+	header.version = ATOM_CACHE_VERSION;
+	header.natom = (int)n;
+	memcpy(header.Mm,Mm,9*sizeof(double));
+	if ((n < 1) || !fileStamp(sourceName,&header.sourceSize,&header.sourceTime)) return 0;
+
+	// write to a temporary file, so that other processes never read a partial sidecar
+	sprintf(tmpName,"%s.tmp",cacheName);
+	if ((fp = fopen(tmpName,"wb")) == NULL) return 0;
+	ok = (fwrite(&header,sizeof(header),1,fp) == 1);
+	buf.resize(block);
+	for (field=0;ok && (field<7);field++) {
+		for (i0=0;ok && (i0<n);i0+=block) {
+			for (i=i0;(i<i0+block) && (i<n);i++) {
+				switch (field) {
+					case 0: buf[i-i0] = atoms[i].x;   break;
+					case 1: buf[i-i0] = atoms[i].y;   break;
+					case 2: buf[i-i0] = atoms[i].z;   break;
+					case 3: buf[i-i0] = atoms[i].dw;  break;
+					case 4: buf[i-i0] = atoms[i].occ; break;
+					case 5: buf[i-i0] = atoms[i].q;   break;
+					default: memcpy(&buf[i-i0],&atoms[i].Znum,sizeof(int));
+				}
+			}
+			ok = (fwrite(&buf[0],sizeof(float),i-i0,fp) == i-i0);
+		}
+	}
+	if (fclose(fp) != 0) ok = 0;
+	if (ok) {
+		remove(cacheName);
+		ok = (rename(tmpName,cacheName) == 0);
+	}
+	if (!ok) remove(tmpName);
+	return ok;
+}
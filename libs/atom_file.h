@@ -0,0 +1,83 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ATOM_FILE_H
+#define ATOM_FILE_H
+
+#include <stddef.h>
+#include <vector>
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * Fast reading of large structure files.
+ *
+ * readCFGAtoms() reads an extended CFG file (the format written
+ * by writeCFG) in one pass over the memory mapped file: the data
+ * lines are split into chunks at line boundaries that are parsed
+ * by several threads, the numbers are converted by parseNumber()
+ * instead of atof/sscanf.  The atoms keep their fractional
+ * coordinates and the order of the file.
+ *
+ * Since parsing text is still slow for millions of atoms, the
+ * atoms can be kept in a binary sidecar file next to the
+ * structure file (<file>.qac, see atomCacheName()):
+ * magic "QSTEMAC1", the size and modification time of the
+ * structure file, the cell matrix and the atoms as arrays of
+ * x, y, z, dw, occ, q (float) and Znum (int).  readAtomCache()
+ * maps it and only accepts it if the structure file has not
+ * changed since the sidecar was written.
+ *
+ * std::vector<atom> atoms;
+ * double Mm[9];
+ * atomCacheName(fileName,cacheName);
+ * if (!readAtomCache(cacheName,fileName,atoms,Mm)) {
+ *   if (readCFGAtoms(fileName,atoms,Mm)) writeAtomCache(cacheName,fileName,atoms,Mm);
+ * }
+ **************************************************************/
+
+/* a read only view of a whole file, mapped if possible */
+typedef struct mappedFileStruct {
+	const char *data;
+	size_t size;
+	void *handle;      // buffer that was read instead of mapped, or NULL
+} mappedFile;
+
+/* both return 1 on success, 0 otherwise (e.g. if the file does not exist) */
+int mapFile(const char *fileName, mappedFile *file);
+void unmapFile(mappedFile *file);
+
+/* converts the number at *p (skipping blanks and tabs first), moves p
+ * behind it and returns 1, or returns 0 if there is no number before end */
+int parseNumber(const char *&p, const char *end, double *value);
+
+/* reads the cell matrix (Mm[0..2] = a, Mm[3..5] = b, Mm[6..8] = c, in A)
+ * and the atoms of the extended CFG file fileName, returns the number
+ * of atoms, 0 on error */
+int readCFGAtoms(const char *fileName, std::vector<atom> &atoms, double Mm[9]);
+
+/* size and modification time of fileName, returns 0 if it does not exist */
+int fileStamp(const char *fileName, double *size, double *time);
+
+/* name of the sidecar of fileName: fileName.qac */
+void atomCacheName(const char *fileName, char *cacheName);
+/* return 1 on success, 0 otherwise */
+int readAtomCache(const char *cacheName, const char *sourceName, std::vector<atom> &atoms, double Mm[9]);
+int writeAtomCache(const char *cacheName, const char *sourceName, const std::vector<atom> &atoms, const double Mm[9]);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "atom_stream.h"
+
+#define SORTED_ATOMS_MAGIC "QSTEMAZ1"
+#define SORTED_ATOMS_VERSION 1
+#define DISPLACEMENT_SIGMAS 8.0   /* atoms displaced further than this are not found */
+
+/* header of <file>.qaz, followed by nKinds atomic numbers and natom atoms */
+typedef struct sortedAtomHeaderStruct {
+	char magic[8];
+	int version;
+	int natom;
+	double sourceSize;     // size and modification time of the structure file
+	double sourceTime;
+	double xOffset,yOffset;
+	double box[3];
+	int nKinds;
+	int reserved;
+} sortedAtomHeader;
+
+static bool zLess(const atom &a, const atom &b) { return a.z < b.z; }
+
+/* Einstein displacement of site with rms wobble per direction */
+static void siteDisplacement(const counterRng *phonon, int config, size_t site, double wobble, double u[4]) {
+	counterGauss4(phonon,(unsigned int)config,site,0,u);
+	u[0] *= wobble;
+	u[1] *= wobble;
+	u[2] *= wobble;
+}
+
+/* margin by which the undisplaced atoms of a slab are searched beyond it */
+static double displacementMargin(const atom *atoms, size_t n, double wobble) {
+	double dwMax = 0;
+	size_t i;
+
+	if (wobble <= 0) return 0;
+	for (i=0;i<n;i++) if (atoms[i].dw > dwMax) dwMax = atoms[i].dw;
+	return DISPLACEMENT_SIGMAS*wobble*sqrt(dwMax);
+}
+
+CrystalSource::CrystalSource(const std::vector<atom> &unit, const std::vector<int> &groups,
+	const std::vector<double> &groupOcc, const double cell[3][3], const int nc[3],
+	int handleVacancies, double wobble, long seed, int sampling) :
+	m_unit(unit),
+	m_groups(groups),
+	m_groupOcc(groupOcc),
+	m_handleVacancies(handleVacancies),
+	m_wobble(wobble)
+{
+	initCounterRng(&m_phonon,seed,RNG_STREAM_PHONON);
+	m_phonon.sampling = sampling;
+	initCounterRng(&m_vacancy,seed,RNG_STREAM_VACANCY);
+	memcpy(m_cell,cell,9*sizeof(double));
+	memcpy(m_nc,nc,3*sizeof(int));
+	m_margin = displacementMargin(m_unit.empty() ? NULL : &m_unit[0],m_unit.size(),m_wobble);
+}
+
+size_t CrystalSource::Count() const {
+	return m_unit.size()*m_nc[0]*m_nc[1]*m_nc[2];
+}
+
+void CrystalSource::Slab(double zmin, double zmax, int config, std::vector<atom> &atoms) {
+	const int nGroups = (int)m_groups.size()-1, ncoord = (int)m_unit.size();
+	const double zlo = zmin-m_margin, zhi = zmax+m_margin;
+	std::vector<std::vector<atom> > &parts = m_parts;
+	int icxy,nThreads = 1;
+	size_t k,n;
+
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	parts.resize(nThreads);
+	for (k=0;k<parts.size();k++) parts[k].clear();
+	// static schedule: thread k does the k-th block of columns, so that the
+	// parts joined in thread order are the atoms of the serial loop
+#pragma omp parallel for schedule(static)
+	for (icxy=0;icxy<m_nc[0]*m_nc[1];icxy++) {
+#ifdef _OPENMP
+		std::vector<atom> &out = parts[omp_get_thread_num()];
+#else
+		std::vector<atom> &out = parts[0];
+#endif
+		const int icx = icxy/m_nc[1], icy = icxy % m_nc[1];
+		const double sx = icx*m_cell[0][0]+icy*m_cell[1][0];
+		const double sy = icx*m_cell[0][1]+icy*m_cell[1][1];
+		const double sz = icx*m_cell[0][2]+icy*m_cell[1][2];
+		int g,i,icz,icz0,icz1,chosen,jChoice;
+		size_t site;
+		double z0,c0,c1,choice,lastOcc,r[4],u[4];
+		atom a;
+
+		for (g=0;g<nGroups;g++) {
+			const int lo = m_groups[g], hi = m_groups[g+1];
+			// unit cells in which this site may fall into the slab
+			z0 = m_unit[lo].z+sz;
+			c0 = ceil((zlo-z0)/m_cell[2][2]);
+			c1 = floor((zhi-z0)/m_cell[2][2]);
+			icz0 = (c0 < 0) ? 0 : ((c0 > m_nc[2]) ? m_nc[2] : (int)c0);
+			icz1 = (c1 > m_nc[2]-1) ? m_nc[2]-1 : ((c1 < -1) ? -1 : (int)c1);
+			for (icz=icz0;icz<=icz1;icz++) {
+				// the same numbering as replicateUnitCell and nextConfiguration
+				site = ((size_t)(icx*m_nc[1]+icy)*m_nc[2]+icz)*ncoord+lo;
+				chosen = -1;
+				jChoice = lo;
+				if ((m_handleVacancies) && ((m_groupOcc[g] < 1) || (hi-lo > 1))) {
+					counterUniform4(&m_vacancy,(unsigned int)config,site,0,r);
+					choice = (m_groupOcc[g] < 1.0) ? r[0] : m_groupOcc[g]*r[0];
+					chosen = -2;
+					lastOcc = 0;
+					for (i=lo;i<hi;i++) {
+						if ((choice >= lastOcc) && (choice < lastOcc+m_unit[i].occ)) chosen = jChoice = i;
+						lastOcc += m_unit[i].occ;
+					}
+					if (chosen == -2) continue;  // vacancy
+				}
+				u[0] = u[1] = u[2] = 0;
+				if (m_wobble > 0) siteDisplacement(&m_phonon,config,site,m_wobble*sqrt(m_unit[jChoice].dw),u);
+				for (i=lo;i<hi;i++) {
+					if ((chosen >= 0) && (i != chosen)) continue;
+					a = m_unit[i];
+					a.x += (float)(sx+icz*m_cell[2][0]+u[0]);
+					a.y += (float)(sy+icz*m_cell[2][1]+u[1]);
+					a.z += (float)(sz+icz*m_cell[2][2]+u[2]);
+					if ((a.z >= zmin) && (a.z < zmax)) out.push_back(a);
+				}
+			}
+		}
+	}
+	for (k=0,n=0;k<parts.size();k++) n += parts[k].size();
+	atoms.clear();
+	atoms.reserve(n);
+	for (k=0;k<parts.size();k++) atoms.insert(atoms.end(),parts[k].begin(),parts[k].end());
+	std::sort(atoms.begin(),atoms.end(),zLess);
+}
+
+SortedAtomFile::SortedAtomFile() :
+	m_atoms(NULL),
+	m_natom(0),
+	m_wobble(0),
+	m_margin(0)
+{
+	m_file.data = NULL;
+	m_file.size = 0;
+	m_file.handle = NULL;
+	m_box[0] = m_box[1] = m_box[2] = 0;
+	initCounterRng(&m_phonon,0,RNG_STREAM_PHONON);
+}
+
+SortedAtomFile::~SortedAtomFile() {
+	unmapFile(&m_file);
+}
+
+int SortedAtomFile::Open(const char *fileName, const char *sourceName, double xOffset, double yOffset) {
+	sortedAtomHeader header;
+	double size,time;
+	size_t n,nKinds;
+
+	unmapFile(&m_file);
+	m_atoms = NULL;
+	m_natom = 0;
+	if (!mapFile(fileName,&m_file)) return 0;
+	if (m_file.size < sizeof(header)) {
+		unmapFile(&m_file);
+		return 0;
+	}
+	memcpy(&header,m_file.data,sizeof(header));
+	n = (header.natom > 0) ? (size_t)header.natom : 0;
+	nKinds = (header.nKinds > 0) ? (size_t)header.nKinds : 0;
+	if ((memcmp(header.magic,SORTED_ATOMS_MAGIC,8) != 0) || (header.version != SORTED_ATOMS_VERSION) ||
+		(m_file.size != sizeof(header)+nKinds*sizeof(int)+n*sizeof(atom))) {
+		unmapFile(&m_file);
+		return 0;
+	}
+	if ((sourceName != NULL) && (!fileStamp(sourceName,&size,&time) ||
+		(header.sourceSize != size) || (header.sourceTime != time) ||
+		(header.xOffset != xOffset) || (header.yOffset != yOffset))) {
+		unmapFile(&m_file);
+		return 0;
+	}
+	m_Znums.assign((const int *)(m_file.data+sizeof(header)),(const int *)(m_file.data+sizeof(header))+nKinds);
+	m_atoms = (const atom *)(m_file.data+sizeof(header)+nKinds*sizeof(int));
+	m_natom = n;
+	memcpy(m_box,header.box,3*sizeof(double));
+	m_margin = displacementMargin(m_atoms,m_natom,m_wobble);
+	return 1;
+}
+
+void SortedAtomFile::SetDisplacement(double wobble, long seed, int sampling) {
+	m_wobble = wobble;
+	initCounterRng(&m_phonon,seed,RNG_STREAM_PHONON);
+	m_phonon.sampling = sampling;
+	m_margin = displacementMargin(m_atoms,m_natom,m_wobble);
+}
+
+void SortedAtomFile::Slab(double zmin, double zmax, int config, std::vector<atom> &atoms) {
+	atom key;
+	const atom *first,*last,*p;
+	double u[4];
+
+	atoms.clear();
+	if (m_natom == 0) return;
+	key.z = (float)(zmin-m_margin);
+	first = std::lower_bound(m_atoms,m_atoms+m_natom,key,zLess);
+	key.z = (float)(zmax+m_margin);
+	last = std::lower_bound(first,m_atoms+m_natom,key,zLess);
+	if (m_wobble <= 0) {
+		for (p=first;(p<last) && (p->z < zmin);p++);
+		for (;(p<last) && (p->z < zmax);p++) atoms.push_back(*p);
+		return;
+	}
+	for (p=first;p<last;p++) {
+		atom a = *p;
+		siteDisplacement(&m_phonon,config,(size_t)(p-m_atoms),m_wobble*sqrt(a.dw),u);
+		a.x += (float)u[0];
+		a.y += (float)u[1];
+		a.z += (float)u[2];
+		if ((a.z >= zmin) && (a.z < zmax)) atoms.push_back(a);
+	}
+	std::sort(atoms.begin(),atoms.end(),zLess);
+}
+
+int writeSortedAtoms(const char *fileName, const char *sourceName, double xOffset, double yOffset,
+	const std::vector<atom> &atoms, const double box[3]) {
+	sortedAtomHeader header;
+	std::vector<atom> sorted;
+	std::vector<int> Znums;
+	char tmpName[1040];
+	FILE *fp;
+	size_t i;
+	int ok;
+
+	for (i=0;i<atoms.size();i++) {
+		if (atoms[i].Znum <= 0) continue;
+		sorted.push_back(atoms[i]);
+		if (std::find(Znums.begin(),Znums.end(),atoms[i].Znum) == Znums.end()) Znums.push_back(atoms[i].Znum);
+	}
+	if (sorted.empty()) return 0;
+	std::sort(sorted.begin(),sorted.end(),zLess);
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,SORTED_ATOMS_MAGIC,8);
+	header.version = SORTED_ATOMS_VERSION;
+	header.natom = (int)sorted.size();
+	header.xOffset = xOffset;
+	header.yOffset = yOffset;
+	memcpy(header.box,box,3*sizeof(double));
+	header.nKinds = (int)Znums.size();
+	if ((sourceName != NULL) && !fileStamp(sourceName,&header.sourceSize,&header.sourceTime)) return 0;
+
+	// write to a temporary file, so that other processes never read a partial file
+	sprintf(tmpName,"%s.tmp",fileName);
+	if ((fp = fopen(tmpName,"wb")) == NULL) return 0;
+	ok = (fwrite(&header,sizeof(header),1,fp) == 1) &&
+		(fwrite(&Znums[0],sizeof(int),Znums.size(),fp) == Znums.size()) &&
+		(fwrite(&sorted[0],sizeof(atom),sorted.size(),fp) == sorted.size());
+	if (fclose(fp) != 0) ok = 0;
+	if (ok) {
+		remove(fileName);
+		ok = (rename(tmpName,fileName) == 0);
+	}
+	if (!ok) remove(tmpName);
+	return ok;
+}
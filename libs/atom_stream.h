@@ -0,0 +1,121 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ATOM_STREAM_H
+#define ATOM_STREAM_H
+
+#include <stddef.h>
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "atom_file.h"
+#include "counter_rng.h"
+
+/**************************************************************
+ * Streamed structures ("stream atoms: yes").
+ *
+ * make3DSlices only needs the atoms of the slab (cellDiv
+ * division) it makes the potential of, sorted in z.  An
+ * AtomSource returns just these atoms of one configuration, so
+ * that the whole model is never held in memory and never sorted:
+ *
+ * CrystalSource generates them from the sites of one unit cell
+ * and the replication counts, with vacancies and Einstein
+ * displacements.  The random numbers of a site only depend on
+ * (seed, configuration, site) (counter_rng.h), so an atom that two
+ * neighbouring slabs need is displaced identically in both, and the
+ * configurations are the same as those of nextConfiguration().
+ *
+ * SortedAtomFile maps an explicit model whose atoms are sorted in
+ * z (<file>.qaz, written by writeSortedAtoms): magic "QSTEMAZ1",
+ * the size and modification time of the structure file, the
+ * offsets and box size it was made with, the atomic numbers and
+ * the atoms.  A slab is found by binary search, only its pages
+ * are read.
+ *
+ * CrystalSource src(unit,groups,groupOcc,cell,nc,1,wobble,seed);
+ * for (k=0;k<cellDiv;k++) src.Slab(k*c,(k+1)*c,avgCount,atoms);
+ **************************************************************/
+
+class AtomSource {
+public:
+	virtual ~AtomSource() {}
+	/* number of sites of the model */
+	virtual size_t Count() const = 0;
+	/* the atoms of configuration config with zmin <= z < zmax (after
+	 * the displacement), sorted in z */
+	virtual void Slab(double zmin, double zmax, int config, std::vector<atom> &atoms) = 0;
+};
+
+class CrystalSource : public AtomSource {
+	std::vector<atom> m_unit;
+	std::vector<int> m_groups;
+	std::vector<double> m_groupOcc;
+	double m_cell[3][3];
+	int m_nc[3];
+	int m_handleVacancies;
+	double m_wobble,m_margin;
+	counterRng m_phonon,m_vacancy;
+	std::vector<std::vector<atom> > m_parts;
+public:
+	/* unit: the sites of unit cell (0,0,0) in cartesian coordinates of
+	 * the super cell, groups/groupOcc: sites [groups[k],groups[k+1])
+	 * share one position with total occupancy groupOcc[k], cell: the
+	 * lattice vectors a,b,c (c[2] must be > 0), nc: the replication
+	 * counts, wobble: the rms displacement per direction is
+	 * wobble*sqrt(dw) (0: no displacements), sampling: SAMPLING_* of
+	 * the displacements (counter_rng.h) */
+	CrystalSource(const std::vector<atom> &unit, const std::vector<int> &groups,
+		const std::vector<double> &groupOcc, const double cell[3][3], const int nc[3],
+		int handleVacancies, double wobble, long seed, int sampling);
+	size_t Count() const;
+	void Slab(double zmin, double zmax, int config, std::vector<atom> &atoms);
+};
+
+class SortedAtomFile : public AtomSource {
+	mappedFile m_file;
+	const atom *m_atoms;
+	size_t m_natom;
+	double m_box[3];
+	std::vector<int> m_Znums;
+	double m_wobble,m_margin;
+	counterRng m_phonon;
+
+	SortedAtomFile(const SortedAtomFile &);
+	SortedAtomFile &operator=(const SortedAtomFile &);
+public:
+	SortedAtomFile();
+	~SortedAtomFile();
+	/* returns 1 on success.  If sourceName is not NULL, the file is only
+	 * accepted if it was made from the current sourceName with the offsets
+	 * xOffset, yOffset */
+	int Open(const char *fileName, const char *sourceName, double xOffset, double yOffset);
+	/* displacements as in CrystalSource */
+	void SetDisplacement(double wobble, long seed, int sampling);
+	size_t Count() const { return m_natom; }
+	void Slab(double zmin, double zmax, int config, std::vector<atom> &atoms);
+	/* size of the box the atoms were placed in (ax, by, c) */
+	const double *Box() const { return m_box; }
+	const std::vector<int> &Znums() const { return m_Znums; }
+};
+
+/* writes the atoms with Znum > 0 sorted in z, returns 1 on success */
+int writeSortedAtoms(const char *fileName, const char *sourceName, double xOffset, double yOffset,
+	const std::vector<atom> &atoms, const double box[3]);
+
+#endif
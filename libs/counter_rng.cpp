@@ -0,0 +1,212 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <ctype.h>
+#include "counter_rng.h"
+
+#define PID 3.14159265358979 /* pi */
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+/* high and low word of the 64 bit product a*b, in 32 bit arithmetic */
+static inline void mulhilo32(unsigned int a, unsigned int b, unsigned int *hi, unsigned int *lo) {
+	unsigned int a0 = a & 0xffffU, a1 = a >> 16;
+	unsigned int b0 = b & 0xffffU, b1 = b >> 16;
+	unsigned int p01 = a0*b1, p10 = a1*b0;
+	unsigned int mid = ((a0*b0) >> 16)+(p01 & 0xffffU)+(p10 & 0xffffU);
+
+	*lo = a*b;
+	*hi = a1*b1+(p01 >> 16)+(p10 >> 16)+(mid >> 16);
+}
+
+void initCounterRng(counterRng *rng, long seed, unsigned int stream) {
+	unsigned long s = (unsigned long)seed;
+
+	rng->key[0] = (unsigned int)s;
+	rng->key[1] = (unsigned int)((s >> 16) >> 16)+stream*PHILOX_W1;
+	rng->sampling = SAMPLING_RANDOM;
+}
+
+void philox4x32(const unsigned int ctr[4], const unsigned int key[2], unsigned int out[4]) {
+	unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	unsigned int k0 = key[0], k1 = key[1];
+	unsigned int hi0,lo0,hi1,lo1;
+	int round;
+
+	for (round=0;round<10;round++) {
+		mulhilo32(PHILOX_M0,c0,&hi0,&lo0);
+		mulhilo32(PHILOX_M1,c2,&hi1,&lo1);
+		c0 = hi1^c1^k0;
+		c1 = lo1;
+		c2 = hi0^c3^k1;
+		c3 = lo0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0;  out[1] = c1;  out[2] = c2;  out[3] = c3;
+}
+
+void counterUniform4(const counterRng *rng, unsigned int config, size_t index, unsigned int sub, double u[4]) {
+	unsigned int ctr[4],r[4];
+	int i;
+
+	ctr[0] = config;
+	ctr[1] = (unsigned int)index;
+	ctr[2] = sub;
+	ctr[3] = (unsigned int)((index >> 16) >> 16);
+	philox4x32(ctr,rng->key,r);
+	for (i=0;i<4;i++) u[i] = ((double)r[i]+0.5)/4294967296.0;
+}
+
+/* direction numbers of the first 4 dimensions of the Sobol sequence
+ * (Joe and Kuo, new-joe-kuo-6.21201) */
+static const unsigned int sobolDirections[4][32] = {
+	{0x80000000,0x40000000,0x20000000,0x10000000,0x08000000,0x04000000,0x02000000,0x01000000,
+	 0x00800000,0x00400000,0x00200000,0x00100000,0x00080000,0x00040000,0x00020000,0x00010000,
+	 0x00008000,0x00004000,0x00002000,0x00001000,0x00000800,0x00000400,0x00000200,0x00000100,
+	 0x00000080,0x00000040,0x00000020,0x00000010,0x00000008,0x00000004,0x00000002,0x00000001},
+	{0x80000000,0xc0000000,0xa0000000,0xf0000000,0x88000000,0xcc000000,0xaa000000,0xff000000,
+	 0x80800000,0xc0c00000,0xa0a00000,0xf0f00000,0x88880000,0xcccc0000,0xaaaa0000,0xffff0000,
+	 0x80008000,0xc000c000,0xa000a000,0xf000f000,0x88008800,0xcc00cc00,0xaa00aa00,0xff00ff00,
+	 0x80808080,0xc0c0c0c0,0xa0a0a0a0,0xf0f0f0f0,0x88888888,0xcccccccc,0xaaaaaaaa,0xffffffff},
+	{0x80000000,0xc0000000,0x60000000,0x90000000,0xe8000000,0x5c000000,0x8e000000,0xc5000000,
+	 0x68800000,0x9cc00000,0xee600000,0x55900000,0x80680000,0xc09c0000,0x60ee0000,0x90550000,
+	 0xe8808000,0x5cc0c000,0x8e606000,0xc5909000,0x6868e800,0x9c9c5c00,0xeeee8e00,0x5555c500,
+	 0x8000e880,0xc0005cc0,0x60008e60,0x9000c590,0xe8006868,0x5c009c9c,0x8e00eeee,0xc5005555},
+	{0x80000000,0xc0000000,0x20000000,0x50000000,0xf8000000,0x74000000,0xa2000000,0x93000000,
+	 0xd8800000,0x25400000,0x59e00000,0xe6d00000,0x78080000,0xb40c0000,0x82020000,0xc3050000,
+	 0x208f8000,0x51474000,0xfbea2000,0x75d93000,0xa0858800,0x914e5400,0xdbe79e00,0x25db6d00,
+	 0x58800080,0xe54000c0,0x79e00020,0xb6d00050,0x800800f8,0xc00c0074,0x200200a2,0x50050093}
+};
+
+/* point n of dimension d of the Sobol sequence, as 32 bit fraction */
+static unsigned int sobolPoint(unsigned int n, int d) {
+	unsigned int x = 0;
+	int i;
+
+	for (i=0;n != 0;i++,n >>= 1) if (n & 1) x ^= sobolDirections[d][i];
+	return x;
+}
+
+static inline unsigned int reverseBits(unsigned int x) {
+	x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+	x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+	x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/* nested uniform (Owen) scrambling of a 32 bit fraction: the hash of
+ * Laine and Karras only lets lower bits affect higher ones, so it is
+ * applied to the bit reversed fraction */
+static unsigned int owenScramble(unsigned int x, unsigned int seed) {
+	x = reverseBits(x);
+	x ^= x*0x3d20adeaU;
+	x += seed;
+	x *= (seed >> 16) | 1U;
+	x ^= x*0x05526c56U;
+	x ^= x*0x53a22864U;
+	return reverseBits(x);
+}
+
+/* inverse of the normal distribution function (Acklam, relative
+ * error below 1.2e-9), 0 < p < 1 */
+static double inverseNormal(double p) {
+	static const double a[6] = {-3.969683028665376e+01, 2.209460984245205e+02,-2.759285104469687e+02,
+	                             1.383577518672690e+02,-3.066479806614716e+01, 2.506628277459239e+00};
+	static const double b[5] = {-5.447609879822406e+01, 1.615858368580409e+02,-1.556989798598866e+02,
+	                             6.680131188771972e+01,-1.328068155288572e+01};
+	static const double c[6] = {-7.784894002430293e-03,-3.223964580411365e-01,-2.400758277161838e+00,
+	                            -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+	static const double d[4] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+	                             3.754408661907416e+00};
+	double q,r;
+
+	if (p < 0.02425) {
+		q = sqrt(-2.0*log(p));
+		return (((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5])/((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1.0);
+	}
+	if (p > 1.0-0.02425) {
+		q = sqrt(-2.0*log(1.0-p));
+		return -(((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5])/((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1.0);
+	}
+	q = p-0.5;
+	r = q*q;
+	return (((((a[0]*r+a[1])*r+a[2])*r+a[3])*r+a[4])*r+a[5])*q/(((((b[0]*r+b[1])*r+b[2])*r+b[3])*r+b[4])*r+1.0);
+}
+
+static void boxMuller4(const double u[4], double g[4]) {
+	double r;
+
+	r = sqrt(-2.0*log(u[0]));
+	g[0] = r*cos(2.0*PID*u[1]);
+	g[1] = r*sin(2.0*PID*u[1]);
+	r = sqrt(-2.0*log(u[2]));
+	g[2] = r*cos(2.0*PID*u[3]);
+	g[3] = r*sin(2.0*PID*u[3]);
+}
+
+void counterGauss4(const counterRng *rng, unsigned int config, size_t index, unsigned int sub, double g[4]) {
+	double u[4];
+	unsigned int ctr[4],seed[4];
+	int i;
+
+	switch (rng->sampling) {
+		case SAMPLING_ANTITHETIC:
+			counterUniform4(rng,config & ~1U,index,sub,u);
+			boxMuller4(u,g);
+			if (config & 1) for (i=0;i<4;i++) g[i] = -g[i];
+			break;
+		case SAMPLING_SOBOL:
+			// scrambling seeds of this (index, sub): a counter no configuration uses
+			ctr[0] = 0xffffffffU;
+			ctr[1] = (unsigned int)index;
+			ctr[2] = sub;
+			ctr[3] = (unsigned int)((index >> 16) >> 16);
+			philox4x32(ctr,rng->key,seed);
+			for (i=0;i<4;i++)
+				g[i] = inverseNormal(((double)owenScramble(sobolPoint(config,i),seed[i])+0.5)/4294967296.0);
+			break;
+		default:
+			counterUniform4(rng,config,index,sub,u);
+			boxMuller4(u,g);
+	}
+}
+
+int parseSampling(const char *name) {
+	while (isspace(*name)) name++;
+	switch (tolower(*name)) {
+		case 'r': return SAMPLING_RANDOM;
+		case 'a': return SAMPLING_ANTITHETIC;
+		case 's': return SAMPLING_SOBOL;
+	}
+	return -1;
+}
+
+const char *samplingName(int sampling) {
+	switch (sampling) {
+		case SAMPLING_ANTITHETIC: return "antithetic";
+		case SAMPLING_SOBOL:      return "scrambled Sobol";
+	}
+	return "random";
+}
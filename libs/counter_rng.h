@@ -0,0 +1,89 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COUNTER_RNG_H
+#define COUNTER_RNG_H
+
+#include <stddef.h>
+
+/**************************************************************
+ * Counter based random numbers (Philox4x32-10, Salmon et al.,
+ * "Parallel random numbers: as easy as 1, 2, 3", SC 2011).
+ *
+ * The random numbers are a function of a key (the seed of the
+ * simulation and what they are used for) and a counter (the TDS
+ * configuration, the index of the atom, ...), not of a generator
+ * state.  They can therefore be drawn in any order and by any
+ * number of threads, a configuration can be made again without
+ * making the ones before it, and the shards of a run with the
+ * same seed draw the same numbers.
+ *
+ * counterRng phonon;
+ * initCounterRng(&phonon,seed,RNG_STREAM_PHONON);
+ * counterGauss4(&phonon,avgCount,atomIndex,0,g);  // g[0..2]: displacement
+ *
+ * With rng.sampling the gaussian deviates of the configurations
+ * of one (index, sub) are not independent but chosen to make the
+ * average over the configurations converge faster:
+ * SAMPLING_ANTITHETIC pairs configuration 2k+1 with 2k (g -> -g),
+ * which cancels the odd orders of the displacements exactly, but
+ * doubles the variance of the even ones (<u^2>, i.e. the Debye-
+ * Waller damping), so it only pays for signals that are mostly odd
+ * in u; SAMPLING_SOBOL takes configuration n from a 4 dimensional Sobol
+ * sequence, scrambled (Owen type, Laine-Karras hash) independently
+ * for every (index, sub), so that each atom still gets an unbiased
+ * and uncorrelated gaussian, but its displacements of the first
+ * 2^m configurations are stratified.
+ **************************************************************/
+
+/* what the numbers are used for (second word of the key) */
+#define RNG_STREAM_PHONON   1   /* Einstein displacements */
+#define RNG_STREAM_VACANCY  2   /* vacancies and shared sites */
+#define RNG_STREAM_SOURCE   3   /* source offsets of CBED/NBED */
+#define RNG_STREAM_MODES    4   /* mode amplitudes of the phonon file model */
+#define RNG_STREAM_ENERGY   5   /* energy deviations of STEM runs with tds stop error */
+
+/* how counterGauss4 samples the configurations (muls->sampling) */
+#define SAMPLING_RANDOM     0   /* independent configurations (plain Monte Carlo) */
+#define SAMPLING_ANTITHETIC 1   /* configuration 2k+1 = -configuration 2k */
+#define SAMPLING_SOBOL      2   /* scrambled Sobol sequence over the configurations */
+
+typedef struct counterRngStruct {
+	unsigned int key[2];
+	int sampling;                  // SAMPLING_*, only used by counterGauss4
+} counterRng;
+
+/* sets sampling to SAMPLING_RANDOM */
+void initCounterRng(counterRng *rng, long seed, unsigned int stream);
+
+/* the 4 random words of counter ctr and key */
+void philox4x32(const unsigned int ctr[4], const unsigned int key[2], unsigned int out[4]);
+
+/* 4 uniform deviates in (0,1) and 4 gaussian deviates (mean 0,
+ * variance 1) of counter (config, index, sub).  Only the gaussian
+ * deviates depend on rng->sampling */
+void counterUniform4(const counterRng *rng, unsigned int config, size_t index, unsigned int sub, double u[4]);
+void counterGauss4(const counterRng *rng, unsigned int config, size_t index, unsigned int sub, double g[4]);
+
+/* converts "random", "antithetic", "sobol" into SAMPLING_*,
+ * returns -1 for anything else */
+int parseSampling(const char *name);
+const char *samplingName(int sampling);
+
+#endif
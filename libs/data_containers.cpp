@@ -20,8 +20,10 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "stdio.h"
 #include <string.h>
 #include "data_containers.h"
+#include "fft_plans.h"
 
-WAVEFUNC::WAVEFUNC(int x, int y, float_tt resX, float_tt resY) :
+template <typename T>
+WaveFunction<T>::WaveFunction(int x, int y, float_tt resX, float_tt resY) :
 detPosX(0),
 detPosY(0),
 iPosX(0),
@@ -30,107 +32,149 @@ thickness(0.0),
 nx(x),
 ny(y),
 resolutionX(resX),
-resolutionY(resY)
+resolutionY(resY),
+defocusOffset(0),
+weight(1),
+lastProbe(1),
+absorbed(0)
 {
 	char waveFile[256];
 	const char *waveFileBase = "mulswav";
-#if FLOAT_PRECISION == 1
-	diffpat = float2D(nx,ny,"diffpat");
-	avgArray = float2D(nx,ny,"avgArray");
-#else
-	diffpat = double2D(nx,ny,"diffpat");
-	avgArray = double2D(nx,ny,"avgArray");
-#endif
+	diffpat.Resize(nx,ny,"diffpat");
+	avgArray.Resize(nx,ny,"avgArray");
 
 	m_imageIO=ImageIOPtr(new CImageIO(nx, ny, thickness, resolutionX, resolutionY));
 	
 
-#if FLOAT_PRECISION == 1
-	wave = complex2Df(nx, ny, "wave");
-	fftPlanWaveForw = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD, FFTW_ESTIMATE);
-	fftPlanWaveInv = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD, FFTW_ESTIMATE);
-#else
-	wave = complex2D(nx, ny, "wave");
-	fftPlanWaveForw = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD,
-		fftMeasureFlag);
-	fftPlanWaveInv = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD,
-		fftMeasureFlag);
-#endif
+	wave.Resize(nx, ny, "wave");
+	// all wave functions of the same size share their plans
+	fftPlanWaveForw = sharedPlan2D<T>(PLAN_WAVE,nx,ny,FFTW_FORWARD);
+	fftPlanWaveInv = sharedPlan2D<T>(PLAN_WAVE,nx,ny,FFTW_BACKWARD);
 
 	sprintf(waveFile,"%s.img",waveFileBase);
 	strcpy(fileout,waveFile);
 	sprintf(fileStart,"mulswav.img");
 }
 
-void WAVEFUNC::WriteWave(const char *fileName, const char *comment,
+template <typename T>
+void WaveFunction<T>::FFTForward()
+{
+	executePlan(fftPlanWaveForw,wave.Data());
+}
+
+template <typename T>
+void WaveFunction<T>::FFTInverse()
+{
+	executePlan(fftPlanWaveInv,wave.Data());
+}
+
+template <typename T>
+void WaveFunction<T>::WriteWave(const char *fileName, const char *comment,
 	std::vector<double>params)
 {
 	m_imageIO->SetComment(comment);
 	m_imageIO->SetResolution(resolutionX, resolutionY);
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteComplexImage((void **)wave, fileName);
+	if (sizeof(wave[0][0][0]) == sizeof(float_tt)) {
+		m_imageIO->WriteComplexImage((void **)wave.Rows(), fileName);
+		return;
+	}
+	// images are always written in single precision
+	Array2D<fftwf_complex> w(nx,ny,"wave (single precision)");
+	for (int i=0;i<nx*ny;i++) {
+		w[0][i][0] = (float)wave[0][i][0];
+		w[0][i][1] = (float)wave[0][i][1];
+	}
+	m_imageIO->WriteComplexImage((void **)w.Rows(), fileName);
 }
 
-void WAVEFUNC::WriteDiffPat(const char *fileName, const char *comment,
+template <typename T>
+void WaveFunction<T>::WriteDiffPat(const char *fileName, const char *comment,
 	std::vector<double>params)
 {
 	m_imageIO->SetComment(comment);
 	m_imageIO->SetResolution(1.0/(nx*resolutionX), 1.0/(ny*resolutionY));
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void**)diffpat, fileName);
+	m_imageIO->WriteRealImage((void**)diffpat.Rows(), fileName);
 }
 
-void WAVEFUNC::WriteAvgArray(const char *fileName, const char *comment,
+template <typename T>
+void WaveFunction<T>::WriteAvgArray(const char *fileName, const char *comment,
 	std::vector<double>params)
 {
 	m_imageIO->SetComment(comment);
 	m_imageIO->SetResolution(1.0/(nx*resolutionX), 1.0/(ny*resolutionY));
 	m_imageIO->SetParams(params);
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void **)avgArray, fileName);
+	m_imageIO->WriteRealImage((void **)avgArray.Rows(), fileName);
 }
 
-void WAVEFUNC::ReadWave(const char *fileName)
+template <typename T>
+void WaveFunction<T>::ReadWave(const char *fileName)
 {
 	// printf("Debug Wavefunc::ReadWave\n");
-	m_imageIO->ReadImage((void **)wave, nx, ny, fileName);
+	if (sizeof(wave[0][0][0]) == sizeof(float_tt)) {
+		m_imageIO->ReadImage((void **)wave.Rows(), nx, ny, fileName);
+		return;
+	}
+	Array2D<fftwf_complex> w(nx,ny,"wave (single precision)");
+	m_imageIO->ReadImage((void **)w.Rows(), nx, ny, fileName);
+	for (int i=0;i<nx*ny;i++) {
+		wave[0][i][0] = w[0][i][0];
+		wave[0][i][1] = w[0][i][1];
+	}
+}
+
+template <typename T>
+double WaveFunction<T>::GetParameter(int index)
+{
+	return m_imageIO->GetParameter(index);
 }
 
-void WAVEFUNC::ReadDiffPat(const char *fileName)
+template <typename T>
+void WaveFunction<T>::ReadDiffPat(const char *fileName)
 {
-	m_imageIO->ReadImage((void **)diffpat, nx, ny, fileName);
+	m_imageIO->ReadImage((void **)diffpat.Rows(), nx, ny, fileName);
 }
 
-void WAVEFUNC::ReadAvgArray(const char *fileName)
+template <typename T>
+void WaveFunction<T>::ReadAvgArray(const char *fileName)
 {
-	m_imageIO->ReadImage((void **)avgArray, nx, ny, fileName);
+	m_imageIO->ReadImage((void **)avgArray.Rows(), nx, ny, fileName);
 }
 
 
+template class WaveFunction<float>;
+template class WaveFunction<double>;
+
+
+int detectorSlots(int slice, int slices, int outputInterval, int slots[2]) {
+	int n = 0;
+
+	if (slice >= slices-1) slots[n++] = slices/outputInterval;
+	if ((slice+1) % outputInterval == 0) slots[n++] = (slice+1)/outputInterval-1;
+	return n;
+}
 
 Detector::Detector(int nx, int ny, float_tt resX, float_tt resY) :
   error(0),
   shiftX(0),
   shiftY(0),
   Navg(0),
-  thickness(0)
-{
-#if FLOAT_PRECISION == 1
-	image = float2D(nx,ny,"ADFimag");
-	image2 = float2D(nx,ny,"ADFimag");
-#else
-	image = double2D(nx,ny,"ADFimag");	
-	image2 = double2D(nx,ny,"ADFimag");	
-#endif
+  thickness(0),
+  absorbedFraction(0)
+{
+	image.Resize(nx,ny,"ADFimag");
+	image2.Resize(nx,ny,"ADFimag");
 	m_imageIO=ImageIOPtr(new CImageIO(nx, ny, thickness, resX, resY, std::vector<double>(2+nx*ny), "STEM image"));
 }
 
 void Detector::WriteImage(const char *fileName)
 {
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void **)image, fileName);
+	m_imageIO->WriteRealImage((void **)image.Rows(), fileName);
 }
 
 void Detector::SetThickness(float_tt t)
@@ -21,12 +21,18 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define DATA_CONTAINERS_H
 
 #include <vector>
+#include <string>
 #include "stemtypes_fftw3.h"
 #include "imagelib_fftw3.h"
+#include "fftw_traits.h"
+#include "array_nd.h"
 
 // a structure for a probe/parallel beam wavefunction.
 // Separate from mulsliceStruct for parallelization.
-class WAVEFUNC 
+// T is the precision of the wave function (float or double, see
+// "precision:" in the .dat file), diffraction patterns are float_tt.
+template <typename T>
+class WaveFunction 
 {
 	// shared pointer to 
 	ImageIOPtr m_imageIO;
@@ -36,27 +42,41 @@ public:
 	int detPosX,detPosY;
 	char fileStart[512];
 	char fileout[512];
-	float_tt **diffpat;
-	float_tt **avgArray;
+	Array2D<float_tt> diffpat;
+	Array2D<float_tt> avgArray;
 	char avgName[512];
 	float_tt thickness;
 	float_tt intIntensity;
 	// These are not used for anything aside from when saving files.
 	float_tt resolutionX, resolutionY;
 
-#if FLOAT_PRECISION == 1
-	fftwf_plan fftPlanWaveForw,fftPlanWaveInv;
-	fftwf_complex  **wave; /* complex wave function */
-#else
-	fftw_plan fftPlanWaveForw,fftPlanWaveInv;
-	fftw_complex  **wave; /* complex wave function */
-#endif
+	// a STEM pixel or CBED pattern may be the incoherent sum of several probes
+	// (focal spread quadrature in doSTEM, source size quadrature in doCBED):
+	// probe() adds defocusOffset (A) to the defocus, collectIntensity() adds
+	// weight times the signal of this probe to detectorSum and diffpatSums and,
+	// if lastProbe is set, the sums to the detector images and diffpat.
+	double defocusOffset;
+	double weight;
+	int lastProbe;
+	// intensity removed by the absorptive potential so far (fraction of the incident
+	// intensity, muls->absorbedToDetectors), kept in the wave files of runMulsSTEM
+	double absorbed;
+	std::vector<double> detectorSum;    // [t*detectorNum+i]
+	std::vector<float_tt> diffpatSums;  // [t*nx*ny+i], empty for single probes
+
+	// shared plans (see fft_plans.h), execute them with FFTForward/FFTInverse
+	typename FFTW<T>::plan fftPlanWaveForw,fftPlanWaveInv;
+	Array2D<typename FFTW<T>::complex> wave; /* complex wave function */
 
 public:
 	// initializing constructor:
-	WAVEFUNC(int nx, int ny, float_tt resX, float_tt resY);
+	WaveFunction(int nx, int ny, float_tt resX, float_tt resY);
 	// define a copy constructor to create new arrays
-	//WAVEFUNC( WAVEFUNC& other );
+	//WaveFunction( WaveFunction& other );
+
+	// in-place transforms of wave
+	void FFTForward();
+	void FFTInverse();
 
 	void WriteWave(const char *fileName, const char *comment="Wavefunction", 
 		std::vector<double>params = std::vector<double>());
@@ -68,8 +88,11 @@ public:
 	void ReadWave(const char *fileName);
 	void ReadDiffPat(const char *fileName);
 	void ReadAvgArray(const char *fileName);
+	// parameter index of the file read last, 0 if it has none
+	double GetParameter(int index);
 };
 
+typedef WaveFunction<float_tt> WAVEFUNC;
 typedef boost::shared_ptr<WAVEFUNC> WavePtr;
 
 
@@ -79,8 +102,8 @@ class Detector {
 	float_tt thickness;
 public:
 	int Navg;
-	float_tt **image;        // place for storing avg image = sum(data)/Navg
-	float_tt **image2;        // we will store sum(data.^2)/Navg 
+	Array2D<float_tt> image;        // place for storing avg image = sum(data)/Navg
+	Array2D<float_tt> image2;        // we will store sum(data.^2)/Navg 
 	float_tt rInside,rOutside;
 	float_tt k2Inside,k2Outside;
 	char name[32];
@@ -94,10 +117,28 @@ public:
 	void SetComment(const char *comment);
 	float_tt error;
 	float_tt shiftX,shiftY;
+	// share of the intensity absorbed by the absorptive potential that thermal
+	// diffuse scattering sends into this detector (muls->absorbedToDetectors)
+	float_tt absorbedFraction;
 };
 
 typedef boost::shared_ptr<Detector> DetectorPtr;
 
+/* detector image slots (muls->detectors[t]) that the wave after slice
+ * (0 .. slices-1, counted through the whole specimen) adds to: the last
+ * slice of every output interval to its slot, the last slice of the
+ * specimen to the final slot tCount = slices/outputInterval, and also to
+ * slot tCount-1 if it completes an interval there.  Returns the number
+ * of slots (0, 1 or 2) written to slots, the final slot first. */
+int detectorSlots(int slice, int slices, int outputInterval, int slots[2]);
+
+class SimState;  // sim_state.h
+
+/* one 'sweep:' line of the parameter file: a parameter and its values */
+typedef struct sweepParameterStruct {
+  std::string name;
+  std::vector<double> values;
+} sweepParameter;
 
 
 class MULS {
@@ -108,18 +149,14 @@ public:
 					 * in the window. */
   int saveLevel;
   int complete_pixels;  //the number of pixels completed so far
+  int waveThreads;      /* number of threads sharing the FFTs and pixel loops of one
+					 * wave function; 1 = one wave per thread (scan-level) */
+  int precision;        /* precision of the wave functions: 1 = float, 2 = double */
 
-#if FLOAT_PRECISION == 1
   fftwf_plan fftPlanPotInv,fftPlanPotForw;
   // wave moved to probeStruct
   //fftwf_complex  **wave; /* complex wave function */
-  fftwf_complex ***trans;
-#else
-  fftw_plan fftPlanPotInv,fftPlanPotForw;
-  // wave moved to probeStruct
-  //fftw_complex  **wave; /* complex wave function */
-  fftw_complex ***trans;
-#endif
+  Array3D<fftwf_complex> trans;  /* [slice][x][y], contiguous */
 
   real **diffpat;
   real czOffset;
@@ -135,6 +172,9 @@ public:
 					   coherence */
   char atomPosFile[512];
                                         /* and start wavefunction */	
+  int atomCache;                        /* read/write the binary sidecar of CFG files (atom_file.h) */
+  int streamAtoms;                      /* make the atoms slab by slab (atom_stream.h) */
+  char trajectoryTypes[256];            /* elements of the LAMMPS types of a trajectory (trajectory.h) */
   float_tt v0;				/* inc. beam energy */
   float_tt resolutionX;                  /* real space pixelsize for wave function and potential */
   float_tt resolutionY;                  /* real space pixelsize for wave function and potential */
@@ -198,7 +238,7 @@ public:
   int totalSliceCount;
   int outputInterval;    // output results every n slices
 
-  float_tt aobj;				/* obj aperture */
+  float_tt aobj;				/* obj aperture in mrad (TEM images), 0: none */
   float_tt aAIS;                         /* condensor aperture in A (projected size, */
                                         /* for Koehler illumination)                */
   // float_tt areaAIS;                      /* fractional area illuminated by AIS (def=1) */
@@ -261,6 +301,9 @@ public:
   int storeSeries;
   int tds;
   int Einstein;        /* if set (default=set), the Einstein model will be used */
+  int sampling;        /* SAMPLING_* of the displacements of the TDS configurations (counter_rng.h) */
+  int absorptive;      /* add the absorptive potential of thermal diffuse scattering (no tds) */
+  int absorbedToDetectors; /* add the absorbed intensity to the detectors (see Detector::absorbedFraction) */
   char phononFile[512];    /* file name for detailed phonon modes */
   int atomKinds;
   int *Znums;
@@ -279,6 +322,18 @@ public:
   double imageGamma;
   char folder[1024];
   int avgRuns; // RAM: What is this?
+  /* adaptive number of TDS runs, see tds_stop.h */
+  float_tt tdsStopError;            // relative error of the detector images to stop at, 0 = avgRuns runs
+  int tdsMinRuns;                   // runs before the error is trusted
+  int tdsStopPixels;                // only continue for the pixels that have not converged
+  /* splitting of one STEM scan over several processes (--shard, --shard-runs),
+   * see stem_shard.h */
+  int shardIndex,shardCount;        // scan pixel p is done if p % shardCount == shardIndex
+  int runShardIndex,runShardCount;  // TDS runs are split into runShardCount blocks
+  int avgStart,avgStop;             // block of avgCount values done by this process
+  int checkpointInterval;           // seconds between STEM checkpoints, 0 = none
+  int resume;                       // continue from the last checkpoint (--resume)
+  int memoryReport;                 // print memory usage per tag at the end of the run
   int potential3D;
   int scatFactor;
   int Scherzer;
@@ -305,6 +360,29 @@ public:
   double zoomFactor; // increases the size of the super-box in x,y, in order to
                      // make full use of atoms present, creates vacuum edge around sample.
 
+  std::vector<std::string> sequences;  // the 'sequence:' lines of the parameter file
+  std::vector<sweepParameter> sweeps;  // the 'sweep:' lines, see runSimulation()
+  int sweepCacheMB;                    // memory for the TDS runs kept between sweep points
+  /* TEM defocus series (stem3/tem_imaging.h) */
+  std::vector<double> imageDefoci;     // in A, empty: no series
+  int imageCoherence;                  // IMAGE_ENVELOPE or IMAGE_QUADRATURE
+  int focalSpreadPoints;               // Gauss-Hermite points of the focal spread, 0: not set
+  double energySpread;                 // sqrt(dE/E^2+dI/I^2+dV/V^2), focal spread = Cc*energySpread
+  /* finite source size (libs/source_size.h) */
+  int sourceDistribution;              // SOURCE_GAUSSIAN, SOURCE_LORENTZIAN or SOURCE_MIXED
+  float_tt sourceLorentzFraction;      // weight of the Lorentzian for SOURCE_MIXED
+  int sourcePoints;                    // CBED: Gauss-Hermite points per axis of the source quadrature, 0: random offsets
+  /* precession electron diffraction (mode PED, stem3/precession.h) */
+  float_tt pedAngle;                   // precession semi-angle in mrad
+  int pedTilts;                        // number of beam tilts around the precession cone
+  int pedSaveTilts;                    // also write the pattern of every tilt
+  /* set by programs that use the engine as a library (see stem3/simulation.h): */
+  std::vector<atom> inputAtoms;  // atoms (cartesian, super cell) used instead of atomPosFile
+  int keepPatterns;              // STEM, CBED: keep the averaged diffraction pattern of every pixel
+  Array3D<float_tt> patterns;    // [ix*scanYN+iy][nx][ny] (CBED: [0][nx][ny]), if keepPatterns
+  /* working state of this simulation (random numbers, propagator, phonon data, ...),
+   * see sim_state.h.  Created by simState(), copies of a MULS share it. */
+  boost::shared_ptr<SimState> state;
 }; 
 
 #endif
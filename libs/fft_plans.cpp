@@ -0,0 +1,254 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include "fft_plans.h"
+#include "lib_lock.h"
+
+template <typename T>
+struct planEntry {
+	int planClass;
+	int rank;
+	int n[3];
+	int howmany;
+	int direction;
+	typename FFTW<T>::plan plan;
+};
+
+static unsigned planRigors[PLAN_CLASSES] = {FFTW_ESTIMATE,FFTW_ESTIMATE,FFTW_ESTIMATE};
+static char wisdomFolder[512] = "";
+// plans, wisdom and the FFTW planner are shared by all simulations of the process
+static LibLock plannerLock;
+
+void lockPlanner() {
+	plannerLock.Lock();
+}
+
+void unlockPlanner() {
+	plannerLock.Unlock();
+}
+
+/* one list of shared plans and one wisdom state per precision */
+template <typename T> static std::vector<planEntry<T> > &planList() {
+	static std::vector<planEntry<T> > plans;
+	return plans;
+}
+template <typename T> static int &newWisdom() {
+	static int flag = 0;
+	return flag;
+}
+
+void setPlanRigor(int planClass, unsigned rigor) {
+	if ((planClass >= 0) && (planClass < PLAN_CLASSES))
+		planRigors[planClass] = rigor;
+}
+
+unsigned planRigor(int planClass) {
+	if ((planClass >= 0) && (planClass < PLAN_CLASSES))
+		return planRigors[planClass];
+	return FFTW_ESTIMATE;
+}
+
+unsigned parsePlanRigor(const char *name) {
+	while (isspace(*name)) name++;
+	switch (tolower(*name)) {
+	  case 'm': return FFTW_MEASURE;
+	  case 'p': return FFTW_PATIENT;
+	  case 'e':
+		  if (tolower(name[1]) == 'x') return FFTW_EXHAUSTIVE;
+		  return FFTW_ESTIMATE;
+	}
+	return FFTW_ESTIMATE;
+}
+
+const char *planRigorName(unsigned rigor) {
+	if (rigor & FFTW_EXHAUSTIVE) return "exhaustive";
+	if (rigor & FFTW_PATIENT) return "patient";
+	if (rigor & FFTW_ESTIMATE) return "estimated";
+	return "measured";
+}
+
+/* describes the CPU by its model name (alphanumeric characters only) */
+static void cpuName(char *name, int len) {
+	char buf[512],*model = NULL;
+	int i,j;
+
+	name[0] = '\0';
+#ifdef _WIN32
+	model = getenv("PROCESSOR_IDENTIFIER");
+	if (model != NULL) strncpy(buf,model,sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+	model = buf;
+#else
+	FILE *fp;
+	if ((fp = fopen("/proc/cpuinfo","r")) != NULL) {
+		while (fgets(buf,sizeof(buf),fp) != NULL) {
+			if ((strncmp(buf,"model name",10) == 0) && ((model = strchr(buf,':')) != NULL)) {
+				model++;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+#endif
+	if (model == NULL) model = (char *)"generic";
+	for (i=0,j=0;(model[i] != '\0') && (j < len-1);i++) {
+		if (isalnum(model[i])) name[j++] = model[i];
+		else if ((j > 0) && (name[j-1] != '_')) name[j++] = '_';
+	}
+	while ((j > 0) && (name[j-1] == '_')) j--;
+	name[j] = '\0';
+	if (j == 0) strcpy(name,"generic");
+}
+
+void wisdomFileName(char *fileName, const char *folder, const char *precision) {
+	char cpu[128];
+
+	cpuName(cpu,sizeof(cpu));
+	sprintf(fileName,"%s/qstem_%s_%s.wisdom",folder,cpu,precision);
+}
+
+template <typename T> static int importWisdom() {
+	char fileName[1024];
+	FILE *fp;
+	int success = 0;
+
+	wisdomFileName(fileName,wisdomFolder,FFTW<T>::Name());
+	if ((fp = fopen(fileName,"r")) != NULL) {
+		success = FFTW<T>::ImportWisdom(fp);
+		fclose(fp);
+		if (!success) printf("Could not import FFTW wisdom from %s\n",fileName);
+	}
+	newWisdom<T>() = 0;
+	return success;
+}
+
+template <typename T> static int exportWisdom() {
+	char fileName[1024];
+	FILE *fp;
+
+	if (!newWisdom<T>()) return 0;
+	wisdomFileName(fileName,wisdomFolder,FFTW<T>::Name());
+	if ((fp = fopen(fileName,"w")) == NULL) {
+		printf("Could not write FFTW wisdom to %s\n",fileName);
+		return 0;
+	}
+	FFTW<T>::ExportWisdom(fp);
+	fclose(fp);
+	newWisdom<T>() = 0;
+	return 1;
+}
+
+int loadWisdom(const char *folder) {
+	ScopedLock lock(plannerLock);
+	int success;
+
+	strncpy(wisdomFolder,folder,sizeof(wisdomFolder)-1);
+	success = importWisdom<float>();
+	success |= importWisdom<double>();
+	return success;
+}
+
+int saveWisdom() {
+	ScopedLock lock(plannerLock);
+	int success;
+
+	if (wisdomFolder[0] == '\0') return 0;
+	success = exportWisdom<float>();
+	success |= exportWisdom<double>();
+	return success;
+}
+
+template <typename T>
+typename FFTW<T>::plan sharedPlan(int planClass, int rank, const int *n, int howmany, int direction) {
+	std::vector<planEntry<T> > &plans = planList<T>();
+	typename FFTW<T>::plan plan = NULL;
+	typename FFTW<T>::complex *scratch;
+	planEntry<T> entry;
+	size_t i,size;
+	int r;
+
+	// the FFTW planner is not thread safe
+	{
+		ScopedLock lock(plannerLock);
+		for (i=0;i<plans.size();i++) {
+			if ((plans[i].planClass == planClass) && (plans[i].rank == rank) &&
+				(plans[i].howmany == howmany) && (plans[i].direction == direction) &&
+				(memcmp(plans[i].n,n,rank*sizeof(int)) == 0)) {
+				plan = plans[i].plan;
+				break;
+			}
+		}
+		if (plan == NULL) {
+			memset(&entry,0,sizeof(entry));
+			entry.planClass = planClass;
+			entry.rank = rank;
+			entry.howmany = howmany;
+			entry.direction = direction;
+			for (size=howmany,r=0;r<rank;r++) {
+				entry.n[r] = n[r];
+				size *= n[r];
+			}
+			// plan on a scratch array, measuring overwrites its contents
+			scratch = (typename FFTW<T>::complex *)FFTW<T>::Malloc(size*sizeof(typename FFTW<T>::complex));
+			entry.plan = FFTW<T>::PlanManyDft(rank,entry.n,howmany,scratch,(int)(size/howmany),
+				scratch,direction,planRigor(planClass));
+			FFTW<T>::Free(scratch);
+			if (entry.plan == NULL) {
+				printf("Could not create FFTW plan (class %d, %d x %d x %d)\n",planClass,
+					entry.n[0],entry.n[1],entry.n[2]);
+				exit(0);
+			}
+			if (planRigor(planClass) != FFTW_ESTIMATE) newWisdom<T>() = 1;
+			plans.push_back(entry);
+			plan = entry.plan;
+		}
+	}
+	return plan;
+}
+
+template <typename T>
+typename FFTW<T>::plan sharedPlan2D(int planClass, int nx, int ny, int direction) {
+	int n[2];
+	n[0] = nx;
+	n[1] = ny;
+	return sharedPlan<T>(planClass,2,n,1,direction);
+}
+
+template <typename T> static void destroyPlanList() {
+	std::vector<planEntry<T> > &plans = planList<T>();
+	size_t i;
+	for (i=0;i<plans.size();i++) FFTW<T>::DestroyPlan(plans[i].plan);
+	plans.clear();
+}
+
+void destroyPlans() {
+	ScopedLock lock(plannerLock);
+	destroyPlanList<float>();
+	destroyPlanList<double>();
+}
+
+template FFTW<float>::plan sharedPlan<float>(int, int, const int *, int, int);
+template FFTW<double>::plan sharedPlan<double>(int, int, const int *, int, int);
+template FFTW<float>::plan sharedPlan2D<float>(int, int, int, int);
+template FFTW<double>::plan sharedPlan2D<double>(int, int, int, int);
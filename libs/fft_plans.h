@@ -0,0 +1,81 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FFT_PLANS_H
+#define FFT_PLANS_H
+
+#include "fftw_traits.h"
+
+/**************************************************************
+ * FFTW plan manager.
+ *
+ * Every plan belongs to one of the plan classes below, each with
+ * its own planner rigor (FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT
+ * or FFTW_EXHAUSTIVE, set from the .dat file).
+ * Plans returned by sharedPlan<T>() are created only once per class,
+ * precision, size and direction, on a scratch array (so measuring does not
+ * destroy any data), and must be executed with the new-array
+ * execute functions (executePlan(plan,data)) on in-place
+ * arrays allocated with fftw_malloc (same alignment as the scratch
+ * array).  All WAVEFUNC instances of a run therefore share the same
+ * two wave plans.
+ * Wisdom is kept in <folder>/qstem_<cpu>_<float|double>.wisdom, so
+ * that measured plans are only expensive the first time a size is
+ * used on a given machine.
+ **************************************************************/
+
+#define PLAN_WAVE       0   /* probe / parallel beam wave function */
+#define PLAN_POTENTIAL  1   /* batch of potential slices */
+#define PLAN_ATOM       2   /* single atom potential lookup tables */
+#define PLAN_CLASSES    3
+
+void setPlanRigor(int planClass, unsigned rigor);
+unsigned planRigor(int planClass);
+/* converts "estimate", "measure", "patient", "exhaustive" into the FFTW
+ * flag, returns FFTW_ESTIMATE for anything else */
+unsigned parsePlanRigor(const char *name);
+const char *planRigorName(unsigned rigor);
+
+/* builds the name of the wisdom file for this CPU and precision (float or double) */
+void wisdomFileName(char *fileName, const char *folder, const char *precision);
+/* imports wisdom of both precisions from folder, returns 1 if a wisdom file was read */
+int loadWisdom(const char *folder);
+/* exports the accumulated wisdom to the folder given to loadWisdom,
+ * if any plan has been created since.  Returns 1 if a file was written */
+int saveWisdom();
+
+/* returns a shared in-place plan of the given class for rank (1-3)
+ * dimensional transforms of size n, howmany consecutive arrays of
+ * n[0]*..*n[rank-1] elements each.  The plan must not be destroyed.
+ * Instantiated for float and double. */
+template <typename T>
+typename FFTW<T>::plan sharedPlan(int planClass, int rank, const int *n, int howmany, int direction);
+template <typename T>
+typename FFTW<T>::plan sharedPlan2D(int planClass, int nx, int ny, int direction);
+/* executes a shared plan on data */
+inline void executePlan(fftwf_plan plan, fftwf_complex *data) { FFTW<float>::ExecuteDft(plan,data,data); }
+inline void executePlan(fftw_plan plan, fftw_complex *data) { FFTW<double>::ExecuteDft(plan,data,data); }
+/* destroys all shared plans */
+void destroyPlans();
+/* the FFTW planner is not thread safe: code that creates or destroys
+ * plans of its own (not shared ones) holds this lock while doing so */
+void lockPlanner();
+void unlockPlanner();
+
+#endif // FFT_PLANS_H
@@ -0,0 +1,76 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FFTW_TRAITS_H
+#define FFTW_TRAITS_H
+
+#include <stdio.h>
+#include "fftw3.h"
+#include "memory_fftw3.h"
+
+/**************************************************************
+ * Maps a scalar type onto the matching FFTW library, so that
+ * code templated over the precision of the wave functions can
+ * call fftwf_* for float and fftw_* for double:
+ *
+ * typename FFTW<T>::complex **w = FFTW<T>::Complex2D(nx,ny,"w");
+ * typename FFTW<T>::plan p = FFTW<T>::PlanManyDft(...);
+ * FFTW<T>::ExecuteDft(p,w[0],w[0]);
+ **************************************************************/
+template <typename T> struct FFTW;
+
+template <> struct FFTW<float> {
+	typedef fftwf_complex complex;
+	typedef fftwf_plan plan;
+	static const char *Name() { return "float"; }
+	static complex **Complex2D(int nx, int ny, const char *message) {
+		return complex2Df(nx,ny,message);
+	}
+	static void *Malloc(size_t n) { return fftwf_malloc(n); }
+	static void Free(void *p) { fftwf_free(p); }
+	static plan PlanManyDft(int rank, const int *n, int howmany, complex *in, int dist,
+		complex *out, int sign, unsigned flags) {
+		return fftwf_plan_many_dft(rank,n,howmany,in,NULL,1,dist,out,NULL,1,dist,sign,flags);
+	}
+	static void ExecuteDft(plan p, complex *in, complex *out) { fftwf_execute_dft(p,in,out); }
+	static void DestroyPlan(plan p) { fftwf_destroy_plan(p); }
+	static int ImportWisdom(FILE *fp) { return fftwf_import_wisdom_from_file(fp); }
+	static void ExportWisdom(FILE *fp) { fftwf_export_wisdom_to_file(fp); }
+};
+
+template <> struct FFTW<double> {
+	typedef fftw_complex complex;
+	typedef fftw_plan plan;
+	static const char *Name() { return "double"; }
+	static complex **Complex2D(int nx, int ny, const char *message) {
+		return complex2D(nx,ny,message);
+	}
+	static void *Malloc(size_t n) { return fftw_malloc(n); }
+	static void Free(void *p) { fftw_free(p); }
+	static plan PlanManyDft(int rank, const int *n, int howmany, complex *in, int dist,
+		complex *out, int sign, unsigned flags) {
+		return fftw_plan_many_dft(rank,n,howmany,in,NULL,1,dist,out,NULL,1,dist,sign,flags);
+	}
+	static void ExecuteDft(plan p, complex *in, complex *out) { fftw_execute_dft(p,in,out); }
+	static void DestroyPlan(plan p) { fftw_destroy_plan(p); }
+	static int ImportWisdom(FILE *fp) { return fftw_import_wisdom_from_file(fp); }
+	static void ExportWisdom(FILE *fp) { fftw_export_wisdom_to_file(fp); }
+};
+
+#endif // FFTW_TRAITS_H
@@ -29,10 +29,18 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "../lib/floatdef.h"
 #include "stemtypes_fftw3.h"
 #include "memory_fftw3.h"	/* memory allocation routines */
+#include "memory_arena.h"
 // #include "tiffsubs.h"
 #include "matrixlib.h"
 #include "readparams.h"
 #include "fileio_fftw3.h"
+#include "atom_file.h"
+#include "atom_stream.h"
+#include "counter_rng.h"
+#include "trajectory.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 // #include "stemlib.h"
 
 #define _CRTDBG_MAP_ALLOC
@@ -66,6 +74,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define THZ_AMU_HBAR 0.15745702964189    /*   A^2*THz*amu/(hbar)   */
 // 4.46677327584453 /* 1e10/sqrt(THz*amu/(pi*hbar)) */ 
 #define THZ_HBAR_2KB  3.81927135604119     /* THz*hbar/(2*kB) */
+#define RMS_BLOCKS 256  /* blocks of the rms displacement sums, independent of the threads */
 #define THZ_HBAR_KB   1.90963567802059     /* THz*hbar/kB */
 #define AMU_THZ2_A2_KB   1.20274224623720     /* AMU*THz^2*A^2/kB */
 
@@ -344,6 +353,84 @@ int writeCFGFractCubic(double *pos,int *Znum,double *dw,int natoms,char *fileNam
 
 
 
+/*******************************************************************************
+* phononModeDisplacements:
+* Displacements of all atoms of the super cell in the phonon file model, made
+* once per configuration.  Coordinate j of the primitive cell in cell R moves by
+*   u_j(R) = Re sum_k sum_lambda (q1+i*q2)(k,lambda) e_j(k,lambda) exp(2 pi i k.R)
+* The sum over the 3*Ns modes is done once per k-vector (modeSum), and the phase
+* factor is the product of one factor per lattice direction, so the sum over k
+* of every cell needs no sin/cos.  The k-vectors of the phonon file need not lie
+* on the grid of the super cell, which is why this is a direct sum and not an FFT.
+* Both loops run in parallel: every k-vector and every cell writes its own rows,
+* and the random numbers only depend on the mode, so the displacements do not
+* depend on the number of threads.
+********************************************************************************/
+static void phononModeDisplacements(MULS *muls,phononState *ph) {
+	int Nk = ph->Nk, n3 = 3*ph->Ns;
+	int nc[3] = {muls->nCellX,muls->nCellY,muls->nCellZ};
+	int ncells = nc[0]*nc[1]*nc[2], nPhase = nc[0]+nc[1]+nc[2];
+	counterRng modes;
+	double *phase;
+
+	// the same amplitudes for this configuration in every run (counter_rng.h)
+	initCounterRng(&modes,randomSeed(muls),RNG_STREAM_MODES);
+	modes.sampling = muls->sampling;
+	if (ph->modeSum == NULL) ph->modeSum = (double *)malloc(2*(size_t)Nk*n3*sizeof(double));
+	if (ph->uCells[0]*ph->uCells[1]*ph->uCells[2] != ncells) {
+		free(ph->uCell);
+		ph->uCell = (double *)malloc((size_t)ncells*n3*sizeof(double));
+	}
+	memcpy(ph->uCells,nc,3*sizeof(int));
+	phase = (double *)malloc(2*(size_t)Nk*nPhase*sizeof(double));
+	if ((ph->modeSum == NULL) || (ph->uCell == NULL) || (phase == NULL)) {
+		printf("phononModeDisplacements: cannot allocate the displacements of %d cells\n",ncells);
+		exit(0);
+	}
+
+#pragma omp parallel for
+	for (int ik=0;ik<Nk;ik++) {
+		double *b = ph->modeSum+2*(size_t)ik*n3;
+		double *p = phase+2*(size_t)ik*nPhase;
+		double g[4],q1,q2;
+
+		memset(b,0,2*n3*sizeof(double));
+		for (int lambda=0;lambda<n3;lambda++) {
+			const fftwf_complex *e = ph->eigVecs[ik][lambda];
+			counterGauss4(&modes,muls->avgCount,(size_t)ik*n3+lambda,0,g);
+			q1 = ph->omega[ik][lambda]*g[0];
+			q2 = ph->omega[ik][lambda]*g[1];
+			for (int j=0;j<n3;j++) {
+				b[2*j]   += q1*e[j][0]-q2*e[j][1];
+				b[2*j+1] += q1*e[j][1]+q2*e[j][0];
+			}
+		}
+		// exp(2 pi i k_d n) for the cells n = 0 .. nc[d]-1 of every direction d
+		for (int d=0;d<3;d++) for (int n=0;n<nc[d];n++,p+=2) {
+			p[0] = cos(2*PID*n*ph->kVecs[ik][d]);
+			p[1] = sin(2*PID*n*ph->kVecs[ik][d]);
+		}
+	}
+
+#pragma omp parallel for
+	for (int cell=0;cell<ncells;cell++) {
+		int icx = cell/(nc[1]*nc[2]), icy = (cell/nc[2]) % nc[1], icz = cell % nc[2];
+		double *u = ph->uCell+(size_t)cell*n3;
+
+		memset(u,0,n3*sizeof(double));
+		for (int ik=0;ik<Nk;ik++) {
+			const double *p = phase+2*(size_t)ik*nPhase;
+			const double *px = p+2*icx, *py = p+2*(nc[0]+icy), *pz = p+2*(nc[0]+nc[1]+icz);
+			const double *b = ph->modeSum+2*(size_t)ik*n3;
+			double xyr = px[0]*py[0]-px[1]*py[1], xyi = px[0]*py[1]+px[1]*py[0];
+			double pr = xyr*pz[0]-xyi*pz[1], pi = xyr*pz[1]+xyi*pz[0];
+			for (int j=0;j<n3;j++) u[j] += b[2*j]*pr-b[2*j+1]*pi;
+		}
+	}
+	free(phase);
+}
+
+
 /*******************************************************************************
 * int phononDisplacement: 
 * This function will calculate the phonon displacement for a given atom i of the
@@ -354,7 +441,9 @@ int writeCFGFractCubic(double *pos,int *Znum,double *dw,int natoms,char *fileNam
 *
 * Input parameters:
 * Einstein-mode:
-* need only: dw, Znum, atomCount
+* need only: dw, Znum, atomCount, site
+* site: counter index of the random numbers of this site, cell*ncoord+first atom
+*       of the site, as in nextConfiguration()
 * atomCount: give statistics report, if 0, important only for non-Einstein mode
 * maxAtom: total number of atoms (will be called first, i.e. atomCount=maxAtoms-1:-1:0)
 *
@@ -362,28 +451,29 @@ int writeCFGFractCubic(double *pos,int *Znum,double *dw,int natoms,char *fileNam
 * ...
 *
 ********************************************************************************/ 
-//  phononDisplacement(u,muls,jChoice,icx,icy,icz,j,atoms[jChoice].dw,*natom,jz);
+//  phononDisplacement(u,muls,jChoice,icx,icy,icz,site,j,atoms[jChoice].dw,*natom,jz);
 //  j == atomCount
 int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
-	int icz,int atomCount,double dw,int maxAtom,int ZnumIndex) {
-	int ix,iy,idd; // iz;
-	static FILE *fpPhonon = NULL;
-	static int Nk, Ns;        // number of k-vectors and atoms per primitive unit cell
-	static float *massPrim;   // masses for every atom in primitive basis
-	static float **omega;     // array of eigenvalues for every k-vector 
-	static fftwf_complex ***eigVecs;  // array of eigenvectors for every k-vector
-	static float **kVecs;     // array for Nk 3-dim k-vectors
-	static double **q1=NULL, **q2=NULL;
-	int ik,lambda,icoord; // Ncells, nkomega;
-	double kR,kRi,kRr,wobble;
-	static double *u2=NULL,*u2T,ux=0,uy=0,uz=0; // u2Collect=0; // Ttotal=0;
-	// static double uxCollect=0,uyCollect=0,uzCollect=0;
-	static int *u2Count = NULL,*u2CountT,runCount = 1,u2Size = -1;
-	static long iseed=0;
-	static double **Mm=NULL,**MmInv=NULL;
-	// static double **MmOrig=NULL,**MmOrigInv=NULL;
-	static double *axCell,*byCell,*czCell,*uf,*b;
-	static double wobScale = 0,sq3,scale=0;
+	int icz,size_t site,int atomCount,double dw,int maxAtom,int ZnumIndex) {
+	int ix,iy,idd,cell; // iz;
+	FILE *fpPhonon;
+	SimState *st = simState(muls);
+	// the phonon data and the statistics belong to the simulation
+	int &Nk = st->phonon.Nk, &Ns = st->phonon.Ns;
+	float *&massPrim = st->phonon.massPrim;
+	float **&omega = st->phonon.omega;
+	fftwf_complex ***&eigVecs = st->phonon.eigVecs;
+	float **&kVecs = st->phonon.kVecs;
+	int *uCells = st->phonon.uCells;
+	double wobble,g[4];
+	counterRng phonon;
+	double *&u2 = st->phonon.u2;
+	double &ux = st->phonon.ux, &uy = st->phonon.uy, &uz = st->phonon.uz;
+	int *&u2Count = st->phonon.u2Count;
+	int &runCount = st->phonon.runCount, &u2Size = st->phonon.u2Size;
+	double **&Mm = st->phonon.Mm, **&MmInv = st->phonon.MmInv;
+	double *&uf = st->phonon.uf;
+	double &wobScale = st->phonon.wobScale, &sq3 = st->phonon.sq3, &scale = st->phonon.scale;
 
 	if (muls->tds == 0) return 0;
 
@@ -422,9 +512,7 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 									   Mm = double2D(3,3,"Mm");
 									   MmInv = double2D(3,3,"Mminv");
 									   uf = double1D(3,"uf");
-		b = double1D(3,"uf");
 
-									   axCell=Mm[0]; byCell=Mm[1]; czCell=Mm[2];
 		// memcpy(Mm[0],muls->Mm[0],3*3*sizeof(double));
 		// We need to copy the transpose of muls->Mm to Mm.
 		// we therefore cannot use the following command:
@@ -493,11 +581,11 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 												   * introduced in order to match the wobble factor with <u^2>
 												   */
 							   scale = (float) sqrt(muls->tds_temp/300.0) ;
-							   iseed = -(long)(time(NULL));
 						   }
 
 
-						   if ((muls->Einstein == 0) && (fpPhonon == NULL)) {
+						   if ((muls->Einstein == 0) && (!st->phonon.fileRead)) {
+							   st->phonon.fileRead = 1;
 							   if ((fpPhonon = fopen(muls->phononFile,"r")) == NULL) {
 								   printf("Cannot find phonon mode file, will use random displacements!");
 								   muls->Einstein = 1;
@@ -561,11 +649,8 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 								   }
 								   // printf("Temperature: %g K\n",Ttotal);
 								   // printf("%d %d %d\n",(int)(0.4*(double)Nk/11.0),(int)(0.6*(double)Nk),Nk);
-								   q1 = double2D(3*Ns,Nk,"q1");
-								   q2 = double2D(3*Ns,Nk,"q2");
-
+								   fclose(fpPhonon);    
 							   }
-							   fclose(fpPhonon);    
 						   }  // end of if phononfile
 
 						   // 
@@ -574,11 +659,7 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 						   if ((muls->Einstein == 0) && (atomCount == maxAtom-1)) {
 							   if (Nk > 800)
 								   printf("Will create phonon displacements for %d k-vectors - please wait ...\n",Nk);
-							   for (lambda=0;lambda<3*Ns;lambda++) for (ik=0;ik<Nk;ik++) {
-								   q1[lambda][ik] = (omega[ik][lambda] * gasdev( &iseed ));
-								   q2[lambda][ik] = (omega[ik][lambda] * gasdev( &iseed ));
-							   }
-							   // printf("Q: %g %g %g\n",q1[0][0],q1[5][8],q1[0][3]);
+							   phononModeDisplacements(muls,&st->phonon);
 						   }
    /********************************************************************************
 	* Do the Einstein model independent vibrations !!!
@@ -586,9 +667,13 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 	if (muls->Einstein) {	    
 	   /* convert the Debye-Waller factor to sqrt(<u^2>) */
 	   wobble = scale*sqrt(dw*wobScale);
-	   u[0] = (wobble*sq3 * gasdev( &iseed ));
-	   u[1] = (wobble*sq3 * gasdev( &iseed ));
-	   u[2] = (wobble*sq3 * gasdev( &iseed ));
+	   // the same numbers for this atom and configuration in every run (counter_rng.h)
+	   initCounterRng(&phonon,randomSeed(muls),RNG_STREAM_PHONON);
+	   phonon.sampling = muls->sampling;
+	   counterGauss4(&phonon,muls->avgCount,site,0,g);
+	   u[0] = (wobble*sq3 * g[0]);
+	   u[1] = (wobble*sq3 * g[1]);
+	   u[2] = (wobble*sq3 * g[2]);
 	   ///////////////////////////////////////////////////////////////////////
 	   // Book keeping:
 		u2[ZnumIndex] += u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
@@ -613,22 +698,15 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 	   memcpy(u,uf,3*sizeof(double));
 	}
 	else {
-	   // id seems to be the index of the correct atom, i.e. ranges from 0 .. Natom
-	   printf("created phonon displacements %d, %d, %d %d (eigVecs: %d %d %d)!\n",ZnumIndex,Ns,Nk,id,Nk,3*Ns,3*Ns);
-	   /* loop over k and lambda:  */
-	   memset(u,0,3*sizeof(double));
-	   for (lambda=0;lambda<3*Ns;lambda++) for (ik=0;ik<Nk;ik++) {
-		   // if (kVecs[ik][2] == 0){
-		   kR = 2*PID*(icx*kVecs[ik][0]+icy*kVecs[ik][1]+icz*kVecs[ik][2]);
-		   //  kR = 2*PID*(blat[0][0]*kVecs[ik][0]+blat[0][1]*kVecs[ik][1]+blat[0][2]*kVecs[ik][2]);
-		   kRr = cos(kR); kRi = sin(kR);
-		   for (icoord=0;icoord<3;icoord++) {
-									   u[icoord] += q1[lambda][ik]*(eigVecs[ik][lambda][icoord+3*id][0]*kRr-
-										   eigVecs[ik][lambda][icoord+3*id][1]*kRi)-
-										   q2[lambda][ik]*(eigVecs[ik][lambda][icoord+3*id][0]*kRi+
-										   eigVecs[ik][lambda][icoord+3*id][1]*kRr);
-		   }
-		}
+	   // id is the index of the atom in the (primitive) unit cell
+	   if ((id >= Ns) || (icx >= uCells[0]) || (icy >= uCells[1]) || (icz >= uCells[2])) {
+		   printf("phononDisplacement: atom %d of cell (%d %d %d) is not in the phonon file (%d atoms per cell)\n",
+			   id,icx,icy,icz,Ns);
+		   exit(0);
+	   }
+	   /* the sum over k and lambda was done for all cells by phononModeDisplacements() */
+	   cell = (icx*uCells[1]+icy)*uCells[2]+icz;
+	   memcpy(u,st->phonon.uCell+(size_t)cell*3*Ns+3*id,3*sizeof(double));
 		// printf("u: %g %g %g\n",u[0],u[1],u[2]);
 	   /* Convert the cartesian displacements back to reduced coordinates
 	   */ 
@@ -714,6 +792,9 @@ int readDATCellParams(MULS *muls, double **Mm, char *fileName) {
 
 
 
+static void cfgCellParams(MULS *muls, double **Mm);
+static void referenceGroups(referenceStructure &ref,const atom *atoms,int ncoord,int handleVacancies);
+
 /***********************************************************************
 * The following function returns the number of atoms in the specified
 * CFG file and updates the cell parameters in the muls struct
@@ -761,7 +842,16 @@ int readCFGCellParams(MULS *muls, double **Mm, char *fileName) {
 	parFpPull();  /* restore old parameter file pointer */
 
 	for (i=0;i<9;i++) Mm[0][i] *= lengthScale;
+	cfgCellParams(muls,Mm);
+	if (ncoord < 1) {
+		printf("Number of atoms in CFG file not specified!\n");
+		ncoord = 0;
+	}
+	return ncoord;
+}
 
+/* lattice parameters and angles of the CFG cell matrix Mm */
+static void cfgCellParams(MULS *muls, double **Mm) {
 	muls->ax = sqrt(Mm[0][0]*Mm[0][0]+Mm[0][1]*Mm[0][1]+Mm[0][2]*Mm[0][2]);
 	muls->by = sqrt(Mm[1][0]*Mm[1][0]+Mm[1][1]*Mm[1][1]+Mm[1][2]*Mm[1][2]);
 	muls->c  = sqrt(Mm[2][0]*Mm[2][0]+Mm[2][1]*Mm[2][1]+Mm[2][2]*Mm[2][2]);
@@ -771,11 +861,28 @@ int readCFGCellParams(MULS *muls, double **Mm, char *fileName) {
 	muls->cGamma /= (float)PI180;
 	muls->cBeta  /= (float)PI180;
 	muls->cAlpha /= (float)PI180;
-	if (ncoord < 1) {
-		printf("Number of atoms in CFG file not specified!\n");
-		ncoord = 0;
+}
+
+/***********************************************************************
+* readCFGFile() reads the cell and all atoms of a CFG file at once
+* (readCFGAtoms, see atom_file.h) or, if muls->atomCache is set, from
+* the sidecar of the file, if it is up to date.  After parsing the file
+* the sidecar is written for the next runs.  Returns the number of atoms.
+***********************************************************************/
+static int readCFGFile(MULS *muls, double **Mm, char *fileName, std::vector<atom> &atoms) {
+	char cacheName[1040];
+
+	atomCacheName(fileName,cacheName);
+	if (muls->atomCache && readAtomCache(cacheName,fileName,atoms,Mm[0])) {
+		if (muls->printLevel >= 2) printf("Read %d atoms from %s\n",(int)atoms.size(),cacheName);
 	}
-	return ncoord;
+	else {
+		if (readCFGAtoms(fileName,atoms,Mm[0]) == 0) return 0;
+		if (muls->atomCache && !writeAtomCache(cacheName,fileName,atoms,Mm[0]))
+			printf("Warning: could not write the atom cache %s\n",cacheName);
+	}
+	cfgCellParams(muls,Mm);
+	return (int)atoms.size();
 }
 
 /***********************************************************************
@@ -814,6 +921,38 @@ int readCSSRCellParams(MULS *muls, double **Mm, char *fileName) {
 	return ncoord;
 }
 
+/* cursor of the readNext...Atom() functions, one per file being read */
+typedef struct atomReaderStruct {
+	FILE *fp;
+	int parFile;               // fp belongs to the parameter file routines
+	int entryCount,element;
+	double *atomData;
+	char buf[NCMAX];
+} atomReader;
+
+static void initAtomReader(atomReader *r) {
+	r->fp = NULL;
+	r->parFile = 0;
+	r->entryCount = 3;
+	r->element = 1;
+	r->atomData = NULL;
+}
+
+/* closes the file and restores the parameter file pointer */
+static void closeAtomReader(atomReader *r) {
+	if (r->fp != NULL) {
+		if (r->parFile) {
+			parClose();   
+			parFpPull();  /* restore old parameter file pointer */
+			setComment('%');
+		}
+		else fclose(r->fp);
+		r->fp = NULL;
+	}
+	free(r->atomData);
+	r->atomData = NULL;
+}
+
 /*******************************************************************************
 * This function reads the atomic position and element data for a single atom
 * from a .dat file.  The atomic positions are given in reduced coordinates.
@@ -822,26 +961,15 @@ int readCSSRCellParams(MULS *muls, double **Mm, char *fileName) {
 * This function will return -1, if the end of file is reached prematurely, 0 otherwise.
 *******************************************************************************/
 
-int readNextDATAtom(atom *newAtom, int flag, char *fileName) {
+static int readNextDATAtom(atomReader *r, atom *newAtom, char *fileName) {
 	int printFlag = 0;
-	static FILE *atomfp = NULL;
-	static int noVelocityFlag = 1,entryCount = 3,element = 1;
-	static char buf[NCMAX];
-	static double *atomData = NULL;
+	char *buf = r->buf;
+	int &entryCount = r->entryCount, &element = r->element;
+	double *&atomData = r->atomData;
 	char *str,elementStr[3];
 	int j;
 
-	if (flag < 0) {
-		if (atomfp != NULL) {
-			parClose();   
-			parFpPull();  /* restore old parameter file pointer */      
-			atomfp = NULL;
-			setComment('%');
-		}
-		return -1;
-	}
-
-	if (atomfp == NULL) {
+	if (r->fp == NULL) {
 		parFpPush();  /* save old parameter file pointer */      
 		if (!parOpen(fileName)) {
 			printf("Could not open DAT input file %s\n",fileName);
@@ -851,13 +979,14 @@ int readNextDATAtom(atom *newAtom, int flag, char *fileName) {
 		resetParamFile();  
 		// advance file pointer to last (known) header line
 		readparam("gamma =",buf,1);
-		atomfp = getFp();  /* get the file pointer from the parameter file routines */
+		r->fp = getFp();  /* get the file pointer from the parameter file routines */
+		r->parFile = 1;
 		atomData = (double *)malloc(entryCount*sizeof(double));
 	}
 
 	element = 0;
 	do {
-		if (fgets(buf, NCMAX, atomfp) == NULL) {
+		if (fgets(buf, NCMAX, r->fp) == NULL) {
 			if (printFlag) printf("Found end of file!\n");
 			return -1;
 		}
@@ -897,97 +1026,6 @@ int readNextDATAtom(atom *newAtom, int flag, char *fileName) {
 
 
 
-/*******************************************************************************
-* This function reads the atomic position and element data for a single atom
-* from a .cfg file.  The atomic positions are given in reduced coordinates.
-* Calling this function several times will read one atom after another from the 
-* file.
-* This function will return -1, if the end of file is reached prematurely, 0 otherwise.
-*******************************************************************************/
-
-int readNextCFGAtom(atom *newAtom, int flag, char *fileName) {
-	static FILE *fpNextCFG=NULL;
-	static int noVelocityFlag = 1,entryCount = 3,element = 1;
-	static char buf[NCMAX];
-	static double *atomData = NULL;
-	static double mass = 28;
-	char *str = NULL;
-	int j;
-
-
-	if (flag < 0) {
-		if (fpNextCFG != NULL) {
-			parClose();   
-			parFpPull();  /* restore old parameter file pointer */
-			fpNextCFG = NULL;
-			setComment('%');
-		}
-		return -1;
-	}
-
-	if (fpNextCFG == NULL) {
-		parFpPush();  /* save old parameter file pointer */      
-		if (!parOpen(fileName)) {
-			printf("Could not open CFG input file %s\n",fileName);
-			parFpPull();  /* restore old parameter file pointer */
-			return -1;
-		}
-		resetParamFile();  
-		if (readparam(".NO_VELOCITY.",buf,1)) noVelocityFlag = 1; 
-		else noVelocityFlag = 0;
-		if (readparam("entry_count =",buf,1)) sscanf(buf,"%d",&entryCount);
-		if (!noVelocityFlag) entryCount+=3;
-		fpNextCFG = getFp();  /* get the file pointer from the parameter file routines */
-		atomData = (double *)malloc((entryCount+1)*sizeof(double));
-	}
-
-	if (fgets(buf, NCMAX, fpNextCFG) == NULL) return -1;
-	/* check, if this is a new mass number */
-	str = strnext(buf," \t");
-	if ((atof(buf) >= 1.0) && ((str==NULL) || (*str == '#'))) {
-		mass = atof(buf);
-		// printf("nV: %d, eC: %d (%g)\n",noVelocityFlag, entryCount,atof(buf));
-		if (fgets(buf, NCMAX, fpNextCFG) == NULL) return -1;
-		element = getZNumber(buf); 
-		// printf("*** found element %d (%s %d) ***\n",element,buf,strlen(buf));
-		if (fgets(buf, NCMAX, fpNextCFG) == NULL) return -1;
-	}
-	str = buf;
-	// skip leading spaces:
-	while (strchr(" \t",*str) != NULL) str++; 
-	for (j=0;j<entryCount;j++) {
-		if (str==NULL) {
-			printf("readNextCFGatom: Error: incomplete data line: >%s<\n",buf);
-			return -1;
-		}
-		atomData[j] = atof(str); str=strnext(str," \t");
-	}
-
-
-	newAtom->Znum = element;
-	newAtom->x    = atomData[0];
-	newAtom->y    = atomData[1];
-	newAtom->z    = atomData[2];
-	// newAtom->dw   = 0.45*28.0/((double)(2*element));	
-	// printf("Element: %d, mass=%g\n",element,mass);
-	newAtom->dw   = 0.45*28.0/mass;	
-	newAtom->occ  = 1.0;
-	newAtom->q    = 0.0;
-	// read the DW-factor
-	if (entryCount > 3+3*(1-noVelocityFlag)) 
-		newAtom->dw = atomData[3+3*(1-noVelocityFlag)];
-	// read the atom's occupancy:
-	if (entryCount > 4+3*(1-noVelocityFlag)) 
-		newAtom->occ = atomData[4+3*(1-noVelocityFlag)];
-	// read the atom's charge:
-	if (entryCount > 5+3*(1-noVelocityFlag)) 
-		newAtom->q = atomData[5+3*(1-noVelocityFlag)];
-	// printf("Atom: %d (%g %g %g), occ=%g, q=%g\n",newAtom->Znum,newAtom->x,newAtom->y,newAtom->z,newAtom->occ,newAtom->q);	
-
-
-	return 0;
-}
-
 /*******************************************************************************
 * This function reads the atomic position and element data for a single atom
 * from a .cssr file.  The atomic positions are given in reduced coordinates.
@@ -995,19 +1033,13 @@ int readNextCFGAtom(atom *newAtom, int flag, char *fileName) {
 * file.
 * A ReadLine error will occur, if the end of file is reached prematurely.
 *******************************************************************************/
-int readNextCSSRAtom(atom *newAtom,int flag, char *fileName) {
-	static FILE *fpNextCSSR = NULL;
-	static char buf[NCMAX];
+static int readNextCSSRAtom(atomReader *r, atom *newAtom, char *fileName) {
+	FILE *&fpNextCSSR = r->fp;
+	char *buf = r->buf;
 	int count;
-	static char element[32],s1[32],s2[32],s3[32];
+	char element[32],s1[32],s2[32],s3[32];
 	double dw;
 
-	if (flag < 0) {
-		if (fpNextCSSR != NULL) fclose(fpNextCSSR);
-		fpNextCSSR = NULL;
-		return 0;
-	}
-
 	if ( fpNextCSSR == NULL) 
 	{
 		fpNextCSSR = fopen(fileName, "r");
@@ -1092,7 +1124,7 @@ MULS initMu() {
 
 
 	/* make multislice read the inout files and assign transr and transi: */
-	muls.trans = NULL;
+	muls.trans.Free();
 	muls.cz = NULL;  // (float_t *)malloc(muls.slices*sizeof(float_t));
 
 	muls.onlyFresnel = 0;
@@ -1157,7 +1189,7 @@ int readCubicCFG(double **pos,double **dw, int **Znums, double *ax,double *by,do
 							 printf("%2d: (%g %g %g) %d [%g]\n",j,(*pos)[3*j],(*pos)[3*j+1],(*pos)[3*j+2],(*Znums)[j],(*dw)[j]);
 						 }
 					 }
-					 free(atoms);
+					 // atoms belongs to mu and is released with it
 					 return Natom;
 }
 
@@ -1188,12 +1220,13 @@ int readCubicCFG(double **pos,double **dw, int **Znums, double *ax,double *by,do
 void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVacancies) {
 	int i,j,i2,jChoice,ncx,ncy,ncz,icx,icy,icz,jz,jCell,jequal,jVac;
 	int 	atomKinds = 0;
+	size_t site;
 	double totOcc;
 	double choice,lastOcc;
-	double *u;
-	// seed for random number generation
-	static long idum = -1;
+	double *u,r[4];
+	counterRng vacancy;
 
+	initCounterRng(&vacancy,randomSeed(muls),RNG_STREAM_VACANCY);
 	ncx = muls->nCellX;
 	ncy = muls->nCellY;
 	ncz = muls->nCellZ;
@@ -1241,6 +1274,8 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 				for (icz=ncz-1;icz>=0;icz--) {
 					jCell = (icz+icy*ncz+icx*ncy*ncz)*ncoord;
 					j = jCell+i;
+					// the first atom of the site numbers its random draws, as in nextConfiguration()
+					site = (size_t)jCell+jequal+1;
 					/* We will also add the phonon displacement to the atomic positions now: */
 					atoms[j].dw = atoms[i].dw;
 					atoms[j].occ = atoms[i].occ;
@@ -1256,8 +1291,9 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 						// 
 						// if the total occupancy is less than 1 -> make sure we keep this
 						// if the total occupancy is greater than 1 (unphysical) -> rescale all partial occupancies!
-						if (totOcc < 1.0) choice = ran1(&idum);   
-						else choice = totOcc*ran1(&idum);
+						counterUniform4(&vacancy,muls->avgCount,site,0,r);
+						if (totOcc < 1.0) choice = r[0];   
+						else choice = totOcc*r[0];
 						// printf("Choice: %g %g %d, %d %d\n",totOcc,choice,j,i,jequal);
 						lastOcc = 0;
 						for (i2=i;i2>jequal;i2--) {
@@ -1288,7 +1324,7 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 
 					// this function does nothing, if muls->tds == 0
 					// if (j % 5 == 0) printf("atomKinds: %d (jz = %d, %d)\n",atomKinds,jz,atoms[jChoice].Znum);
-					phononDisplacement(u,muls,jChoice,icx,icy,icz,j,atoms[jChoice].dw,*natom,jz);
+					phononDisplacement(u,muls,jChoice,icx,icy,icz,site,j,atoms[jChoice].dw,*natom,jz);
 					// printf("atomKinds: %d (jz = %d, %d)\n",atomKinds,jz,atoms[jChoice].Znum);
 
 					for (i2=i;i2>jequal;i2--) {
@@ -1310,7 +1346,7 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 //
 // This function reads the atomic positions from fileName and also adds 
 // Thermal displacements to their positions, if muls.tds is turned on.
-atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
+static atom *readUnitCellLocked(int *natom,char *fileName,MULS *muls, int handleVacancies,atomReader *reader) {
 	int printFlag = 1;
 	// char buf[NCMAX], *str,element[16];
 	// FILE *fp;
@@ -1325,16 +1361,22 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 	double choice,lastOcc;
 	double *u = NULL;
 	double **Mm = NULL;
-	static atom *atoms = NULL;
-	static int ncoord_old = 0;
+	std::vector<atom> cfgAtoms;
+	SimState *st = simState(muls);
+	// the atoms belong to the simulation and are reused for the next configuration
+	atom *&atoms = st->atoms;
+	int &ncoord_old = st->ncoord_old;
+	referenceStructure &ref = st->reference;
+	int useReference;
 
 	printFlag = muls->printLevel;
+	ref.cellAtoms = 0;
 
 	if (Mm == NULL) {
 		Mm = double2D(3,3,"Mm");
 		memset(Mm[0],0,9*sizeof(double));
 		muls->Mm = Mm;
-		u = (double *)malloc(3*sizeof(double));
+		u = (double *)st->arena.Alloc("readUnitCell u",3*sizeof(double));
 	}
 
 	/* figure out, whether we have  cssr, pdb, or cfg */
@@ -1354,8 +1396,7 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 	}
 	if (strstr(fileName,".cfg") == fileName+strlen(fileName)-4) {
 		format = FORMAT_CFG;
-		ncoord = readCFGCellParams(muls,Mm,fileName);
-		// return readCFGUnitCell(natom,fileName,muls);
+		ncoord = readCFGFile(muls,Mm,fileName,cfgAtoms);
 	}
 	if (strstr(fileName,".dat") == fileName+strlen(fileName)-4) {
 		format = FORMAT_DAT;
@@ -1424,21 +1465,19 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 
 		switch (format) {
 		case FORMAT_CFG: 
-		if (readNextCFGAtom(atoms+i,0,fileName) < 0) {
-			printf("number of atoms does not agree with atoms in file!\n");
-			return NULL;
-		}
+		// read at once by readCFGFile, in the order of the file
+		atoms[i] = cfgAtoms[ncoord-1-i];
 		break;
 		case FORMAT_DAT: 
 
-		if (readNextDATAtom(atoms+i,0,fileName) < 0) {
+		if (readNextDATAtom(reader,atoms+i,fileName) < 0) {
 			printf("number of atoms does not agree with atoms in file!\n");
 			return NULL;
 		}
 		break;
 
 		case FORMAT_CSSR:
-		readNextCSSRAtom(atoms+i,0,fileName);
+		readNextCSSRAtom(reader,atoms+i,fileName);
 		break;
 		default: return NULL;
 		}
@@ -1482,17 +1521,7 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 
 		////////////////////////////////////////////////////////////////
 	// Close the file for further reading, and restore file pointer 
-	switch (format) {
-		case FORMAT_CFG: 
-			readNextCFGAtom(NULL,-1,NULL);
-			break;
-		case FORMAT_DAT: 
-			readNextDATAtom(NULL,-1,NULL);
-			break;
-		case FORMAT_CSSR:
-			readNextCSSRAtom(NULL,-1,NULL);
-			break;
-	}
+	closeAtomReader(reader);
 
 	// First, we will sort the atoms by position:
 	if (handleVacancies) {
@@ -1514,7 +1543,23 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 		// add the phonon displacement in this condition, because there we can 
 		// actually do the correct Eigenmode treatment.
 		// but we will probably just do Einstein vibrations anyway:
-		replicateUnitCell(ncoord,natom,muls,atoms,handleVacancies);
+		// In the Einstein model the super cell is kept undisplaced as the
+		// reference of all configurations (see nextConfiguration).
+		useReference = !muls->tds || muls->Einstein;
+		if (useReference) {
+			referenceGroups(ref,atoms,ncoord,handleVacancies);
+			for (icx=0;icx<ncx;icx++) for (icy=0;icy<ncy;icy++) for (icz=0;icz<ncz;icz++) {
+				j = (icz+icy*ncz+icx*ncy*ncz)*ncoord;
+				if (j == 0) continue;
+				for (i=0;i<ncoord;i++) {
+					atoms[j+i] = atoms[i];
+					atoms[j+i].x += icx;
+					atoms[j+i].y += icy;
+					atoms[j+i].z += icz;
+				}
+			}
+		}
+		else replicateUnitCell(ncoord,natom,muls,atoms,handleVacancies);
 		/**************************************************************
 		* now, after we read all of the important coefficients, we
 		* need to decide if this is workable
@@ -1637,6 +1682,12 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 			atoms[i].y += muls->yOffset; 
 		}		 
 	}
+	if (useReference) {
+		ref.atoms.assign(atoms,atoms+*natom);
+		ref.cellAtoms = ncoord;
+		ref.handleVacancies = handleVacancies;
+		atoms = nextConfiguration(natom,muls);
+	}
 	} // end of Ncell mode conversion to cartesian coords and tilting.
 	// printf("Offset: (%f, %f)\n",muls->xOffset,muls->yOffset);
 
@@ -1656,21 +1707,477 @@ atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
 	return atoms;
 } // end of readUnitCell
 
+// The parameter file routines used to read the structure file are
+// shared by all simulations of the process, so only one structure
+// file is read at a time.
+atom *readUnitCell(int *natom,char *fileName,MULS *muls, int handleVacancies) {
+	atomReader reader;
+	atom *atoms;
+
+	initAtomReader(&reader);
+	parLock();
+	atoms = readUnitCellLocked(natom,fileName,muls,handleVacancies,&reader);
+	closeAtomReader(&reader);  // also if reading failed
+	parUnlock();
+	return atoms;
+}
+
+
+/* sites of the (sorted) unit cell that share one position, as in
+ * replicateUnitCell() */
+static void referenceGroups(referenceStructure &ref,const atom *atoms,int ncoord,int handleVacancies) {
+	int i,j;
+	double totOcc;
+
+	ref.groups.clear();
+	ref.groupOcc.clear();
+	for (i=0;i<ncoord;i=j) {
+		totOcc = atoms[i].occ;
+		for (j=i+1;(handleVacancies) && (atoms[i].Znum > 0) && (j<ncoord);j++) {
+			if ((fabs(atoms[i].x-atoms[j].x) >= 1e-6) || (fabs(atoms[i].y-atoms[j].y) >= 1e-6) ||
+				(fabs(atoms[i].z-atoms[j].z) >= 1e-6)) break;
+			totOcc += atoms[j].occ;
+		}
+		if ((!handleVacancies) || (atoms[i].Znum <= 0)) {
+			j = i+1;
+			totOcc = 1;
+		}
+		ref.groups.push_back(i);
+		ref.groupOcc.push_back(totOcc);
+	}
+	ref.groups.push_back(ncoord);
+}
+
+/* The configuration is the reference plus one vacancy choice and one
+ * Einstein displacement per shared site and unit cell.  Their random
+ * numbers only depend on the configuration and the site (counter_rng.h),
+ * so all atoms are set in one parallel pass.  Because the displacements
+ * are isotropic gaussians, they are drawn directly in the (tilted)
+ * cartesian frame of the reference.  The rms sums are made over a fixed
+ * number of blocks of cells and added in block order, so that the reported
+ * displacements do not depend on the number of threads either. */
+atom *nextConfiguration(int *natom,MULS *muls) {
+	SimState *st = simState(muls);
+	referenceStructure &ref = st->reference;
+	counterRng phonon,vacancy;
+	int c,jz,b,nCells,nBlocks,nGroups,nThreads = 1,nVac=0;
+	double wobbleScale;
+
+	if (ref.cellAtoms == 0) return NULL;
+	*natom = (int)ref.atoms.size();
+	nCells = *natom/ref.cellAtoms;
+	nGroups = (int)ref.groups.size()-1;
+	if (st->ncoord_old != ref.cellAtoms) {
+		free(st->atoms);
+		st->atoms = (atom *)malloc(*natom*sizeof(atom));
+		st->ncoord_old = ref.cellAtoms;
+	}
+	if (st->atoms == NULL) {
+		printf("Could not allocate memory for atoms!\n");
+		exit(0);
+	}
+	initCounterRng(&phonon,randomSeed(muls),RNG_STREAM_PHONON);
+	phonon.sampling = muls->sampling;
+	initCounterRng(&vacancy,randomSeed(muls),RNG_STREAM_VACANCY);
+	wobbleScale = muls->tds ? sqrt(muls->tds_temp/300.0)/sqrt(8*PID*PID)/sqrt(3.0) : 0;
+	std::vector<double> u2(muls->atomKinds,0.0);
+	std::vector<int> u2Count(muls->atomKinds,0);
+	std::vector<int> kind(ref.cellAtoms);
+	for (c=0;c<ref.cellAtoms;c++) {
+		for (jz=0;jz<muls->atomKinds;jz++) if (muls->Znums[jz] == ref.atoms[c].Znum) break;
+		kind[c] = jz;
+	}
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	// one row of sums per block of cells, plus one kind for unlisted elements
+	nBlocks = (nCells < RMS_BLOCKS) ? nCells : RMS_BLOCKS;
+	std::vector<double> u2Part((size_t)nBlocks*(muls->atomKinds+1),0.0);
+	std::vector<int> u2CountPart((size_t)nBlocks*(muls->atomKinds+1),0);
+	std::vector<int> vacPart(nBlocks,0);
+
+#pragma omp parallel num_threads(nThreads)
+	{
+		int blk,cell,g,i,lo,hi,chosen,jChoice,vac;
+		double choice,lastOcc,wobble,r[4],u[4];
+		double *u2Sum;
+		int *u2N;
+		size_t site;
+
+#pragma omp for schedule(static)
+		for (blk=0;blk<nBlocks;blk++) {
+			u2Sum = &u2Part[(size_t)blk*(muls->atomKinds+1)];
+			u2N = &u2CountPart[(size_t)blk*(muls->atomKinds+1)];
+			vac = 0;
+			for (cell=(int)((size_t)blk*nCells/nBlocks);cell<(int)((size_t)(blk+1)*nCells/nBlocks);cell++) {
+				const atom *a = &ref.atoms[(size_t)cell*ref.cellAtoms];
+				atom *b = st->atoms+(size_t)cell*ref.cellAtoms;
+				for (g=0;g<nGroups;g++) {
+					lo = ref.groups[g];
+					hi = ref.groups[g+1];
+					site = (size_t)cell*ref.cellAtoms+lo;
+					// the site kept (-1: all sites, -2: vacancy)
+					chosen = -1;
+					jChoice = lo;
+					if ((ref.handleVacancies) && ((ref.groupOcc[g] < 1) || (hi-lo > 1))) {
+						counterUniform4(&vacancy,muls->avgCount,site,0,r);
+						choice = (ref.groupOcc[g] < 1.0) ? r[0] : ref.groupOcc[g]*r[0];
+						chosen = -2;
+						lastOcc = 0;
+						for (i=lo;i<hi;i++) {
+							if ((choice >= lastOcc) && (choice < lastOcc+a[i].occ)) chosen = jChoice = i;
+							lastOcc += a[i].occ;
+						}
+						vac += (chosen == -2) ? hi-lo : hi-lo-1;
+					}
+					u[0] = u[1] = u[2] = 0;
+					if ((wobbleScale > 0) && (chosen != -2)) {
+						wobble = wobbleScale*sqrt(a[jChoice].dw);
+						counterGauss4(&phonon,muls->avgCount,site,0,u);
+						u[0] *= wobble;  u[1] *= wobble;  u[2] *= wobble;
+						u2Sum[kind[jChoice]] += u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
+						u2N[kind[jChoice]]++;
+					}
+					for (i=lo;i<hi;i++) {
+						b[i] = a[i];
+						b[i].x += (float)u[0];
+						b[i].y += (float)u[1];
+						b[i].z += (float)u[2];
+						if ((chosen != -1) && (chosen != i)) b[i].Znum = 0;  // vacancy
+					}
+				}
+			}
+			vacPart[blk] = vac;
+		}
+	}
+	for (b=0;b<nBlocks;b++) {
+		for (jz=0;jz<muls->atomKinds;jz++) {
+			u2[jz] += u2Part[(size_t)b*(muls->atomKinds+1)+jz];
+			u2Count[jz] += u2CountPart[(size_t)b*(muls->atomKinds+1)+jz];
+		}
+		nVac += vacPart[b];
+	}
+	if ((nVac > 0) && (muls->printLevel)) printf("Removed %d atoms because of occupancies < 1 or multiple atoms in the same place\n",nVac);
+
+	// rms displacement of this run and averaged over the runs
+	for (jz=0;(muls->tds) && (jz<muls->atomKinds);jz++) {
+		if (u2Count[jz] > 0) u2[jz] /= u2Count[jz];
+		muls->u2[jz] = sqrt(u2[jz]);
+		muls->u2avg[jz] = sqrt((muls->avgCount*muls->u2avg[jz]*muls->u2avg[jz]+u2[jz])/(muls->avgCount+1));
+	}
+	return st->atoms;
+}
+
+/* takes the box and the elements of a sorted atom file */
+static int useSortedAtomFile(MULS *muls,SortedAtomFile *file) {
+	int jz;
+
+	muls->ax = (float_tt)file->Box()[0];
+	muls->by = (float_tt)file->Box()[1];
+	muls->c  = (float_tt)file->Box()[2];
+	muls->atomKinds = (int)file->Znums().size();
+	muls->Znums = (int *)realloc(muls->Znums,muls->atomKinds*sizeof(int));
+	for (jz=0;jz<muls->atomKinds;jz++) muls->Znums[jz] = file->Znums()[jz];
+	if (muls->tds) {
+		muls->u2 = (double *)realloc(muls->u2,muls->atomKinds*sizeof(double));
+		muls->u2avg = (double *)realloc(muls->u2avg,muls->atomKinds*sizeof(double));
+		memset(muls->u2,0,muls->atomKinds*sizeof(double));
+		memset(muls->u2avg,0,muls->atomKinds*sizeof(double));
+	}
+	return 1;
+}
+
+/* A structure file ending in .qaz is a sorted atom file.  Of any other
+ * file only the unit cell is read; an explicit model (one unit cell)
+ * without shared sites is converted to <file>.qaz once (if the atom
+ * cache is on), a crystal is generated cell by cell. */
+int openAtomSource(MULS *muls) {
+	SimState *st = simState(muls);
+	referenceStructure &ref = st->reference;
+	SortedAtomFile *file;
+	const char *ext = strrchr(muls->atomPosFile,'.');
+	char name[1040];
+	int nc[3],i,j,icx,icy,icz,natom,explicitModel,shared = 0;
+	double cell[3][3],box[3],boxMin1[3],boxMin[3],boxMax[3],v,wobble;
+	long seed = randomSeed(muls);
+
+	wobble = muls->tds ? sqrt(muls->tds_temp/300.0)*sqrt(1.0/(8*PID*PID))/sqrt(3.0) : 0;
+	st->atomSource.reset();
+
+	if ((ext != NULL) && (strcmp(ext,".qaz") == 0)) {
+		file = new SortedAtomFile();
+		st->atomSource = boost::shared_ptr<AtomSource>(file);
+		if (!file->Open(muls->atomPosFile,NULL,0,0)) {
+			printf("Could not read sorted atom file %s\n",muls->atomPosFile);
+			return 0;
+		}
+		file->SetDisplacement(wobble,seed,muls->sampling);
+		muls->atoms = NULL;
+		muls->natom = (int)file->Count();
+		return useSortedAtomFile(muls,file);
+	}
+	if (((muls->cubex > 0) && (muls->cubey > 0) && (muls->cubez > 0)) ||
+		(muls->ctiltx != 0) || (muls->ctilty != 0) || (muls->ctiltz != 0)) {
+		printf("stream atoms: only untilted crystals without cube are supported\n");
+		return 0;
+	}
+	if ((muls->tds) && (!muls->Einstein)) {
+		printf("stream atoms: only the Einstein model is supported\n");
+		return 0;
+	}
+	explicitModel = (muls->nCellX == 1) && (muls->nCellY == 1) && (muls->nCellZ == 1);
+	sprintf(name,"%s.qaz",muls->atomPosFile);
+	if ((explicitModel) && (muls->atomCache)) {
+		file = new SortedAtomFile();
+		st->atomSource = boost::shared_ptr<AtomSource>(file);
+		if (file->Open(name,muls->atomPosFile,muls->xOffset,muls->yOffset)) {
+			file->SetDisplacement(wobble,seed,muls->sampling);
+			muls->atoms = NULL;
+			muls->natom = (int)file->Count();
+			return useSortedAtomFile(muls,file);
+		}
+		st->atomSource.reset();
+	}
+
+	// the sites of one unit cell
+	nc[0] = muls->nCellX;  nc[1] = muls->nCellY;  nc[2] = muls->nCellZ;
+	muls->nCellX = muls->nCellY = muls->nCellZ = 1;
+	readUnitCell(&natom,muls->atomPosFile,muls,1);
+	muls->nCellX = nc[0];  muls->nCellY = nc[1];  muls->nCellZ = nc[2];
+	if (ref.cellAtoms == 0) {
+		printf("Could not read the unit cell of %s\n",muls->atomPosFile);
+		return 0;
+	}
+	for (i=0;i<3;i++) for (j=0;j<3;j++) cell[i][j] = muls->Mm[i][j];
+	if (cell[2][2] <= 0) {
+		printf("stream atoms: the c-axis must point into +z\n");
+		return 0;
+	}
+	// readUnitCell placed the box of one cell at the origin, move the
+	// atoms into the box of the super cell
+	for (j=0;j<3;j++) boxMin1[j] = boxMin[j] = boxMax[j] = 0;
+	for (icx=0;icx<=1;icx++) for (icy=0;icy<=1;icy++) for (icz=0;icz<=1;icz++) {
+		for (j=0;j<3;j++) {
+			v = icx*cell[0][j]+icy*cell[1][j]+icz*cell[2][j];
+			if (v < boxMin1[j]) boxMin1[j] = v;
+			v = icx*nc[0]*cell[0][j]+icy*nc[1]*cell[1][j]+icz*nc[2]*cell[2][j];
+			if (v < boxMin[j]) boxMin[j] = v;
+			if (v > boxMax[j]) boxMax[j] = v;
+		}
+	}
+	for (i=0;i<(int)ref.atoms.size();i++) {
+		ref.atoms[i].x += (float)(boxMin1[0]-boxMin[0]);
+		ref.atoms[i].y += (float)(boxMin1[1]-boxMin[1]);
+		ref.atoms[i].z += (float)(boxMin1[2]-boxMin[2]);
+	}
+	for (j=0;j<3;j++) box[j] = boxMax[j]-boxMin[j];
+	for (i=0;i+1<(int)ref.groups.size();i++) {
+		if ((ref.handleVacancies) && ((ref.groupOcc[i] < 1) || (ref.groups[i+1]-ref.groups[i] > 1))) shared = 1;
+	}
+
+	if ((explicitModel) && (muls->atomCache) && (!shared) &&
+		writeSortedAtoms(name,muls->atomPosFile,muls->xOffset,muls->yOffset,ref.atoms,box)) {
+		file = new SortedAtomFile();
+		st->atomSource = boost::shared_ptr<AtomSource>(file);
+		if (!file->Open(name,muls->atomPosFile,muls->xOffset,muls->yOffset)) st->atomSource.reset();
+		else {
+			file->SetDisplacement(wobble,seed,muls->sampling);
+			useSortedAtomFile(muls,file);
+		}
+	}
+	if (st->atomSource.get() == NULL) {
+		st->atomSource = boost::shared_ptr<AtomSource>(new CrystalSource(ref.atoms,ref.groups,
+			ref.groupOcc,cell,nc,ref.handleVacancies,wobble,seed,muls->sampling));
+		muls->ax = (float_tt)box[0];
+		muls->by = (float_tt)box[1];
+		muls->c  = (float_tt)box[2];
+	}
+	if (muls->printLevel) printf("Streaming %d atoms of %s slab by slab\n",(int)st->atomSource->Count(),muls->atomPosFile);
+
+	// the unit cell is no longer needed
+	ref.cellAtoms = 0;
+	std::vector<atom>().swap(ref.atoms);
+	free(st->atoms);
+	st->atoms = NULL;
+	st->ncoord_old = 0;
+	muls->atoms = NULL;
+	muls->natom = (int)st->atomSource->Count();
+	return 1;
+}
+
+/* adds the elements of atoms that are not in muls->Znums yet */
+static void addElements(MULS *muls,const atom *atoms,int natom) {
+	int i,jz;
+
+	for (i=0;i<natom;i++) {
+		if ((atoms[i].Znum < 1) || (atoms[i].Znum > NZMAX)) {
+			printf("Error: bad atomic number %d (atom %d)\n",atoms[i].Znum,i);
+			exit(0);
+		}
+		for (jz=0;jz<muls->atomKinds;jz++) if (muls->Znums[jz] == atoms[i].Znum) break;
+		if (jz == muls->atomKinds) {
+			muls->Znums = (int *)realloc(muls->Znums,(jz+1)*sizeof(int));
+			muls->u2 = (double *)realloc(muls->u2,(jz+1)*sizeof(double));
+			muls->u2avg = (double *)realloc(muls->u2avg,(jz+1)*sizeof(double));
+			muls->Znums[jz] = atoms[i].Znum;
+			muls->u2[jz] = muls->u2avg[jz] = 0;
+			muls->atomKinds++;
+		}
+	}
+}
+
+void setInputAtoms(MULS *muls,const atom *atoms,int natom) {
+	muls->inputAtoms.assign(atoms,atoms+natom);
+	muls->natom = natom;
+	muls->atoms = muls->inputAtoms.empty() ? NULL : &muls->inputAtoms[0];
+	simState(muls)->transReady = 0;
+	addElements(muls,atoms,natom);
+}
+
+atom *displaceInputAtoms(int *natom,MULS *muls) {
+	int jz,b,nBlocks,nThreads = 1;
+	SimState *st = simState(muls);
+	counterRng phonon;
+	std::vector<double> u2(muls->atomKinds,0.0);
+	std::vector<int> u2Count(muls->atomKinds,0);
+
+	*natom = (int)muls->inputAtoms.size();
+	if (st->ncoord_old != *natom) {
+		free(st->atoms);
+		st->atoms = (atom *)malloc(*natom*sizeof(atom));
+		st->ncoord_old = *natom;
+	}
+	if (st->atoms == NULL) {
+		printf("Could not allocate memory for atoms!\n");
+		exit(0);
+	}
+	memcpy(st->atoms,&muls->inputAtoms[0],*natom*sizeof(atom));
+	if (!muls->tds) return st->atoms;
+
+	/* Einstein model, as in phononDisplacement(), but in cartesian
+	 * coordinates, with the random numbers of atom i (counter_rng.h).
+	 * The rms sums are made over fixed blocks of atoms as in nextConfiguration(). */
+	initCounterRng(&phonon,randomSeed(muls),RNG_STREAM_PHONON);
+	phonon.sampling = muls->sampling;
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	nBlocks = (*natom < RMS_BLOCKS) ? *natom : RMS_BLOCKS;
+	std::vector<double> u2Part((size_t)nBlocks*(muls->atomKinds+1),0.0);
+	std::vector<int> u2CountPart((size_t)nBlocks*(muls->atomKinds+1),0);
+
+#pragma omp parallel num_threads(nThreads)
+	{
+		double wobble,u[4];
+		double *u2Sum;
+		int *u2N;
+		int blk,k,j;
+
+#pragma omp for schedule(static)
+		for (blk=0;blk<nBlocks;blk++) {
+			u2Sum = &u2Part[(size_t)blk*(muls->atomKinds+1)];
+			u2N = &u2CountPart[(size_t)blk*(muls->atomKinds+1)];
+			for (k=(int)((size_t)blk*(*natom)/nBlocks);k<(int)((size_t)(blk+1)*(*natom)/nBlocks);k++) {
+				wobble = sqrt(muls->tds_temp/300.0)*sqrt(st->atoms[k].dw/(8*PID*PID))/sqrt(3.0);
+				counterGauss4(&phonon,muls->avgCount,k,0,u);
+				u[0] *= wobble;  u[1] *= wobble;  u[2] *= wobble;
+				st->atoms[k].x += (float)u[0];
+				st->atoms[k].y += (float)u[1];
+				st->atoms[k].z += (float)u[2];
+				for (j=0;j<muls->atomKinds;j++) if (muls->Znums[j] == st->atoms[k].Znum) break;
+				u2Sum[j] += u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
+				u2N[j]++;
+			}
+		}
+	}
+	for (b=0;b<nBlocks;b++) for (jz=0;jz<muls->atomKinds;jz++) {
+		u2[jz] += u2Part[(size_t)b*(muls->atomKinds+1)+jz];
+		u2Count[jz] += u2CountPart[(size_t)b*(muls->atomKinds+1)+jz];
+	}
+	// rms displacement of this run and averaged over the runs
+	for (jz=0;jz<muls->atomKinds;jz++) {
+		if (u2Count[jz] > 0) u2[jz] /= u2Count[jz];
+		muls->u2[jz] = sqrt(u2[jz]);
+		muls->u2avg[jz] = sqrt((muls->avgCount*muls->u2avg[jz]*muls->u2avg[jz]+u2[jz])/(muls->avgCount+1));
+	}
+	return st->atoms;
+}
+
+
+int openTrajectory(MULS *muls) {
+	SimState *st = simState(muls);
+	Trajectory *traj = new Trajectory();
+	int natom;
+
+	st->trajectory = boost::shared_ptr<Trajectory>(traj);
+	if (((muls->cubex > 0) && (muls->cubey > 0) && (muls->cubez > 0)) ||
+		(muls->ctiltx != 0) || (muls->ctilty != 0) || (muls->ctiltz != 0)) {
+		printf("trajectory: the frames are used as they are, without tilt or cube\n");
+		return 0;
+	}
+	if ((muls->nCellX != 1) || (muls->nCellY != 1) || (muls->nCellZ != 1)) {
+		printf("trajectory: the frames are not replicated, please set NCELLX, NCELLY and NCELLZ to 1\n");
+		return 0;
+	}
+	if (!traj->Open(muls->atomPosFile,muls->trajectoryTypes[0] ? muls->trajectoryTypes : NULL,muls->atomCache)) return 0;
+	if (muls->printLevel) printf("Using the %d frames of %s as configurations\n",traj->Frames(),muls->atomPosFile);
+	muls->ax = muls->by = muls->c = 0;   // taken from frame 0
+	muls->atoms = trajectoryConfiguration(&natom,muls);
+	muls->natom = natom;
+	return 1;
+}
 
+atom *trajectoryConfiguration(int *natom,MULS *muls) {
+	SimState *st = simState(muls);
+	std::vector<atom> &atoms = st->frameAtoms;
+	double Mm[9];
+	int i;
+
+	if (!st->trajectory->Frame(muls->avgCount,atoms,Mm)) exit(0);
+	if ((fabs(Mm[1])+fabs(Mm[2])+fabs(Mm[3])+fabs(Mm[5])+fabs(Mm[6])+fabs(Mm[7])) > 1e-6*(Mm[0]+Mm[4]+Mm[8])) {
+		printf("trajectory: frame %d does not have an orthogonal cell\n",muls->avgCount);
+		exit(0);
+	}
+	// the box of the simulation is the one of frame 0
+	if (muls->ax == 0) {
+		muls->ax = (float_tt)Mm[0];
+		muls->by = (float_tt)Mm[4];
+		muls->c  = (float_tt)Mm[8];
+	}
+	else if ((muls->printLevel) && ((fabs(Mm[0]-muls->ax)+fabs(Mm[4]-muls->by)+fabs(Mm[8]-muls->c)) > 1e-3))
+		printf("trajectory: the cell of frame %d differs from the one of frame 0\n",muls->avgCount);
+	if ((muls->xOffset != 0) || (muls->yOffset != 0)) {
+		for (i=0;i<(int)atoms.size();i++) {
+			atoms[i].x += muls->xOffset;
+			atoms[i].y += muls->yOffset;
+		}
+	}
+	addElements(muls,&atoms[0],(int)atoms.size());
+	*natom = (int)atoms.size();
+	return &atoms[0];
+}
+
+int trajectoryFrames(MULS *muls) {
+	SimState *st = simState(muls);
+	return (st->trajectory.get() == NULL) ? 0 : st->trajectory->Frames();
+}
 
 atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancies) {
 	int atomKinds = 0;
 	int iatom,jVac,jequal,jChoice,i2,ix,iy,iz,atomCount = 0,atomSize;
-	static double *axCell,*byCell,*czCell=NULL;
-	static double **Mm = NULL, **Mminv = NULL, **MpRed = NULL, **MpRedInv = NULL;
-	static double **MbPrim = NULL, **MbPrimInv = NULL, **MmOrig = NULL,**MmOrigInv=NULL;
-	static double **a = NULL,**aOrig = NULL,**b= NULL,**bfloor=NULL,**blat=NULL;
-	static double *uf;
-	static int oldAtomSize = 0;
+	SimState *st = simState(muls);
+	counterRng vacancy;
+	// the matrices are kept by the simulation between configurations
+	double **&Mm = st->tilt.Mm, **&Mminv = st->tilt.Mminv, **&MpRed = st->tilt.MpRed, **&MpRedInv = st->tilt.MpRedInv;
+	double **&MbPrim = st->tilt.MbPrim, **&MbPrimInv = st->tilt.MbPrimInv, **&MmOrig = st->tilt.MmOrig,**&MmOrigInv = st->tilt.MmOrigInv;
+	double **&a = st->tilt.a,**&aOrig = st->tilt.aOrig,**&b = st->tilt.b,**&bfloor = st->tilt.bfloor,**&blat = st->tilt.blat;
+	double *&uf = st->tilt.uf;
+	int &oldAtomSize = st->tilt.oldAtomSize;
 	double x,y,z,dx,dy,dz; 
-	double totOcc,lastOcc,choice;
+	double totOcc,lastOcc,choice,r[4];
 	atom *unitAtoms,newAtom;
 	int nxmin,nxmax,nymin,nymax,nzmin,nzmax,jz;
+	size_t site;
 	// static FILE *fpPhonon = NULL;
 	// FILE *fpu2;
 	// static int Nk, Ns;     // number of k-vectors and atoms per primitive unit cell
@@ -1687,8 +2194,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 	//static double u2=0;
 	//static int u2Count = 0;
 	// static long iseed=0;
-	static double *u;
-	static long idum = -1;
+	double *&u = st->tilt.u;
 
 
 	// if (iseed == 0) iseed = -(long) time( NULL );
@@ -1715,7 +2221,6 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 												   */
 		Mm			= double2D(3,3,"Mm");
 		Mminv		= double2D(3,3,"Mminv");
-		axCell = Mm[0]; byCell = Mm[1]; czCell = Mm[2];
 		a			= double2D(1,3,"a");
 		aOrig		= double2D(1,3,"aOrig");
 		b			= double2D(1,3,"b");
@@ -1724,6 +2229,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 		uf			= (double *)malloc(3*sizeof(double));
 		u			= (double *)malloc(3*sizeof(double));
 	}
+	initCounterRng(&vacancy,randomSeed(muls),RNG_STREAM_VACANCY);
 
 
 	dx = 0; dy = 0; dz = 0;
@@ -1779,7 +2285,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 	}
 
 	// nxmin--;nxmax++;nymin--;nymax++;nzmin--;nzmax++;
-	unitAtoms = (atom *)malloc(ncoord*sizeof(atom));
+	unitAtoms = (atom *)st->arena.Alloc("unitAtoms",ncoord*sizeof(atom));
 	memcpy(unitAtoms,atoms,ncoord*sizeof(atom));
 	atomSize = (1+(nxmax-nxmin)*(nymax-nymin)*(nzmax-nzmin)*ncoord);
 	if (atomSize != oldAtomSize) {
@@ -1844,13 +2350,16 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 					// All we need to decide is whether to include the atom at all (if totOcc < 1
 					// of which of the atoms at equal positions to include
 					jChoice = iatom;  // This will be the atom we wil use.
+					// linear index of the cell (ix,iy,iz) in the box range, times ncoord, plus the first atom of the site
+					site = (((size_t)(ix-nxmin)*(nymax-nymin+1)+(iy-nymin))*(nzmax-nzmin+1)+(iz-nzmin))*ncoord+iatom;
 					if ((totOcc < 1) || (jequal > iatom+1)) { // found atoms at equal positions or an occupancy less than 1!
 						// ran1 returns a uniform random deviate between 0.0 and 1.0 exclusive of the endpoint values. 
 						// 
 						// if the total occupancy is less than 1 -> make sure we keep this
 						// if the total occupancy is greater than 1 (unphysical) -> rescale all partial occupancies!
-						if (totOcc < 1.0) choice = ran1(&idum);   
-						else choice = totOcc*ran1(&idum);
+						counterUniform4(&vacancy,muls->avgCount,site,0,r);
+						if (totOcc < 1.0) choice = r[0];   
+						else choice = totOcc*r[0];
 						// printf("Choice: %g %g %d, %d %d\n",totOcc,choice,j,i,jequal);
 						lastOcc = 0;
 						for (i2=iatom;i2<jequal;i2++) {
@@ -1882,7 +2391,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 					if (muls->Einstein == 1) {
 						// phononDisplacement(u,muls,iatom,ix,iy,iz,1,newAtom.dw,10,newAtom.Znum);
 						if (muls->tds) {
-							phononDisplacement(u,muls,jChoice,ix,iy,iz,1,unitAtoms[jChoice].dw,atomSize,jz);
+							phononDisplacement(u,muls,jChoice,ix,iy,iz,site,1,unitAtoms[jChoice].dw,atomSize,jz);
 							a[0][0] = aOrig[0][0]+u[0]; a[0][1] = aOrig[0][1]+u[1]; a[0][2] = aOrig[0][2]+u[2];
 						}
 						else {
@@ -1932,10 +2441,9 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 	muls->c  = muls->cubez;
 	*natom = atomCount;
 	// call phononDisplacement again to update displacement data:
-	phononDisplacement(u,muls,iatom,ix,iy,iz,0,newAtom.dw,*natom,jz);
+	phononDisplacement(u,muls,iatom,ix,iy,iz,0,0,newAtom.dw,*natom,jz);
 
 
-	free(unitAtoms);
 	return atoms;
 }  // end of 'tiltBoxed(...)'
 
@@ -1956,318 +2464,6 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 
 
 
-/*******************************************************
-* This function reads in a .cssr or .pdb file and fills a 
-* atom struct array with the files data
-* .cssr: Cerius data format, also supported by Cerius2
-* .pdb:  Protein Data Bank format, supported by AtomEye
-* atomic positions will be in FRACTIONAL coordinates!!!
-******************************************************/
-
-atom *readUnitCell_old(int *natom,char *fileName,MULS *muls) {
-	char buf[NCMAX], *str,element[16];
-	FILE *fpUnit;
-	real alpha,beta,gamma;
-	int ncoord,ncx,ncy,ncz,icx,icy,icz;
-	real dw,occ,dx,dy,dz,r;
-	int spaceGrp,i,count,j,type;
-	static atom *atoms = NULL;
-	char s1[32],s2[32],s3[32],dummy[32];
-	static int ncoord_old = 0;
-	int format = FORMAT_UNKNOWN;
-
-	/* figure out, whether we have xyz, or cssr */
-	if (strstr(fileName,".cssr") == fileName+strlen(fileName)-5)
-		format = FORMAT_CSSR;
-	if (strstr(fileName,".pdb") == fileName+strlen(fileName)-4)
-		format = FORMAT_PDB;
-	if (format == FORMAT_UNKNOWN) {
-		printf("Cannot read anything else than .cssr or .pdb files (%s)!\n",
-			fileName);
-		exit(0);
-	}
-
-	printf("Format of input file: %d (%s)\n",format,format==FORMAT_CSSR ? "cssr" : "pdb");
-
-	ncx = muls->nCellX;
-	ncy = muls->nCellY;
-	ncz = muls->nCellZ;
-	/******************************************************************/
-	fpUnit = fopen( fileName, "r" );
-	if ( fpUnit == NULL ) {
-		printf("Cannot open file %s\n",fileName);
-		exit( 0 );
-	}
-	if (format == FORMAT_CSSR) {
-
-		/* skip first line in first pass */
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-
-		/************************************************************
-		* check angles, of cssr file (must be 90 degrees)
-		*************************************************************/
-		str = strchr(buf,'9');
-		alpha = (real)atof(str++);
-		beta = (real)atof(strchr(str++,'9'));
-		gamma = (real)atof(strchr(str,'9'));
-		muls->cAlpha = alpha;
-		muls->cBeta  = beta;
-		muls->cGamma = gamma;
-		/*
-		if ((alpha != 90.0) || (beta != 90.0) || (gamma!= 90.0)) {
-		printf("angles are not 90 degrees! (%g, %g, %g) \n",
-		alpha,beta,gamma);
-		exit(0);
-		}
-		*/
-		/* check the space group: */
-		spaceGrp = atoi(strstr(buf,"SPGR =")+strlen("SPGR ="));
-		if (spaceGrp != 1) {
-			printf("cannot interpret space group %d\n",spaceGrp);
-			exit(0);
-		}
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		ncoord = atoi(buf);
-	}
-	else if (format == FORMAT_PDB) {
-		/*****************************************************************
-		* File Format of pdb files:
-		* HEADER    libAtoms:Config_save_as_pdb; 388 atoms
-		* CRYST1   15.638   15.638   42.547  90.00  90.00  90.00 P 1           1
-		* ATOM      1  C           1      11.729   7.819   0.000
-		* ATOM      2  C           1      11.483   9.183  42.182
-		*****************************************************************
-		* We will look for the first string that is a non-zero number in 
-		* the first line and make it the number of atoms.
-		* The second line will determine a,b,c,alpha,beta,gamma
-		****************************************************************/
-
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		str = buf;
-		ncoord = 0;
-		do {
-			ncoord = atoi(str);
-			if (ncoord > 0) break;
-		}
-		while(((str=strtok(str," \t")) != NULL) && (ncoord == 0));
-		if (ncoord == 0) {
-			printf("Could not determine number of atmoms - quit\n");
-			exit(0);
-		}
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-
-		/************************************************************
-		* check angles, of pdb file (must be 90 degrees)
-		* This cannot work yet - please check !!!
-		*************************************************************/
-		str = buf;
-		muls->ax = (real)atof(str);
-		muls->by = (real)atof(str = strtok(buf," \t"));
-		muls->c  = (real)atof(str = strtok(buf," \t"));
-		alpha = (real)atof(str = strtok(buf," \t"));
-		beta = (real)atof(str = strtok(buf," \t"));
-		gamma = (real)atof(str = strtok(buf," \t"));
-		muls->cAlpha = alpha;
-		muls->cBeta  = beta;
-		muls->cGamma = gamma;
-		/*
-		if ((alpha != 90.0) || (beta != 90.0) || (gamma!= 90.0)) {
-		printf("angles are not 90 degrees! (%g, %g, %g) \n",
-		alpha,beta,gamma);
-		exit(0);
-		}
-		*/
-	}
-	else {
-		printf("Wrong file format!\n");
-		exit(0);
-	}
-
-	/************************************************************
-	* now that we know how many coordinates there are
-	* allocate the arrays 
-	************************************************************/
-	if (muls->nCellX == 0) {
-		printf("Number of unit cell repetitions in X is 0, adjusted to 1/n");
-		muls->nCellX = 1;
-	}
-	if (muls->nCellY == 0) {
-		printf("Number of unit cell repetitions in Y is 0, adjusted to 1/n");
-		muls->nCellY = 1;
-	}
-	if (muls->nCellZ == 0) {
-		printf("Number of unit cell repetitions in Z is 0, adjusted to 1/n");
-		muls->nCellZ = 1;
-	}
-
-	if (ncoord_old != ncoord) {
-		if (atoms != NULL)
-			free(atoms);
-		atoms = (atom *)malloc(ncoord*sizeof(atom)*ncx*ncy*ncz);
-		ncoord_old = ncoord;
-	}
-	if (atoms == NULL) {
-		printf("Could not allocate memory for atoms!\n");
-		exit(0);
-	}
-	if (format == FORMAT_CSSR) {
-		fclose( fpUnit );
-		fpUnit = fopen( fileName, "r" );
-		if ( fpUnit == NULL ) {
-			printf("Cannot open file %s\n",fileName);
-			exit( 0 );
-		}
-
-		/***********************************************************
-		* Read Header for .cssr and .pdb
-		***********************************************************/
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		/* printf(buf); */
-		sscanf( buf, " %s %s %s",s1,s2,s3);
-		/* printf("\n%s\n",s2); */
-		muls->ax = atof(s1);
-		muls->by = atof(s2);
-		muls->c = atof(s3);
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord" );
-	} /* end of if FORMAT_CSSR */
-	printf("Lattice parameters: ax=%g(%dx%g) by=%g(%dx%g) cz=%g(%dx%g)\n",
-		muls->ax*ncx,ncx,muls->ax,muls->by*ncy,ncy,muls->by,
-		muls->c*ncz,ncz,muls->c);
-
-	/***********************************************************
-	* Read actual Data
-	***********************************************************/
-	for( i=0; i<ncoord; i++) {
-		ReadLine( fpUnit, buf, NCMAX, "in ReadXYZcoord()" );
-		/* for Si */
-		/*    dw = 0.444; */
-		occ = 1.0F;
-		if (format == FORMAT_CSSR) {
-			sscanf(buf,"%d %s %s %s %s %d %d %d %d %d %d %d %d %g",
-				&count,element,s1,s2,s3,&count,&count,
-				&count,&count,&count,&count,&count,&count,&dw);
-		}
-		else if (format==FORMAT_PDB) {
-			/* ATOM      1  C 1      11.729   7.819   0.000 */
-			sscanf(buf,"%s %d %s %d %s %s %s",dummy,&count,element,&type,s1,s2,s3);
-		}
-		atoms[i].x = atof(s1);
-		atoms[i].y = atof(s2);
-		atoms[i].z = atof(s3);
-		atoms[i].occ = occ;
-		atoms[i].q = 0;
-		atoms[i].Znum = getZNumber(element); 
-		switch (atoms[i].Znum) {
-	case 14:  atoms[i].dw = 0.45f;
-		break;
-	case 29:  atoms[i].dw = 0.21f;
-		break;
-	default: atoms[i].dw = 0.21f;
-		}
-		/* get wobble factor from debye waller factor 
-		(*wobble)[i] = sqrt(*(*wobble+i)/(8*PI*PI));
-		*/    
-		if((atoms[i].Znum < 1 ) || (atoms[i].Znum > NZMAX)) {
-			printf("Error: bad atomic number %d in file %s\n",
-				atoms[i].Znum,fileName);
-			exit(0);
-		}
-		if (format == FORMAT_CSSR) {
-			/* replicate unit cell ncx,y,z times: */
-			for (icx=0;icx<ncx;icx++) {
-				for (icy=0;icy<ncy;icy++) {
-					for (icz=0;icz<ncz;icz++) {
-						j = (icz+icy*ncz+icx*ncy*ncz)*ncoord+i;
-						atoms[j].x   = atoms[i].x+icx;
-						atoms[j].y   = atoms[i].y+icy;
-						atoms[j].z   = atoms[i].z+icz;
-						atoms[j].dw  = atoms[i].dw;
-						atoms[j].occ = atoms[i].occ;
-						atoms[j].q   = atoms[i].q;
-						atoms[j].Znum = atoms[i].Znum; 	  
-					}
-				}
-			}
-		}
-		else {
-			/* replicate unit cell ncx,y,z times: */
-			for (icx=0;icx<ncx;icx++) {
-				for (icy=0;icy<ncy;icy++) {
-					for (icz=0;icz<ncz;icz++) {
-						j = (icz+icy*ncz+icx*ncy*ncz)*ncoord+i;
-						atoms[j].x = atoms[i].x+icx*muls->ax;
-						atoms[j].y = atoms[i].y+icy*muls->by;
-						atoms[j].z = atoms[i].z+icz*muls->c;
-						atoms[j].dw = atoms[i].dw;
-						atoms[j].occ = atoms[i].occ;
-						atoms[j].q   = atoms[i].q;
-						atoms[j].Znum = atoms[i].Znum; 	  
-					}
-				}
-			}
-		}
-	}
-	fclose( fpUnit );
-
-	*natom = ncoord*ncx*ncy*ncz;
-
-	/**************************************************************
-	* Converting to cartesian coordinates
-	if (format == FORMAT_CSSR) {
-	for(i=0;i<*natom;i++) {
-	atoms[i].x *= muls->ax; 
-	atoms[i].y *= muls->by; 
-	atoms[i].z *= muls->c;
-	}	
-	}	 
-	*************************************************************/
-	muls->ax *= ncx;
-	muls->by *= ncy;
-	muls->c  *= ncz;
-
-	/***************************************************************
-	* Now let us tilt around the center of the full crystal
-	*/
-
-	if ((muls->ctiltx != 0) || (muls->ctilty)!=0) {
-		for(i=0;i<*natom;i++) {
-			/* apply tilt around x-axis: */
-			if (muls->ctiltx != 0) {
-				dy =(atoms[i].y-muls->by/2.0);
-				dz = (atoms[i].z-muls->c/2.0);
-				r = sqrt(dz*dz+dy*dy);
-				alpha = atan2(dz,dy)+muls->ctiltx;
-				atoms[i].y = muls->by/2.0+r*cos(alpha); 
-				atoms[i].z = muls->c/2.0+r*sin(alpha); 
-			}
-			if (muls->ctilty != 0) {
-				dx =(atoms[i].x-muls->ax/2.0);
-				dz = (atoms[i].z-muls->c/2.0);
-				r = sqrt(dz*dz+dx*dx);
-				alpha = atan2(dz,dx)+muls->ctilty;
-				atoms[i].x = muls->ax/2.0+r*cos(alpha); 
-				atoms[i].z = muls->c/2.0+r*sin(alpha); 
-			}
-		}
-	}
-
-
-
-	/*  natom = ReadXYZcoord(filein,1,1,1,
-	&ax, &by, &cz, &Znum, &x, &y, &z, &occ, &wobble,
-	description, NCMAX );
-	*/
-
-
-
-	printf("%d atoms read from file <%s>, %d atoms in model (Tilt: x: %g mrad, y: %g mrad).\n",
-		ncoord,fileName,*natom,muls->ctiltx,muls->ctilty);
-	return atoms;
-}
-
 /*--------------------- ReadLine() -----------------------*/
 /*
 read a full line from a file and 
@@ -2543,8 +2739,8 @@ void writeAmorphous(FILE *fpAmorph,superCellBox superCell,int nstart,int nstop)
 * Set idum to any integer, except MASK, to initialize the sequence.
 *******************************************************************/
 float ran(long *idum) { 
-	static long k; 
-	static float ans; 
+	long k; 
+	float ans; 
 
 	*idum ^= MASK; // XORing with MASK allows use of zero and other . 
 	k=(*idum)/IQ;  // simple bit patterns for idum.
@@ -2572,11 +2768,11 @@ float ran(long *idum) {
 * thereafter, do not alter idum between successive deviates in a sequence. 
 * RNMX should approximate the largest  floating value that is less than 1.
 */
-double ran1(long *idum) { 
+double ran1(long *idum, randomState *state) { 
 	int j; 
 	long k; 
-	static long iy=0; 
-	static long iv[NTAB]; 
+	long &iy = state->ran1Y; 
+	long *iv = state->ran1V; 
 	double temp; 
 	if (*idum <= 0 || !iy) { // Initialize. 
 		if (-(*idum) < 1) *idum=1; // Be sure to prevent  idum = 0. 
@@ -2604,13 +2800,13 @@ double ran1(long *idum) {
 * Gaussian distribution with unit variance
 * idum must be initailized to a negative integer 
 ****************************************************************/
-double gasdev(long *idum) 
+double gasdev(long *idum, randomState *state) 
 /* Returns a normally distributed deviate with zero mean and unit variance, 
 * using ran1(idum) as the source of uniform deviates. */
 { 
 	// float ran1(long *idum); 
-	static int iset=0; 
-	static float gset; 
+	int &iset = state->gasdevSet; 
+	float &gset = state->gasdevStore; 
 	double fac,rsq,v1,v2; 
 	if (*idum < 0) {
 		iset=0; // Reinitialize. 
@@ -2620,8 +2816,8 @@ double gasdev(long *idum)
 		/* We don t have an extra deviate handy, so 
 		* pick two uniform numbers in the square extending from -1 to +1 in each direction, */
 		do { 
-			v1=2.0*ran1(idum)-1.0;  
-			v2=2.0*ran1(idum)-1.0; 
+			v1=2.0*ran1(idum,state)-1.0;  
+			v2=2.0*ran1(idum,state)-1.0; 
 			rsq=v1*v1+v2*v2;  // see if they are in the unit circle,
 		} while (rsq >= 1.0 || rsq == 0.0); // and if they are not, try again. 
 		fac=sqrt(-2.0*log(rsq)/rsq); 
@@ -2638,6 +2834,17 @@ double gasdev(long *idum)
 	} 
 }
 
+/* generator shared by the stand-alone tools */
+static randomState toolRandomState = {0,{0},0,0.0f,0};
+
+double ran1(long *idum) {
+	return ran1(idum,&toolRandomState);
+}
+
+double gasdev(long *idum) {
+	return gasdev(idum,&toolRandomState);
+}
+
 void writeSTEMinput(char* stemFile,char *cfgFile,MULS *muls) {
 	FILE *fpSTEM;
 	char folder[64];
@@ -2660,6 +2867,7 @@ void writeSTEMinput(char* stemFile,char *cfgFile,MULS *muls) {
 		muls->nCellX,muls->nCellY,muls->nCellZ,muls->cellDiv);
 	fprintf( fpSTEM, "v0: %g\n", muls->v0 );
 	fprintf( fpSTEM, "tds: %s\n", muls->tds ? "yes" : "no" );
+	fprintf( fpSTEM, "absorptive potential: %s\n", muls->absorptive ? "yes" : "no" );
 	fprintf( fpSTEM, "temperature: %g\n", muls->tds_temp );
 	fprintf( fpSTEM, "slice-thickness: %g\n", muls->sliceThickness );
 	fprintf( fpSTEM, "periodicXY: no\n" );
@@ -2691,6 +2899,11 @@ void writeSTEMinput(char* stemFile,char *cfgFile,MULS *muls) {
 	fprintf( fpSTEM, "Display Gamma: 0 \n" );
 	fprintf( fpSTEM, "Folder: %s\n", folder );
 	fprintf( fpSTEM, "Runs for averaging: %d\n", muls->avgRuns );
+	if (muls->tdsStopError > 0) {
+		fprintf( fpSTEM, "tds stop error: %g\n", muls->tdsStopError );
+		fprintf( fpSTEM, "tds min runs: %d\n", muls->tdsMinRuns );
+		fprintf( fpSTEM, "tds stop pixels: %s\n", muls->tdsStopPixels ? "yes" : "no" );
+	}
 	fprintf( fpSTEM, "Structure Factors: DT  \n" );
 	fprintf( fpSTEM, "show Probe: %s \n", muls->showProbe ? "yes" : "no" );
 	fprintf( fpSTEM, "propagation progress interval: 10 \n" );
@@ -22,10 +22,33 @@ QSTEM - image simulation for TEM/STEM/CBED
 
 #include "data_containers.h"
 #include "stemtypes_fftw3.h"
+#include "sim_state.h"
 
 atom *readUnitCell(int *natom,char *fileName,MULS *muls,int handleVacancies);
+/* next configuration (vacancies, Einstein displacements) of the structure
+ * the last readUnitCell() read, without reading the file again.  Returns
+ * NULL if that structure cannot be reused (tiltBoxed, phonon file) */
+atom *nextConfiguration(int *natom,MULS *muls);
+/* opens the structure of muls->atomPosFile as a stream of slabs
+ * (muls->streamAtoms, see atom_stream.h) instead of making all of its
+ * atoms, sets the box size, returns 0 on error */
+int openAtomSource(MULS *muls);
 void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVacancies);
 atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancies);
+/* atoms given by the caller instead of a structure file (muls->inputAtoms):
+ * setInputAtoms() stores them and updates the list of elements,
+ * displaceInputAtoms() returns the configuration of the current run
+ * (with thermal displacements in the Einstein model, if muls->tds) */
+void setInputAtoms(MULS *muls,const atom *atoms,int natom);
+atom *displaceInputAtoms(int *natom,MULS *muls);
+/* a molecular dynamics trajectory as structure file (trajectory.h):
+ * openTrajectory() opens muls->atomPosFile and takes the box and the
+ * atoms of frame 0, returns 0 on error; trajectoryConfiguration()
+ * returns frame avgCount as configuration of the current run;
+ * trajectoryFrames() returns the number of frames, 0 without trajectory */
+int openTrajectory(MULS *muls);
+atom *trajectoryConfiguration(int *natom,MULS *muls);
+int trajectoryFrames(MULS *muls);
 int writePDB(atom *atoms,int natoms,char *fileName,MULS *muls);
 int writeCFG(atom *atoms,int natoms,char *fileName,MULS *muls);
 // write CFG file using atomic positions stored in pos, Z's in Znum and DW-factors in dw
@@ -46,6 +69,11 @@ int readCSSRCellParams(MULS *muls, double **Mm, char *fileName);
 void writeFrameWork(FILE *fp,superCellBox superCell);
 void writeAmorphous(FILE *fp,superCellBox superCell,int nstart,int nstop);
 
+/* the simulation draws its random numbers from its own generator state
+ * (simState(muls)->rng), the versions without state share one
+ * generator and are meant for the stand-alone tools (gbmaker) */
+double gasdev(long *idum, randomState *state);
+double ran1(long *idum, randomState *state);
 double gasdev(long *idum); 
 double ran1(long *idum);
 float ran(long *idum);
@@ -256,3 +256,9 @@ void CImageIO::SetParameter(int index, double value)
 		throw std::runtime_error("Tried to set out of bounds parameter.");
 }
 
+double CImageIO::GetParameter(int index) const
+{
+	if ((index < 0) || (index >= (int)m_params.size())) return 0;
+	return m_params[index];
+}
+
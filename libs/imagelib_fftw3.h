@@ -58,6 +58,8 @@ public:
   void SetThickness(double thickness);
   void SetParams(std::vector<double> params);
   void SetParameter(int index, double value);
+  // parameter index of the image read or set last, 0 if there is none
+  double GetParameter(int index) const;
   void SetResolution(double resX, double resY);
 private:
   void WriteData(void **pix, const char *fileName);
@@ -0,0 +1,50 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lib_lock.h"
+
+#ifdef _OPENMP
+
+LibLock::LibLock() { omp_init_nest_lock(&m_lock); }
+LibLock::~LibLock() { omp_destroy_nest_lock(&m_lock); }
+void LibLock::Lock() { omp_set_nest_lock(&m_lock); }
+void LibLock::Unlock() { omp_unset_nest_lock(&m_lock); }
+
+#elif !defined(_WIN32)
+
+LibLock::LibLock() {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m_lock,&attr);
+	pthread_mutexattr_destroy(&attr);
+}
+LibLock::~LibLock() { pthread_mutex_destroy(&m_lock); }
+void LibLock::Lock() { pthread_mutex_lock(&m_lock); }
+void LibLock::Unlock() { pthread_mutex_unlock(&m_lock); }
+
+#else
+
+LibLock::LibLock() {}
+LibLock::~LibLock() {}
+void LibLock::Lock() {}
+void LibLock::Unlock() {}
+
+#endif
@@ -0,0 +1,75 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIB_LOCK_H
+#define LIB_LOCK_H
+
+#ifdef _OPENMP
+#include <omp.h>
+#elif !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+/**************************************************************
+ * Lock for the state that all simulations of a process share
+ * (parameter parser, FFTW planner, memory accounting, ...).
+ *
+ * Simulations may run in threads that OpenMP does not know about
+ * (Python threads, see pyqstem), so the library cannot rely on
+ * "omp critical", which compiles to nothing without OpenMP.  A
+ * LibLock is an OpenMP nestable lock when the library is built
+ * with OpenMP, otherwise a recursive pthread mutex.  Only Windows
+ * builds without OpenMP, which have no threads, do not lock.
+ * The same thread may lock it again.
+ *
+ * static LibLock plannerLock;
+ * {
+ *     ScopedLock lock(plannerLock);
+ *     ...                               // one thread at a time
+ * }
+ **************************************************************/
+
+class LibLock {
+#ifdef _OPENMP
+	omp_nest_lock_t m_lock;
+#elif !defined(_WIN32)
+	pthread_mutex_t m_lock;
+#endif
+
+	LibLock(const LibLock &);
+	LibLock &operator=(const LibLock &);
+public:
+	LibLock();
+	~LibLock();
+	void Lock();
+	void Unlock();
+};
+
+/* holds a LibLock for its lifetime */
+class ScopedLock {
+	LibLock &m_lock;
+
+	ScopedLock(const ScopedLock &);
+	ScopedLock &operator=(const ScopedLock &);
+public:
+	ScopedLock(LibLock &lock) : m_lock(lock) { m_lock.Lock(); }
+	~ScopedLock() { m_lock.Unlock(); }
+};
+
+#endif // LIB_LOCK_H
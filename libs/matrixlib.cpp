@@ -261,24 +261,14 @@ void inverse_3x3 (double *res, const double *a)
  * even if M is not orthogonal. For any rowvector vec
  * vec == invMM*vec, if vec is represented by M, or vec!=invMM*vec if not.
  * the matrix M will be preserved
- * The invMM matrix will be of size M X M
+ * The invMM matrix will be of size M X M, the caller must free it
  */
 double **invMM(double **Mmatrix, int N, int M) {
-  static int Mold = 0; // Nold = 0, 
-  static double **invMMmatrix = NULL;
   // int i;
 
   if (N > M) return NULL;
   
-  if (Mold < M) {
-    Mold = M;
-    if (invMMmatrix != NULL) {
-      free(invMMmatrix[0]); free(invMMmatrix);
-    }
-    invMMmatrix = double2D(M,M,"invMMmatrix");
-  }
-  
-  return invMMmatrix;
+  return double2D(M,M,"invMMmatrix");
 }
 
 
@@ -547,18 +537,12 @@ void showMatrix(double **M,int Nx, int Ny,char *name) {
  * This is important for using the reversed order in the atom struct.
  */
 double findLambda(plane *p, float *point, int revFlag) {
-  static double **M=NULL;
-  static double **Minv=NULL;
-  static double *diff=NULL;
+  double M[3][3];
+  double Minv[3][3];
+  double diff[3];
   double lambda; /* dummy variable */
 
 
-  if ((M == NULL) || (Minv == NULL) || (diff==NULL)) {
-    M = double2D(3,3,"M");
-    Minv = double2D(3,3,"Minv");
-    diff = double1D(3,"diff");
-  }
-
   /*
   printf("hello x=(%g %g %g)\n",p->pointX,p->pointY,p->pointZ);
   printf("hello p->norm=(%g %g %g), (%d %d %d)\n",p->normX,p->normY,p->normZ,
@@ -566,8 +550,8 @@ double findLambda(plane *p, float *point, int revFlag) {
   */
 
   M[0][0] = -((*p).normX); 
-  M[0][3] = -((*p).normY); 
-  M[0][6] = -((*p).normZ);
+  M[1][0] = -((*p).normY); 
+  M[2][0] = -((*p).normZ);
   M[0][1] = p->vect1X; M[1][1] = p->vect1Y; M[2][1] = p->vect1Z;
   M[0][2] = p->vect2X; M[1][2] = p->vect2Y; M[2][2] = p->vect2Z;
   vectDiff_f(point,&(p->pointX),diff,revFlag);
@@ -589,43 +573,34 @@ double findLambda(plane *p, float *point, int revFlag) {
 
 
 
+/* rotation matrix for the angles phi_x,phi_y,phi_z (in that sequence
+ * and about the respective orthogonal axes)
+ */
+static void makeRotationMatrix(double Mrot[3][3], double phi_x, double phi_y, double phi_z) {
+  Mrot[0][0] = cos(phi_z)*cos(phi_y);
+  Mrot[0][1] = cos(phi_z)*sin(phi_y)*sin(phi_x)-sin(phi_z)*cos(phi_x);
+  Mrot[0][2] = cos(phi_z)*sin(phi_y)*cos(phi_x)+sin(phi_z)*sin(phi_x);
+
+  Mrot[1][0] = sin(phi_z)*cos(phi_y);
+  Mrot[1][1] = sin(phi_z)*sin(phi_y)*sin(phi_x)+cos(phi_z)*cos(phi_x);
+  Mrot[1][2] = sin(phi_z)*sin(phi_y)*cos(phi_x)-cos(phi_z)*sin(phi_x);
+
+  Mrot[2][0] = -sin(phi_y);
+  Mrot[2][1] = cos(phi_y)*sin(phi_x);
+  Mrot[2][2] = cos(phi_y)*cos(phi_x);
+}
+
 /* This function will perform a 3D rotation about the angles
  * phi_x,phi_y,phi_z (in that sequence and about the respective orthogonal axes)
  * of the vector vectIn, and store the result in vectOut.
- * The angles will be written in a matrix, which will be saved for the next rotation,
- * in case the angles don't change.
  * The same vector can be specified as input, as well as output vector.
  */
 void rotateVect(double *vectIn,double *vectOut, double phi_x, double phi_y, double phi_z) {
-  static double **Mrot = NULL;
-  static double *vectOutTemp = NULL;
-  static double sphi_x=0, sphi_y=0, sphi_z=0;
-  //  static double *vectOut = NULL;
+  double Mrot[3][3];
+  double vectOutTemp[3];
   // printf("angles: %g %g %g\n",phi_x,phi_y,phi_z);
 
-  if (Mrot == NULL) {
-    Mrot = double2D(3,3,"Mrot");
-    memset(Mrot[0],0,9*sizeof(double));
-    Mrot[0][0] = 1;Mrot[1][1] = 1;Mrot[2][2] = 1;
-    vectOutTemp = double1D(3,"vectOutTemp");
-  }
-  if ((phi_x!=sphi_x) || (phi_y!=sphi_y) || (phi_z!=sphi_z)) {
-    Mrot[0][0] = cos(phi_z)*cos(phi_y);
-    Mrot[0][1] = cos(phi_z)*sin(phi_y)*sin(phi_x)-sin(phi_z)*cos(phi_x);
-    Mrot[0][2] = cos(phi_z)*sin(phi_y)*cos(phi_x)+sin(phi_z)*sin(phi_x);
-
-    Mrot[1][0] = sin(phi_z)*cos(phi_y);
-    Mrot[1][1] = sin(phi_z)*sin(phi_y)*sin(phi_x)+cos(phi_z)*cos(phi_x);
-    Mrot[1][2] = sin(phi_z)*sin(phi_y)*cos(phi_x)-cos(phi_z)*sin(phi_x);
-
-    Mrot[2][0] = -sin(phi_y);
-    Mrot[2][1] = cos(phi_y)*sin(phi_x);
-    Mrot[2][2] = cos(phi_y)*cos(phi_x);
-
-    sphi_x = phi_x;
-    sphi_y = phi_y;
-    sphi_z = phi_z;
-  }
+  makeRotationMatrix(Mrot,phi_x,phi_y,phi_z);
   vectOutTemp[0] = Mrot[0][0]*vectIn[0]+Mrot[0][1]*vectIn[1]+Mrot[0][2]*vectIn[2];
   vectOutTemp[1] = Mrot[1][0]*vectIn[0]+Mrot[1][1]*vectIn[1]+Mrot[1][2]*vectIn[2];
   vectOutTemp[2] = Mrot[2][0]*vectIn[0]+Mrot[2][1]*vectIn[1]+Mrot[2][2]*vectIn[2];
@@ -636,35 +611,11 @@ void rotateVect(double *vectIn,double *vectOut, double phi_x, double phi_y, doub
 
 void rotateMatrix(double *matrixIn,double *matrixOut, double phi_x, double phi_y, double phi_z) {
 int i,j,k;
-static double **Mrot = NULL;
-static double *matrixOutTemp = NULL;
-static double sphi_x=0, sphi_y=0, sphi_z=0;
-// static double *vectOut = NULL;
+double Mrot[3][3];
+double matrixOutTemp[9];
 // printf("angles: %g %g %g\n",phi_x,phi_y,phi_z);
 
-if (Mrot == NULL) {
-	Mrot = double2D(3,3,"Mrot");
-	memset(Mrot[0],0,9*sizeof(double));
-	Mrot[0][0] = 1;Mrot[1][1] = 1;Mrot[2][2] = 1;
-	matrixOutTemp = double1D(9,"vectOutTemp");
-}
-if ((phi_x!=sphi_x) || (phi_y!=sphi_y) || (phi_z!=sphi_z)) {
-	Mrot[0][0] = cos(phi_z)*cos(phi_y);
-	Mrot[0][1] = cos(phi_z)*sin(phi_y)*sin(phi_x)-sin(phi_z)*cos(phi_x);
-	Mrot[0][2] = cos(phi_z)*sin(phi_y)*cos(phi_x)+sin(phi_z)*sin(phi_x);
-
-	Mrot[1][0] = sin(phi_z)*cos(phi_y);
-	Mrot[1][1] = sin(phi_z)*sin(phi_y)*sin(phi_x)+cos(phi_z)*cos(phi_x);
-	Mrot[1][2] = sin(phi_z)*sin(phi_y)*cos(phi_x)-cos(phi_z)*sin(phi_x);
-
-	Mrot[2][0] = -sin(phi_y);
-	Mrot[2][1] = cos(phi_y)*sin(phi_x);
-	Mrot[2][2] = cos(phi_y)*cos(phi_x);
-
-	sphi_x = phi_x;
-	sphi_y = phi_y;
-	sphi_z = phi_z;
-}
+makeRotationMatrix(Mrot,phi_x,phi_y,phi_z);
 memset(matrixOutTemp,0,9*sizeof(double));
 for (i=0;i<3;i++) for (j=0;j<3;j++) for (k=0;k<3;k++) {
 	matrixOutTemp[i*3+j] += Mrot[i][k]*matrixIn[k*3+j];
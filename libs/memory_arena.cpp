@@ -0,0 +1,171 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include "memory_arena.h"
+#include "lib_lock.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+struct memStat {
+	size_t calls;
+	double total;     // bytes allocated in total (double: may exceed 4GB on 32 bit)
+	size_t live;
+	size_t peak;
+};
+
+/* header in front of every block returned by alignedMalloc */
+struct alignedHeader {
+	void *block;
+	size_t size;
+	const char *tag;
+};
+
+static std::map<std::string,memStat> memStats;
+static size_t memLive = 0, memPeak = 0;
+// the accounting is shared by all threads and simulations of the process
+static LibLock memStatsLock;
+
+static const char *tagName(const char *tag) {
+	return (tag == NULL) ? "(untagged)" : tag;
+}
+
+void memRecordAlloc(const char *tag, size_t bytes) {
+	{
+		ScopedLock lock(memStatsLock);
+		memStat &s = memStats[tagName(tag)];
+		s.calls++;
+		s.total += (double)bytes;
+		s.live += bytes;
+		if (s.live > s.peak) s.peak = s.live;
+		memLive += bytes;
+		if (memLive > memPeak) memPeak = memLive;
+	}
+}
+
+void memRecordFree(const char *tag, size_t bytes) {
+	{
+		ScopedLock lock(memStatsLock);
+		memStat &s = memStats[tagName(tag)];
+		s.live = (s.live > bytes) ? s.live-bytes : 0;
+		memLive = (memLive > bytes) ? memLive-bytes : 0;
+	}
+}
+
+void memRecordUntracked(const char *tag, size_t bytes) {
+	{
+		ScopedLock lock(memStatsLock);
+		memStat &s = memStats[tagName(tag)];
+		s.calls++;
+		s.total += (double)bytes;
+	}
+}
+
+size_t memPeakBytes() {
+	return memPeak;
+}
+
+/* peak resident set size of the process in bytes, 0 if unknown */
+static double peakResidentBytes() {
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF,&usage) == 0) {
+#ifdef __APPLE__
+		return (double)usage.ru_maxrss;
+#else
+		return 1024.0*usage.ru_maxrss;
+#endif
+	}
+#endif
+	return 0;
+}
+
+void memReport(FILE *fp) {
+	ScopedLock lock(memStatsLock);
+	std::map<std::string,memStat>::const_iterator it;
+
+	fprintf(fp,"Memory usage by tag:\n%-28s %8s %12s %12s %12s\n","tag","calls","total/kB","live/kB","peak/kB");
+	for (it=memStats.begin();it!=memStats.end();it++) {
+		fprintf(fp,"%-28.28s %8lu %12.1f %12.1f %12.1f\n",it->first.c_str(),(unsigned long)it->second.calls,
+			it->second.total/1024.0,it->second.live/1024.0,it->second.peak/1024.0);
+	}
+	fprintf(fp,"Peak of tracked live memory: %.2f MB\n",memPeak/1048576.0);
+	if (peakResidentBytes() > 0)
+		fprintf(fp,"Peak resident size:          %.2f MB\n",peakResidentBytes()/1048576.0);
+}
+
+void *alignedMalloc(size_t size, const char *tag) {
+	char *block,*aligned;
+	alignedHeader *header;
+
+	block = (char *)malloc(size+ARRAY_ALIGNMENT+sizeof(alignedHeader));
+	if (block == NULL) {
+		printf("cannot allocate %lu bytes: %s\n",(unsigned long)size,tagName(tag));
+		exit(0);
+	}
+	aligned = block+sizeof(alignedHeader);
+	aligned += (ARRAY_ALIGNMENT-((size_t)aligned % ARRAY_ALIGNMENT)) % ARRAY_ALIGNMENT;
+	header = (alignedHeader *)aligned-1;
+	header->block = block;
+	header->size = size;
+	header->tag = tag;
+	memRecordAlloc(tag,size);
+	return aligned;
+}
+
+void alignedFree(void *p) {
+	alignedHeader *header;
+
+	if (p == NULL) return;
+	header = (alignedHeader *)p-1;
+	memRecordFree(header->tag,header->size);
+	free(header->block);
+}
+
+void *MemoryArena::Alloc(const char *tag, size_t size) {
+	void *data;
+
+	{
+		ScopedLock lock(m_lock);
+		buffer &b = m_buffers[tagName(tag)];
+		if (b.capacity < size) {
+			alignedFree(b.data);
+			b.data = alignedMalloc(size,tag);
+			b.capacity = size;
+		}
+		data = b.data;
+	}
+	return data;
+}
+
+void MemoryArena::FreeAll() {
+	std::map<std::string,buffer>::iterator it;
+
+	{
+		ScopedLock lock(m_lock);
+		for (it=m_buffers.begin();it!=m_buffers.end();it++) alignedFree(it->second.data);
+		m_buffers.clear();
+	}
+}
@@ -0,0 +1,88 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include "lib_lock.h"
+
+/**************************************************************
+ * Tagged memory accounting and a scratch arena.
+ *
+ * Every allocation is booked under its tag (the message string
+ * passed to the allocators of memory_fftw3, Array2D/Array3D and
+ * MemoryArena::Alloc).  For memory that is returned through
+ * alignedFree() or MemoryArena the live and peak bytes per tag are
+ * exact.
+ * Tags must be string constants.
+ * The row pointer allocators of memory_fftw3 are released by their
+ * callers with fftw_free(), so for their tags only the number of
+ * calls and the bytes allocated in total are known - a tag whose
+ * total grows with every TDS configuration is a leak.
+ *
+ * MemoryArena::Alloc(tag,size) returns a buffer that belongs to the
+ * tag: calling it again with the same tag (e.g. in the next avgCount
+ * iteration) returns the same buffer, which only grows if more
+ * bytes are requested.  The contents are not preserved or cleared.
+ * A tag must therefore not be used by two concurrent threads; every
+ * simulation owns one arena (SimState::arena) for its serial per-run
+ * work (structure, potential).  All buffers of an arena are released
+ * at once by FreeAll() or when the arena is destroyed.
+ **************************************************************/
+
+#define ARRAY_ALIGNMENT 64
+
+/* books an allocation / release of bytes under tag */
+void memRecordAlloc(const char *tag, size_t bytes);
+void memRecordFree(const char *tag, size_t bytes);
+/* books an allocation whose release cannot be seen (calls and total only) */
+void memRecordUntracked(const char *tag, size_t bytes);
+/* peak of all tracked live bytes */
+size_t memPeakBytes();
+/* prints calls, total, live and peak bytes per tag and the peak resident size */
+void memReport(FILE *fp);
+
+/* allocates size bytes aligned to ARRAY_ALIGNMENT, booked under tag,
+ * which must be a string constant.  Prints tag and exits on failure */
+void *alignedMalloc(size_t size, const char *tag);
+void alignedFree(void *p);
+
+class MemoryArena {
+	struct buffer {
+		void *data;
+		size_t capacity;
+	};
+	std::map<std::string,buffer> m_buffers;
+	LibLock m_lock;
+
+	MemoryArena(const MemoryArena &);
+	MemoryArena &operator=(const MemoryArena &);
+public:
+	MemoryArena() {}
+	~MemoryArena() { FreeAll(); }
+
+	void *Alloc(const char *tag, size_t size);
+	void FreeAll();
+};
+
+#endif // MEMORY_ARENA_H
@@ -21,6 +21,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <stdio.h>
 #include "fftw3.h"
 #include "memory_fftw3.h"
+#include "memory_arena.h"
  
 #ifndef WIN32
 #include <stdint.h>
@@ -51,6 +52,7 @@ float_tt *float1D( int n, const char *message )
 		       n, message);
 		exit( 0 );
 	}
+	memRecordUntracked(message,n*sizeof(float_tt));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s\n",message);
 #endif
@@ -78,6 +80,7 @@ double* double1D( int n, const char *message )
 		       n, message);
 		exit( 0 );
 	}
+	memRecordUntracked(message,n*sizeof(double));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s\n",message);
 #endif
@@ -114,6 +117,7 @@ short **short2D( int nx, int ny, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = &(m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(short*)+(size_t)nx*ny*sizeof(short));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s\n",message);
 #endif
@@ -147,6 +151,7 @@ int **int2D( int nx, int ny, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = (int *)(&m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(int*)+(size_t)nx*ny*sizeof(int));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s (int) = %d\n",message,(int)m);
 #endif
@@ -183,6 +188,7 @@ long **long2D( int nx, int ny, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = &(m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(long*)+(size_t)nx*ny*sizeof(long));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s\n",message);
 #endif
@@ -219,6 +225,7 @@ float **float32_2D( int nx, int ny, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = (float *)(&m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(float*)+(size_t)nx*ny*sizeof(float));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s (float_tt) = %d\n",message,(int)m);
 #endif
@@ -255,6 +262,7 @@ float_tt **float2D( int nx, int ny, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = (float_tt *)(&m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(float_tt*)+(size_t)nx*ny*sizeof(float_tt));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s (float_tt) = %d\n",message,(int)m);
 #endif
@@ -304,6 +312,7 @@ float_tt ***float3D( int nx, int ny,int nz, const char *message )
   for (i=0; i<nx; i++) for (j=0;j<ny;j++) {
     m[i][j] = (float_tt*)(&(m[0][0][nz*(i*ny+j)]));
   }
+  memRecordUntracked(message,nx*(1+ny)*sizeof(float_tt*)+(size_t)nx*ny*nz*sizeof(float_tt));
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (float_tt) = %d\n",message,(int)m);
 #endif
@@ -348,6 +357,7 @@ float ***float32_3D( int nx, int ny,int nz, const char *message )
   for (i=0; i<nx; i++) for (j=0;j<ny;j++) {
     m[i][j] = (float*)(&(m[0][0][nz*(i*ny+j)]));
   }
+  memRecordUntracked(message,nx*(1+ny)*sizeof(float*)+(size_t)nx*ny*nz*sizeof(float));
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (float32) = %d\n",message,(int)m);
 #endif
@@ -393,6 +403,7 @@ double **double2D( int nx, int ny, const char *message )
 	}
 	//memset(m, 0, sizeof(float_tt)*ny*nx);
 
+	memRecordUntracked(message,nx*sizeof(double*)+(size_t)nx*ny*sizeof(double));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s\n",message);
 #endif
@@ -428,6 +439,7 @@ fftw_complex **complex2D( int nx, int ny, const char *message)
   for (i=1; i<nx; i++){
     m[i] = (fftw_complex*)(&m[0][i*ny]);
   }
+  memRecordUntracked(message,nx*sizeof(fftw_complex*)+(size_t)nx*ny*sizeof(fftw_complex));
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -463,6 +475,7 @@ fftwf_complex **complex2Df( int nx, int ny, const char *message)
 	for (i=1; i<nx; i++){
 	  m[i] = (fftwf_complex*)(&m[0][i*ny]);
 	}
+	memRecordUntracked(message,nx*sizeof(fftwf_complex*)+(size_t)nx*ny*sizeof(fftwf_complex));
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -506,6 +519,7 @@ fftw_complex ***complex3D( int nx, int ny,int nz, const char *message)
   for (i=0; i<nx; i++) for (j=0;j<ny;j++) {
     m[i][j] = (fftw_complex*)(&(m[0][0][nz*(i*ny+j)]));
   }
+  memRecordUntracked(message,nx*(1+ny)*sizeof(fftw_complex*)+(size_t)nx*ny*nz*sizeof(fftw_complex));
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -549,6 +563,7 @@ fftwf_complex ***complex3Df( int nx, int ny,int nz, const char *message)
   for (i=0; i<nx; i++) for (j=0;j<ny;j++) {
     m[i][j] = (fftwf_complex*)(&(m[0][0][nz*(i*ny+j)]));
   }
+  memRecordUntracked(message,nx*(1+ny)*sizeof(fftwf_complex*)+(size_t)nx*ny*nz*sizeof(fftwf_complex));
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -585,6 +600,7 @@ void **any2D( int nx, int ny,int size, const char *message )
 	for (i=1; i<nx; i++){
 	  m[i] = (void *)((intptr_t)(m[0])+(i*ny*size));
 	}
+	memRecordUntracked(message,nx*sizeof(void*)+(size_t)nx*ny*size);
 #ifdef PRINT_MESSAGE
 	printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -629,6 +645,7 @@ void ***any3D( int nx, int ny,int nz,int size, const char *message )
   for (i=0; i<nx; i++) for (j=0;j<ny;j++) {
     m[i][j] =(void *)((intptr_t)(m[0][0])+size*nz*(i*ny+j));
   }
+  memRecordUntracked(message,nx*(1+ny)*sizeof(void*)+(size_t)nx*ny*nz*size);
 #ifdef PRINT_MESSAGE
   printf("allocated memory for %s (fftw_complex) = %d\n",message,(int)m);
 #endif
@@ -33,6 +33,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <stdlib.h>
 #include <string.h>
 #include "readparams.h"
+#include "lib_lock.h"
 
 #define COMMENT '%'
 #define PAR_BUF_LEN 1024
@@ -42,6 +43,7 @@ FILE *fpParam=NULL;
 FILE **fpStack = NULL;
 char parBuf[PAR_BUF_LEN];
 char commentChar = COMMENT;
+static LibLock parserLock;
 // int stackheight = 0; // RAM: not implemented yet
 
 // RAM: strongly consider writing a structure here to hold the filename and individual buffers
@@ -317,3 +319,11 @@ int readNextLine(char *buf,int bufLen) {
 
 
 
+
+void parLock() {
+	parserLock.Lock();
+}
+
+void parUnlock() {
+	parserLock.Unlock();
+}
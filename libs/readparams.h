@@ -107,5 +107,15 @@ void resetParamFile();
 
 char *strnext(char *str,char *delim);
 
+/******************************************************************
+ * The parameter file (and the stack of parFpPush()) is shared by
+ * the whole process.  Code that may run while other simulations
+ * are running (e.g. reading the structure file of the next
+ * configuration) brackets its use with parLock()/parUnlock().
+ * The lock may be taken several times by the same thread.
+ ******************************************************************/
+void parLock();
+void parUnlock();
+
 
 #endif /* READPARAMS_H */
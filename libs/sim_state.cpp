@@ -0,0 +1,85 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_state.h"
+#include "data_containers.h"
+#include "lib_lock.h"
+
+static LibLock simStateLock;
+
+void initRandomState(randomState *state) {
+	memset(state,0,sizeof(randomState));
+	state->seed = 0;           // counter based generators, 0 = seed from the time
+}
+
+SimState::SimState() :
+	atoms(NULL),
+	ncoord_old(0),
+	divCount(0),
+	transReady(0),
+	runTransLimit(0),
+	runTransTemp(0),
+	boxLUT(NULL),
+	tdsStop(NULL)
+{
+	int i;
+
+	initRandomState(&rng);
+	memset(&tilt,0,sizeof(tilt));
+	memset(&phonon,0,sizeof(phonon));
+	phonon.runCount = 1;
+	phonon.u2Size = -1;
+	memset(&beams,0,sizeof(beams));
+	memset(&progress,0,sizeof(progress));
+	memset(&sf,0,sizeof(sf));
+	for (i=0;i<POTENTIAL_LUT_KINDS;i++) potentialLUT[i] = NULL;
+}
+
+SimState::~SimState() {
+	if (beams.fp1 != NULL) fclose(beams.fp1);
+	if (beams.fpAmpl != NULL) fclose(beams.fpAmpl);
+	if (beams.fpPhase != NULL) fclose(beams.fpPhase);
+	free(atoms);
+	free(phonon.u2);
+	free(phonon.u2Count);
+	free(phonon.massPrim);
+	free(phonon.modeSum);
+	free(phonon.uCell);
+}
+
+SimState *simState(MULS *muls) {
+	if (muls->state.get() == NULL) {
+		ScopedLock lock(simStateLock);
+		if (muls->state.get() == NULL) muls->state = boost::shared_ptr<SimState>(new SimState());
+	}
+	return muls->state.get();
+}
+
+long randomSeed(MULS *muls) {
+	SimState *st = simState(muls);
+
+	if (st->rng.seed == 0) {
+		ScopedLock lock(simStateLock);
+		if (st->rng.seed == 0) st->rng.seed = (long)time(NULL);
+	}
+	return st->rng.seed;
+}
@@ -0,0 +1,202 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIM_STATE_H
+#define SIM_STATE_H
+
+#include <time.h>
+#include <vector>
+#include <map>
+#include "stemtypes_fftw3.h"
+#include "array_nd.h"
+#include "memory_arena.h"
+
+/**************************************************************
+ * Working state of one simulation.
+ *
+ * Everything the engine used to keep in function statics between
+ * calls (random number generator, propagator, phonon data, beam
+ * files, slab counters, ...) lives here, one instance per MULS
+ * (muls->state, created on first use by simState()).  Several
+ * simulations can therefore run concurrently in one process.
+ *
+ * Data that only depends on the sampling and not on the specimen
+ * (the atom potential lookup tables of stemlib) is shared by all
+ * simulations with the same sampling; a simulation only keeps
+ * pointers to the tables it uses.  FFTW plans are shared by the
+ * plan manager (fft_plans.h).
+ **************************************************************/
+
+class MULS;
+
+/* state of ran1()/gasdev() (shuffle table of 32 entries), which only
+ * the stand-alone tools still use, and the seed of the counter based
+ * generators (counter_rng.h) of the simulation */
+typedef struct randomStateStruct {
+	long ran1Y;
+	long ran1V[32];
+	int gasdevSet;
+	float gasdevStore;
+	long seed;
+} randomState;
+
+void initRandomState(randomState *state);
+
+/* propagator of propagate_slow() for wave functions of precision T */
+template <typename T>
+struct propagatorState {
+	real dzs;                      // slice thickness the propagator was made for
+	int nx,ny;
+	std::vector<T> propxr,propxi,propyr,propyi;
+	std::vector<real> kx2,ky2,kx,ky;
+	real k2max;
+
+	propagatorState() : dzs(0), nx(0), ny(0), k2max(0) {}
+};
+
+/* phonon file data and displacement statistics of phononDisplacement() */
+typedef struct phononStateStruct {
+	int fileRead;                  // phonon file has been read (or tried)
+	int Nk, Ns;                    // number of k-vectors and atoms per primitive unit cell
+	float *massPrim;               // masses for every atom in primitive basis
+	float **omega;                 // array of eigenvalues for every k-vector
+	fftwf_complex ***eigVecs;      // array of eigenvectors for every k-vector
+	float **kVecs;                 // array for Nk 3-dim k-vectors
+	double *modeSum;               // [k][3*Ns] (re,im): eigenvectors weighted by the mode amplitudes of this configuration
+	double *uCell;                 // [cell][3*Ns]: displacements of the super cell, cell = (icx*nCellY+icy)*nCellZ+icz
+	int uCells[3];                 // nCellX,nCellY,nCellZ of uCell
+	double *u2,ux,uy,uz;
+	int *u2Count,runCount,u2Size;
+	double **Mm,**MmInv;
+	double *uf;
+	double wobScale,sq3,scale;
+} phononState;
+
+/* undisplaced super cell of readUnitCell() in NCell mode, from which
+ * nextConfiguration() makes the configuration of every run */
+struct referenceStructure {
+	std::vector<atom> atoms;       // all sites (cartesian, tilted), unit cell c at [c*cellAtoms,(c+1)*cellAtoms)
+	std::vector<int> groups;       // sites [groups[k],groups[k+1]) of a unit cell share one position
+	std::vector<double> groupOcc;  // total occupancy of group k
+	int cellAtoms;                 // 0 = no reference, re-read the structure file
+	int handleVacancies;
+
+	referenceStructure() : cellAtoms(0), handleVacancies(0) {}
+};
+
+/* scratch matrices of tiltBoxed() */
+typedef struct tiltStateStruct {
+	double **Mm, **Mminv, **MpRed, **MpRedInv;
+	double **MbPrim, **MbPrimInv, **MmOrig, **MmOrigInv;
+	double **a, **aOrig, **b, **bfloor, **blat;
+	double *uf, *u;
+	int oldAtomSize;
+} tiltState;
+
+/* output files of writeBeams() */
+typedef struct beamStateStruct {
+	char fileAmpl[512];
+	char filePhase[512];
+	char fileBeam[512];
+	FILE *fp1,*fpAmpl,*fpPhase;
+	int *hbeam,*kbeam;
+	real zsum,scale;
+} beamState;
+
+/* timing of displayProgress() */
+typedef struct progressStateStruct {
+	double timeAvg;
+	double intensityAvg;
+	time_t time0,time1;
+} progressState;
+
+/* spline coefficients of sfLUT() for the custom scattering factors */
+typedef struct sfSplineStateStruct {
+	double *splinx;
+	double **spliny,**splinb,**splinc,**splind;
+	int sfSize,atKinds;
+	double maxK;
+} sfSplineState;
+
+/* defined by the modules that own them */
+struct atomPotentialLUT;
+struct atomBoxLUT;
+struct checkpointState;
+class AtomSource;
+class Trajectory;
+class TdsStopping;
+
+#define POTENTIAL_LUT_3D        0   /* getAtomPotential3D() */
+#define POTENTIAL_LUT_OFFSET_3D 1   /* getAtomPotentialOffset3D() */
+#define POTENTIAL_LUT_2D        2   /* getAtomPotential2D() */
+#define POTENTIAL_LUT_ABSORPTIVE 3  /* getAbsorptivePotential() */
+#define POTENTIAL_LUT_KINDS     4
+
+class SimState {
+	SimState(const SimState &);
+	SimState &operator=(const SimState &);
+public:
+	SimState();
+	~SimState();
+
+	randomState rng;
+	MemoryArena arena;
+
+	/* structure (readUnitCell, tiltBoxed, phononDisplacement) */
+	atom *atoms;                   // atoms of the current configuration
+	int ncoord_old;
+	tiltState tilt;
+	phononState phonon;
+	referenceStructure reference;
+	boost::shared_ptr<AtomSource> atomSource;  // streamed structure (muls->streamAtoms)
+	std::vector<atom> slabAtoms;               // its atoms of the current slab
+	boost::shared_ptr<Trajectory> trajectory;  // frames of a MD trajectory, one per run
+	std::vector<atom> frameAtoms;              // atoms of the current frame
+
+	/* potential (make3DSlices) */
+	int divCount;                  // sub-division of the unit cell being sliced
+	int transReady;                // muls->trans holds the slices of this structure (see buildSlices)
+	std::map<int,std::vector<boost::shared_ptr<Array3D<fftwf_complex> > > > runTrans;  // muls->trans of the slabs of every TDS run of a sweep
+	size_t runTransLimit;          // bytes runTrans may hold, 0: not kept
+	double runTransTemp;           // tds_temp of the runs in runTrans
+	atomPotentialLUT *potentialLUT[POTENTIAL_LUT_KINDS];  // shared, not owned
+	atomBoxLUT *boxLUT;                                   // shared, not owned
+	sfSplineState sf;
+
+	/* propagation and output */
+	propagatorState<float> propagatorFloat;
+	propagatorState<double> propagatorDouble;
+	template <typename T> propagatorState<T> &propagator();
+	beamState beams;
+	progressState progress;
+	boost::shared_ptr<checkpointState> checkpoint;
+	TdsStopping *tdsStop;          // doSTEM's controller in pixel mode, not owned
+};
+
+template <> inline propagatorState<float> &SimState::propagator<float>() { return propagatorFloat; }
+template <> inline propagatorState<double> &SimState::propagator<double>() { return propagatorDouble; }
+
+/* returns the state of the simulation muls, creates it if necessary */
+SimState *simState(MULS *muls);
+
+/* the seed of the counter based generators of the simulation: the one
+ * set with "random seed:", otherwise taken from the time once */
+long randomSeed(MULS *muls);
+
+#endif // SIM_STATE_H
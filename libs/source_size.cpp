@@ -0,0 +1,82 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "source_size.h"
+#include "array_nd.h"
+#include "fft_plans.h"
+
+int parseSourceDistribution(const char *name) {
+	while (isspace(*name)) name++;
+	switch (tolower(*name)) {
+		case 'l': return SOURCE_LORENTZIAN;
+		case 'm': return SOURCE_MIXED;
+	}
+	return SOURCE_GAUSSIAN;
+}
+
+const char *sourceDistributionName(int distribution) {
+	switch (distribution) {
+		case SOURCE_LORENTZIAN: return "lorentzian";
+		case SOURCE_MIXED:      return "mixed";
+	}
+	return "gaussian";
+}
+
+double sourceTransfer(double q, double radius, int distribution, double lorentzFraction) {
+	const double pi=3.1415926535897;
+	// variance radius^2*2 along each axis:
+	double gauss = exp(-4.0*pi*pi*radius*radius*q*q);
+	double lorentz = exp(-2.0*pi*radius*q);
+
+	switch (distribution) {
+		case SOURCE_LORENTZIAN: return lorentz;
+		case SOURCE_MIXED:      return (1.0-lorentzFraction)*gauss+lorentzFraction*lorentz;
+	}
+	return gauss;
+}
+
+void convolveSourceSize(float_tt *image, int nx, int ny, double dx, double dy,
+						double radius, int distribution, double lorentzFraction) {
+	int ix,iy;
+	double qx,qy,f;
+
+	if ((radius <= 0) || (nx < 2) || (ny < 2)) return;
+	Array2D<fftw_complex> a(nx,ny,"source size convolution");
+	for (ix=0;ix<nx*ny;ix++) {
+		a[0][ix][0] = image[ix];
+		a[0][ix][1] = 0;
+	}
+	executePlan(sharedPlan2D<double>(PLAN_WAVE,nx,ny,FFTW_FORWARD),a.Data());
+	for (ix=0;ix<nx;ix++) {
+		qx = ((ix > nx/2) ? ix-nx : ix)/(nx*dx);
+		for (iy=0;iy<ny;iy++) {
+			qy = ((iy > ny/2) ? iy-ny : iy)/(ny*dy);
+			f = sourceTransfer(sqrt(qx*qx+qy*qy),radius,distribution,lorentzFraction)/((double)nx*ny);
+			a[ix][iy][0] *= f;
+			a[ix][iy][1] *= f;
+		}
+	}
+	executePlan(sharedPlan2D<double>(PLAN_WAVE,nx,ny,FFTW_BACKWARD),a.Data());
+	for (ix=0;ix<nx*ny;ix++) image[ix] = (float_tt)a[0][ix][0];
+}
@@ -0,0 +1,63 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SOURCE_SIZE_H
+#define SOURCE_SIZE_H
+
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * Finite source size (spatial incoherence) of STEM images.
+ *
+ * The effective source is a distribution of probe positions
+ * around the nominal one.  Since the STEM signal of a shifted
+ * probe is the signal of a shifted scan position, the image with
+ * a finite source is the image of a point source convolved with
+ * the source distribution.  The convolution is done by FFT over
+ * the scan grid, i.e. it is exact for a uniformly sampled scan
+ * over a period of the specimen (the image is treated as periodic).
+ *
+ * radius is the source radius of the parameter file (half of
+ * "Source Size (diameter):"):
+ *  SOURCE_GAUSSIAN    offsets radius*sqrt(2)*N(0,1) along x and y, as
+ *                     the random probe offsets of doCBED/doNBED
+ *  SOURCE_LORENTZIAN  p(r) ~ 1/(r^2+radius^2)^(3/2), the 2D Lorentzian
+ *                     with Fourier transform exp(-2*pi*radius*q)
+ *  SOURCE_MIXED       (1-lorentzFraction)*Gaussian+lorentzFraction*Lorentzian
+ **************************************************************/
+
+#define SOURCE_GAUSSIAN   0
+#define SOURCE_LORENTZIAN 1
+#define SOURCE_MIXED      2
+
+/* converts "gaussian", "lorentzian", "mixed" into SOURCE_*, 
+ * returns SOURCE_GAUSSIAN for anything else */
+int parseSourceDistribution(const char *name);
+const char *sourceDistributionName(int distribution);
+
+/* Fourier transform of the source distribution at spatial frequency q (1/A) */
+double sourceTransfer(double q, double radius, int distribution, double lorentzFraction);
+
+/* convolves image [ix*ny+iy] of nx x ny scan pixels of size dx x dy (A)
+ * with the source distribution */
+void convolveSourceSize(float_tt *image, int nx, int ny, double dx, double dy,
+						double radius, int distribution, double lorentzFraction);
+
+#endif // SOURCE_SIZE_H
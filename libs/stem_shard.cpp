@@ -0,0 +1,187 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "stem_shard.h"
+
+#define SHARD_MAGIC "QSTEMSH1"
+#define SHARD_NAME_LEN 32
+#define SHARD_HEADER_INTS 10
+
+STEMShard::STEMShard() :
+scanXN(1),
+scanYN(1),
+detectorNum(0),
+nThick(0),
+shardIndex(0),
+shardCount(1),
+runShardIndex(0),
+runShardCount(1),
+runs(0),
+avgRuns(1),
+resX(1.0),
+resY(1.0)
+{
+}
+
+void STEMShard::Resize()
+{
+	thickness.resize(nThick);
+	names.resize(detectorNum);
+	sum.assign(nThick*detectorNum*NumPixels(),0.0);
+	sum2.assign(nThick*detectorNum*NumPixels(),0.0);
+}
+
+int STEMShard::NumPixels() const
+{
+	int npix = scanXN*scanYN;
+	if (shardIndex >= npix) return 0;
+	return (npix-shardIndex+shardCount-1)/shardCount;
+}
+
+bool STEMShard::OwnsPixel(int p) const
+{
+	return (p % shardCount) == shardIndex;
+}
+
+int STEMShard::Index(int t, int i, int k) const
+{
+	return (t*detectorNum+i)*NumPixels()+k;
+}
+
+/*
+ * File layout (native byte order):
+ * char[8] magic, int[10] sizes and shard indices, double resX, resY,
+ * double thickness[nThick], char names[detectorNum][32],
+ * double sum[nThick][detectorNum][npix], double sum2[...]
+ */
+int STEMShard::Write(const char *fileName) const
+{
+	FILE *fp;
+	int header[SHARD_HEADER_INTS];
+	char name[SHARD_NAME_LEN];
+	int i,n;
+
+	if ((fp = fopen(fileName,"wb")) == NULL) {
+		printf("Could not open shard file %s for writing\n",fileName);
+		return 0;
+	}
+	header[0] = scanXN;        header[1] = scanYN;
+	header[2] = detectorNum;   header[3] = nThick;
+	header[4] = shardIndex;    header[5] = shardCount;
+	header[6] = runShardIndex; header[7] = runShardCount;
+	header[8] = runs;          header[9] = avgRuns;
+	n = nThick*detectorNum*NumPixels();
+
+	fwrite(SHARD_MAGIC,1,8,fp);
+	fwrite(header,sizeof(int),SHARD_HEADER_INTS,fp);
+	fwrite(&resX,sizeof(double),1,fp);
+	fwrite(&resY,sizeof(double),1,fp);
+	if (nThick > 0) fwrite(&thickness[0],sizeof(double),nThick,fp);
+	for (i=0;i<detectorNum;i++) {
+		memset(name,0,SHARD_NAME_LEN);
+		strncpy(name,names[i].c_str(),SHARD_NAME_LEN-1);
+		fwrite(name,1,SHARD_NAME_LEN,fp);
+	}
+	if (n > 0) {
+		fwrite(&sum[0],sizeof(double),n,fp);
+		fwrite(&sum2[0],sizeof(double),n,fp);
+	}
+	if (ferror(fp)) {
+		printf("Error writing shard file %s\n",fileName);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+	return 1;
+}
+
+int STEMShard::Read(const char *fileName)
+{
+	FILE *fp;
+	int header[SHARD_HEADER_INTS];
+	char magic[8];
+	char name[SHARD_NAME_LEN];
+	int i,n;
+	size_t numRead = 0;
+
+	if ((fp = fopen(fileName,"rb")) == NULL) {
+		printf("Could not open shard file %s\n",fileName);
+		return 0;
+	}
+	if ((fread(magic,1,8,fp) != 8) || (strncmp(magic,SHARD_MAGIC,8) != 0) ||
+		(fread(header,sizeof(int),SHARD_HEADER_INTS,fp) != SHARD_HEADER_INTS)) {
+		printf("%s is not a STEM shard file\n",fileName);
+		fclose(fp);
+		return 0;
+	}
+	scanXN = header[0];        scanYN = header[1];
+	detectorNum = header[2];   nThick = header[3];
+	shardIndex = header[4];    shardCount = header[5];
+	runShardIndex = header[6]; runShardCount = header[7];
+	runs = header[8];          avgRuns = header[9];
+	if ((scanXN < 1) || (scanYN < 1) || (detectorNum < 0) || (nThick < 0) ||
+		(shardCount < 1) || (shardIndex < 0) || (shardIndex >= shardCount)) {
+		printf("Corrupt header in shard file %s\n",fileName);
+		fclose(fp);
+		return 0;
+	}
+	Resize();
+	n = nThick*detectorNum*NumPixels();
+
+	numRead += fread(&resX,sizeof(double),1,fp);
+	numRead += fread(&resY,sizeof(double),1,fp);
+	if (nThick > 0) numRead += fread(&thickness[0],sizeof(double),nThick,fp);
+	for (i=0;i<detectorNum;i++) {
+		numRead += (fread(name,1,SHARD_NAME_LEN,fp) == SHARD_NAME_LEN);
+		name[SHARD_NAME_LEN-1] = '\0';
+		names[i] = name;
+	}
+	if (n > 0) {
+		numRead += fread(&sum[0],sizeof(double),n,fp);
+		numRead += fread(&sum2[0],sizeof(double),n,fp);
+	}
+	fclose(fp);
+	if (numRead != (size_t)(2+nThick+detectorNum+2*n)) {
+		printf("Shard file %s is truncated\n",fileName);
+		return 0;
+	}
+	return 1;
+}
+
+int STEMShard::Accumulate(std::vector<double> &sumAll, std::vector<double> &sum2All,
+	std::vector<double> &runsAll) const
+{
+	int t,i,k,p;
+	int npix = scanXN*scanYN;
+
+	if ((sumAll.size() != (size_t)(nThick*detectorNum*npix)) ||
+		(sum2All.size() != sumAll.size()) || (runsAll.size() != (size_t)npix))
+		return 0;
+
+	for (t=0;t<nThick;t++) for (i=0;i<detectorNum;i++) {
+		for (k=0,p=shardIndex;p<npix;k++,p+=shardCount) {
+			sumAll[(t*detectorNum+i)*npix+p]  += sum[Index(t,i,k)];
+			sum2All[(t*detectorNum+i)*npix+p] += sum2[Index(t,i,k)];
+		}
+	}
+	for (p=shardIndex;p<npix;p+=shardCount) runsAll[p] += runs;
+	return 1;
+}
@@ -0,0 +1,78 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEM_SHARD_H
+#define STEM_SHARD_H
+
+#include <vector>
+#include <string>
+
+/**************************************************************
+ * Partial STEM detector accumulators of one shard of a scan.
+ *
+ * A STEM scan can be split over several independent processes
+ * (stem3 --shard i/N --shard-runs j/M).  The scan pixel with the
+ * linear index p = ix*scanYN+iy belongs to pixel shard
+ * p % shardCount, the TDS runs are split into runShardCount
+ * contiguous blocks of avgRuns.
+ * Each process writes the sum and sum of squares of its detector
+ * intensities together with the number of runs they contain,
+ * qstem-merge adds up any set of shard files and writes the
+ * same STEM images saveSTEMImages would have written.
+ *
+ * STEMShard shard;
+ * shard.Read("shard_0_0.qsh");
+ * shard.Accumulate(sum,sum2,runs);
+ **************************************************************/
+class STEMShard {
+public:
+	int scanXN,scanYN;
+	int detectorNum;
+	int nThick;              // number of thickness outputs (intermediate + final)
+	int shardIndex,shardCount;
+	int runShardIndex,runShardCount;
+	int runs;                // number of TDS runs contained in sum and sum2
+	int avgRuns;             // total number of TDS runs of the whole job
+	double resX,resY;        // scan step size
+	std::vector<double> thickness;        // [nThick]
+	std::vector<std::string> names;       // [detectorNum]
+	std::vector<double> sum,sum2;         // [nThick][detectorNum][NumPixels()]
+
+public:
+	STEMShard();
+	// allocates thickness, names, sum and sum2 according to the sizes set above
+	void Resize();
+	int NumPixels() const;
+	bool OwnsPixel(int p) const;
+	// index of the value for thickness t, detector i, k-th pixel of this shard
+	int Index(int t, int i, int k) const;
+
+	// both return 1 on success, 0 otherwise
+	int Write(const char *fileName) const;
+	int Read(const char *fileName);
+
+	/* adds this shard to full size arrays of nThick*detectorNum*scanXN*scanYN
+	 * (sum, sum of squares) and scanXN*scanYN (runs per pixel) elements.
+	 * Returns 0 if the arrays do not match the shard.
+	 */
+	int Accumulate(std::vector<double> &sumAll, std::vector<double> &sum2All,
+		std::vector<double> &runsAll) const;
+};
+
+#endif
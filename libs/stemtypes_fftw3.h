@@ -23,12 +23,6 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "memory_fftw3.h"
 #include "boost/shared_ptr.hpp"
 
-////////////////////////////////////////////////////////////////////////
-// define whether to use single or double precision
-///////////////////////////////////////////////////////////////////////
-#define FLOAT_PRECISION 1
-
-
 #define BW (2.0F/3.0F)	/* bandwidth limit */
 #define DOYLE_TURNER 0
 #define WEICK_KOHL 1
@@ -40,6 +34,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define MSCBED  5
 #define TOMO    6
 #define NBED    7
+#define PED     8
 
 ////////////////////////////////////////////////////////////////////////
 // Define physical constants
@@ -52,19 +47,15 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "fftw3.h"
 
 ////////////////////////////////////////////////////////////////
-#if FLOAT_PRECISION == 1
+// Potentials, detector images and diffraction patterns are single 
+// precision.  The wave functions are templates over their precision 
+// (WaveFunction<float> or WaveFunction<double>, see data_containers.h),
+// which is selected at run time by "precision:" in the .dat file.
 #define fftw_real float
 #ifndef float_tt
 #define float_tt  float
 #endif
 #define real      float
-#else  // FLOAT_PRECISION
-#define fftw_real double
-#ifndef float_tt
-#define float_tt  float
-#endif
-#define real      float
-#endif  // FLOAT_PRECISION
 ////////////////////////////////////////////////////////////////
 
 typedef struct atomStruct {
@@ -118,13 +109,8 @@ typedef struct atomBoxStruct {
   int nx,ny,nz;
   float_tt dx,dy,dz;
   double B;
-#if FLOAT_PRECISION == 1
   fftwf_complex ***potential;   /* 3D array containg 1st quadrant of real space potential */
   float_tt ***rpotential;   /* 3D array containg 1st quadrant of real space potential */
-#else
-  fftw_complex ***potential;   /* 3D array containg 1st quadrant of real space potential */
-  float_tt ***rpotential;   /* 3D array containg 1st quadrant of real space potential */
-#endif
 } atomBox;
 
 #endif // STEMTYPES_H
@@ -0,0 +1,83 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <math.h>
+#include "tds_convergence.h"
+#include "counter_rng.h"
+
+TdsConvergence::TdsConvergence(size_t pixels, int sampling) :
+	m_mean(pixels,0.0),
+	m_m2(pixels,0.0),
+	m_sampling(sampling)
+{
+}
+
+void TdsConvergence::Add(const float_tt *pattern) {
+	size_t i,pixels = m_mean.size();
+	int n = Runs()+1;
+	double d,mean,chisq = 0,m2 = 0;
+
+	for (i=0;i<pixels;i++) {
+		d = pattern[i]-m_mean[i];
+		mean = m_mean[i]+d/n;
+		chisq += (mean-m_mean[i])*(mean-m_mean[i]);
+		m_m2[i] += d*(pattern[i]-mean);
+		m_mean[i] = mean;
+		m2 += m_m2[i];
+	}
+	if (n > 1) m_chisq.push_back(chisq/pixels);
+	m_variance.push_back(n > 1 ? m2/(pixels*(double)(n-1)) : 0.0);
+}
+
+double TdsConvergence::MonteCarloChisq(int n) const {
+	return Variance(n+1)/((double)n*(n+1));
+}
+
+double TdsConvergence::EquivalentRuns(int n) const {
+	// solves m*(m-1) = sigma^2/chi^2 for the run count m = n+1 of chi^2(n)
+	if (Chisq(n) <= 0) return 0;
+	return 0.5*(1.0+sqrt(1.0+4.0*Variance(n+1)/Chisq(n)));
+}
+
+int TdsConvergence::Write(const char *folder) const {
+	char fileName[512];
+	FILE *fp;
+	int n;
+
+	sprintf(fileName,"%s/convergence.dat",folder);
+	if ((fp = fopen(fileName,"w")) == NULL) {
+		printf("Sorry, could not open %s\n",fileName);
+		return 0;
+	}
+	fprintf(fp,"# %s sampling of the TDS configurations\n",samplingName(m_sampling));
+	fprintf(fp,"# runs chi^2 variance chi^2(plain Monte Carlo) equivalent_plain_runs\n");
+	for (n=1;n<Runs();n++)
+		fprintf(fp,"%d %g %g %g %.1f\n",n+1,Chisq(n),Variance(n+1),MonteCarloChisq(n),EquivalentRuns(n));
+	fclose(fp);
+	return 1;
+}
+
+void TdsConvergence::Print() const {
+	int n = Runs()-1;
+
+	if (n < 1) return;
+	printf("TDS convergence (%s sampling): chi^2 = %g after %d runs, plain Monte Carlo: %g (~%.1f runs)\n",
+		samplingName(m_sampling),Chisq(n),n+1,MonteCarloChisq(n),EquivalentRuns(n));
+}
@@ -0,0 +1,74 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TDS_CONVERGENCE_H
+#define TDS_CONVERGENCE_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * Convergence of the average over the TDS configurations.
+ *
+ * The drivers report chi^2 of run n (muls->chisq, avgresults.dat)
+ * as the mean square change of the averaged pattern by run n+1.
+ * For independent configurations (plain Monte Carlo) its
+ * expectation is sigma^2/(n*(n+1)), sigma^2 being the variance of
+ * the pattern of a single configuration, averaged over the pixels.
+ * TdsConvergence estimates sigma^2 from the patterns of the runs
+ * (Welford's running variance per pixel) and compares the chi^2
+ * reached with the sampling of the displacements (counter_rng.h)
+ * to the one plain Monte Carlo would reach with the same number of
+ * runs, and gives the number of plain Monte Carlo runs that would
+ * reach it.  For correlated (antithetic, Sobol) configurations the
+ * sample variance slightly overestimates sigma^2 for a few runs.
+ *
+ * TdsConvergence conv(muls.nx*muls.ny,muls.sampling);
+ * conv.Add(wave->diffpat.Data());       // after every run
+ * conv.Write(muls.folder);              // <folder>/convergence.dat
+ **************************************************************/
+
+class TdsConvergence {
+	std::vector<double> m_mean,m_m2;
+	std::vector<double> m_chisq,m_variance;
+	int m_sampling;
+public:
+	TdsConvergence(size_t pixels, int sampling);
+
+	/* adds the pattern of the next run */
+	void Add(const float_tt *pattern);
+	int Runs() const { return (int)m_variance.size(); }
+
+	/* chi^2 of run n (1 <= n < Runs()), as muls->chisq[n-1] */
+	double Chisq(int n) const { return m_chisq[n-1]; }
+	/* pixel averaged sample variance of the first n runs (n >= 2) */
+	double Variance(int n) const { return m_variance[n-1]; }
+	/* expectation of Chisq(n) for plain Monte Carlo */
+	double MonteCarloChisq(int n) const;
+	/* number of plain Monte Carlo runs that reach Chisq(n), i.e. the
+	 * run count at which MonteCarloChisq would drop to Chisq(n) */
+	double EquivalentRuns(int n) const;
+
+	/* writes <folder>/convergence.dat, returns 0 if it cannot */
+	int Write(const char *folder) const;
+	/* one line summary of the last run */
+	void Print() const;
+};
+
+#endif // TDS_CONVERGENCE_H
@@ -0,0 +1,146 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <math.h>
+#include "tds_stop.h"
+
+TdsStopping::TdsStopping(size_t pixels, double target, int minRuns, int pixelMode) :
+	m_target(target),
+	m_minRuns(minRuns < 2 ? 2 : minRuns),
+	m_pixelMode(pixelMode),
+	m_runs(pixels,0),
+	m_active(pixels,1),
+	m_updates(0)
+{
+}
+
+double TdsStopping::RelativeError(const Detector &det, const int *runs) {
+	size_t p,pixels = det.image.Size();
+	const float_tt *image = det.image.Data(), *image2 = det.image2.Data();
+	double var,se2 = 0,sum2 = 0;
+
+	for (p=0;p<pixels;p++) {
+		if (runs[p] < 2) return -1;
+		var = image2[p]-(double)image[p]*image[p];
+		if (var > 0) se2 += var/(runs[p]-1);
+		sum2 += (double)image[p]*image[p];
+	}
+	if (sum2 <= 0) return 0;
+	return sqrt(se2/sum2);
+}
+
+int TdsStopping::Update(const std::vector<std::vector<DetectorPtr> > &detectors) {
+	size_t p,pixels = m_runs.size();
+	int t,i,k,pixelCount = ActivePixels();
+	int detectorNum = detectors.empty() ? 0 : (int)detectors[0].size();
+	double se2,threshold2;
+	std::vector<double> errors;
+	std::vector<char> converged;
+	char name[64];
+
+	for (p=0;p<pixels;p++) if (m_active[p]) m_runs[p]++;
+	m_updates++;
+	if (m_names.empty()) for (t=0;t<(int)detectors.size();t++) for (i=0;i<detectorNum;i++) {
+		sprintf(name,"%s_%d",detectors[t][i]->name,t);
+		m_names.push_back(name);
+	}
+	if (m_updates < 2) return 0;
+
+	for (t=0;t<(int)detectors.size();t++) for (i=0;i<detectorNum;i++)
+		errors.push_back(RelativeError(*detectors[t][i],&m_runs[0]));
+	m_rowRuns.push_back(m_updates);
+	m_rowPixels.push_back(pixelCount);
+	m_errors.push_back(errors);
+	if ((m_target <= 0) || (m_updates < m_minRuns)) return 0;
+
+	if (!m_pixelMode) {
+		for (k=0;k<(int)errors.size();k++) if (errors[k] > m_target) return 0;
+		return 1;
+	}
+
+	// pixel mode: the pixels whose error is below target*rms(image) everywhere drop out
+	converged.assign(pixels,1);
+	for (t=0;t<(int)detectors.size();t++) for (i=0;i<detectorNum;i++) {
+		const Detector &det = *detectors[t][i];
+		for (threshold2=0,p=0;p<pixels;p++) threshold2 += (double)det.image[0][p]*det.image[0][p];
+		threshold2 *= m_target*m_target/pixels;
+		for (p=0;p<pixels;p++) if (m_active[p] && converged[p]) {
+			se2 = det.image2[0][p]-(double)det.image[0][p]*det.image[0][p];
+			if (se2/(m_runs[p]-1) > threshold2) converged[p] = 0;
+		}
+	}
+	for (p=0;p<pixels;p++) if (converged[p]) m_active[p] = 0;
+	return ActivePixels() == 0;
+}
+
+void TdsStopping::SetRuns(int runs) {
+	m_runs.assign(m_runs.size(),runs);
+	m_updates = runs;
+}
+
+int TdsStopping::ActivePixels() const {
+	size_t p;
+	int count = 0;
+
+	for (p=0;p<m_active.size();p++) if (m_active[p]) count++;
+	return count;
+}
+
+double TdsStopping::MaxError() const {
+	size_t k;
+	double err = -1;
+
+	if (m_errors.empty()) return -1;
+	for (k=0;k<m_errors.back().size();k++) if (m_errors.back()[k] > err) err = m_errors.back()[k];
+	return err;
+}
+
+int TdsStopping::Write(const char *folder) const {
+	char fileName[512];
+	FILE *fp;
+	size_t r,k;
+
+	sprintf(fileName,"%s/tds_stop.dat",folder);
+	if ((fp = fopen(fileName,"w")) == NULL) {
+		printf("Sorry, could not open %s\n",fileName);
+		return 0;
+	}
+	fprintf(fp,"# relative standard error of the detector images (target %g%s)\n",
+		m_target,m_pixelMode ? ", per pixel" : "");
+	fprintf(fp,"# runs pixels");
+	for (k=0;k<m_names.size();k++) fprintf(fp," %s",m_names[k].c_str());
+	fprintf(fp,"\n");
+	for (r=0;r<m_errors.size();r++) {
+		fprintf(fp,"%d %d",m_rowRuns[r],m_rowPixels[r]);
+		for (k=0;k<m_errors[r].size();k++) fprintf(fp," %g",m_errors[r][k]);
+		fprintf(fp,"\n");
+	}
+	fclose(fp);
+	return 1;
+}
+
+void TdsStopping::Print() const {
+	if (m_errors.empty()) return;
+	printf("TDS run %d: largest relative error of the detector images %g (target %g)",
+		m_updates,MaxError(),m_target);
+	if (m_pixelMode) printf(", %d of %d pixels left",ActivePixels(),(int)m_active.size());
+	printf("\n");
+}
@@ -0,0 +1,87 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TDS_STOP_H
+#define TDS_STOP_H
+
+#include <vector>
+#include <string>
+#include "data_containers.h"
+
+/**************************************************************
+ * Adaptive number of TDS runs.
+ *
+ * Detector::image holds the mean of the runs averaged so far and
+ * image2 the mean of their squares, so the standard error of pixel
+ * p after n runs is SE_p^2 = (image2-image^2)/(n-1).  The relative
+ * error of a detector image is sqrt(sum_p SE_p^2 / sum_p image^2).
+ * After every run TdsStopping evaluates it for every detector and
+ * thickness, and tells doSTEM to stop as soon as all of them are
+ * below the target ("tds stop error:") after at least minRuns runs.
+ *
+ * In pixel mode ("tds stop pixels: yes") a pixel drops out of the
+ * later runs once its standard error is below target times the rms
+ * intensity of the image, for every detector and thickness, and
+ * the runs stop when no pixel is left.  Runs(p) is the number of
+ * runs averaged into pixel p, which collectIntensity() then uses
+ * instead of Detector::Navg.
+ *
+ * TdsStopping stop(muls.scanXN*muls.scanYN,0.01,3,0);
+ * if (!stop.Active(pixel)) continue;       // in the pixel loop
+ * done = stop.Update(muls.detectors);      // after every run
+ * stop.Write(muls.folder);                 // <folder>/tds_stop.dat
+ **************************************************************/
+
+class TdsStopping {
+	double m_target;
+	int m_minRuns,m_pixelMode;
+	std::vector<int> m_runs;                     // runs averaged into each pixel
+	std::vector<char> m_active;                  // pixel takes part in the next run
+	std::vector<std::string> m_names;            // detector of each error column
+	std::vector<int> m_rowRuns,m_rowPixels;      // run and pixels of that run, per row
+	std::vector<std::vector<double> > m_errors;  // [row][t*detectorNum+i], from run 2 on
+	int m_updates;
+public:
+	TdsStopping(size_t pixels, double target, int minRuns, int pixelMode);
+
+	/* relative error of the image of det, runs[p] runs in pixel p,
+	 * -1 if a pixel has less than 2 runs */
+	static double RelativeError(const Detector &det, const int *runs);
+
+	/* counts the run that the active pixels just took part in, with
+	 * detectors[t][i] holding the images including it.  Returns 1 if
+	 * no more runs are needed */
+	int Update(const std::vector<std::vector<DetectorPtr> > &detectors);
+	/* all pixels already hold runs runs (continuing from a checkpoint) */
+	void SetRuns(int runs);
+	int Active(size_t pixel) const { return m_active[pixel]; }
+	int Runs(size_t pixel) const { return m_runs[pixel]; }
+	int PixelMode() const { return m_pixelMode; }
+	int ActivePixels() const;
+	/* largest relative error of the last run, -1 before run 2 */
+	double MaxError() const;
+
+	/* writes the errors of every run to <folder>/tds_stop.dat, returns 0 if it cannot */
+	int Write(const char *folder) const;
+	/* one line summary of the last run */
+	void Print() const;
+};
+
+#endif // TDS_STOP_H
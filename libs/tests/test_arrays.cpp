@@ -0,0 +1,88 @@
+#include <boost/test/unit_test.hpp>
+
+#include "array_nd.h"
+
+typedef float complexf[2];
+
+BOOST_AUTO_TEST_SUITE (TestArrays)
+
+BOOST_AUTO_TEST_CASE (testAlignmentAndZero)
+{
+  Array2D<complexf> a(7, 5, "a");
+  BOOST_CHECK_EQUAL((size_t)a.Data() % ARRAY_ALIGNMENT, 0);
+  BOOST_CHECK_EQUAL(a.Size(), 35);
+  for (int i=0; i<35; i++) {
+    BOOST_CHECK_EQUAL(a[0][i][0], 0.0f);
+    BOOST_CHECK_EQUAL(a[0][i][1], 0.0f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testRowLayout)
+{
+  Array2D<float> a(4, 3);
+  for (int ix=0; ix<4; ix++) for (int iy=0; iy<3; iy++) a[ix][iy] = 10*ix+iy;
+  // contiguous, row major, and the row pointer adapter agrees
+  BOOST_CHECK_EQUAL(a.Data()[2*3+1], 21.0f);
+  BOOST_CHECK_EQUAL(a.Rows()[3][2], 32.0f);
+  BOOST_CHECK_EQUAL(a[0][11], 32.0f);
+}
+
+BOOST_AUTO_TEST_CASE (testCopyAndResize)
+{
+  Array2D<float> a(2, 2);
+  a[1][1] = 5;
+  Array2D<float> b(a);
+  b[1][1] = 6;
+  BOOST_CHECK_EQUAL(a[1][1], 5.0f);
+  BOOST_CHECK(b.Rows()[1] == b[1]);
+  a.Resize(3, 4);
+  BOOST_CHECK_EQUAL(a.Nx(), 3);
+  BOOST_CHECK_EQUAL(a[1][1], 0.0f);
+  a.Free();
+  BOOST_CHECK(a.Empty());
+}
+
+BOOST_AUTO_TEST_CASE (testWindow)
+{
+  Array3D<float> t(2, 6, 8, "trans");
+  for (int iz=0; iz<2; iz++) for (int ix=0; ix<6; ix++) for (int iy=0; iy<8; iy++)
+    t[iz][ix][iy] = 100*iz+10*ix+iy;
+  Array2DView<float> w = t[1].Window(2, 3, 4, 5);
+  BOOST_CHECK_EQUAL(w.Stride(), 8);
+  BOOST_CHECK(!w.Contiguous());
+  BOOST_CHECK_EQUAL(w[0][0], 123.0f);
+  BOOST_CHECK_EQUAL(w[3][4], 157.0f);
+  BOOST_CHECK_EQUAL(t.Rows(1)[5][7], 157.0f);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
+
+
+BOOST_AUTO_TEST_SUITE (TestMemoryArena)
+
+BOOST_AUTO_TEST_CASE (testArenaReuse)
+{
+  MemoryArena arena;
+  char *a = (char *)arena.Alloc("test arena", 100);
+  char *b = (char *)arena.Alloc("test arena", 50);
+  // same tag, smaller request: the buffer is reused
+  BOOST_CHECK(a == b);
+  BOOST_CHECK_EQUAL((size_t)a % ARRAY_ALIGNMENT, 0);
+  b = (char *)arena.Alloc("test arena", 1000);
+  b[999] = 1;
+  arena.FreeAll();
+}
+
+BOOST_AUTO_TEST_CASE (testPeakAccounting)
+{
+  size_t peak = memPeakBytes();
+  {
+    Array2D<double> a(512, 512, "test peak");
+  }
+  Array2D<double> b(512, 512, "test peak");
+  // the first array has been released before the second one was allocated
+  BOOST_CHECK(memPeakBytes() >= 512*512*sizeof(double));
+  BOOST_CHECK(memPeakBytes() < peak+2*512*512*sizeof(double));
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,57 @@
+#include <boost/test/unit_test.hpp>
+
+#include "atom_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE (TestAtomFile)
+
+BOOST_AUTO_TEST_CASE (testParseNumber)
+{
+  const char *text = " -1.25e-2\t3 .5 x";
+  const char *p = text, *end = text+strlen(text);
+  double v;
+  BOOST_REQUIRE(parseNumber(p, end, &v));
+  BOOST_CHECK_CLOSE(v, -0.0125, 1e-12);
+  BOOST_REQUIRE(parseNumber(p, end, &v));
+  BOOST_CHECK_EQUAL(v, 3.0);
+  BOOST_REQUIRE(parseNumber(p, end, &v));
+  BOOST_CHECK_EQUAL(v, 0.5);
+  BOOST_CHECK(!parseNumber(p, end, &v));
+}
+
+BOOST_AUTO_TEST_CASE (testReadCFGAndCache)
+{
+  const char *fileName = "test_atom_file.cfg";
+  char cacheName[1040];
+  std::vector<atom> atoms, cached;
+  double Mm[9], cachedMm[9];
+  FILE *fp = fopen(fileName, "w");
+  BOOST_REQUIRE(fp != NULL);
+  fprintf(fp, "Number of particles = 3\nA = 1.0 Angstrom (basic length-scale)\n"
+              "H0(1,1) = 5.43 A\nH0(2,2) = 5.43 A\nH0(3,3) = 10.86 A\n"
+              ".NO_VELOCITY.\nentry_count = 5\nauxiliary[0] = dw [A^2]\nauxiliary[1] = occ\n"
+              "28.0855\nSi\n0.1 0.2 0.3 0.45 1\n0.5 0.5 0.5 0.5 0.7\n"
+              "15.999\nO\n0.25 0.75 0.125 0.3 1\n");
+  fclose(fp);
+
+  BOOST_REQUIRE_EQUAL(readCFGAtoms(fileName, atoms, Mm), 3);
+  BOOST_CHECK_CLOSE(Mm[0], 5.43, 1e-10);
+  BOOST_CHECK_CLOSE(Mm[8], 10.86, 1e-10);
+  BOOST_CHECK_EQUAL(atoms[0].Znum, 14);
+  BOOST_CHECK_EQUAL(atoms[2].Znum, 8);
+  BOOST_CHECK_CLOSE(atoms[1].occ, 0.7f, 1e-5);
+  BOOST_CHECK_CLOSE(atoms[2].z, 0.125f, 1e-5);
+
+  atomCacheName(fileName, cacheName);
+  BOOST_REQUIRE(writeAtomCache(cacheName, fileName, atoms, Mm));
+  BOOST_REQUIRE(readAtomCache(cacheName, fileName, cached, cachedMm));
+  BOOST_REQUIRE_EQUAL(cached.size(), atoms.size());
+  BOOST_CHECK(memcmp(&cached[0], &atoms[0], atoms.size()*sizeof(atom)) == 0);
+  BOOST_CHECK_EQUAL(cachedMm[4], Mm[4]);
+  remove(cacheName);
+  remove(fileName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
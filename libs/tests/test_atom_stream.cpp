@@ -0,0 +1,79 @@
+#include <boost/test/unit_test.hpp>
+
+#include "atom_stream.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE (TestAtomStream)
+
+static atom makeAtom(float x, float y, float z, int Znum)
+{
+  atom a;
+  memset(&a, 0, sizeof(a));
+  a.x = x; a.y = y; a.z = z;
+  a.dw = 0.5f; a.occ = 1; a.Znum = Znum;
+  return a;
+}
+
+// 2 sites per cell, 3x2x10 cells of 2x3x4 A
+static CrystalSource makeCrystal(double wobble)
+{
+  std::vector<atom> unit;
+  std::vector<int> groups;
+  std::vector<double> groupOcc(2, 1.0);
+  double cell[3][3] = {{2,0,0},{0,3,0},{0,0,4}};
+  int nc[3] = {3,2,10};
+  unit.push_back(makeAtom(0, 0, 0, 14));
+  unit.push_back(makeAtom(1, 1.5f, 2, 8));
+  groups.push_back(0); groups.push_back(1); groups.push_back(2);
+  return CrystalSource(unit, groups, groupOcc, cell, nc, 1, wobble, 1234, SAMPLING_RANDOM);
+}
+
+BOOST_AUTO_TEST_CASE (testCrystalSlabs)
+{
+  CrystalSource src = makeCrystal(0.1);
+  std::vector<atom> slab, again;
+  size_t k, total = 0;
+
+  BOOST_CHECK_EQUAL(src.Count(), (size_t)120);
+  // every atom in exactly one of the slabs, sorted in z
+  for (k=0;k<4;k++) {
+    src.Slab(k == 0 ? -1e30 : 10.0*k, k == 3 ? 1e30 : 10.0*(k+1), 0, slab);
+    for (size_t i=1;i<slab.size();i++) BOOST_CHECK(slab[i-1].z <= slab[i].z);
+    total += slab.size();
+  }
+  BOOST_CHECK_EQUAL(total, (size_t)120);
+
+  // the same configuration is displaced identically, another one is not
+  src.Slab(8, 22, 1, slab);
+  src.Slab(8, 22, 1, again);
+  BOOST_REQUIRE_EQUAL(slab.size(), again.size());
+  BOOST_CHECK(memcmp(&slab[0], &again[0], slab.size()*sizeof(atom)) == 0);
+  src.Slab(8, 22, 2, again);
+  BOOST_CHECK(slab.size() != again.size() || memcmp(&slab[0], &again[0], slab.size()*sizeof(atom)) != 0);
+}
+
+BOOST_AUTO_TEST_CASE (testSortedAtomFile)
+{
+  const char *fileName = "test_atom_stream.qaz";
+  std::vector<atom> atoms, slab;
+  double box[3] = {5, 5, 9};
+  SortedAtomFile file;
+  int i;
+
+  for (i=0;i<10;i++) atoms.push_back(makeAtom(1, 2, (float)(9-i), (i % 2) ? 8 : 14));
+  atoms[3].Znum = 0;  // vacancies are not written
+  BOOST_REQUIRE(writeSortedAtoms(fileName, NULL, 0, 0, atoms, box));
+  BOOST_REQUIRE(file.Open(fileName, NULL, 0, 0));
+  BOOST_CHECK_EQUAL(file.Count(), (size_t)9);
+  BOOST_CHECK_EQUAL(file.Box()[2], 9.0);
+  BOOST_CHECK_EQUAL(file.Znums().size(), (size_t)2);
+  file.Slab(2, 5, 0, slab);
+  BOOST_REQUIRE_EQUAL(slab.size(), (size_t)3);
+  BOOST_CHECK_EQUAL(slab[0].z, 2.0f);
+  BOOST_CHECK_EQUAL(slab[2].z, 4.0f);
+  remove(fileName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
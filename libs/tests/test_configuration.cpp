@@ -0,0 +1,72 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stemtypes_fftw3.h"
+#include "fileio_fftw3.h"
+#include "sim_state.h"
+#include <stdlib.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+BOOST_AUTO_TEST_SUITE (TestConfiguration)
+
+// displaces the same atoms with nThreads threads and returns the rms displacements
+static void displaceWithThreads(int nThreads, std::vector<atom> &out, std::vector<double> &u2)
+{
+  MULS muls = MULS();
+  std::vector<atom> atoms(1000);
+  atom *displaced;
+  int i, natom;
+
+  for (i = 0; i < (int)atoms.size(); i++) {
+    atoms[i].x = (float)(i % 10);
+    atoms[i].y = (float)((i/10) % 10);
+    atoms[i].z = (float)(i/100);
+    atoms[i].dw = 0.45f;
+    atoms[i].occ = 1;
+    atoms[i].q = 0;
+    atoms[i].Znum = (i % 3) ? 14 : 8;
+  }
+  muls.tds = 1;
+  muls.tds_temp = 300;
+  muls.avgCount = 2;
+  simState(&muls)->rng.seed = 1234;
+  setInputAtoms(&muls, &atoms[0], (int)atoms.size());
+#ifdef _OPENMP
+  int maxThreads = omp_get_max_threads();
+  omp_set_num_threads(nThreads);
+  displaced = displaceInputAtoms(&natom, &muls);
+  omp_set_num_threads(maxThreads);
+#else
+  displaced = displaceInputAtoms(&natom, &muls);
+#endif
+  out.assign(displaced, displaced+natom);
+  u2.assign(muls.u2, muls.u2+muls.atomKinds);
+  free(muls.Znums);
+  free(muls.u2);
+  free(muls.u2avg);
+}
+
+// the configuration of a run and its rms sums do not depend on the number of threads
+BOOST_AUTO_TEST_CASE (testDisplaceThreadCount)
+{
+  std::vector<atom> serial, threaded;
+  std::vector<double> u2Serial, u2Threaded;
+  int i;
+
+  displaceWithThreads(1, serial, u2Serial);
+  displaceWithThreads(3, threaded, u2Threaded);
+  BOOST_REQUIRE_EQUAL(serial.size(), threaded.size());
+  for (i = 0; i < (int)serial.size(); i++) {
+    BOOST_CHECK_EQUAL(serial[i].x, threaded[i].x);
+    BOOST_CHECK_EQUAL(serial[i].y, threaded[i].y);
+    BOOST_CHECK_EQUAL(serial[i].z, threaded[i].z);
+  }
+  BOOST_REQUIRE_EQUAL(u2Serial.size(), (size_t)2);
+  BOOST_CHECK_EQUAL(u2Serial[0], u2Threaded[0]);
+  BOOST_CHECK_EQUAL(u2Serial[1], u2Threaded[1]);
+  BOOST_CHECK(u2Serial[0] > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -32,9 +32,11 @@ BOOST_FIXTURE_TEST_SUITE (TestWave, WaveFixture)
 BOOST_AUTO_TEST_CASE (testArrayAllocation)
 {
   // Check array allocation
-  BOOST_CHECK(wave->diffpat != NULL);
-  BOOST_CHECK(wave->avgArray != NULL);
-  BOOST_CHECK(wave->wave != NULL);
+  BOOST_CHECK(!wave->diffpat.Empty());
+  BOOST_CHECK(!wave->avgArray.Empty());
+  BOOST_CHECK(!wave->wave.Empty());
+  BOOST_CHECK_EQUAL(wave->wave.Nx(), 10);
+  BOOST_CHECK_EQUAL(wave->wave.Ny(), 10);
 }
 
 // Test image saving
@@ -49,8 +51,8 @@ BOOST_FIXTURE_TEST_SUITE (TestDetector, DetectorFixture)
 BOOST_AUTO_TEST_CASE (testArrayAllocation)
 {
   // Check array allocation
-  BOOST_CHECK(det->image != NULL);
-  BOOST_CHECK(det->image2 != NULL);
+  BOOST_CHECK(!det->image.Empty());
+  BOOST_CHECK(!det->image2.Empty());
 }
 
 BOOST_AUTO_TEST_CASE (testSetComment)
@@ -58,4 +60,22 @@ BOOST_AUTO_TEST_CASE (testSetComment)
 	
 }
 
+// slices: 4, slices between outputs: 2 - the last slice ends the second
+// interval, so slot 1 must be filled as well as the final slot 2
+BOOST_AUTO_TEST_CASE (testDetectorSlots)
+{
+  int slots[2];
+
+  BOOST_CHECK_EQUAL(detectorSlots(0,4,2,slots), 0);
+  BOOST_CHECK_EQUAL(detectorSlots(1,4,2,slots), 1);
+  BOOST_CHECK_EQUAL(slots[0], 0);
+  BOOST_CHECK_EQUAL(detectorSlots(2,4,2,slots), 0);
+  BOOST_CHECK_EQUAL(detectorSlots(3,4,2,slots), 2);
+  BOOST_CHECK_EQUAL(slots[0], 2);
+  BOOST_CHECK_EQUAL(slots[1], 1);
+  // the last slice does not end an interval: only the final slot
+  BOOST_CHECK_EQUAL(detectorSlots(4,5,2,slots), 1);
+  BOOST_CHECK_EQUAL(slots[0], 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END( )
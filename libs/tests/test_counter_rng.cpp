@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+
+#include "counter_rng.h"
+#include "tds_convergence.h"
+
+BOOST_AUTO_TEST_SUITE (TestCounterRng)
+
+// known answers of the Random123 distribution
+BOOST_AUTO_TEST_CASE (testPhiloxKnownAnswers)
+{
+  unsigned int ctr0[4] = {0, 0, 0, 0}, key0[2] = {0, 0};
+  unsigned int ctr1[4] = {0xffffffffU, 0xffffffffU, 0xffffffffU, 0xffffffffU}, key1[2] = {0xffffffffU, 0xffffffffU};
+  unsigned int ctr2[4] = {0x243f6a88U, 0x85a308d3U, 0x13198a2eU, 0x03707344U}, key2[2] = {0xa4093822U, 0x299f31d0U};
+  unsigned int r[4];
+
+  philox4x32(ctr0, key0, r);
+  BOOST_CHECK_EQUAL(r[0], 0x6627e8d5U);
+  BOOST_CHECK_EQUAL(r[3], 0x9b00dbd8U);
+  philox4x32(ctr1, key1, r);
+  BOOST_CHECK_EQUAL(r[0], 0x408f276dU);
+  BOOST_CHECK_EQUAL(r[3], 0x6d5451fdU);
+  philox4x32(ctr2, key2, r);
+  BOOST_CHECK_EQUAL(r[0], 0xd16cfe09U);
+  BOOST_CHECK_EQUAL(r[3], 0x24126ea1U);
+}
+
+BOOST_AUTO_TEST_CASE (testGaussMoments)
+{
+  counterRng rng;
+  double g[4], sum = 0, sum2 = 0;
+  int i, k, n = 100000;
+
+  initCounterRng(&rng, 12345, RNG_STREAM_PHONON);
+  for (i=0;i<n;i++) {
+    counterGauss4(&rng, 3, i, 0, g);
+    for (k=0;k<4;k++) {
+      sum += g[k];
+      sum2 += g[k]*g[k];
+    }
+  }
+  BOOST_CHECK_SMALL(sum/(4*n), 0.01);
+  BOOST_CHECK_CLOSE(sum2/(4*n), 1.0, 2.0);
+}
+
+BOOST_AUTO_TEST_CASE (testAntithetic)
+{
+  counterRng rng;
+  double g0[4], g1[4];
+  int k;
+
+  initCounterRng(&rng, 12345, RNG_STREAM_PHONON);
+  rng.sampling = SAMPLING_ANTITHETIC;
+  counterGauss4(&rng, 6, 17, 2, g0);
+  counterGauss4(&rng, 7, 17, 2, g1);
+  for (k=0;k<4;k++) BOOST_CHECK_EQUAL(g1[k], -g0[k]);
+}
+
+BOOST_AUTO_TEST_CASE (testSobolStratified)
+{
+  // the mean of 64 configurations of one atom is much more accurate
+  // than the 1/64 variance of independent configurations
+  counterRng rng;
+  double g[4], sum, sum2 = 0, err2 = 0;
+  int i, c, k, sites = 500, configs = 64;
+
+  initCounterRng(&rng, 12345, RNG_STREAM_PHONON);
+  rng.sampling = SAMPLING_SOBOL;
+  for (i=0;i<sites;i++) for (k=0;k<4;k++) {
+    sum = 0;
+    for (c=0;c<configs;c++) {
+      counterGauss4(&rng, c, i, 0, g);
+      sum += g[k];
+      sum2 += g[k]*g[k];
+    }
+    err2 += (sum/configs)*(sum/configs);
+  }
+  BOOST_CHECK_CLOSE(sum2/(4*sites*configs), 1.0, 3.0);
+  BOOST_CHECK_LT(err2/(4*sites), 0.1/configs);
+}
+
+BOOST_AUTO_TEST_CASE (testConvergenceReport)
+{
+  // independent patterns: chi^2 follows plain Monte Carlo
+  counterRng rng;
+  double g[4];
+  float_tt pattern[1000];
+  int i, n, runs = 20;
+
+  initCounterRng(&rng, 99, RNG_STREAM_PHONON);
+  TdsConvergence conv(1000, SAMPLING_RANDOM);
+  for (n=0;n<runs;n++) {
+    for (i=0;i<1000;i++) {
+      counterGauss4(&rng, n, i, 0, g);
+      pattern[i] = (float_tt)(5+2*g[0]);
+    }
+    conv.Add(pattern);
+  }
+  BOOST_CHECK_EQUAL(conv.Runs(), runs);
+  BOOST_CHECK_CLOSE(conv.Variance(runs), 4.0, 5.0);
+  BOOST_CHECK_CLOSE(conv.Chisq(runs-1), conv.MonteCarloChisq(runs-1), 20.0);
+  BOOST_CHECK_CLOSE(conv.EquivalentRuns(runs-1), (double)runs, 10.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
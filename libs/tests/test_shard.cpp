@@ -0,0 +1,71 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stem_shard.h"
+#include <stdio.h>
+
+struct ShardFixture {
+  ShardFixture()
+  {
+    // 3x5 scan, 2 detectors, 2 thicknesses, split into 2 pixel shards
+    for (int s=0; s<2; s++) {
+      shards[s].scanXN = 3;
+      shards[s].scanYN = 5;
+      shards[s].detectorNum = 2;
+      shards[s].nThick = 2;
+      shards[s].shardIndex = s;
+      shards[s].shardCount = 2;
+      shards[s].runs = 2+s;
+      shards[s].Resize();
+      shards[s].names[0] = "ADF";
+      shards[s].names[1] = "BF";
+      for (int t=0; t<2; t++) for (int i=0; i<2; i++)
+        for (int k=0, p=s; p<15; k++, p+=2) {
+          shards[s].sum[shards[s].Index(t,i,k)]  = shards[s].runs*(100*t+10*i+p);
+          shards[s].sum2[shards[s].Index(t,i,k)] = shards[s].runs*(100*t+10*i+p)*(100*t+10*i+p);
+        }
+    }
+  }
+
+  STEMShard shards[2];
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestShard, ShardFixture)
+
+BOOST_AUTO_TEST_CASE (testPixelPartition)
+{
+  BOOST_CHECK_EQUAL(shards[0].NumPixels(), 8);
+  BOOST_CHECK_EQUAL(shards[1].NumPixels(), 7);
+  BOOST_CHECK(shards[0].OwnsPixel(4));
+  BOOST_CHECK(!shards[1].OwnsPixel(4));
+}
+
+BOOST_AUTO_TEST_CASE (testWriteRead)
+{
+  STEMShard read;
+  const char *fileName = "test_shard.qsh";
+  BOOST_REQUIRE(shards[1].Write(fileName));
+  BOOST_REQUIRE(read.Read(fileName));
+  remove(fileName);
+  BOOST_CHECK_EQUAL(read.shardIndex, 1);
+  BOOST_CHECK_EQUAL(read.runs, 3);
+  BOOST_CHECK(read.names == shards[1].names);
+  BOOST_CHECK(read.sum == shards[1].sum);
+  BOOST_CHECK(read.sum2 == shards[1].sum2);
+}
+
+BOOST_AUTO_TEST_CASE (testAccumulate)
+{
+  std::vector<double> sum(2*2*15,0.0), sum2(2*2*15,0.0), runs(15,0.0);
+  BOOST_REQUIRE(shards[0].Accumulate(sum,sum2,runs));
+  BOOST_REQUIRE(shards[1].Accumulate(sum,sum2,runs));
+  for (int p=0; p<15; p++) {
+    BOOST_CHECK_EQUAL(runs[p], 2+(p%2));
+    // the merged average is the value each shard stored for its pixels
+    BOOST_CHECK_CLOSE(sum[(1*2+1)*15+p]/runs[p], 110.0+p, 1e-10);
+  }
+  // arrays of the wrong size are rejected
+  std::vector<double> tooSmall(10,0.0);
+  BOOST_CHECK(!shards[0].Accumulate(tooSmall,sum2,runs));
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,32 @@
+#include <boost/test/unit_test.hpp>
+
+#include "source_size.h"
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE (TestSourceSize)
+
+BOOST_AUTO_TEST_CASE (testTransferNormalized)
+{
+  BOOST_CHECK_CLOSE(sourceTransfer(0, 0.5, SOURCE_GAUSSIAN, 0), 1.0, 1e-10);
+  BOOST_CHECK_CLOSE(sourceTransfer(0, 0.5, SOURCE_LORENTZIAN, 0), 1.0, 1e-10);
+  BOOST_CHECK_CLOSE(sourceTransfer(0, 0.5, SOURCE_MIXED, 0.3), 1.0, 1e-10);
+  BOOST_CHECK(sourceTransfer(1.0, 0.5, SOURCE_GAUSSIAN, 0) < sourceTransfer(0.5, 0.5, SOURCE_GAUSSIAN, 0));
+  BOOST_CHECK_EQUAL(parseSourceDistribution("Lorentzian"), SOURCE_LORENTZIAN);
+  BOOST_CHECK_EQUAL(parseSourceDistribution("mixed 0.2"), SOURCE_MIXED);
+}
+
+BOOST_AUTO_TEST_CASE (testConvolutionConservesIntensity)
+{
+  // a point in a 16x8 scan spreads symmetrically, the total stays the same
+  std::vector<float_tt> image(16*8, 0);
+  double sum = 0;
+  image[8*8+4] = 1;
+  convolveSourceSize(&image[0], 16, 8, 0.2, 0.3, 0.4, SOURCE_MIXED, 0.5);
+  for (size_t i=0; i<image.size(); i++) sum += image[i];
+  BOOST_CHECK_CLOSE(sum, 1.0, 1e-3);
+  BOOST_CHECK(image[8*8+4] < 1);
+  BOOST_CHECK_CLOSE(image[7*8+4], image[9*8+4], 1e-3);
+  BOOST_CHECK_CLOSE(image[8*8+3], image[8*8+5], 1e-3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,84 @@
+#include <boost/test/unit_test.hpp>
+
+#include <math.h>
+#include "tds_stop.h"
+#include "counter_rng.h"
+
+// adds run n (0,1,...) to the running averages of det as collectIntensity does,
+// pixel p gets mean 1 and noise of standard deviation sigma[p]
+static void addRun(Detector &det, int n, const int *runs, const std::vector<double> &sigma,
+                   const TdsStopping *stop)
+{
+  counterRng rng;
+  double g[4], x;
+  int p, m, pixels = (int)det.image.Size();
+
+  initCounterRng(&rng, 777, RNG_STREAM_PHONON);
+  for (p=0;p<pixels;p++) {
+    if ((stop != NULL) && !stop->Active(p)) continue;
+    m = runs[p];
+    counterGauss4(&rng, n, p, 0, g);
+    x = 1.0+sigma[p]*g[0];
+    det.image[0][p] = (float_tt)((m*det.image[0][p]+x)/(m+1));
+    det.image2[0][p] = (float_tt)((m*det.image2[0][p]+x*x)/(m+1));
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testRelativeError)
+{
+  DetectorPtr det(new Detector(4, 4, 1.0f, 1.0f));
+  std::vector<int> runs(16, 0);
+  std::vector<double> sigma(16, 0.1);
+  int n, p;
+
+  BOOST_CHECK_EQUAL(TdsStopping::RelativeError(*det, &runs[0]), -1);
+  for (n=0;n<400;n++) {
+    addRun(*det, n, &runs[0], sigma, NULL);
+    for (p=0;p<16;p++) runs[p]++;
+  }
+  // standard error of the mean of 400 runs: 0.1/sqrt(400)
+  BOOST_CHECK_CLOSE(TdsStopping::RelativeError(*det, &runs[0]), 0.005, 10.0);
+}
+
+BOOST_AUTO_TEST_CASE (testStopWholeImage)
+{
+  std::vector<std::vector<DetectorPtr> > detectors(1);
+  std::vector<double> sigma(16, 0.1);
+  TdsStopping stop(16, 0.01, 3, 0);
+  int n, done = 0;
+
+  detectors[0].push_back(DetectorPtr(new Detector(4, 4, 1.0f, 1.0f)));
+  for (n=0;(n<1000) && !done;n++) {
+    std::vector<int> runs(16, n);
+    addRun(*detectors[0][0], n, &runs[0], sigma, NULL);
+    done = stop.Update(detectors);
+  }
+  // 0.1/sqrt(n) drops below 0.01 at about n = 100
+  BOOST_CHECK(done);
+  BOOST_CHECK((n > 60) && (n < 160));
+  BOOST_CHECK(stop.MaxError() <= 0.01);
+  BOOST_CHECK_EQUAL(stop.Runs(0), n);
+}
+
+BOOST_AUTO_TEST_CASE (testStopPixels)
+{
+  std::vector<std::vector<DetectorPtr> > detectors(1);
+  std::vector<double> sigma(16, 0.001);
+  TdsStopping stop(16, 0.01, 3, 1);
+  int n, done = 0;
+
+  // one noisy pixel keeps running, the others stop after the minimum
+  sigma[5] = 0.1;
+  detectors[0].push_back(DetectorPtr(new Detector(4, 4, 1.0f, 1.0f)));
+  for (n=0;(n<1000) && !done;n++) {
+    std::vector<int> runs(16);
+    for (int p=0;p<16;p++) runs[p] = stop.Runs(p);
+    addRun(*detectors[0][0], n, &runs[0], sigma, &stop);
+    done = stop.Update(detectors);
+    if (n == 2) BOOST_CHECK_EQUAL(stop.ActivePixels(), 1);
+  }
+  BOOST_CHECK(done);
+  BOOST_CHECK_EQUAL(stop.Runs(0), 3);
+  BOOST_CHECK(stop.Runs(5) > 50);
+  BOOST_CHECK_EQUAL(stop.Runs(5), n);
+}
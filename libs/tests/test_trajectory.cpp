@@ -0,0 +1,128 @@
+#include <boost/test/unit_test.hpp>
+
+#include "trajectory.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE (TestTrajectory)
+
+static void writeText(const char *fileName, const char *text)
+{
+  FILE *fp = fopen(fileName, "wb");
+  fputs(text, fp);
+  fclose(fp);
+}
+
+BOOST_AUTO_TEST_CASE (testLAMMPSDump)
+{
+  const char *fileName = "test_trajectory.lammpstrj";
+  std::vector<atom> atoms;
+  double Mm[9];
+  Trajectory traj;
+
+  // scaled positions and types, then positions with elements, then an incomplete frame
+  writeText(fileName,
+    "ITEM: TIMESTEP\n0\nITEM: NUMBER OF ATOMS\n2\nITEM: BOX BOUNDS pp pp pp\n"
+    "0 10\n0 20\n-5 5\nITEM: ATOMS id type xs ys zs\n"
+    "1 1 0.5 0.25 0.1\n2 2 0.1 0.5 0.5\n"
+    "ITEM: TIMESTEP\n100\nITEM: NUMBER OF ATOMS\n2\nITEM: BOX BOUNDS pp pp pp\n"
+    "0 10\n0 20\n-5 5\nITEM: ATOMS id element x y z\n"
+    "1 Si 11 -1 0\n2 O 1 10 4\n"
+    "ITEM: TIMESTEP\n200\nITEM: NUMBER OF ATOMS\n2\nITEM: BOX BOUNDS pp pp pp\n"
+    "0 10\n0 20\n");
+  BOOST_REQUIRE(traj.Open(fileName, "Si O", 0));
+  BOOST_CHECK_EQUAL(traj.Frames(), 2);
+
+  BOOST_REQUIRE(traj.Frame(0, atoms, Mm));
+  BOOST_REQUIRE_EQUAL(atoms.size(), (size_t)2);
+  BOOST_CHECK_EQUAL(Mm[0], 10.0);
+  BOOST_CHECK_EQUAL(Mm[8], 10.0);
+  BOOST_CHECK_EQUAL(atoms[0].Znum, 14);
+  BOOST_CHECK_EQUAL(atoms[1].Znum, 8);
+  BOOST_CHECK_CLOSE(atoms[0].x, 5.0f, 1e-4);
+  BOOST_CHECK_CLOSE(atoms[0].y, 5.0f, 1e-4);
+  BOOST_CHECK_CLOSE(atoms[0].z, 1.0f, 1e-4);
+
+  // read ahead, atoms outside of the box are wrapped into it
+  BOOST_REQUIRE(traj.Frame(1, atoms, Mm));
+  BOOST_CHECK_EQUAL(atoms[0].Znum, 14);
+  BOOST_CHECK_CLOSE(atoms[0].x, 1.0f, 1e-4);
+  BOOST_CHECK_CLOSE(atoms[0].y, 19.0f, 1e-4);
+  BOOST_CHECK_CLOSE(atoms[0].z, 5.0f, 1e-4);
+  BOOST_CHECK_CLOSE(atoms[1].z, 9.0f, 1e-4);
+  BOOST_CHECK(!traj.Frame(2, atoms, Mm));
+  remove(fileName);
+}
+
+BOOST_AUTO_TEST_CASE (testExtendedXYZ)
+{
+  const char *fileName = "test_trajectory.xyz";
+  std::vector<atom> atoms;
+  double Mm[9];
+  Trajectory traj;
+
+  writeText(fileName,
+    "2\nLattice=\"4 0 0 0 5 0 0 0 6\" Properties=id:I:1:species:S:1:pos:R:3 Time=0\n"
+    "1 Ga 1 2 3\n2 N 3 4 7\n"
+    "2\nLattice=\"4 0 0 0 5 0 0 0 6\" Properties=id:I:1:species:S:1:pos:R:3 Time=1\n"
+    "1 Ga 1.5 2 3\n2 N 3 4 5\n");
+  BOOST_REQUIRE(traj.Open(fileName, NULL, 0));
+  BOOST_CHECK_EQUAL(traj.Frames(), 2);
+  BOOST_REQUIRE(traj.Read(0, atoms, Mm));
+  BOOST_CHECK_EQUAL(Mm[4], 5.0);
+  BOOST_CHECK_EQUAL(atoms[0].Znum, 31);
+  BOOST_CHECK_EQUAL(atoms[1].Znum, 7);
+  BOOST_CHECK_CLOSE(atoms[1].z, 1.0f, 1e-4);
+  BOOST_REQUIRE(traj.Read(1, atoms, Mm));
+  BOOST_CHECK_CLOSE(atoms[0].x, 1.5f, 1e-4);
+  remove(fileName);
+}
+
+BOOST_AUTO_TEST_CASE (testBinaryTrajectory)
+{
+  const char *fileName = "test_trajectory.xyz";
+  char binaryName[64];
+  std::vector<atom> atoms, again;
+  double Mm[9], Mm2[9];
+  int n;
+
+  // a text trajectory read in order is converted to <file>.qtr
+  writeText(fileName,
+    "1\nLattice=\"4 0 0 0 5 0 0 0 6\"\nSi 1 2 3\n"
+    "1\nLattice=\"4 0 0 0 5 0 0 0 6\"\nSi 2 2 3\n"
+    "1\nLattice=\"4 0 0 0 5 0 0 0 6\"\nSi 3 2 3\n");
+  sprintf(binaryName, "%s.qtr", fileName);
+  remove(binaryName);
+  {
+    Trajectory traj;
+    BOOST_REQUIRE(traj.Open(fileName, NULL, 1));
+    // frame 0 twice, as openTrajectory and run 0 of a TDS simulation do
+    BOOST_REQUIRE(traj.Frame(0, atoms, Mm));
+    BOOST_REQUIRE(traj.Frame(0, again, Mm2));
+    BOOST_REQUIRE_EQUAL(atoms.size(), again.size());
+    BOOST_CHECK(memcmp(&atoms[0], &again[0], atoms.size()*sizeof(atom)) == 0);
+    for (n=1;n<3;n++) BOOST_REQUIRE(traj.Frame(n, atoms, Mm));
+  }
+  Trajectory text, binary;
+  BOOST_REQUIRE(text.Open(fileName, NULL, 0));
+  BOOST_REQUIRE(binary.Open(binaryName, NULL, 0));
+  BOOST_REQUIRE_EQUAL(binary.Frames(), 3);
+  for (n=0;n<3;n++) {
+    BOOST_REQUIRE(text.Read(n, atoms, Mm));
+    BOOST_REQUIRE(binary.Frame(n, again, Mm2));
+    BOOST_REQUIRE_EQUAL(atoms.size(), again.size());
+    BOOST_CHECK(memcmp(&atoms[0], &again[0], atoms.size()*sizeof(atom)) == 0);
+    BOOST_CHECK(memcmp(Mm, Mm2, sizeof(Mm)) == 0);
+  }
+
+  // frames can be appended
+  BOOST_REQUIRE(appendTrajectoryFrame(binaryName, atoms, Mm));
+  Trajectory appended;
+  BOOST_REQUIRE(appended.Open(binaryName, NULL, 0));
+  BOOST_CHECK_EQUAL(appended.Frames(), 4);
+  remove(fileName);
+  remove(binaryName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
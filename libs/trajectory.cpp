@@ -0,0 +1,600 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include "trajectory.h"
+#include "matrixlib.h"
+#include "fileio_fftw3.h"
+
+#define TRAJECTORY_MAGIC "QSTEMTR1"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_LAMMPS 1
+#define TRAJECTORY_XYZ    2
+#define TRAJECTORY_BINARY 3
+#define MAX_COLUMNS 64       /* columns of an atom line that are looked at */
+
+/* header of a binary trajectory, followed by the frames */
+typedef struct trajectoryHeaderStruct {
+	char magic[8];
+	int version;
+	int natom;
+	int frames;
+	int reserved;
+	double sourceSize;     // size and modification time of the text trajectory, 0 if none
+	double sourceTime;
+} trajectoryHeader;
+
+/* one atom of a binary frame, after the cell matrix */
+typedef struct trajectoryAtomStruct {
+	float x,y,z;
+	int Znum;
+} trajectoryAtom;
+
+static size_t frameBytes(int natom) {
+	return 9*sizeof(double)+(size_t)natom*sizeof(trajectoryAtom);
+}
+
+int isTrajectoryFile(const char *fileName) {
+	static const char *ext[] = {".lammpstrj",".dump",".xyz",".extxyz",".qtr"};
+	const char *e = strrchr(fileName,'.');
+	int i;
+
+	if (e == NULL) return 0;
+	for (i=0;i<5;i++) if (strcmp(e,ext[i]) == 0) return 1;
+	return 0;
+}
+
+static const char *endOfLine(const char *p, const char *end) {
+	const char *eol = (const char *)memchr(p,'\n',end-p);
+	return (eol == NULL) ? end : eol;
+}
+
+static const char *nextLine(const char *eol, const char *end) {
+	return (eol < end) ? eol+1 : end;
+}
+
+/* the starts of the (blank separated) columns of the line p .. eol,
+ * returns their number, at most maxCol */
+static int splitColumns(const char *p, const char *eol, const char **col, int maxCol) {
+	int n = 0;
+
+	while (n < maxCol) {
+		while ((p < eol) && isspace((unsigned char)*p)) p++;
+		if (p >= eol) break;
+		col[n++] = p;
+		while ((p < eol) && !isspace((unsigned char)*p)) p++;
+	}
+	return n;
+}
+
+/* 1 if the column at p is name */
+static int columnIs(const char *p, const char *eol, const char *name) {
+	size_t n = strlen(name);
+	return (p+n <= eol) && (strncmp(p,name,n) == 0) && ((p+n == eol) || isspace((unsigned char)p[n]));
+}
+
+/* atomic number of the element symbol (or atomic number) at p, 0 if unknown */
+static int elementZ(const char *p, const char *eol) {
+	char elem[4];
+	double v;
+
+	if (p >= eol) return 0;
+	if (isdigit((unsigned char)*p)) return parseNumber(p,eol,&v) ? (int)v : 0;
+	elem[0] = (char)toupper((unsigned char)p[0]);
+	elem[1] = ((p+1 < eol) && isalpha((unsigned char)p[1])) ? (char)tolower((unsigned char)p[1]) : '\0';
+	elem[2] = '\0';
+	return getZNumber(elem);
+}
+
+/* moves the atoms (cartesian relative to origin, or fractional if scaled)
+ * into the cell Mm, in cartesian coordinates */
+static void wrapAtoms(std::vector<atom> &atoms, const double Mm[9], const double origin[3], int scaled) {
+	double MmInv[9],r[3],f[3];
+	size_t i;
+	int j;
+
+	inverse_3x3(MmInv,Mm);
+	for (i=0;i<atoms.size();i++) {
+		r[0] = atoms[i].x;  r[1] = atoms[i].y;  r[2] = atoms[i].z;
+		for (j=0;j<3;j++) {
+			f[j] = scaled ? r[j] : (r[0]-origin[0])*MmInv[j]+(r[1]-origin[1])*MmInv[3+j]+(r[2]-origin[2])*MmInv[6+j];
+			f[j] -= floor(f[j]);
+		}
+		atoms[i].x = (float)(f[0]*Mm[0]+f[1]*Mm[3]+f[2]*Mm[6]);
+		atoms[i].y = (float)(f[0]*Mm[1]+f[1]*Mm[4]+f[2]*Mm[7]);
+		atoms[i].z = (float)(f[0]*Mm[2]+f[1]*Mm[5]+f[2]*Mm[8]);
+	}
+}
+
+static void setAtom(atom *a, const double r[3], int Znum) {
+	a->x = (float)r[0];  a->y = (float)r[1];  a->z = (float)r[2];
+	a->dw = 0;           // the thermal motion is in the positions
+	a->occ = 1;
+	a->q = 0;
+	a->Znum = Znum;
+}
+
+/* checks the header of a binary trajectory and the size of the file */
+static int binaryHeader(const mappedFile *file, trajectoryHeader *header) {
+	if (file->size < sizeof(trajectoryHeader)) return 0;
+	memcpy(header,file->data,sizeof(trajectoryHeader));
+	return (memcmp(header->magic,TRAJECTORY_MAGIC,8) == 0) && (header->version == TRAJECTORY_VERSION) &&
+		(header->natom > 0) && (header->frames >= 0) &&
+		(file->size == sizeof(trajectoryHeader)+(size_t)header->frames*frameBytes(header->natom));
+}
+
+static int writeFrame(FILE *fp, const std::vector<atom> &atoms, const double Mm[9]) {
+	std::vector<trajectoryAtom> buf(atoms.size());
+	size_t i;
+
+	for (i=0;i<atoms.size();i++) {
+		buf[i].x = atoms[i].x;  buf[i].y = atoms[i].y;  buf[i].z = atoms[i].z;
+		buf[i].Znum = atoms[i].Znum;
+	}
+	return (fwrite(Mm,sizeof(double),9,fp) == 9) &&
+		(buf.empty() || (fwrite(&buf[0],sizeof(trajectoryAtom),buf.size(),fp) == buf.size()));
+}
+
+Trajectory::Trajectory() :
+	m_format(0),
+	m_busy(0),
+	m_nextFrame(-1),
+	m_nextOk(0),
+	m_frame(-1),
+	m_cache(NULL),
+	m_cached(0)
+{
+	m_file.data = NULL;
+	m_file.size = 0;
+	m_file.handle = NULL;
+	m_cacheName[0] = '\0';
+}
+
+Trajectory::~Trajectory() {
+	char tmpName[1050];
+
+	Wait();
+	// an incomplete conversion is dropped
+	if (m_cache != NULL) {
+		fclose(m_cache);
+		sprintf(tmpName,"%s.tmp",m_cacheName);
+		remove(tmpName);
+	}
+	unmapFile(&m_file);
+}
+
+int Trajectory::Open(const char *fileName, const char *types, int cache) {
+	trajectoryHeader header;
+	const char *p,*end,*col[MAX_COLUMNS];
+	const char *ext = strrchr(fileName,'.');
+	char tmpName[1050];
+	double size,time;
+	int i,n,Z,binary = (ext != NULL) && (strcmp(ext,".qtr") == 0);
+
+	m_typeZ.clear();
+	if (types != NULL) {
+		end = types+strlen(types);
+		n = splitColumns(types,end,col,MAX_COLUMNS);
+		for (i=0;i<n;i++) {
+			if ((Z = elementZ(col[i],end)) == 0) {
+				printf("Trajectory: unknown element %.2s of type %d\n",col[i],i+1);
+				return 0;
+			}
+			m_typeZ.push_back(Z);
+		}
+	}
+	m_offsets.clear();
+	m_counts.clear();
+
+	// a binary copy of a text trajectory that has not changed since
+	sprintf(m_cacheName,"%s.qtr",fileName);
+	if ((cache) && (!binary) && fileStamp(fileName,&size,&time) && mapFile(m_cacheName,&m_file)) {
+		if (binaryHeader(&m_file,&header) && (header.sourceSize == size) && (header.sourceTime == time)) {
+			m_format = TRAJECTORY_BINARY;
+			for (i=0;i<header.frames;i++) {
+				m_offsets.push_back(sizeof(header)+(size_t)i*frameBytes(header.natom));
+				m_counts.push_back(header.natom);
+			}
+			return 1;
+		}
+		unmapFile(&m_file);
+	}
+
+	if (!mapFile(fileName,&m_file)) {
+		printf("Could not open trajectory %s\n",fileName);
+		return 0;
+	}
+	if (binary) {
+		if (!binaryHeader(&m_file,&header)) {
+			printf("%s is not a binary trajectory (or is incomplete)\n",fileName);
+			return 0;
+		}
+		m_format = TRAJECTORY_BINARY;
+		for (i=0;i<header.frames;i++) {
+			m_offsets.push_back(sizeof(header)+(size_t)i*frameBytes(header.natom));
+			m_counts.push_back(header.natom);
+		}
+		return 1;
+	}
+
+	end = m_file.data+m_file.size;
+	for (p=m_file.data;(p < end) && isspace((unsigned char)*p);p++);
+	if ((p+5 <= end) && (strncmp(p,"ITEM:",5) == 0)) m_format = TRAJECTORY_LAMMPS;
+	else if ((p < end) && isdigit((unsigned char)*p)) m_format = TRAJECTORY_XYZ;
+	else {
+		printf("%s is neither a LAMMPS dump nor an extended XYZ file\n",fileName);
+		return 0;
+	}
+	if (!IndexText()) return 0;
+	if (m_counts.empty()) {
+		printf("No complete frame in trajectory %s\n",fileName);
+		return 0;
+	}
+
+	// convert to <file>.qtr while the frames are read, if they are all of the same size
+	for (i=1;(i < Frames()) && (m_counts[i] == m_counts[0]);i++);
+	if ((cache) && (i == Frames())) {
+		memset(&header,0,sizeof(header));
+		memcpy(header.magic,TRAJECTORY_MAGIC,8);
+		header.version = TRAJECTORY_VERSION;
+		header.natom = m_counts[0];
+		header.frames = Frames();
+		sprintf(tmpName,"%s.tmp",m_cacheName);
+		if (fileStamp(fileName,&header.sourceSize,&header.sourceTime) &&
+			((m_cache = fopen(tmpName,"wb")) != NULL) &&
+			(fwrite(&header,sizeof(header),1,m_cache) != 1)) {
+			fclose(m_cache);
+			m_cache = NULL;
+			remove(tmpName);
+		}
+	}
+	return 1;
+}
+
+/* finds the start and the number of atoms of every frame */
+int Trajectory::IndexText() {
+	const char *end = m_file.data+m_file.size,*p,*s,*eol;
+	int i,header,natom;
+	double v;
+
+	for (p=m_file.data;p<end;) {
+		// blank lines between frames
+		eol = endOfLine(p,end);
+		for (s=p;(s < eol) && isspace((unsigned char)*s);s++);
+		if (s == eol) {
+			p = nextLine(eol,end);
+			continue;
+		}
+		m_offsets.push_back(p-m_file.data);
+		if (m_format == TRAJECTORY_LAMMPS) {
+			// ITEM: TIMESTEP, step, ITEM: NUMBER OF ATOMS, natom,
+			// ITEM: BOX BOUNDS and 3 lines, ITEM: ATOMS, natom lines
+			if (strncmp(s,"ITEM: TIMESTEP",14) != 0) {
+				printf("Trajectory: frame %d does not start with ITEM: TIMESTEP\n",(int)m_offsets.size()-1);
+				return 0;
+			}
+			for (i=0;i<3;i++) s = nextLine(endOfLine(s,end),end);
+			header = 9;
+		}
+		else header = 2;     // natom, comment, natom lines
+		if (!parseNumber(s,endOfLine(s,end),&v) || (v < 0)) {
+			printf("Trajectory: no number of atoms in frame %d\n",(int)m_offsets.size()-1);
+			return 0;
+		}
+		natom = (int)v;
+		for (i=0;(i < header+natom) && (p < end);i++) p = nextLine(endOfLine(p,end),end);
+		if (i < header+natom) {
+			// the simulation may still be writing it
+			printf("Trajectory: the last frame (%d) is incomplete and is not used\n",(int)m_offsets.size()-1);
+			m_offsets.pop_back();
+			break;
+		}
+		m_counts.push_back(natom);
+	}
+	return 1;
+}
+
+int Trajectory::Read(int n, std::vector<atom> &atoms, double Mm[9]) const {
+	const char *f;
+	const trajectoryAtom *a;
+	double r[3];
+	int i;
+
+	if ((n < 0) || (n >= Frames())) {
+		printf("Trajectory: there is no frame %d (%d frames)\n",n,Frames());
+		return 0;
+	}
+	if (m_format == TRAJECTORY_LAMMPS) return ReadLAMMPS(n,atoms,Mm);
+	if (m_format == TRAJECTORY_XYZ) return ReadXYZ(n,atoms,Mm);
+
+	f = m_file.data+m_offsets[n];
+	a = (const trajectoryAtom *)(f+9*sizeof(double));
+	memcpy(Mm,f,9*sizeof(double));
+	atoms.resize(m_counts[n]);
+	for (i=0;i<m_counts[n];i++) {
+		r[0] = a[i].x;  r[1] = a[i].y;  r[2] = a[i].z;
+		setAtom(&atoms[i],r,a[i].Znum);
+	}
+	return 1;
+}
+
+int Trajectory::ReadLAMMPS(int n, std::vector<atom> &atoms, double Mm[9]) const {
+	const char *end = m_file.data+m_file.size,*p = m_file.data+m_offsets[n],*eol,*s,*col[MAX_COLUMNS];
+	double lo[3],hi[3],tilt[3] = {0,0,0},v[3],r[3],lmin,lmax;
+	int natom = m_counts[n],pos[3] = {-1,-1,-1},eCol = -1,tCol = -1,maxCol = 0,scaled = 0,triclinic = 0;
+	int i,j,k,nCol,Z;
+	static const char *names[3][3] = {{"x","xu","xs"},{"y","yu","ys"},{"z","zu","zs"}};
+
+	for (i=0;i<4;i++) p = nextLine(endOfLine(p,end),end);
+	// ITEM: BOX BOUNDS [xy xz yz] pp pp pp
+	eol = endOfLine(p,end);
+	nCol = splitColumns(p,eol,col,MAX_COLUMNS);
+	for (k=0;k<nCol;k++) if (columnIs(col[k],eol,"xy")) triclinic = 1;
+	p = nextLine(eol,end);
+	for (j=0;j<3;j++,p=nextLine(eol,end)) {
+		eol = endOfLine(p,end);
+		for (k=0;(k < 3) && parseNumber(p,eol,&v[k]);k++);
+		if (k < 2+triclinic) {
+			printf("Trajectory: bad box bounds in frame %d\n",n);
+			return 0;
+		}
+		lo[j] = v[0];  hi[j] = v[1];
+		if (triclinic) tilt[j] = v[2];
+	}
+	// tilt = xy, xz, yz: the bounds are those of the tilted box
+	if (triclinic) {
+		lmin = lmax = 0;
+		for (k=0;k<3;k++) {
+			v[0] = (k == 0) ? tilt[0] : ((k == 1) ? tilt[1] : tilt[0]+tilt[1]);
+			if (v[0] < lmin) lmin = v[0];
+			if (v[0] > lmax) lmax = v[0];
+		}
+		lo[0] -= lmin;  hi[0] -= lmax;
+		lo[1] -= (tilt[2] < 0) ? tilt[2] : 0;
+		hi[1] -= (tilt[2] > 0) ? tilt[2] : 0;
+	}
+	memset(Mm,0,9*sizeof(double));
+	Mm[0] = hi[0]-lo[0];
+	Mm[3] = tilt[0];  Mm[4] = hi[1]-lo[1];
+	Mm[6] = tilt[1];  Mm[7] = tilt[2];  Mm[8] = hi[2]-lo[2];
+
+	// ITEM: ATOMS and the names of the columns
+	eol = endOfLine(p,end);
+	nCol = splitColumns(p,eol,col,MAX_COLUMNS);
+	for (k=2;k<nCol;k++) {
+		for (j=0;j<3;j++) for (i=0;i<3;i++) {
+			if (columnIs(col[k],eol,names[j][i])) {
+				pos[j] = k-2;
+				if (j == 0) scaled = (i == 2);
+			}
+		}
+		if (columnIs(col[k],eol,"element")) eCol = k-2;
+		if (columnIs(col[k],eol,"type")) tCol = k-2;
+	}
+	if ((pos[0] < 0) || (pos[1] < 0) || (pos[2] < 0)) {
+		printf("Trajectory: frame %d has no positions (columns x y z, xu yu zu or xs ys zs)\n",n);
+		return 0;
+	}
+	if ((eCol < 0) && ((tCol < 0) || m_typeZ.empty())) {
+		printf("Trajectory: frame %d has no column element, please give the elements of the types (trajectory types:)\n",n);
+		return 0;
+	}
+	for (j=0;j<3;j++) if (pos[j] > maxCol) maxCol = pos[j];
+	if (eCol > maxCol) maxCol = eCol;
+	if ((eCol < 0) && (tCol > maxCol)) maxCol = tCol;
+
+	p = nextLine(eol,end);
+	atoms.resize(natom);
+	for (i=0;i<natom;i++,p=nextLine(eol,end)) {
+		eol = endOfLine(p,end);
+		if (splitColumns(p,eol,col,maxCol+1) <= maxCol) {
+			printf("Trajectory: incomplete atom line in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+			return 0;
+		}
+		for (j=0;j<3;j++) {
+			s = col[pos[j]];
+			if (!parseNumber(s,eol,&r[j])) {
+				printf("Trajectory: bad position in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+				return 0;
+			}
+		}
+		if (eCol >= 0) Z = elementZ(col[eCol],eol);
+		else {
+			s = col[tCol];
+			Z = (parseNumber(s,eol,&v[0]) && (v[0] >= 1) && (v[0] <= (double)m_typeZ.size())) ? m_typeZ[(int)v[0]-1] : 0;
+		}
+		if (Z == 0) {
+			printf("Trajectory: unknown element in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+			return 0;
+		}
+		setAtom(&atoms[i],r,Z);
+	}
+	wrapAtoms(atoms,Mm,lo,scaled);
+	return 1;
+}
+
+int Trajectory::ReadXYZ(int n, std::vector<atom> &atoms, double Mm[9]) const {
+	const char *end = m_file.data+m_file.size,*p = m_file.data+m_offsets[n],*eol,*s,*t,*col[MAX_COLUMNS];
+	double r[3],origin[3] = {0,0,0},v;
+	int natom = m_counts[n],eCol = 0,xCol = 1,column = 0,maxCol,count,i,j,k,Z,found = 0;
+
+	// comment line: Lattice="ax ay az bx by bz cx cy cz" Properties=species:S:1:pos:R:3 ...
+	p = nextLine(endOfLine(p,end),end);
+	eol = endOfLine(p,end);
+	for (s=p;s+9<=eol;s++) {
+		if (strncmp(s,"Lattice=\"",9) == 0) {
+			t = s+9;
+			for (k=0;(k < 9) && parseNumber(t,eol,&Mm[k]);k++);
+			found = (k == 9);
+		}
+		if (strncmp(s,"Properties=",11) == 0) {
+			eCol = xCol = -1;
+			// name:type:count triples, up to the next blank
+			for (t=s+11;(t < eol) && !isspace((unsigned char)*t);) {
+				s = t;
+				while ((t < eol) && (*t != ':') && !isspace((unsigned char)*t)) t++;
+				if ((t-s == 7) && (strncmp(s,"species",7) == 0)) eCol = column;
+				if ((t-s == 1) && (*s == 'Z')) eCol = column;
+				if ((t-s == 3) && (strncmp(s,"pos",3) == 0)) xCol = column;
+				for (k=0;(k < 2) && (t < eol) && (*t == ':');k++) {
+					s = ++t;
+					while ((t < eol) && (*t != ':') && !isspace((unsigned char)*t)) t++;
+				}
+				count = (int)strtol(s,NULL,10);
+				column += (count > 0) ? count : 1;
+				if ((t < eol) && (*t == ':')) t++;
+			}
+			s = t-1;
+		}
+	}
+	if (!found) {
+		printf("Trajectory: frame %d has no Lattice=\"...\" in its comment line\n",n);
+		return 0;
+	}
+	if ((eCol < 0) || (xCol < 0)) {
+		printf("Trajectory: frame %d has no species or pos in its Properties\n",n);
+		return 0;
+	}
+	maxCol = (xCol+2 > eCol) ? xCol+2 : eCol;
+
+	p = nextLine(eol,end);
+	atoms.resize(natom);
+	for (i=0;i<natom;i++,p=nextLine(eol,end)) {
+		eol = endOfLine(p,end);
+		if (splitColumns(p,eol,col,maxCol+1) <= maxCol) {
+			printf("Trajectory: incomplete atom line in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+			return 0;
+		}
+		for (j=0;j<3;j++) {
+			s = col[xCol+j];
+			if (!parseNumber(s,eol,&v)) {
+				printf("Trajectory: bad position in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+				return 0;
+			}
+			r[j] = v;
+		}
+		if ((Z = elementZ(col[eCol],eol)) == 0) {
+			printf("Trajectory: unknown element in frame %d: >%.*s<\n",n,(int)(eol-p),p);
+			return 0;
+		}
+		setAtom(&atoms[i],r,Z);
+	}
+	wrapAtoms(atoms,Mm,origin,0);
+	return 1;
+}
+
+void *Trajectory::ReadAhead(void *arg) {
+	Trajectory *t = (Trajectory *)arg;
+	t->m_nextOk = t->Read(t->m_nextFrame,t->m_next,t->m_nextMm);
+	return NULL;
+}
+
+void Trajectory::Wait() {
+	if (!m_busy) return;
+#ifndef _WIN32
+	pthread_join(m_reader,NULL);
+#endif
+	m_busy = 0;
+}
+
+int Trajectory::Frame(int n, std::vector<atom> &atoms, double Mm[9]) {
+	int ok = -1;
+
+	// the same frame again (e.g. run 0 after openTrajectory): the next one is already read ahead
+	if (n == m_frame) {
+		atoms = m_frameAtoms;
+		memcpy(Mm,m_frameMm,9*sizeof(double));
+		return 1;
+	}
+	if (m_busy) {
+		Wait();
+		if (m_nextFrame == n) {
+			atoms.swap(m_next);
+			memcpy(Mm,m_nextMm,9*sizeof(double));
+			ok = m_nextOk;
+		}
+	}
+	if (ok < 0) ok = Read(n,atoms,Mm);
+	m_frame = ok ? n : -1;
+	if (ok) {
+		m_frameAtoms = atoms;
+		memcpy(m_frameMm,Mm,9*sizeof(double));
+		Convert(n,atoms,Mm);
+	}
+#ifndef _WIN32
+	// no threads on Windows: the next frame is read when it is needed
+	if ((ok) && (n+1 < Frames())) {
+		m_nextFrame = n+1;
+		m_busy = (pthread_create(&m_reader,NULL,ReadAhead,this) == 0);
+	}
+#endif
+	return ok;
+}
+
+/* appends frame n to the binary copy, if the frames are read in order,
+ * frames that are already in it are skipped */
+void Trajectory::Convert(int n, const std::vector<atom> &atoms, const double Mm[9]) {
+	char tmpName[1050];
+	int ok;
+
+	if ((m_cache == NULL) || (n < m_cached)) return;
+	sprintf(tmpName,"%s.tmp",m_cacheName);
+	ok = (n == m_cached) && writeFrame(m_cache,atoms,Mm);
+	if ((ok) && (++m_cached < Frames())) return;
+	if (fclose(m_cache) != 0) ok = 0;
+	m_cache = NULL;
+	if (ok) {
+		remove(m_cacheName);
+		ok = (rename(tmpName,m_cacheName) == 0);
+	}
+	if (!ok) remove(tmpName);
+}
+
+int appendTrajectoryFrame(const char *fileName, const std::vector<atom> &atoms, const double Mm[9]) {
+	trajectoryHeader header;
+	FILE *fp;
+	int ok;
+
+	if ((fp = fopen(fileName,"r+b")) != NULL) {
+		if ((fread(&header,sizeof(header),1,fp) != 1) || (memcmp(header.magic,TRAJECTORY_MAGIC,8) != 0) ||
+			(header.version != TRAJECTORY_VERSION) || (header.natom != (int)atoms.size())) {
+			printf("appendTrajectoryFrame: %s is not a trajectory of %d atoms\n",fileName,(int)atoms.size());
+			fclose(fp);
+			return 0;
+		}
+	}
+	else {
+		if ((atoms.empty()) || ((fp = fopen(fileName,"w+b")) == NULL)) return 0;
+		memset(&header,0,sizeof(header));
+		memcpy(header.magic,TRAJECTORY_MAGIC,8);
+		header.version = TRAJECTORY_VERSION;
+		header.natom = (int)atoms.size();
+	}
+	ok = (fseek(fp,0,SEEK_END) == 0) && writeFrame(fp,atoms,Mm);
+	if (ok) {
+		header.frames++;
+		ok = (fseek(fp,0,SEEK_SET) == 0) && (fwrite(&header,sizeof(header),1,fp) == 1);
+	}
+	if (fclose(fp) != 0) ok = 0;
+	return ok;
+}
@@ -0,0 +1,125 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include "stemtypes_fftw3.h"
+#include "atom_file.h"
+
+/**************************************************************
+ * Molecular dynamics trajectories as TDS configurations.
+ *
+ * If the structure file is a trajectory (isTrajectoryFile()),
+ * frame n is the configuration of run avgCount = n, instead of
+ * displacing one structure.  Three formats are read:
+ *
+ * - LAMMPS dump files (ITEM: TIMESTEP ...), orthogonal or
+ *   triclinic, with the positions in the columns x y z, xu yu zu
+ *   or xs ys zs, and the element in column element, or the type
+ *   in column type and the elements of the types given to Open()
+ *   ("trajectory types: Si O"),
+ * - extended XYZ files, with the cell in Lattice="..." and the
+ *   columns in Properties=species:S:1:pos:R:3:... of the comment
+ *   line (species and pos are the first columns by default),
+ * - binary trajectories (.qtr): magic "QSTEMTR1", version, the
+ *   number of atoms and frames, the size and modification time of
+ *   the text trajectory it was converted from (0 if none), then
+ *   per frame the cell matrix (double[9]) and x,y,z (float) and
+ *   Znum (int) of every atom.
+ *
+ * Atoms are returned in cartesian coordinates (A), wrapped into
+ * the cell, with Mm[0..2] = a, Mm[3..5] = b, Mm[6..8] = c.
+ * Frame(n) starts reading frame n+1 in a background thread (as
+ * the checkpoint writer does), so that the next configuration is
+ * parsed while the current one is simulated.  Asking for the frame
+ * returned last again gives a copy of it.  A text trajectory
+ * whose frames are all read in order is converted to <file>.qtr
+ * on the way if cache is set in Open(); as long as the text file
+ * does not change, later runs map the binary file instead.
+ *
+ * Trajectory traj;
+ * if (traj.Open(fileName,"Si O",1)) {
+ *   for (n=0;n<traj.Frames();n++) traj.Frame(n,atoms,Mm);
+ * }
+ **************************************************************/
+
+/* 1 if fileName ends in .lammpstrj, .dump, .xyz, .extxyz or .qtr */
+int isTrajectoryFile(const char *fileName);
+
+class Trajectory {
+	mappedFile m_file;
+	int m_format;
+	std::vector<size_t> m_offsets;     // start of every frame in m_file
+	std::vector<int> m_counts;         // atoms of every frame
+	std::vector<int> m_typeZ;          // Z of LAMMPS type t+1
+
+	/* read ahead */
+	int m_busy;
+	int m_nextFrame,m_nextOk;
+	std::vector<atom> m_next;
+	double m_nextMm[9];
+	/* the frame returned last */
+	int m_frame;
+	std::vector<atom> m_frameAtoms;
+	double m_frameMm[9];
+#ifndef _WIN32
+	pthread_t m_reader;
+#endif
+
+	/* conversion to <file>.qtr */
+	FILE *m_cache;
+	int m_cached;
+	char m_cacheName[1040];
+
+	Trajectory(const Trajectory &);
+	Trajectory &operator=(const Trajectory &);
+
+	int IndexText();
+	int ReadLAMMPS(int n, std::vector<atom> &atoms, double Mm[9]) const;
+	int ReadXYZ(int n, std::vector<atom> &atoms, double Mm[9]) const;
+	void Wait();
+	void Convert(int n, const std::vector<atom> &atoms, const double Mm[9]);
+	static void *ReadAhead(void *arg);
+public:
+	Trajectory();
+	~Trajectory();
+
+	/* types: elements of the LAMMPS types 1, 2, ... (may be NULL),
+	 * returns 0 on error */
+	int Open(const char *fileName, const char *types, int cache);
+	int Frames() const { return (int)m_counts.size(); }
+	/* frame n, returns 0 on error */
+	int Read(int n, std::vector<atom> &atoms, double Mm[9]) const;
+	/* as Read(), reads frame n+1 ahead */
+	int Frame(int n, std::vector<atom> &atoms, double Mm[9]);
+};
+
+/* appends a frame to the binary trajectory fileName (created if it does
+ * not exist, all frames must have the same number of atoms), returns 0
+ * on error */
+int appendTrajectoryFrame(const char *fileName, const std::vector<atom> &atoms, const double Mm[9]);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Python.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "data_containers.h"
+#include "fileio_fftw3.h"
+#include "simulation.h"
+
+/**************************************************************
+ * Python module pyqstem: the simulation engine without the
+ * round trip through .cfg, .dat and .img files.
+ *
+ * import numpy as np, pyqstem
+ * sim = pyqstem.Simulation("stem.dat",keep_patterns=1)
+ * sim.set("df0",-200.0)
+ * sim.run()
+ * images = sim.detector_images()   # [thickness]{detector name: image}
+ * patterns = np.asarray(sim.patterns())  # (scanXN,scanYN,nx,ny)
+ *
+ * Arrays are returned as pyqstem.Array objects, which export the
+ * engine's memory through the buffer protocol, so numpy.asarray()
+ * does not copy them.  An Array keeps its simulation alive; it is
+ * valid until the engine reallocates the data (set_atoms() for
+ * atoms(), a run with a different scan size for patterns()).
+ * The GIL is released while a simulation reads its parameters or
+ * runs, so simulations in different Python threads run at the same
+ * time (see simulation.h).  Fatal errors of the engine still end
+ * the process.
+ * python/engine.py wraps this in numpy arrays.
+ **************************************************************/
+
+#if PY_MAJOR_VERSION >= 3
+#define ARRAY_TPFLAGS Py_TPFLAGS_DEFAULT
+#else
+#define ARRAY_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#endif
+
+#define ARRAY_MAXDIM 4
+
+/* the format of atom (stemtypes_fftw3.h) for the buffer protocol */
+#define ATOM_FORMAT "T{f:z:f:y:f:x:f:dw:f:occ:f:q:i:Znum:}"
+#define FLOAT_TT_FORMAT ((sizeof(float_tt) == sizeof(float)) ? "f" : "d")
+
+typedef struct {
+	PyObject_HEAD
+	MULS *muls;
+	int running;
+} simulationObject;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *owner;               // the simulation the data belongs to
+	void *data;
+	const char *format;
+	Py_ssize_t itemsize;
+	int ndim;
+	Py_ssize_t shape[ARRAY_MAXDIM];
+	Py_ssize_t strides[ARRAY_MAXDIM];
+} arrayObject;
+
+static PyTypeObject simulationType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject arrayType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyBufferProcs arrayBufferProcs;
+
+/* a new Array of ndim dimensions (shape), sharing data with simulation owner */
+static PyObject *newArray(PyObject *owner, void *data, const char *format, Py_ssize_t itemsize,
+						  int ndim, const Py_ssize_t *shape) {
+	arrayObject *a;
+	int i;
+
+	a = PyObject_New(arrayObject,&arrayType);
+	if (a == NULL) return NULL;
+	Py_INCREF(owner);
+	a->owner = owner;
+	a->data = data;
+	a->format = format;
+	a->itemsize = itemsize;
+	a->ndim = ndim;
+	for (i=ndim-1;i>=0;i--) {
+		a->shape[i] = shape[i];
+		a->strides[i] = (i == ndim-1) ? itemsize : a->strides[i+1]*shape[i+1];
+	}
+	return (PyObject *)a;
+}
+
+/************************************************************************
+ * pyqstem.Array
+ ***********************************************************************/
+
+static void array_dealloc(arrayObject *self) {
+	Py_XDECREF(self->owner);
+	PyObject_Del(self);
+}
+
+static int array_getbuffer(arrayObject *self, Py_buffer *view, int flags) {
+	static char empty[1];
+	int i;
+
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->buf = (self->data != NULL) ? self->data : empty;
+	view->len = self->itemsize;
+	for (i=0;i<self->ndim;i++) view->len *= self->shape[i];
+	view->readonly = 0;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+	view->ndim = self->ndim;
+	view->shape = ((flags & PyBUF_ND) == PyBUF_ND) ? self->shape : NULL;
+	view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+/************************************************************************
+ * pyqstem.Simulation
+ ***********************************************************************/
+
+static int simulation_init(simulationObject *self, PyObject *args, PyObject *kwds) {
+	static char *kwlist[] = {(char *)"parameter_file",(char *)"keep_patterns",NULL};
+	const char *fileName;
+	int keepPatterns = 0,ok;
+
+	if (!PyArg_ParseTupleAndKeywords(args,kwds,"s|i",kwlist,&fileName,&keepPatterns)) return -1;
+	if (self->muls != NULL) {
+		PyErr_SetString(PyExc_RuntimeError,"the simulation has already been initialized");
+		return -1;
+	}
+	self->muls = new MULS();
+	self->muls->keepPatterns = keepPatterns;
+	Py_BEGIN_ALLOW_THREADS
+	ok = readParameterFile(*self->muls,fileName);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_Format(PyExc_IOError,"could not open parameter file %s",fileName);
+		return -1;
+	}
+	return 0;
+}
+
+static void simulation_dealloc(simulationObject *self) {
+	delete self->muls;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* checks that the simulation can be used (initialized and not running) */
+static MULS *simulationMuls(simulationObject *self) {
+	if (self->muls == NULL) {
+		PyErr_SetString(PyExc_RuntimeError,"the simulation has not been initialized");
+		return NULL;
+	}
+	if (self->running) {
+		PyErr_SetString(PyExc_RuntimeError,"the simulation is running");
+		return NULL;
+	}
+	return self->muls;
+}
+
+static PyObject *simulation_run(simulationObject *self) {
+	MULS *muls = simulationMuls(self);
+
+	if (muls == NULL) return NULL;
+	self->running = 1;
+	Py_BEGIN_ALLOW_THREADS
+	runSimulation(*muls);
+	Py_END_ALLOW_THREADS
+	self->running = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject *simulation_get(simulationObject *self, PyObject *args) {
+	const char *name;
+	double value;
+	MULS *muls = simulationMuls(self);
+
+	if ((muls == NULL) || !PyArg_ParseTuple(args,"s",&name)) return NULL;
+	if (!getSimulationParameter(*muls,name,&value)) {
+		PyErr_Format(PyExc_KeyError,"unknown parameter %s",name);
+		return NULL;
+	}
+	return PyFloat_FromDouble(value);
+}
+
+static PyObject *simulation_set(simulationObject *self, PyObject *args) {
+	const char *name;
+	double value;
+	MULS *muls = simulationMuls(self);
+
+	if ((muls == NULL) || !PyArg_ParseTuple(args,"sd",&name,&value)) return NULL;
+	switch (setSimulationParameter(*muls,name,value)) {
+		case 0:
+			PyErr_Format(PyExc_KeyError,"unknown parameter %s",name);
+			return NULL;
+		case -1:
+			PyErr_Format(PyExc_ValueError,"%s is fixed by the parameter file",name);
+			return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/* set_atoms(atoms): atoms is a contiguous buffer of atom structs, e.g. a
+ * numpy array of engine.atom_dtype, in cartesian coordinates of the super cell */
+static PyObject *simulation_set_atoms(simulationObject *self, PyObject *args) {
+	PyObject *obj;
+	Py_buffer view;
+	MULS *muls = simulationMuls(self);
+
+	if ((muls == NULL) || !PyArg_ParseTuple(args,"O",&obj)) return NULL;
+	if (PyObject_GetBuffer(obj,&view,PyBUF_C_CONTIGUOUS) != 0) return NULL;
+	if ((view.itemsize != (Py_ssize_t)sizeof(atom)) || (view.len % sizeof(atom) != 0)) {
+		PyErr_Format(PyExc_ValueError,"atoms must be an array of %d byte records (engine.atom_dtype)",
+			(int)sizeof(atom));
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+	setInputAtoms(muls,(const atom *)view.buf,(int)(view.len/sizeof(atom)));
+	PyBuffer_Release(&view);
+	Py_RETURN_NONE;
+}
+
+static PyObject *simulation_atoms(simulationObject *self) {
+	Py_ssize_t shape[1];
+	MULS *muls = simulationMuls(self);
+
+	if (muls == NULL) return NULL;
+	shape[0] = (muls->atoms != NULL) ? muls->natom : 0;
+	return newArray((PyObject *)self,muls->atoms,ATOM_FORMAT,sizeof(atom),1,shape);
+}
+
+static PyObject *simulation_trans(simulationObject *self) {
+	Py_ssize_t shape[3];
+	MULS *muls = simulationMuls(self);
+
+	if (muls == NULL) return NULL;
+	shape[0] = muls->trans.Nz();
+	shape[1] = muls->trans.Nx();
+	shape[2] = muls->trans.Ny();
+	return newArray((PyObject *)self,muls->trans.Data(),"Zf",sizeof(fftwf_complex),3,shape);
+}
+
+static PyObject *simulation_detector_images(simulationObject *self) {
+	Py_ssize_t shape[2];
+	PyObject *list,*dict,*image;
+	size_t it;
+	int i;
+	MULS *muls = simulationMuls(self);
+
+	if (muls == NULL) return NULL;
+	if ((list = PyList_New(0)) == NULL) return NULL;
+	for (it=0;it<muls->detectors.size();it++) {
+		if ((dict = PyDict_New()) == NULL) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		for (i=0;i<(int)muls->detectors[it].size();i++) {
+			Detector &det = *muls->detectors[it][i];
+			shape[0] = det.image.Nx();
+			shape[1] = det.image.Ny();
+			image = newArray((PyObject *)self,det.image.Data(),FLOAT_TT_FORMAT,sizeof(float_tt),2,shape);
+			if ((image == NULL) || (PyDict_SetItemString(dict,det.name,image) != 0)) {
+				Py_XDECREF(image);
+				Py_DECREF(dict);
+				Py_DECREF(list);
+				return NULL;
+			}
+			Py_DECREF(image);
+		}
+		if (PyList_Append(list,dict) != 0) {
+			Py_DECREF(dict);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(dict);
+	}
+	return list;
+}
+
+static PyObject *simulation_patterns(simulationObject *self) {
+	Py_ssize_t shape[4];
+	MULS *muls = simulationMuls(self);
+
+	if (muls == NULL) return NULL;
+	if (muls->patterns.Empty()) {
+		PyErr_SetString(PyExc_RuntimeError,"no diffraction patterns: use keep_patterns=1 and run a STEM simulation");
+		return NULL;
+	}
+	shape[0] = muls->scanXN;
+	shape[1] = muls->scanYN;
+	shape[2] = muls->patterns.Nx();
+	shape[3] = muls->patterns.Ny();
+	return newArray((PyObject *)self,muls->patterns.Data(),FLOAT_TT_FORMAT,sizeof(float_tt),4,shape);
+}
+
+static PyMethodDef simulationMethods[] = {
+	{"run",(PyCFunction)simulation_run,METH_NOARGS,"run() does the simulation (the GIL is released)"},
+	{"get",(PyCFunction)simulation_get,METH_VARARGS,"get(name) returns a parameter"},
+	{"set",(PyCFunction)simulation_set,METH_VARARGS,"set(name,value) changes a parameter for the next run"},
+	{"set_atoms",(PyCFunction)simulation_set_atoms,METH_VARARGS,
+		"set_atoms(atoms) uses atoms (cartesian, super cell) instead of the structure file"},
+	{"atoms",(PyCFunction)simulation_atoms,METH_NOARGS,"atoms() returns the atoms of the current configuration"},
+	{"trans",(PyCFunction)simulation_trans,METH_NOARGS,"trans() returns the transmission functions [slice][x][y]"},
+	{"detector_images",(PyCFunction)simulation_detector_images,METH_NOARGS,
+		"detector_images() returns a dict of STEM images for every output thickness"},
+	{"patterns",(PyCFunction)simulation_patterns,METH_NOARGS,
+		"patterns() returns the diffraction pattern of every scan pixel [ix][iy][kx][ky]"},
+	{NULL,NULL,0,NULL}
+};
+
+/************************************************************************
+ * module
+ ***********************************************************************/
+
+static PyMethodDef moduleMethods[] = {
+	{NULL,NULL,0,NULL}
+};
+
+static PyObject *initModule() {
+	PyObject *m;
+
+	arrayBufferProcs.bf_getbuffer = (getbufferproc)array_getbuffer;
+	arrayType.tp_name = "pyqstem.Array";
+	arrayType.tp_basicsize = sizeof(arrayObject);
+	arrayType.tp_dealloc = (destructor)array_dealloc;
+	arrayType.tp_as_buffer = &arrayBufferProcs;
+	arrayType.tp_flags = ARRAY_TPFLAGS;
+	arrayType.tp_doc = "memory of the simulation engine, use numpy.asarray()";
+	if (PyType_Ready(&arrayType) < 0) return NULL;
+
+	simulationType.tp_name = "pyqstem.Simulation";
+	simulationType.tp_basicsize = sizeof(simulationObject);
+	simulationType.tp_dealloc = (destructor)simulation_dealloc;
+	simulationType.tp_flags = Py_TPFLAGS_DEFAULT;
+	simulationType.tp_doc = "Simulation(parameter_file, keep_patterns=0)";
+	simulationType.tp_methods = simulationMethods;
+	simulationType.tp_init = (initproc)simulation_init;
+	simulationType.tp_new = PyType_GenericNew;
+	if (PyType_Ready(&simulationType) < 0) return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+	static struct PyModuleDef moduleDef = {
+		PyModuleDef_HEAD_INIT,"pyqstem","QSTEM simulation engine",-1,moduleMethods
+	};
+	m = PyModule_Create(&moduleDef);
+#else
+	m = Py_InitModule3("pyqstem",moduleMethods,"QSTEM simulation engine");
+#endif
+	if (m == NULL) return NULL;
+	Py_INCREF(&arrayType);
+	PyModule_AddObject(m,"Array",(PyObject *)&arrayType);
+	Py_INCREF(&simulationType);
+	PyModule_AddObject(m,"Simulation",(PyObject *)&simulationType);
+	PyModule_AddIntConstant(m,"atom_size",(long)sizeof(atom));
+	return m;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_pyqstem(void) {
+	return initModule();
+}
+#else
+PyMODINIT_FUNC initpyqstem(void) {
+	initModule();
+}
+#endif
@@ -0,0 +1,74 @@
+"""
+numpy interface to the simulation engine (the pyqstem module, built with
+cmake -DBUILD_PYTHON=ON).  All arrays share their memory with the engine,
+nothing is written to or read from .img files.
+
+sim = Simulation("stem.dat", keep_patterns=True)
+sim.set_atoms(make_atoms(xyz, Znum, dw=0.45))
+for df in (-100, -200, -300):
+    sim["df0"] = df
+    sim.run()
+    haadf = sim.detector_images()[-1]["HAADF"].copy()
+"""
+
+import numpy as np
+import pyqstem
+
+# layout of the engine's atom struct (stemtypes_fftw3.h)
+atom_dtype = np.dtype([('z', np.float32), ('y', np.float32), ('x', np.float32),
+                       ('dw', np.float32), ('occ', np.float32), ('q', np.float32),
+                       ('Znum', np.int32)])
+assert atom_dtype.itemsize == pyqstem.atom_size
+
+
+def make_atoms(xyz, Znum, dw=0.0, occ=1.0, q=0.0):
+    """
+    atom array from cartesian positions xyz (N x 3, in A), atomic numbers,
+    Debye-Waller factors (A^2), occupancies and charges
+    """
+    xyz = np.asarray(xyz, dtype=np.float64).reshape(-1, 3)
+    atoms = np.zeros(len(xyz), dtype=atom_dtype)
+    atoms['x'] = xyz[:, 0]
+    atoms['y'] = xyz[:, 1]
+    atoms['z'] = xyz[:, 2]
+    atoms['Znum'] = Znum
+    atoms['dw'] = dw
+    atoms['occ'] = occ
+    atoms['q'] = q
+    return atoms
+
+
+class Simulation(object):
+    """
+    a simulation set up by a stem3 parameter file.  Parameters can be read
+    and changed with sim[name] (see mulsParameters in stem3/stem3.cpp).
+    The returned arrays are views into the engine: copy them if they
+    should survive the next run.
+    """
+    def __init__(self, parameter_file, keep_patterns=False):
+        self._sim = pyqstem.Simulation(parameter_file, int(keep_patterns))
+
+    def __getitem__(self, name):
+        return self._sim.get(name)
+
+    def __setitem__(self, name, value):
+        self._sim.set(name, value)
+
+    def set_atoms(self, atoms):
+        self._sim.set_atoms(np.ascontiguousarray(atoms, dtype=atom_dtype))
+
+    def run(self):
+        self._sim.run()
+
+    def atoms(self):
+        return np.asarray(self._sim.atoms()).view(atom_dtype)
+
+    def trans(self):
+        return np.asarray(self._sim.trans())
+
+    def detector_images(self):
+        return [dict((name, np.asarray(image)) for name, image in thickness.items())
+                for thickness in self._sim.detector_images()]
+
+    def patterns(self):
+        return np.asarray(self._sim.patterns())
@@ -0,0 +1,135 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* file qstem_merge.cpp: combines the partial detector sums written by
+* sharded stem3 runs (stem3 --shard i/N --shard-runs j/M) into the
+* STEM images a single stem3 run would have written.
+********************************************************************/
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+
+#include "stem_shard.h"
+#include "data_containers.h"
+#include "source_size.h"
+
+void usage() {
+	printf("usage: qstem-merge [-o output folder='.'] [--source diameter [gaussian|lorentzian|mixed f]]\n");
+	printf("                   shard files ...\n\n");
+	printf("  Combines the shard_<i>_<j>.qsh files written by stem3 --shard/--shard-runs\n");
+	printf("  into the STEM images (<detector>.img, <detector>_<t>.img).\n");
+	printf("  --source convolves the images with a source of this diameter (A),\n");
+	printf("  as stem3 does for 'Source Size (diameter):' and 'source distribution:'.\n\n");
+}
+
+int main(int argc, char *argv[]) {
+	int i,t,p,f,nFiles = 0,npix,missing;
+	char folder[512];
+	char fileName[1024];
+	double intensity,minRuns;
+	double sourceRadius = 0,lorentzFraction = 0.5;
+	int distribution = SOURCE_GAUSSIAN;
+	STEMShard shard,ref;
+	std::vector<double> sum,sum2,runs;
+
+	sprintf(folder,".");
+	for (i=1;i<argc;i++) {
+		if ((strcmp(argv[i],"-o") == 0) && (i+1 < argc)) {
+			strcpy(folder,argv[++i]);
+			continue;
+		}
+		if ((strcmp(argv[i],"--source") == 0) && (i+1 < argc)) {
+			sourceRadius = atof(argv[++i])/2.0;
+			if ((i+1 < argc) && ((strcmp(argv[i+1],"gaussian") == 0) ||
+				(strcmp(argv[i+1],"lorentzian") == 0) || (strcmp(argv[i+1],"mixed") == 0))) {
+				distribution = parseSourceDistribution(argv[++i]);
+				if ((distribution == SOURCE_MIXED) && (i+1 < argc)) lorentzFraction = atof(argv[++i]);
+			}
+			continue;
+		}
+		if (!shard.Read(argv[i])) exit(0);
+		if (nFiles == 0) {
+			ref = shard;
+			npix = ref.scanXN*ref.scanYN;
+			sum.assign(ref.nThick*ref.detectorNum*npix,0.0);
+			sum2.assign(sum.size(),0.0);
+			runs.assign(npix,0.0);
+		}
+		else if ((shard.scanXN != ref.scanXN) || (shard.scanYN != ref.scanYN) ||
+			(shard.nThick != ref.nThick) || (shard.detectorNum != ref.detectorNum) ||
+			(shard.names != ref.names)) {
+			printf("%s does not belong to the same scan as %s\n",argv[i],argv[1]);
+			exit(0);
+		}
+		shard.Accumulate(sum,sum2,runs);
+		printf("Read %s: pixel shard %d/%d, runs %d (block %d/%d)\n",argv[i],
+			shard.shardIndex,shard.shardCount,shard.runs,shard.runShardIndex,shard.runShardCount);
+		nFiles++;
+	}
+	if (nFiles == 0) {
+		usage();
+		exit(0);
+	}
+
+	missing = 0;
+	minRuns = runs[0];
+	for (p=0;p<npix;p++) {
+		if (runs[p] == 0) missing++;
+		if (runs[p] < minRuns) minRuns = runs[p];
+	}
+	if (missing > 0)
+		printf("Warning: %d of %d scan pixels are not covered by any shard, they will be 0\n",missing,npix);
+	if (minRuns < ref.avgRuns)
+		printf("Warning: some pixels contain only %g of %d TDS runs\n",minRuns,ref.avgRuns);
+
+	/* write the images the same way saveSTEMImages does */
+	DetectorPtr det = DetectorPtr(new Detector(ref.scanXN,ref.scanYN,(float_tt)ref.resX,(float_tt)ref.resY));
+	for (t=0;t<ref.nThick;t++) {
+		for (i=0;i<ref.detectorNum;i++) {
+			det->error = 0;
+			intensity = 0;
+			for (p=0;p<npix;p++) {
+				f = (t*ref.detectorNum+i)*npix+p;
+				det->image[0][p]  = (runs[p] > 0) ? (float_tt)(sum[f]/runs[p]) : 0;
+				det->image2[0][p] = (runs[p] > 0) ? (float_tt)(sum2[f]/runs[p]) : 0;
+				det->error += (det->image2[0][p]-det->image[0][p]*det->image[0][p]);
+				intensity += det->image[0][p]*det->image[0][p];
+			}
+			det->error /= intensity;
+			if (t < ref.nThick-1)
+				sprintf(fileName,"%s/%s_%d.img",folder,ref.names[i].c_str(),t);
+			else
+				sprintf(fileName,"%s/%s.img",folder,ref.names[i].c_str());
+			// the comment must be "STEM image" for the GUIs to recognize it
+			det->SetComment("STEM image");
+			det->SetThickness((float_tt)ref.thickness[t]);
+			det->SetParameter(0, minRuns);
+			det->SetParameter(1, (double)det->error);
+			for (p=0;p<npix;p++)
+				det->SetParameter(2+p, (double)det->image2[0][p]);
+			if (sourceRadius > 0)
+				convolveSourceSize(det->image.Data(),ref.scanXN,ref.scanYN,ref.resX,ref.resY,
+					sourceRadius,distribution,lorentzFraction);
+			det->WriteImage(fileName);
+			printf("Wrote %s\n",fileName);
+		}
+	}
+	return 0;
+}
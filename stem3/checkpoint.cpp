@@ -0,0 +1,340 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "fileio_fftw3.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC "QSTEMCP1"
+#define CHECKPOINT_HEADER_INTS 8
+
+/* everything the background thread needs to write one checkpoint */
+typedef struct checkpointSnapshotStruct {
+	char fileName[1024];
+	int header[CHECKPOINT_HEADER_INTS];  // avgCount, slab, scanXN, scanYN, detectorNum, nThick, avgRuns, atomKinds
+	double collectedIntensity;
+	randomState rng;
+	std::vector<unsigned char> done;
+	std::vector<double> image,image2;    // [nThick][detectorNum][scanXN*scanYN]
+	std::vector<double> chisq,dE_E;      // [avgRuns]
+	std::vector<double> u2,u2avg;        // [atomKinds]
+} checkpointSnapshot;
+
+/* checkpoint state of one simulation (simState(muls)->checkpoint) */
+struct checkpointState {
+	int currentSlab;                          // slab number within the current run
+	std::vector<unsigned char> done;          // pixels finished in the current slab
+	std::vector<float_tt> slabImage,slabImage2; // detector images at the start of the slab
+	randomState runRandomState;               // random state at the start of the current run
+	time_t lastCheckpoint;
+
+	checkpointSnapshot snapshot;
+	int writerBusy;
+	volatile int writerDone;
+#ifndef _WIN32
+	pthread_t writer;
+#endif
+
+	/* what readCheckpoint() found: */
+	int resumeAvgCount,resumeSlab;
+	std::vector<unsigned char> resumeDone;
+	randomState resumeRandomState;
+
+	checkpointState() : currentSlab(0), lastCheckpoint(0), writerBusy(0), writerDone(0),
+		resumeAvgCount(-1), resumeSlab(-1) {
+		initRandomState(&runRandomState);
+		initRandomState(&resumeRandomState);
+	}
+};
+
+static checkpointState *getCheckpointState(MULS *muls) {
+	SimState *st = simState(muls);
+	if (st->checkpoint.get() == NULL) st->checkpoint = boost::shared_ptr<checkpointState>(new checkpointState());
+	return st->checkpoint.get();
+}
+
+static void checkpointFileName(MULS *muls, char *fileName) {
+	sprintf(fileName,"%s/stem_checkpoint_%d_%d.qcp",muls->folder,muls->shardIndex,muls->runShardIndex);
+}
+
+static int numThick(MULS *muls) {
+	return (int)muls->detectors.size();
+}
+
+static void *writeCheckpointFile(void *arg) {
+	checkpointState *cs = (checkpointState *)arg;
+	checkpointSnapshot *cp = &cs->snapshot;
+	char tmpName[1040];
+	FILE *fp;
+	int ok;
+
+	sprintf(tmpName,"%s.tmp",cp->fileName);
+	if ((fp = fopen(tmpName,"wb")) == NULL) {
+		printf("Could not open %s for writing the checkpoint\n",tmpName);
+		cs->writerDone = 1;
+		return NULL;
+	}
+	fwrite(CHECKPOINT_MAGIC,1,8,fp);
+	fwrite(cp->header,sizeof(int),CHECKPOINT_HEADER_INTS,fp);
+	fwrite(&cp->collectedIntensity,sizeof(double),1,fp);
+	fwrite(&cp->rng,sizeof(randomState),1,fp);
+	if (cp->done.size() > 0)  fwrite(&cp->done[0],1,cp->done.size(),fp);
+	if (cp->image.size() > 0) {
+		fwrite(&cp->image[0],sizeof(double),cp->image.size(),fp);
+		fwrite(&cp->image2[0],sizeof(double),cp->image2.size(),fp);
+	}
+	if (cp->chisq.size() > 0) {
+		fwrite(&cp->chisq[0],sizeof(double),cp->chisq.size(),fp);
+		fwrite(&cp->dE_E[0],sizeof(double),cp->dE_E.size(),fp);
+	}
+	if (cp->u2.size() > 0) {
+		fwrite(&cp->u2[0],sizeof(double),cp->u2.size(),fp);
+		fwrite(&cp->u2avg[0],sizeof(double),cp->u2avg.size(),fp);
+	}
+	ok = !ferror(fp);
+	fclose(fp);
+
+	// only replace the previous checkpoint once the new one is complete
+	if (ok) {
+#ifdef _WIN32
+		remove(cp->fileName);
+#endif
+		if (rename(tmpName,cp->fileName) != 0) ok = 0;
+	}
+	if (!ok) printf("Error writing checkpoint %s\n",cp->fileName);
+	cs->writerDone = 1;
+	return NULL;
+}
+
+/* returns 1 if no checkpoint is being written (any more) */
+static int writerAvailable(checkpointState *cs, int wait) {
+	if (!cs->writerBusy) return 1;
+	if (!cs->writerDone && !wait) return 0;
+#ifndef _WIN32
+	pthread_join(cs->writer,NULL);
+#endif
+	cs->writerBusy = 0;
+	return 1;
+}
+
+static void startWriter(checkpointState *cs) {
+	cs->writerBusy = 1;
+	cs->writerDone = 0;
+#ifndef _WIN32
+	if (pthread_create(&cs->writer,NULL,writeCheckpointFile,cs) == 0) return;
+#endif
+	// no threads: write it right here
+	writeCheckpointFile(cs);
+	cs->writerBusy = 0;
+}
+
+/* copies the state of the scan into snapshot.  Pixels that are not done yet
+ * (or still being worked on) get the detector values from the start of the slab.
+ */
+static void takeSnapshot(checkpointState *cs, MULS *muls, double collectedIntensity) {
+	int t,i,p,j,npix,nThick,atomKinds;
+	checkpointSnapshot &snapshot = cs->snapshot;
+	const std::vector<unsigned char> &done = cs->done;
+
+	npix = muls->scanXN*muls->scanYN;
+	nThick = numThick(muls);
+	atomKinds = ((muls->u2 != NULL) && (muls->u2avg != NULL)) ? muls->atomKinds : 0;
+
+	checkpointFileName(muls,snapshot.fileName);
+	snapshot.header[0] = muls->avgCount;
+	snapshot.header[1] = cs->currentSlab;
+	snapshot.header[2] = muls->scanXN;
+	snapshot.header[3] = muls->scanYN;
+	snapshot.header[4] = muls->detectorNum;
+	snapshot.header[5] = nThick;
+	snapshot.header[6] = muls->avgRuns;
+	snapshot.header[7] = atomKinds;
+	snapshot.collectedIntensity = collectedIntensity;
+	snapshot.rng = cs->runRandomState;
+	snapshot.done = done;
+
+	snapshot.image.resize(nThick*muls->detectorNum*npix);
+	snapshot.image2.resize(nThick*muls->detectorNum*npix);
+	for (t=0,j=0;t<nThick;t++) for (i=0;i<muls->detectorNum;i++) for (p=0;p<npix;p++,j++) {
+		if (done[p]) {
+			snapshot.image[j]  = muls->detectors[t][i]->image[0][p];
+			snapshot.image2[j] = muls->detectors[t][i]->image2[0][p];
+		}
+		else {
+			snapshot.image[j]  = cs->slabImage[j];
+			snapshot.image2[j] = cs->slabImage2[j];
+		}
+	}
+	snapshot.chisq.assign(muls->chisq.begin(),muls->chisq.end());
+	snapshot.dE_E.assign(muls->dE_EArray,muls->dE_EArray+muls->avgRuns);
+	snapshot.u2.assign(muls->u2,muls->u2+atomKinds);
+	snapshot.u2avg.assign(muls->u2avg,muls->u2avg+atomKinds);
+}
+
+void checkpointRunStart(MULS *muls) {
+	getCheckpointState(muls)->runRandomState = simState(muls)->rng;
+}
+
+void checkpointSlabStart(MULS *muls, int slab) {
+	int t,i,p,j,npix;
+	checkpointState *cs = getCheckpointState(muls);
+	std::vector<float_tt> &slabImage = cs->slabImage;
+	std::vector<float_tt> &slabImage2 = cs->slabImage2;
+
+	npix = muls->scanXN*muls->scanYN;
+	if ((muls->avgCount == cs->resumeAvgCount) && (slab == cs->resumeSlab) && ((int)cs->resumeDone.size() == npix))
+		cs->done = cs->resumeDone;
+	else
+		cs->done.assign(npix,0);
+	cs->currentSlab = slab;
+
+	if (muls->checkpointInterval <= 0) return;
+	// keep the images as they were before this slab, for the pixels which are not done yet
+	slabImage.resize(numThick(muls)*muls->detectorNum*npix);
+	slabImage2.resize(numThick(muls)*muls->detectorNum*npix);
+	for (t=0,j=0;t<numThick(muls);t++) for (i=0;i<muls->detectorNum;i++) for (p=0;p<npix;p++,j++) {
+		slabImage[j]  = muls->detectors[t][i]->image[0][p];
+		slabImage2[j] = muls->detectors[t][i]->image2[0][p];
+	}
+	if (cs->lastCheckpoint == 0) cs->lastCheckpoint = time(NULL);
+}
+
+void checkpointPixelDone(MULS *muls, int pixel, double collectedIntensity) {
+	checkpointState *cs = getCheckpointState(muls);
+
+	// the critical section also makes sure that the image values of this pixel
+	// are visible to the thread taking the snapshot
+#pragma omp critical(checkpoint)
+	{
+		cs->done[pixel] = 1;
+		if ((muls->checkpointInterval > 0) &&
+			(difftime(time(NULL),cs->lastCheckpoint) >= muls->checkpointInterval) &&
+			writerAvailable(cs,0)) {
+			takeSnapshot(cs,muls,collectedIntensity);
+			cs->lastCheckpoint = time(NULL);
+			startWriter(cs);
+			if (muls->printLevel > 1) printf("Checkpoint: run %d, slab %d\n",muls->avgCount,cs->currentSlab);
+		}
+	}
+}
+
+int checkpointPixelIsDone(MULS *muls, int pixel) {
+	checkpointState *cs = getCheckpointState(muls);
+	return (pixel < (int)cs->done.size()) ? cs->done[pixel] : 0;
+}
+
+void checkpointSlabDone(MULS *muls, double collectedIntensity) {
+	checkpointState *cs = getCheckpointState(muls);
+
+	if (muls->checkpointInterval <= 0) return;
+	writerAvailable(cs,1);
+	cs->done.assign(cs->done.size(),1);
+	takeSnapshot(cs,muls,collectedIntensity);
+	cs->lastCheckpoint = time(NULL);
+	startWriter(cs);
+}
+
+void finishCheckpoints(MULS *muls) {
+	writerAvailable(getCheckpointState(muls),1);
+}
+
+int readCheckpoint(MULS *muls, int *avgCount, int *slab, double *collectedIntensity) {
+	FILE *fp;
+	char fileName[1024],magic[8];
+	int header[CHECKPOINT_HEADER_INTS];
+	int t,i,p,j,npix,nThick,n,atomKinds;
+	size_t numRead = 0,numExpected;
+	std::vector<double> image,image2,dE_E,u2,u2avg;
+	checkpointState *cs = getCheckpointState(muls);
+	std::vector<unsigned char> &resumeDone = cs->resumeDone;
+
+	checkpointFileName(muls,fileName);
+	if ((fp = fopen(fileName,"rb")) == NULL) {
+		printf("Could not open checkpoint %s, starting from the beginning\n",fileName);
+		return 0;
+	}
+	npix = muls->scanXN*muls->scanYN;
+	nThick = numThick(muls);
+	if ((fread(magic,1,8,fp) != 8) || (strncmp(magic,CHECKPOINT_MAGIC,8) != 0) ||
+		(fread(header,sizeof(int),CHECKPOINT_HEADER_INTS,fp) != CHECKPOINT_HEADER_INTS) ||
+		(header[2] != muls->scanXN) || (header[3] != muls->scanYN) ||
+		(header[4] != muls->detectorNum) || (header[5] != nThick) || (header[6] != muls->avgRuns)) {
+		printf("Checkpoint %s does not match this simulation, starting from the beginning\n",fileName);
+		fclose(fp);
+		return 0;
+	}
+	n = nThick*muls->detectorNum*npix;
+	atomKinds = header[7];
+	resumeDone.resize(npix);
+	image.resize(n);
+	image2.resize(n);
+	dE_E.resize(muls->avgRuns);
+	u2.resize(atomKinds);
+	u2avg.resize(atomKinds);
+	muls->chisq.resize(muls->avgRuns);
+
+	numRead += fread(collectedIntensity,sizeof(double),1,fp);
+	numRead += fread(&cs->resumeRandomState,sizeof(randomState),1,fp);
+	numRead += fread(&resumeDone[0],1,npix,fp);
+	if (n > 0) {
+		numRead += fread(&image[0],sizeof(double),n,fp);
+		numRead += fread(&image2[0],sizeof(double),n,fp);
+	}
+	numRead += fread(&muls->chisq[0],sizeof(double),muls->avgRuns,fp);
+	numRead += fread(&dE_E[0],sizeof(double),muls->avgRuns,fp);
+	if (atomKinds > 0) {
+		numRead += fread(&u2[0],sizeof(double),atomKinds,fp);
+		numRead += fread(&u2avg[0],sizeof(double),atomKinds,fp);
+	}
+	fclose(fp);
+	numExpected = 2+npix+2*(n > 0 ? n : 0)+2*muls->avgRuns+2*atomKinds;
+	if (numRead != numExpected) {
+		printf("Checkpoint %s is incomplete, starting from the beginning\n",fileName);
+		return 0;
+	}
+
+	for (t=0,j=0;t<nThick;t++) for (i=0;i<muls->detectorNum;i++) for (p=0;p<npix;p++,j++) {
+		muls->detectors[t][i]->image[0][p]  = (float_tt)image[j];
+		muls->detectors[t][i]->image2[0][p] = (float_tt)image2[j];
+	}
+	for (i=0;i<muls->avgRuns;i++) muls->dE_EArray[i] = dE_E[i];
+	if ((atomKinds == muls->atomKinds) && (muls->u2 != NULL) && (muls->u2avg != NULL)) {
+		for (i=0;i<atomKinds;i++) {
+			muls->u2[i] = u2[i];
+			muls->u2avg[i] = u2avg[i];
+		}
+	}
+	cs->resumeAvgCount = *avgCount = header[0];
+	cs->resumeSlab = *slab = header[1];
+	for (p=0,n=0;p<npix;p++) n += resumeDone[p];
+	printf("Resuming from %s: run %d, slab %d, %d of %d pixels done\n",
+		fileName,cs->resumeAvgCount,cs->resumeSlab,n,npix);
+	return 1;
+}
+
+void checkpointRestoreRandomState(MULS *muls) {
+	simState(muls)->rng = getCheckpointState(muls)->resumeRandomState;
+}
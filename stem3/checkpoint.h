@@ -0,0 +1,68 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "data_containers.h"
+
+/**************************************************************
+ * Checkpoints for long STEM runs.
+ *
+ * Every muls->checkpointInterval seconds (and at the end of each
+ * slab) the state of doSTEM is written to
+ * muls->folder/stem_checkpoint_<i>_<j>.qcp, i = muls->shardIndex
+ * and j = muls->runShardIndex, so that the shards of a scan or
+ * of the TDS runs can share a folder:
+ *  - the current TDS run (avgCount) and slab (counted across all
+ *    sequences of a run) and the pixels finished in this slab,
+ *  - all detector images (image, image2),
+ *  - the random number state at the start of the run, dE_EArray,
+ *    chisq and the TDS displacement averages.
+ * The snapshot is taken by the thread that just finished a pixel
+ * and written by a background thread (to a temporary file which
+ * is then renamed), so the scan does not wait for the disk.
+ * stem3 --resume reads the checkpoint, rebuilds the potential of
+ * the interrupted run from the saved random state and skips all
+ * pixels (and slabs) that are already done.
+ * The state of the checkpoints is kept per simulation
+ * (simState(muls)->checkpoint).
+ **************************************************************/
+
+/* called at the beginning of every TDS run, before the potential is built */
+void checkpointRunStart(MULS *muls);
+/* called once the potential of a slab has been built, before the scan */
+void checkpointSlabStart(MULS *muls, int slab);
+/* marks pixel (ix*scanYN+iy) as done, writes a checkpoint if one is due */
+void checkpointPixelDone(MULS *muls, int pixel, double collectedIntensity);
+int  checkpointPixelIsDone(MULS *muls, int pixel);
+/* writes a checkpoint after all pixels of the slab have been done */
+void checkpointSlabDone(MULS *muls, double collectedIntensity);
+/* waits for a checkpoint that is still being written */
+void finishCheckpoints(MULS *muls);
+
+/* restores the state from the checkpoint of this shard (see above).
+ * Returns 1 and the run, slab and collected intensity to continue
+ * from if successful, 0 otherwise.
+ */
+int readCheckpoint(MULS *muls, int *avgCount, int *slab, double *collectedIntensity);
+/* restores the random number state of the interrupted run */
+void checkpointRestoreRandomState(MULS *muls);
+
+#endif // CHECKPOINT_H
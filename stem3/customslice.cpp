@@ -29,6 +29,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "stemutil.h"
 #include "customslice.h"
 #include "fileio_fftw3.h"
+#include "fft_plans.h"
 
 #define _CRTDBG_MAP_ALLOC
 #include <stdio.h>	/* ANSI C libraries */
@@ -83,7 +84,7 @@ void make3DSlicesFT(MULS *muls) {
   char buf[128];
   double dX,dZ;                      // real space resol. of FT box
   ImageIOPtr imageIO = ImageIOPtr();
-  static char fileName[64];
+  char fileName[512];
 
 
   /******************************************
@@ -189,9 +190,13 @@ void make3DSlicesFT(MULS *muls) {
       }
 
       // new fftw3 code:
+      lockPlanner();
       plan = fftw_plan_dft_2d(Nz,Nx,pot[0],pot[0],FFTW_BACKWARD,fftMeasureFlag);
+      unlockPlanner();
       fftw_execute(plan);
+      lockPlanner();
       fftw_destroy_plan(plan);
+      unlockPlanner();
     
       /* see L.M. Peng, Micron 30, p. 625 (1999) for details on the scale factor
        * so that pot is the true electrostatic potential. 
@@ -244,11 +249,11 @@ void make3DSlicesFT(MULS *muls) {
   /*******************************************************
    * initializing  cz, and trans
    *************************************************************/
-  if(muls->trans==NULL) {
+  if(muls->trans.Empty()) {
     printf("make3DSlicesFT: Error, trans not allocated!\n");
     exit(0);
   }
-  memset(muls->trans[0][0],0,Nzp*Nxp*Nyp*sizeof(fftw_complex));
+  muls->trans.Zero();
   if (muls->cz == NULL) muls->cz = float1D(Nzp,"cz");
   for (i=0;i<Nzp;i++) muls->cz[i] = muls->sliceThickness;  					
   
@@ -309,7 +314,7 @@ void make3DSlicesFT(MULS *muls) {
       // printf("Saving potential layer %d to file %s\n",iz,filename); 
       sprintf(buf,"Projected Potential (%d slices)",muls->slices);
 	  imageIO->SetComment(std::string(buf));
-	  imageIO->WriteComplexImage((void **)muls->trans[iz], fileName);
+	  imageIO->WriteComplexImage((void **)muls->trans.Rows(iz), fileName);
     } 
   } /* end of if savePotential ... */
   
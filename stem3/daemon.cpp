@@ -0,0 +1,294 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <list>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "data_containers.h"
+#include "sim_state.h"
+#include "simulation.h"
+#include "daemon.h"
+
+#define DAEMON_LINE_LEN 4096
+
+/* a simulation kept between jobs */
+typedef struct residentSimStruct {
+	std::string fileName;             // its parameter file
+	time_t fileTime;                  // modification time of the file when it was read
+	boost::shared_ptr<MULS> muls;
+} residentSim;
+
+typedef struct daemonStateStruct {
+	std::list<residentSim> sims;      // most recently used first
+	double budget;                    // bytes
+	int stream;                       // send the STEM images with the result
+	FILE *out;                        // replies
+} daemonState;
+
+static time_t fileTime(const char *fileName) {
+	struct stat st;
+
+	if (stat(fileName,&st) != 0) return 0;
+	return st.st_mtime;
+}
+
+/* the memory a resident simulation keeps: transmission functions,
+ * atoms, kept diffraction patterns and detector images */
+static double simulationBytes(MULS &muls) {
+	double bytes;
+	size_t it,i;
+
+	bytes = (double)muls.trans.Size()*sizeof(fftwf_complex);
+	bytes += (double)muls.patterns.Size()*sizeof(float_tt);
+	bytes += (double)(muls.natom+muls.inputAtoms.size())*sizeof(atom);
+	for (it=0;it<muls.detectors.size();it++) for (i=0;i<muls.detectors[it].size();i++)
+		bytes += 2.0*muls.detectors[it][i]->image.Size()*sizeof(float_tt);
+	return bytes;
+}
+
+static double residentBytes(daemonState &d) {
+	double bytes = 0;
+	std::list<residentSim>::iterator s;
+
+	for (s=d.sims.begin();s!=d.sims.end();s++) bytes += simulationBytes(*s->muls);
+	return bytes;
+}
+
+/* drops the least recently used simulations until the budget is met */
+static void evictSimulations(daemonState &d) {
+	while (!d.sims.empty() && (residentBytes(d) > d.budget)) {
+		if (d.sims.back().muls->printLevel > 0)
+			printf("daemon: dropping %s (memory budget)\n",d.sims.back().fileName.c_str());
+		d.sims.pop_back();
+	}
+}
+
+static std::list<residentSim>::iterator findSimulation(daemonState &d, const char *fileName) {
+	std::list<residentSim>::iterator s;
+
+	for (s=d.sims.begin();s!=d.sims.end();s++) if (s->fileName == fileName) break;
+	return s;
+}
+
+static void streamImages(daemonState &d, MULS &muls) {
+	size_t it;
+	int i,ix,iy;
+
+	for (it=0;it<muls.detectors.size();it++) for (i=0;i<(int)muls.detectors[it].size();i++) {
+		Detector &det = *muls.detectors[it][i];
+		fprintf(d.out,"@qstem image %d %s %d %d\n",(int)it,det.name,det.image.Nx(),det.image.Ny());
+		for (ix=0;ix<det.image.Nx();ix++) {
+			for (iy=0;iy<det.image.Ny();iy++) fprintf(d.out,iy ? " %g" : "%g",(double)det.image[ix][iy]);
+			fprintf(d.out,"\n");
+		}
+	}
+}
+
+/* run <parameter file> [name=value ...] */
+static void runJob(daemonState &d, char *args) {
+	char *token,*value;
+	const char *fileName;
+	std::vector<std::string> tokens,names;
+	std::vector<double> values,oldValues;
+	std::list<residentSim>::iterator s;
+	double v;
+	size_t i;
+	int status = 1;
+
+	// split the line first, readParameterFile() uses strtok() as well
+	for (token=strtok(args," \t");token!=NULL;token=strtok(NULL," \t")) tokens.push_back(token);
+	if (tokens.empty()) {
+		fprintf(d.out,"@qstem error run needs a parameter file\n");
+		return;
+	}
+	fileName = tokens[0].c_str();
+	for (i=1;i<tokens.size();i++) {
+		token = &tokens[i][0];
+		if (((value = strchr(token,'=')) == NULL) || (sscanf(value+1,"%lf",&v) != 1)) {
+			fprintf(d.out,"@qstem error expected name=value instead of %s\n",token);
+			return;
+		}
+		names.push_back(std::string(token,value-token));
+		values.push_back(v);
+	}
+
+	s = findSimulation(d,fileName);
+	if ((s != d.sims.end()) && (s->fileTime != fileTime(fileName))) {
+		// the parameter file has been edited, read it again
+		d.sims.erase(s);
+		s = d.sims.end();
+	}
+	if (s == d.sims.end()) {
+		residentSim sim;
+		sim.fileName = fileName;
+		sim.fileTime = fileTime(fileName);
+		sim.muls = boost::shared_ptr<MULS>(new MULS());
+		if (readParameterFile(*sim.muls,fileName) == 0) {
+			fprintf(d.out,"@qstem error cannot open %s\n",fileName);
+			return;
+		}
+		d.sims.push_front(sim);
+	}
+	else d.sims.splice(d.sims.begin(),d.sims,s);
+	MULS &muls = *d.sims.front().muls;
+
+	oldValues.resize(names.size());
+	for (i=0;(status == 1) && (i<names.size());i++) {
+		if ((status = getSimulationParameter(muls,names[i].c_str(),&oldValues[i])) == 1)
+			status = setSimulationParameter(muls,names[i].c_str(),values[i]);
+		if (status != 1) {
+			fprintf(d.out,"@qstem error %s %s\n",names[i].c_str(),status ? "cannot be changed" : "is not a parameter");
+			names.resize(i);
+		}
+	}
+	if (status == 1) {
+		fflush(d.out);
+		runSimulation(muls);
+		fprintf(d.out,"@qstem result %s\n",muls.folder);
+		if (d.stream && (muls.mode == STEM)) streamImages(d,muls);
+	}
+	// settings only apply to this job
+	for (i=0;i<names.size();i++) setSimulationParameter(muls,names[i].c_str(),oldValues[i]);
+	evictSimulations(d);
+}
+
+/* handles one line, returns 0 for quit */
+static int handleCommand(daemonState &d, char *line) {
+	char *command,*args,*name;
+	std::list<residentSim>::iterator s;
+	double v;
+
+	line[strcspn(line,"\r\n")] = '\0';
+	command = line+strspn(line," \t");
+	if (*command == '\0') return 1;
+	args = command+strcspn(command," \t");
+	if (*args != '\0') *args++ = '\0';
+	if (strcmp(command,"quit") == 0) {
+		fprintf(d.out,"@qstem ok bye\n");
+		return 0;
+	}
+	if (strcmp(command,"run") == 0) runJob(d,args);
+	else if (strcmp(command,"drop") == 0) {
+		name = strtok(args," \t");
+		s = findSimulation(d,(name != NULL) ? name : "");
+		if (s != d.sims.end()) d.sims.erase(s);
+		fprintf(d.out,"@qstem ok %d simulations resident\n",(int)d.sims.size());
+	}
+	else if ((strcmp(command,"budget") == 0) && (sscanf(args,"%lf",&v) == 1) && (v > 0)) {
+		d.budget = v*1024.0*1024.0;
+		evictSimulations(d);
+		fprintf(d.out,"@qstem ok budget %g MB\n",v);
+	}
+	else if ((strcmp(command,"stream") == 0) && (sscanf(args,"%d",&d.stream) == 1)) 
+		fprintf(d.out,"@qstem ok stream %d\n",d.stream);
+	else if (strcmp(command,"stats") == 0) {
+		for (s=d.sims.begin();s!=d.sims.end();s++) 
+			fprintf(d.out,"@qstem sim %s %.1f MB\n",s->fileName.c_str(),simulationBytes(*s->muls)/(1024.0*1024.0));
+		fprintf(d.out,"@qstem ok %d simulations, %.1f of %.1f MB\n",(int)d.sims.size(),
+			residentBytes(d)/(1024.0*1024.0),d.budget/(1024.0*1024.0));
+	}
+	else fprintf(d.out,"@qstem error unknown command %s\n",command);
+	return 1;
+}
+
+/* handles the lines of in until quit (returns 0) or end of input (returns 1) */
+static int serve(daemonState &d, FILE *in) {
+	char line[DAEMON_LINE_LEN];
+
+	while (fgets(line,DAEMON_LINE_LEN,in) != NULL) {
+		if (!handleCommand(d,line)) {
+			fflush(d.out);
+			return 0;
+		}
+		fflush(d.out);
+	}
+	return 1;
+}
+
+int runDaemon(const char *socketPath, double budgetMB) {
+	daemonState d;
+
+	d.budget = budgetMB*1024.0*1024.0;
+	d.stream = 0;
+	d.out = stdout;
+	if (socketPath == NULL) {
+		fprintf(d.out,"@qstem ok ready\n");
+		fflush(d.out);
+		serve(d,stdin);
+		return 0;
+	}
+#ifndef _WIN32
+	{
+		struct sockaddr_un addr;
+		int server,client,more;
+		FILE *in;
+
+		if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+			printf("Error: socket path %s is too long\n",socketPath);
+			return 1;
+		}
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path,socketPath);
+		unlink(socketPath);
+		signal(SIGPIPE,SIG_IGN);   // a client that hangs up must not end the daemon
+		if (((server = socket(AF_UNIX,SOCK_STREAM,0)) < 0) ||
+			(bind(server,(struct sockaddr *)&addr,sizeof(addr)) != 0) || (listen(server,4) != 0)) {
+			printf("Error: cannot listen on %s\n",socketPath);
+			return 1;
+		}
+		printf("daemon: listening on %s\n",socketPath);
+		for (;;) {
+			if ((client = accept(server,NULL,NULL)) < 0) continue;
+			in = fdopen(client,"r");
+			d.out = fdopen(dup(client),"w");
+			if ((in == NULL) || (d.out == NULL)) {
+				if (in != NULL) fclose(in); else close(client);
+				if (d.out != NULL) fclose(d.out);
+				continue;
+			}
+			fprintf(d.out,"@qstem ok ready\n");
+			fflush(d.out);
+			more = serve(d,in);
+			fclose(in);
+			fclose(d.out);
+			if (!more) break;
+		}
+		close(server);
+		unlink(socketPath);
+		return 0;
+	}
+#else
+	printf("Error: --socket is not supported on Windows, jobs can be sent through stdin\n");
+	return 1;
+#endif
+}
@@ -0,0 +1,60 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/**************************************************************
+ * Warm daemon mode (stem3 --daemon [budget MB] [--socket path]).
+ *
+ * Reads jobs, one per line, from stdin or, if socketPath is given,
+ * from clients of a local Unix socket (one client at a time):
+ *
+ *   run <parameter file> [name=value ...]
+ *   drop <parameter file>     forget the simulation of this file
+ *   budget <MB>               change the memory budget
+ *   stream 0|1                send the STEM images back with the result
+ *   stats                     list the resident simulations
+ *   quit                      end the daemon
+ *
+ * The simulation of a parameter file is read once and kept, with
+ * its transmission functions (see buildSlices in stem3.cpp), until
+ * the file changes or it is evicted: when the resident simulations
+ * need more than the budget the least recently used ones are
+ * dropped.  Atom potential tables and FFTW plans are process-wide
+ * anyway (stemlib.h, fft_plans.h) and stay for all jobs.
+ * name=value settings (see setSimulationParameter) only apply to
+ * their job.
+ * Every reply line starts with "@qstem ", so it can be told apart
+ * from the output of the simulation when both go to stdout:
+ *
+ *   @qstem ok <message>
+ *   @qstem error <message>
+ *   @qstem result <output folder>
+ *   @qstem image <thickness> <detector> <nx> <ny>   (stream 1, STEM,
+ *          followed by nx lines of ny values)
+ *
+ * Fatal errors of the engine still end the daemon.
+ **************************************************************/
+
+/* runs the daemon until quit or end of input, returns 0 on success */
+int runDaemon(const char *socketPath, double budgetMB);
+
+#endif // DAEMON_H
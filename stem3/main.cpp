@@ -0,0 +1,162 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>	/* ANSI C libraries */
+#include <stdlib.h>
+#ifdef _WIN32
+#if _DEBUG
+#include <crtdbg.h>
+#endif
+#endif
+#include <string.h>
+#include <iostream>
+
+#include <omp.h>
+
+#include "data_containers.h"
+#include "readparams.h"
+#include "stemlib.h"
+#include "fft_plans.h"
+#include "memory_arena.h"
+#include "simulation.h"
+#include "daemon.h"
+
+#ifndef _WIN32
+#define UNIX 
+#endif
+
+void usage() {
+	printf("usage: stem [input file='stem.dat'] [--shard i/N] [--shard-runs j/M] [--resume]\n\n");
+	printf("  --shard i/N       only do every N-th STEM scan pixel, starting at pixel i\n");
+	printf("                    (TOMO: every N-th tilt, written to tomo_stack_<i>.img)\n");
+	printf("  --shard-runs j/M  only do the j-th of M blocks of TDS runs\n");
+	printf("  sharded runs write %%s/shard_<i>_<j>.qsh instead of STEM images,\n");
+	printf("  use qstem-merge to combine them into the final images.\n");
+	printf("  --resume          continue a STEM run from its last checkpoint\n");
+	printf("                    (written every 'checkpoint interval:' seconds)\n");
+	printf("       stem --daemon [memory budget in MB=1024] [--socket path]\n\n");
+	printf("  --daemon          keep simulations resident and run jobs read from stdin\n");
+	printf("                    or from clients of the Unix socket path (see daemon.h)\n\n");
+}
+
+/* stem --daemon [budget] [--socket path], returns 1 if argv asks for the daemon */
+static int daemonMode(int argc, char *argv[]) {
+	int i,daemon = 0;
+	double budget = 1024;
+	const char *socketPath = NULL;
+
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i],"--daemon") == 0) {
+			daemon = 1;
+			if ((i+1 < argc) && (sscanf(argv[i+1],"%lf",&budget) == 1)) i++;
+		}
+		else if ((strcmp(argv[i],"--socket") == 0) && (i+1 < argc)) socketPath = argv[++i];
+	}
+	if (!daemon) return 0;
+	if (budget <= 0) {
+		printf("Invalid memory budget %g MB\n",budget);
+		usage();
+		exit(0);
+	}
+#ifdef _OPENMP
+	omp_set_dynamic(1);
+#endif
+	runDaemon(socketPath,budget);
+	saveWisdom();
+	freePotentialLUTs();
+	destroyPlans();
+	return 1;
+}
+
+
+/***************************************************************
+***************************************************************
+* MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN *
+***************************************************************
+**************************************************************/
+
+
+int main(int argc, char *argv[]) {
+	int i; 
+	char fileName[512]; 
+	boost::shared_ptr<MULS> sim(new MULS());
+	MULS &muls = *sim;
+
+	if (daemonMode(argc,argv)) return 0;
+
+#ifdef UNIX
+	system("date");
+#endif
+
+	/*************************************************************
+	* read in the parameters
+	************************************************************/  
+	muls.shardIndex = 0;
+	muls.shardCount = 1;
+	muls.runShardIndex = 0;
+	muls.runShardCount = 1;
+	muls.resume = 0;
+	sprintf(fileName,"stem.dat");
+	for (i=1;i<argc;i++) {
+		if ((strcmp(argv[i],"--shard") == 0) && (i+1 < argc)) {
+			if ((sscanf(argv[++i],"%d/%d",&muls.shardIndex,&muls.shardCount) != 2) ||
+				(muls.shardCount < 1) || (muls.shardIndex < 0) || (muls.shardIndex >= muls.shardCount)) {
+				printf("Invalid shard specification %s\n",argv[i]);
+				usage();
+				exit(0);
+			}
+		}
+		else if ((strcmp(argv[i],"--shard-runs") == 0) && (i+1 < argc)) {
+			if ((sscanf(argv[++i],"%d/%d",&muls.runShardIndex,&muls.runShardCount) != 2) ||
+				(muls.runShardCount < 1) || (muls.runShardIndex < 0) || (muls.runShardIndex >= muls.runShardCount)) {
+				printf("Invalid shard specification %s\n",argv[i]);
+				usage();
+				exit(0);
+			}
+		}
+		else if (strcmp(argv[i],"--resume") == 0) muls.resume = 1;
+		else strcpy(fileName,argv[i]);
+	}
+	if (readParameterFile(muls,fileName) == 0) 
+	{
+		printf("could not open input file %s!\n",fileName);
+		usage();
+		exit(0);
+	}
+
+#ifdef _OPENMP
+	omp_set_dynamic(1);
+#endif
+	runSimulation(muls);
+
+	if (saveWisdom() && (muls.printLevel >= 2)) printf("Saved FFTW wisdom\n");
+	freePotentialLUTs();
+	destroyPlans();
+	if (muls.memoryReport) memReport(stdout);
+	sim.reset();
+
+#if _DEBUG
+	_CrtDumpMemoryLeaks();
+#endif
+
+	// Console.Read(); //  <--- Right here
+	printf( "DEBUG Main: Press any key to exit()" );
+	std::cin.ignore();
+	return 0;
+}
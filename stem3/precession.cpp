@@ -0,0 +1,177 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "data_containers.h"
+#include "fft_plans.h"
+#include "stemlib.h"
+#include "stemutil.h"
+#include "precession.h"
+
+/* nearest reciprocal pixel of the beam tilt t (rad) along a box of size a (A) */
+static int tiltPixel(double t, double a, double wavlen) {
+	return (int)floor(sin(t)*a/wavlen+0.5);
+}
+
+void precessionTilts(MULS &muls, std::vector<precessionTilt> &tilts) {
+	const double pi=3.1415926535897;
+	double wavlen,ax,by,phi,theta;
+	int k,n,baseX,baseY;
+	precessionTilt tilt;
+
+	wavlen = wavelength(muls.v0);
+	ax = muls.nx*muls.resolutionX;
+	by = muls.ny*muls.resolutionY;
+	theta = 0.001*muls.pedAngle;
+	n = (muls.pedTilts > 0) ? muls.pedTilts : 1;
+	baseX = muls.tiltBack ? 0 : tiltPixel(muls.btiltx,ax,wavlen);
+	baseY = muls.tiltBack ? 0 : tiltPixel(muls.btilty,by,wavlen);
+
+	tilts.clear();
+	for (k=0;k<n;k++) {
+		phi = 2.0*pi*k/n;
+		tilt.beamX = tiltPixel(muls.btiltx+theta*cos(phi),ax,wavlen);
+		tilt.beamY = tiltPixel(muls.btilty+theta*sin(phi),by,wavlen);
+		tilt.tiltX = asin(tilt.beamX*wavlen/ax);
+		tilt.tiltY = asin(tilt.beamY*wavlen/by);
+		tilt.shiftX = tilt.beamX-baseX;
+		tilt.shiftY = tilt.beamY-baseY;
+		tilts.push_back(tilt);
+	}
+}
+
+template <typename T>
+void precessionIncidentWaves(MULS &muls, const std::vector<precessionTilt> &tilts,
+							 Array3D<typename FFTW<T>::complex> &waves) {
+	const double pi=3.1415926535897;
+	int k,ix,iy,nx = muls.nx,ny = muls.ny;
+	double phase;
+
+	if ((waves.Nz() != (int)tilts.size()) || (waves.Nx() != nx) || (waves.Ny() != ny))
+		waves.Resize((int)tilts.size(),nx,ny,"precession waves");
+	// exp(2 pi i (beamX*ix/nx+beamY*iy/ny)) is periodic in the super cell
+#pragma omp parallel for private(ix,iy,phase)
+	for (k=0;k<(int)tilts.size();k++) {
+		Array2DView<typename FFTW<T>::complex> w = waves[k];
+		for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
+			phase = 2.0*pi*((double)tilts[k].beamX*ix/nx+(double)tilts[k].beamY*iy/ny);
+			w[ix][iy][0] = (T)cos(phase);
+			w[ix][iy][1] = (T)sin(phase);
+		}
+	}
+}
+
+template <typename T>
+void precessionSlab(MULS &muls, Array3D<typename FFTW<T>::complex> &waves) {
+	int nTilts = waves.Nz(),nx = muls.nx,ny = muls.ny;
+	int nBatch,nBatches,nRest,b,k,first,count,islice,mRepeat,n[2];
+	int nThreads = 1;
+
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	// enough batches to keep all threads busy, at most PED_BATCH tilts each
+	nBatch = nTilts/nThreads;
+	if (nBatch > PED_BATCH) nBatch = PED_BATCH;
+	if (nBatch < 1) nBatch = 1;
+	nBatches = (nTilts+nBatch-1)/nBatch;
+	nRest = nTilts-(nBatches-1)*nBatch;
+	n[0] = nx; n[1] = ny;
+	typename FFTW<T>::plan forw = sharedPlan<T>(PLAN_WAVE,2,n,nBatch,FFTW_FORWARD);
+	typename FFTW<T>::plan inv = sharedPlan<T>(PLAN_WAVE,2,n,nBatch,FFTW_BACKWARD);
+	typename FFTW<T>::plan forwRest = sharedPlan<T>(PLAN_WAVE,2,n,nRest,FFTW_FORWARD);
+	typename FFTW<T>::plan invRest = sharedPlan<T>(PLAN_WAVE,2,n,nRest,FFTW_BACKWARD);
+
+#pragma omp parallel for private(k,first,count,islice,mRepeat) schedule(dynamic)
+	for (b=0;b<nBatches;b++) {
+		first = b*nBatch;
+		count = (b < nBatches-1) ? nBatch : nRest;
+		for (mRepeat=0;mRepeat<muls.mulsRepeat1;mRepeat++) {
+			for (islice=0;islice<muls.slices;islice++) {
+				for (k=first;k<first+count;k++)
+					transmit<T>(waves[k],muls.trans[islice].Window(0,0,nx,ny));
+				executePlan((count == nBatch) ? forw : forwRest,waves[first].Data());
+				for (k=first;k<first+count;k++)
+					propagate_slow<T>(waves[k],nx,ny,&muls);
+				executePlan((count == nBatch) ? inv : invRest,waves[first].Data());
+				for (k=first;k<first+count;k++)
+					fft_normalize<T>(waves[k],nx,ny);
+			}
+		}
+	}
+}
+
+template <typename T>
+void precessionPatterns(MULS &muls, const std::vector<precessionTilt> &tilts,
+						const Array3D<typename FFTW<T>::complex> &waves, Array3D<float_tt> &patterns) {
+	typedef typename FFTW<T>::complex complex;
+	int nTilts = waves.Nz(),nx = muls.nx,ny = muls.ny;
+	int nBatch,first,count,b,ix,iy,jx,jy;
+	double scale,intensity;
+	int n[2];
+
+	if ((patterns.Nz() != nTilts) || (patterns.Nx() != nx) || (patterns.Ny() != ny))
+		patterns.Resize(nTilts,nx,ny,"precession patterns");
+	nBatch = (nTilts < PED_BATCH) ? nTilts : PED_BATCH;
+	n[0] = nx; n[1] = ny;
+	Array3D<complex> batch(nBatch,nx,ny,"precession batch");
+	typename FFTW<T>::plan plan = sharedPlan<T>(PLAN_WAVE,2,n,nBatch,FFTW_FORWARD);
+	// the spectrum of a unit plane wave is nx*ny in one pixel
+	scale = 1.0/((double)nx*ny);
+	scale *= scale;
+
+	for (first=0;first<nTilts;first+=nBatch) {
+		count = (first+nBatch <= nTilts) ? nBatch : nTilts-first;
+		memcpy(batch.Data(),waves[first].Data(),(size_t)count*nx*ny*sizeof(complex));
+		if (count < nBatch) memset(batch[count].Data(),0,(size_t)(nBatch-count)*nx*ny*sizeof(complex));
+		executePlan(plan,batch.Data());
+		for (b=0;b<count;b++) {
+			const precessionTilt &tilt = tilts[first+b];
+			Array2DView<complex> spectrum = batch[b];
+			Array2DView<float_tt> pattern = patterns[first+b];
+			// pixel ix of the spectrum goes to ix-shiftX, (0,0) to the center
+#pragma omp parallel for private(iy,jx,jy,intensity)
+			for (ix=0;ix<nx;ix++) {
+				jx = (((ix-tilt.shiftX+nx/2)%nx)+nx)%nx;
+				for (iy=0;iy<ny;iy++) {
+					jy = (((iy-tilt.shiftY+ny/2)%ny)+ny)%ny;
+					intensity = spectrum[ix][iy][0]*spectrum[ix][iy][0]+spectrum[ix][iy][1]*spectrum[ix][iy][1];
+					pattern[jx][jy] = (float_tt)(scale*intensity);
+				}
+			}
+		}
+	}
+}
+
+#define INSTANTIATE_PRECESSION(T) \
+	template void precessionIncidentWaves<T>(MULS &, const std::vector<precessionTilt> &, Array3D<FFTW<T>::complex> &); \
+	template void precessionSlab<T>(MULS &, Array3D<FFTW<T>::complex> &); \
+	template void precessionPatterns<T>(MULS &, const std::vector<precessionTilt> &, const Array3D<FFTW<T>::complex> &, Array3D<float_tt> &);
+
+INSTANTIATE_PRECESSION(float)
+INSTANTIATE_PRECESSION(double)
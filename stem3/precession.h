@@ -0,0 +1,72 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PRECESSION_H
+#define PRECESSION_H
+
+#include <vector>
+#include "data_containers.h"
+
+/**************************************************************
+ * Precession electron diffraction (mode: PED).
+ *
+ * The incident plane wave is tilted by the precession angle
+ * muls.pedAngle (mrad) towards muls.pedTilts azimuths
+ * phi_k = 2*pi*k/pedTilts around the beam tilt (btiltx,btilty).
+ * Every tilt is rounded to the nearest reciprocal space pixel, so
+ * that the tilted wave is periodic in the super cell and its
+ * diffraction pattern is de-tilted exactly by shifting it back by
+ * (shiftX,shiftY) pixels (including the beam tilt if muls.tiltBack).
+ *
+ * All tilts pass the slices of one potential together: the waves
+ * are kept in one Array3D and split into batches of up to
+ * PED_BATCH tilts.  The batches are propagated in parallel, each
+ * one transformed by a single batched FFT per slice.
+ **************************************************************/
+
+#define PED_BATCH 4
+
+typedef struct precessionTiltStruct {
+	double tiltX,tiltY;     // beam tilt after rounding, in rad
+	int beamX,beamY;        // reciprocal pixel of the incident beam
+	int shiftX,shiftY;      // shift that de-tilts the pattern, in pixels
+} precessionTilt;
+
+/* the tilts of the precession cone of muls */
+void precessionTilts(MULS &muls, std::vector<precessionTilt> &tilts);
+
+/* sets waves[k] to the incident plane wave of tilts[k] */
+template <typename T>
+void precessionIncidentWaves(MULS &muls, const std::vector<precessionTilt> &tilts,
+							 Array3D<typename FFTW<T>::complex> &waves);
+
+/* propagates all waves (real space) through the muls.slices slices
+ * of muls.trans, muls.mulsRepeat1 times */
+template <typename T>
+void precessionSlab(MULS &muls, Array3D<typename FFTW<T>::complex> &waves);
+
+/* sets patterns[k] to the de-tilted diffraction pattern of the exit
+ * wave waves[k] (not changed), centered like WaveFunction::diffpat and
+ * normalized to the incident intensity */
+template <typename T>
+void precessionPatterns(MULS &muls, const std::vector<precessionTilt> &tilts,
+						const Array3D<typename FFTW<T>::complex> &waves, Array3D<float_tt> &patterns);
+
+#endif // PRECESSION_H
@@ -0,0 +1,58 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "data_containers.h"
+
+/**************************************************************
+ * The simulation engine (stem3 without its command line).
+ *
+ * boost::shared_ptr<MULS> sim(new MULS());
+ * if (readParameterFile(*sim,"stem.dat")) runSimulation(*sim);
+ *
+ * All working data of a simulation is kept in its MULS (and in
+ * simState(&muls)), so several simulations can be set up and run
+ * at the same time, e.g. from different threads.  Reading the
+ * parameter file is serialized, because the parser is shared.
+ * Tables that only depend on the sampling (atom potentials) and
+ * FFTW plans are shared by all simulations; freePotentialLUTs()
+ * and destroyPlans() release them once no simulation is running.
+ **************************************************************/
+
+/* reads the parameters of a simulation from fileName into muls.
+ * muls must be new (value initialized); command line settings
+ * (shards, resume) may be set before.  Returns 0 if the file
+ * could not be opened.
+ */
+int readParameterFile(MULS &muls, const char *fileName);
+/* runs the simulation (STEM, TEM, CBED, ...) described by muls */
+void runSimulation(MULS &muls);
+
+/* reads (get) or changes (set) parameter name of muls between runs,
+ * e.g. "df0" or "Cs" (see mulsParameters in stem3.cpp).  Parameters
+ * that array sizes or tables depend on can only be read.
+ * Return 1 if successful, 0 for an unknown name and -1 if the
+ * parameter cannot be changed.
+ */
+int getSimulationParameter(MULS &muls, const char *name, double *value);
+int setSimulationParameter(MULS &muls, const char *name, double value);
+
+#endif // SIMULATION_H
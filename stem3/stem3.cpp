@@ -45,8 +45,10 @@ QSTEM - image simulation for TEM/STEM/CBED
 #endif
 
 #include <time.h>
+#include <iostream>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <map>
 // #include <stat.h>
 
 #include <omp.h>
@@ -61,6 +63,18 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "weblib.h"
 #include "customslice.h"
 #include "data_containers.h"
+#include "checkpoint.h"
+#include "fft_plans.h"
+#include "memory_arena.h"
+#include "sim_state.h"
+#include "counter_rng.h"
+#include "trajectory.h"
+#include "tds_convergence.h"
+#include "tds_stop.h"
+#include "simulation.h"
+#include "tem_imaging.h"
+#include "source_size.h"
+#include "precession.h"
 
 #define NCINMAX 1024
 #define NPARAM	64    /* number of parameters */
@@ -75,73 +89,57 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define SQRT_2 1.4142135
 
 const char *resultPage = "result.html";
-/* global variable: */
-MULS muls;
-// int fftMeasureFlag = FFTW_MEASURE;
-int fftMeasureFlag = FFTW_ESTIMATE;
 extern char *elTable;
 
 void makeAnotation(real **pict,int nx,int ny,char *text);
-void initMuls();
+void initMuls(MULS &muls);
 void writeIntPix(char *outFile,real **pict,int nx,int ny);
 void runMuls(int lstart);
 void saveLineScan(int run);
 void readBeams(FILE *fpBeams);
-void doCBED();
-void doNBED();
-void doSTEM();
-void doTEM();
-void doMSCBED();
-void doTOMO();
-void readFile();
-void displayParams();
-
-void usage() {
-	printf("usage: stem [input file='stem.dat']\n\n");
-}
-
+/* the wave functions of these modes are float or double precision */
+template <typename T> void doCBED(MULS &muls);
+template <typename T> void doNBED(MULS &muls);
+template <typename T> void doSTEM(MULS &muls);
+template <typename T> void doTEM(MULS &muls);
+template <typename T> void doPED(MULS &muls);
+void doMSCBED(MULS &muls);
+void doTOMO(MULS &muls);
+void readFile(MULS &muls);
+void displayParams(MULS &muls);
 
 /***************************************************************
-***************************************************************
-* MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN *
-***************************************************************
-**************************************************************/
-
-
-int main(int argc, char *argv[]) {
-	int i; 
-	double timerTot;
-	char fileName[512]; 
-	char cinTemp[BUF_LEN];
-
-	timerTot = cputim();
-	for (i=0;i<BUF_LEN;i++)
-		cinTemp[i] = 0;
-	muls.nCellX = 1; muls.nCellY = 1; muls.nCellZ = 1; 
-
-#ifdef UNIX
-	system("date");
-#endif
-
-	/*************************************************************
-	* read in the parameters
-	************************************************************/  
-	if (argc < 2)
-		sprintf(fileName,"stem.dat");
-	else
-		strcpy(fileName,argv[1]);
-	if (parOpen(fileName) == 0) 
-	{
-		printf("could not open input file %s!\n",fileName);
-		usage();
-		exit(0);
-	}
-	readFile();
+* readParameterFile() reads the parameters of a simulation from
+* fileName into muls.  The parameter file parser is shared by all
+* simulations of the process, so it is locked while the file is
+* being read.
+* Returns 0 if the file could not be opened.
+***************************************************************/
+int readParameterFile(MULS &muls, const char *fileName) {
+	char parFile[512];
+
+	if (muls.nCellX < 1) muls.nCellX = 1;
+	if (muls.nCellY < 1) muls.nCellY = 1;
+	if (muls.nCellZ < 1) muls.nCellZ = 1;
+	if (muls.shardCount < 1) muls.shardCount = 1;
+	if (muls.runShardCount < 1) muls.runShardCount = 1;
+
+	strncpy(parFile,fileName,511);
+	parFile[511] = '\0';
+	parLock();
+	if (parOpen(parFile) == 0) {
+		parUnlock();
+		return 0;
+	}
+	readFile(muls);
+	parClose();
+	parUnlock();
+	return 1;
+}
 
-	displayParams();
-#ifdef _OPENMP
-	omp_set_dynamic(1);
-#endif
+/* does the simulation of muls.mode with the current parameters */
+static void runMode(MULS &muls) {
+	displayParams(muls);
 	if (muls.mode == STEM) {
 		// sprintf(systStr,"mkdir %s",muls.folder);
 		// system(systStr);
@@ -157,35 +155,183 @@ int main(int argc, char *argv[]) {
 	}
 
 	switch (muls.mode) {
-	  case CBED:   doCBED();   break;	
-	  case STEM:   doSTEM();   break;
-	  case TEM:    doTEM();    break;
-	  case MSCBED: doMSCBED(); break;
-	  case TOMO:   doTOMO();   break;
-	  case NBED:   doNBED();   break;
+	  case CBED:   if (muls.precision == 2) doCBED<double>(muls); else doCBED<float>(muls); break;
+	  case STEM:   if (muls.precision == 2) doSTEM<double>(muls); else doSTEM<float>(muls); break;
+	  case TEM:    if (muls.precision == 2) doTEM<double>(muls);  else doTEM<float>(muls);  break;
+	  case MSCBED: doMSCBED(muls); break;
+	  case TOMO:   doTOMO(muls);   break;
+	  case NBED:   if (muls.precision == 2) doNBED<double>(muls); else doNBED<float>(muls); break;
+	  case PED:    if (muls.precision == 2) doPED<double>(muls);  else doPED<float>(muls);  break;
 	  // case REFINE: doREFINE(); break;
 	  default:
 		  printf("Mode not supported\n");
 	}
+}
 
-	parClose();
-#if _DEBUG
-	_CrtDumpMemoryLeaks();
-#endif
-
-	// Console.Read(); //  <--- Right here
-	printf( "DEBUG Main: Press any key to exit()" );
-	std::cin.ignore();
-	return 0;
+/***************************************************************
+* runSimulation() does the simulation described by muls (STEM,
+* TEM, CBED, ...).  All working data is kept in simState(&muls),
+* so several simulations can run at the same time, each with its
+* own MULS.
+* With 'sweep:' lines the simulation is run for every point of
+* the sweep (the last sweep line varies fastest).  Point k writes
+* its results to muls.folder/sweep_<k>, the parameters of all
+* points are listed in muls.folder/sweep.txt.  The optics do not
+* change the potential, so without TDS all points use the
+* transmission functions of the first one, and with TDS the
+* transmission functions of every run are kept for the other
+* points, as far as 'sweep cache:' (in MB) allows (see buildSlices).
+***************************************************************/
+void runSimulation(MULS &muls) {
+	char folder[1024],fileName[1024];
+	std::vector<int> index;
+	std::vector<double> baseValues;
+	int point,i;
+	FILE *fp = NULL;
+	SimState *st = simState(&muls);
+	double runBytes;
+
+	if (muls.sweeps.empty()) {
+		runMode(muls);
+		st->arena.FreeAll();
+		return;
+	}
+	strcpy(folder,muls.folder);
+	displayParams(muls);      // creates the folder
+	st->runTransLimit = (size_t)muls.sweepCacheMB*1024*1024;
+	runBytes = (double)muls.cellDiv*muls.slices*muls.potNx*muls.potNy*sizeof(fftwf_complex);
+	if (muls.tds && (muls.avgRuns*runBytes > st->runTransLimit)) 
+		printf("Warning: sweep cache of %d MB holds %d of %d runs, the others are made again for every point\n",
+			muls.sweepCacheMB,(int)(st->runTransLimit/runBytes),muls.avgRuns);
+	sprintf(fileName,"%s/sweep.txt",folder);
+	if ((fp = fopen(fileName,"w")) == NULL) printf("Warning: cannot write %s\n",fileName);
+	index.assign(muls.sweeps.size(),0);
+	baseValues.resize(muls.sweeps.size());
+	for (i=0;i<(int)muls.sweeps.size();i++) 
+		getSimulationParameter(muls,muls.sweeps[i].name.c_str(),&baseValues[i]);
+
+	for (point=0;;point++) {
+		if (fp != NULL) fprintf(fp,"sweep_%d",point);
+		for (i=0;i<(int)muls.sweeps.size();i++) {
+			setSimulationParameter(muls,muls.sweeps[i].name.c_str(),muls.sweeps[i].values[index[i]]);
+			if (fp != NULL) fprintf(fp," %s=%g",muls.sweeps[i].name.c_str(),muls.sweeps[i].values[index[i]]);
+		}
+		if (fp != NULL) {
+			fprintf(fp,"\n");
+			fflush(fp);
+		}
+		sprintf(muls.folder,"%s/sweep_%d",folder,point);
+		runMode(muls);
+		st->arena.FreeAll();
+
+		// next point, the last sweep line varies fastest
+		for (i=(int)muls.sweeps.size()-1;i>=0;i--) {
+			if (++index[i] < (int)muls.sweeps[i].values.size()) break;
+			index[i] = 0;
+		}
+		if (i < 0) break;
+	}
+	if (fp != NULL) fclose(fp);
+	st->runTrans.clear();
+	st->runTransLimit = 0;
+	strcpy(muls.folder,folder);
+	for (i=0;i<(int)muls.sweeps.size();i++) 
+		setSimulationParameter(muls,muls.sweeps[i].name.c_str(),baseValues[i]);
 }
 
 /***************************************************************
-***************************************************************
-** End of MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN MAIN  ** 
-***************************************************************
-**************************************************************/
+* Parameters that can be read and changed between runs by
+* programs that keep a simulation (pyqstem, stem3 --daemon).
+* Parameters from which readFile() derives array sizes, lookup
+* tables or the detectors are read only.
+***************************************************************/
+typedef struct {
+	const char *name;
+	float_tt MULS::*f;
+	int MULS::*i;
+	int settable;
+} mulsParameter;
+
+static const mulsParameter mulsParameters[] = {
+	{"df0",&MULS::df0,0,1},
+	{"Cs",&MULS::Cs,0,1},
+	{"C5",&MULS::C5,0,1},
+	{"Cc",&MULS::Cc,0,1},
+	{"alpha",&MULS::alpha,0,1},
+	{"aobj",&MULS::aobj,0,1},
+	{"astigMag",&MULS::astigMag,0,1},
+	{"astigAngle",&MULS::astigAngle,0,1},
+	{"a33",&MULS::a33,0,1},   {"phi33",&MULS::phi33,0,1},
+	{"a31",&MULS::a31,0,1},   {"phi31",&MULS::phi31,0,1},
+	{"a44",&MULS::a44,0,1},   {"phi44",&MULS::phi44,0,1},
+	{"a42",&MULS::a42,0,1},   {"phi42",&MULS::phi42,0,1},
+	{"a55",&MULS::a55,0,1},   {"phi55",&MULS::phi55,0,1},
+	{"a53",&MULS::a53,0,1},   {"phi53",&MULS::phi53,0,1},
+	{"a51",&MULS::a51,0,1},   {"phi51",&MULS::phi51,0,1},
+	{"a66",&MULS::a66,0,1},   {"phi66",&MULS::phi66,0,1},
+	{"a64",&MULS::a64,0,1},   {"phi64",&MULS::phi64,0,1},
+	{"a62",&MULS::a62,0,1},   {"phi62",&MULS::phi62,0,1},
+	{"sourceRadius",&MULS::sourceRadius,0,1},
+	{"sourceDistribution",0,&MULS::sourceDistribution,1},
+	{"sourceLorentzFraction",&MULS::sourceLorentzFraction,0,1},
+	{"sourcePoints",0,&MULS::sourcePoints,1},
+	{"pedAngle",&MULS::pedAngle,0,1},
+	{"pedTilts",0,&MULS::pedTilts,1},
+	{"btiltx",&MULS::btiltx,0,1},
+	{"btilty",&MULS::btilty,0,1},
+	{"tds_temp",&MULS::tds_temp,0,1},
+	{"tds",0,&MULS::tds,1},
+	{"tdsStopError",&MULS::tdsStopError,0,1},
+	{"tdsMinRuns",0,&MULS::tdsMinRuns,1},
+	{"tdsStopPixels",0,&MULS::tdsStopPixels,1},
+	{"printLevel",0,&MULS::printLevel,1},
+	{"saveLevel",0,&MULS::saveLevel,1},
+	{"v0",&MULS::v0,0,0},
+	{"resolutionX",&MULS::resolutionX,0,0},
+	{"resolutionY",&MULS::resolutionY,0,0},
+	{"sliceThickness",&MULS::sliceThickness,0,0},
+	{"ax",&MULS::ax,0,0},
+	{"by",&MULS::by,0,0},
+	{"c",&MULS::c,0,0},
+	{"mode",0,&MULS::mode,0},
+	{"nx",0,&MULS::nx,0},
+	{"ny",0,&MULS::ny,0},
+	{"potNx",0,&MULS::potNx,0},
+	{"potNy",0,&MULS::potNy,0},
+	{"slices",0,&MULS::slices,0},
+	{"scanXN",0,&MULS::scanXN,0},
+	{"scanYN",0,&MULS::scanYN,0},
+	{"avgRuns",0,&MULS::avgRuns,0},
+	{"natom",0,&MULS::natom,0},
+	{NULL,0,0,0}
+};
+
+static const mulsParameter *findParameter(const char *name) {
+	const mulsParameter *p;
+
+	for (p=mulsParameters;p->name != NULL;p++) if (strcmp(p->name,name) == 0) return p;
+	return NULL;
+}
+
+int getSimulationParameter(MULS &muls, const char *name, double *value) {
+	const mulsParameter *p = findParameter(name);
+
+	if (p == NULL) return 0;
+	*value = (p->f != 0) ? (double)(muls.*(p->f)) : (double)(muls.*(p->i));
+	return 1;
+}
+
+int setSimulationParameter(MULS &muls, const char *name, double value) {
+	const mulsParameter *p = findParameter(name);
 
-void initMuls() {
+	if (p == NULL) return 0;
+	if (!p->settable) return -1;
+	if (p->f != 0) muls.*(p->f) = (float_tt)value;
+	else muls.*(p->i) = (int)value;
+	return 1;
+}
+
+void initMuls(MULS &muls) {
 	int sCount,i,slices;
 
 	slices = muls.slices;
@@ -218,7 +364,7 @@ void initMuls() {
 	muls.tomoCount = 0;  // indicate: NO Tomography simulation.
 
 	/* make multislice read the inout files and assign transr and transi: */
-	muls.trans = NULL;
+	muls.trans.Free();
 	muls.cz = NULL;  // (real *)malloc(muls.slices*sizeof(real));
 
 	muls.onlyFresnel = 0;
@@ -256,11 +402,12 @@ int DirExists(char *filename) {
 /************************************************************************
 *
 ***********************************************************************/
-void displayProgress(int flag) {
-	// static double timer;
-	static double timeAvg = 0;
-	static double intensityAvg = 0;
-	static time_t time0,time1;
+void displayProgress(MULS &muls, int flag) {
+	progressState &progress = simState(&muls)->progress;
+	double &timeAvg = progress.timeAvg;
+	double &intensityAvg = progress.intensityAvg;
+	time_t &time0 = progress.time0;
+	time_t &time1 = progress.time1;
 	double curTime;
 	int jz;
 
@@ -309,12 +456,12 @@ void displayProgress(int flag) {
 
 }
 
-void displayParams() {
+void displayParams(MULS &muls) {
 	FILE *fpDir;
 	char systStr[64];
 	double k2max,temp;
 	int i,j;
-	static char Date[16],Time[16];
+	char Date[16],Time[16];
 	time_t caltime;
 	struct tm *mytime;
 	const double pi=3.1415926535897;
@@ -340,7 +487,7 @@ void displayParams() {
 	printf("* Running program STEM3 (version %.2f) in %s mode\n",VERSION,
 		(muls.mode == STEM) ? "STEM" : (muls.mode==TEM) ? "TEM" : 
 		(muls.mode == CBED) ? "CBED" : (muls.mode==TOMO)? "TOMO" : 
-		(muls.mode == NBED) ? "NBED" :
+		(muls.mode == NBED) ? "NBED" : (muls.mode == PED) ? "PED" :
 		"???"); 
 	printf("* Date: %s, Time: %s\n",Date,Time);
 	printf("*****************************************************\n");
@@ -373,6 +520,7 @@ void displayParams() {
 
 	printf("* Super cell:           %d x %d x %d unit cells\n",muls.nCellX,muls.nCellY,muls.nCellZ);
 	printf("* Number of atoms:      %d (super cell)\n",muls.natom);
+	printf("* Random seed:          %ld\n",randomSeed(&muls));
 	printf("* Crystal tilt:         x=%g deg, y=%g deg, z=%g deg\n",
 		muls.ctiltx*RAD2DEG,muls.ctilty*RAD2DEG,muls.ctiltz*RAD2DEG);
 	printf("* Beam tilt:            x=%g deg, y=%g deg (tilt back == %s)\n",muls.btiltx*RAD2DEG,muls.btilty*RAD2DEG,
@@ -445,10 +593,20 @@ void displayParams() {
 	printf("\n");
 	*/
 	printf("* Temperature:          %gK\n",muls.tds_temp);
-	if (muls.tds)
+	if ((muls.tds) && (trajectoryFrames(&muls) > 0))
+		printf("* TDS:                  yes (%d runs, frames of the trajectory)\n",muls.avgRuns);
+	else if (muls.tds)
 		printf("* TDS:                  yes (%d runs)\n",muls.avgRuns);
 	else
 		printf("* TDS:                  no\n"); 
+	if (muls.tds)
+		printf("* Displacements:        %s sampling\n",samplingName(muls.sampling));
+	if (muls.tds && (muls.tdsStopError > 0))
+		printf("* TDS stop:             relative error %g, at least %d runs%s\n",
+			muls.tdsStopError,muls.tdsMinRuns,muls.tdsStopPixels ? ", per pixel" : "");
+	if (muls.absorptive)
+		printf("* Absorptive potential: yes%s\n",
+			muls.absorbedToDetectors ? " (absorbed intensity to detectors)" : "");
 	if (muls.imageGamma == 0)
 		printf("* Gamma for diff. patt: logarithmic\n");
 	else
@@ -457,17 +615,14 @@ void displayParams() {
 	/**********************************************************
 	* FFTW specific data structures (stores in row major order)
 	*/
-	if (fftMeasureFlag == FFTW_MEASURE)
-		printf("* Probe array:          %d x %d pixels (optimized)\n",muls.nx,muls.ny);
-	else
-		printf("* Probe array:          %d x %d pixels (estimated)\n",muls.nx,muls.ny);
+	printf("* Probe array:          %d x %d pixels (%s)\n",muls.nx,muls.ny,
+		planRigorName(planRigor(PLAN_WAVE)));
 	printf("*                       %g x %gA\n",
 		muls.nx*muls.resolutionX,muls.ny*muls.resolutionY);
+	printf("* Wave precision:       %s\n",(muls.precision == 2) ? "double" : "single");
 
-	if (fftMeasureFlag == FFTW_MEASURE)
-		printf("* Potential array:      %d x %d (optimized)\n",muls.potNx,muls.potNy);
-	else
-		printf("* Potential array:      %d x %d (estimated)\n",muls.potNx,muls.potNy);
+	printf("* Potential array:      %d x %d (%s)\n",muls.potNx,muls.potNy,
+		planRigorName(planRigor(PLAN_POTENTIAL)));
 	printf("*                       %g x %gA\n",muls.potSizeX,muls.potSizeY);
 	printf("* Scattering factors:   %d\n",muls.scatFactor);
 	/***************************************************/
@@ -506,6 +661,13 @@ void displayParams() {
 			muls.scanXN,muls.scanYN,muls.scanXN*muls.scanYN);
 	} /* end of if mode == STEM */
 
+	if (muls.mode == PED) {
+		printf("*\n"
+			"* PED parameters:\n");
+		printf("* Precession angle:     %g mrad, %d tilts%s\n",muls.pedAngle,muls.pedTilts,
+			muls.pedSaveTilts ? " (patterns of every tilt are written)" : "");
+	}
+
 	/***********************************************************************
 	* TOMOGRAPHY Mode
 	**********************************************************************/
@@ -552,7 +714,7 @@ void readArray(char *title,double *array,int N) {
 * readSFactLUT() reads the scattering factor lookup table from the 
 * input file
 **********************************************************************/
-void readSFactLUT() {
+void readSFactLUT(MULS &muls) {
 	int Nk,i,j;
 	double **sfTable=NULL;
 	double *kArray = NULL;
@@ -602,6 +764,62 @@ void readSFactLUT() {
 }
 
 
+/***************************************************************
+* readSweep() adds a 'sweep:' line (buf: parameter name followed
+* by values or by from:to:step) to muls.sweeps.  Only parameters
+* that setSimulationParameter() may change can be swept; apart
+* from tds_temp they do not change the potential.
+***************************************************************/
+static void readSweep(MULS &muls, char *buf) {
+	sweepParameter sweep;
+	char name[64],*ptr;
+	double value,from,to,step;
+	int n;
+
+	if (sscanf(buf," %63s%n",name,&n) < 1) return;
+	sweep.name = name;
+	if ((getSimulationParameter(muls,name,&value) != 1) || (setSimulationParameter(muls,name,value) != 1)) {
+		printf("Error: %s cannot be swept\n",name);
+		exit(0);
+	}
+	ptr = strtok(buf+n," \t\r\n");
+	while (ptr != NULL) {
+		if (sscanf(ptr,"%lf:%lf:%lf",&from,&to,&step) == 3) {
+			if ((step == 0) || ((to-from)/step < 0)) {
+				printf("Error: invalid range %s for sweep of %s\n",ptr,name);
+				exit(0);
+			}
+			for (n=0;n<=(int)floor((to-from)/step+1e-6);n++) sweep.values.push_back(from+n*step);
+		}
+		else if (sscanf(ptr,"%lf",&value) == 1) sweep.values.push_back(value);
+		ptr = strtok(NULL," \t\r\n");
+	}
+	if (sweep.values.empty()) {
+		printf("Error: no values for sweep of %s\n",name);
+		exit(0);
+	}
+	muls.sweeps.push_back(sweep);
+}
+
+/* allocates muls.trans (slices x potNx x potNy) and plans the FFTs that
+ * bandwidth limit the transmission functions in place */
+static void allocateTrans(MULS &muls) {
+	int potDimensions[2];
+
+	potDimensions[0] = muls.potNx;
+	potDimensions[1] = muls.potNy;
+	muls.trans.Resize(muls.slices,muls.potNx,muls.potNy,"trans");
+	// printf("allocated trans %d %d %d\n",muls.slices,muls.potNx,muls.potNy);
+	lockPlanner();
+	muls.fftPlanPotForw = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans.Data(), NULL,
+		1, muls.potNx*muls.potNy,muls.trans.Data(), NULL,
+		1, muls.potNx*muls.potNy, FFTW_FORWARD, planRigor(PLAN_POTENTIAL));
+	muls.fftPlanPotInv = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans.Data(), NULL,
+		1, muls.potNx*muls.potNy,muls.trans.Data(), NULL,
+		1, muls.potNx*muls.potNy, FFTW_BACKWARD, planRigor(PLAN_POTENTIAL));
+	unlockPlanner();
+}
+
 /************************************************************************
 * readFile() 
 *
@@ -609,13 +827,13 @@ void readSFactLUT() {
 * further setup accordingly
 *
 ***********************************************************************/
-void readFile() {
+void readFile(MULS &muls) {
 	char answer[256];
 	FILE *fpTemp;
 	float ax,by,c;
 	char buf[BUF_LEN],*strPtr;
+	char wisdomFolder[512];
 	int i,ix;
-	int potDimensions[2];
 	long ltime;
 	unsigned long iseed;
 	double dE_E0,x,y,dx,dy;
@@ -636,6 +854,7 @@ void readFile() {
 		else if (strstr(buf, "NBED")) muls.mode = NBED;
 		else if (strstr(buf, "TOMO")) muls.mode = TOMO;
 		else if (strstr(buf, "REFINE")) muls.mode = REFINE;
+		else if (strstr(buf, "PED")) muls.mode = PED;
 	}
 
 	muls.printLevel = 2;
@@ -768,6 +987,36 @@ void readFile() {
 		sscanf(buf,"%s",muls.phononFile);
 		muls.Einstein = 0;
 	}
+	/* random: independent configurations, antithetic: every second
+	 * configuration mirrors the one before, sobol: scrambled Sobol
+	 * sequence over the configurations (see counter_rng.h) */
+	muls.sampling = SAMPLING_RANDOM;
+	if (readparam("displacement sampling:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.sampling = parseSampling(answer);
+		if (muls.sampling < 0) {
+			printf("Unknown displacement sampling %s, will use random\n",answer);
+			muls.sampling = SAMPLING_RANDOM;
+		}
+	}
+	/* instead of frozen phonons the TDS can be approximated by an absorptive
+	 * potential made from the Debye-Waller factors, whose absorbed intensity
+	 * may be added to the detectors for a quick estimate of HAADF images */
+	muls.absorptive = 0;
+	muls.absorbedToDetectors = 0;
+	if (readparam("absorptive potential:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.absorptive = (tolower(answer[0]) == (int)'y');
+	}
+	if (readparam("absorbed intensity to detectors:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.absorbedToDetectors = (tolower(answer[0]) == (int)'y');
+	}
+	if (muls.absorptive && muls.tds) {
+		printf("The absorptive potential would count the TDS twice, will not use it with tds: yes\n");
+		muls.absorptive = 0;
+	}
+	if (!muls.absorptive) muls.absorbedToDetectors = 0;
 
 	/**********************************************************************
 	* Read the atomic model positions !!!
@@ -829,17 +1078,56 @@ void readFile() {
 	if (readparam("yOffset:",buf,1)) sscanf(buf,"%g",&(muls.yOffset));
 	// printf("Reading Offset: %f, %f\n",muls.xOffset,muls.yOffset);
 
+	/* the atoms of a CFG file are kept in a binary sidecar (<file>.qac),
+	 * which later runs read instead of parsing the file again */
+	muls.atomCache = 1;
+	if (readparam("atom cache:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.atomCache = (tolower(answer[0]) == (int)'y');
+	}
+	/* for very large models: make3DSlices gets the atoms of every slab
+	 * from the unit cell or from a z-sorted file (<file>.qaz), the whole
+	 * model is never held in memory */
+	muls.streamAtoms = 0;
+	if (readparam("stream atoms:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.streamAtoms = (tolower(answer[0]) == (int)'y');
+	}
+	/* seed of the phonon displacements, vacancies and source offsets: with
+	 * the same seed every configuration is reproduced exactly, also when
+	 * the runs are split over several processes */
+	if (readparam("random seed:",buf,1))
+		sscanf(buf,"%ld",&simState(&muls)->rng.seed);
+	/* a molecular dynamics trajectory (see trajectory.h) gives the
+	 * configuration of every run, the elements of its LAMMPS types
+	 * are listed here (e.g. Si O) */
+	muls.trajectoryTypes[0] = '\0';
+	if (readparam("trajectory types:",buf,1)) {
+		strncpy(muls.trajectoryTypes,buf,sizeof(muls.trajectoryTypes)-1);
+		muls.trajectoryTypes[sizeof(muls.trajectoryTypes)-1] = '\0';
+	}
+
 	// the last parameter is handleVacancies.  If it is set to 1 vacancies 
 	// and multiple occupancies will be handled. 
 	// _CrtSetDbgFlag  _CRTDBG_CHECK_ALWAYS_DF();
 	// printf("memory check: %d, ptr= %d\n",_CrtCheckMemory(),(int)malloc(32*sizeof(char)));
 
-	muls.atoms = readUnitCell(&(muls.natom),muls.atomPosFile,&muls,1);
+	if (isTrajectoryFile(muls.atomPosFile)) {
+		if (muls.streamAtoms) {
+			printf("stream atoms: not supported for trajectories\n");
+			exit(0);
+		}
+		if (!openTrajectory(&muls)) exit(0);
+	}
+	else if (muls.streamAtoms) {
+		if (!openAtomSource(&muls)) exit(0);
+	}
+	else muls.atoms = readUnitCell(&(muls.natom),muls.atomPosFile,&muls,1);
 
 	// printf("memory check: %d, ptr= %d\n",_CrtCheckMemory(),(int)malloc(32*sizeof(char)));
 
 
-	if (muls.atoms == NULL) {
+	if ((muls.atoms == NULL) && (!muls.streamAtoms)) {
 		printf("Error reading atomic positions!\n");
 		exit(0);
 	}
@@ -937,7 +1225,7 @@ void readFile() {
 
 
 
-	initMuls();  
+	initMuls(muls);  
 	muls.czOffset = 0.0; /* slize z-position offset in cartesian coords */
 	if (readparam("zOffset:",buf,1)) sscanf(buf,"%g",&(muls.czOffset));
 
@@ -1014,6 +1302,20 @@ void readFile() {
 	if (readparam("Runs for averaging:",buf,1))
 		sscanf(buf,"%d",&(muls.avgRuns));
 
+	/* stop the STEM runs once the relative standard error of all detector
+	 * images is below this (see tds_stop.h), avgRuns is then the maximum */
+	muls.tdsStopError = 0;
+	if (readparam("tds stop error:",buf,1))
+		sscanf(buf,"%g",&(muls.tdsStopError));
+	muls.tdsMinRuns = 3;
+	if (readparam("tds min runs:",buf,1))
+		sscanf(buf,"%d",&(muls.tdsMinRuns));
+	muls.tdsStopPixels = 0;
+	if (readparam("tds stop pixels:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		muls.tdsStopPixels = (tolower(answer[0]) == (int)'y');
+	}
+
 	muls.storeSeries = 0;
 	if (readparam("Store TDS diffr. patt. series:",buf,1)) {
 		sscanf(buf,"%s",answer);
@@ -1021,6 +1323,11 @@ void readFile() {
 	}  
 
 	if (!muls.tds) muls.avgRuns = 1;
+	if ((trajectoryFrames(&muls) > 0) && (muls.avgRuns > trajectoryFrames(&muls))) {
+		printf("The trajectory has only %d frames, will average over %d runs\n",
+			trajectoryFrames(&muls),trajectoryFrames(&muls));
+		muls.avgRuns = trajectoryFrames(&muls);
+	}
 
 	muls.scanXStart = muls.ax/2.0;
 	muls.scanYStart = muls.by/2.0;
@@ -1074,6 +1381,15 @@ void readFile() {
 		if (readparam("propagation progress interval:",buf,1)) 
 			sscanf(buf,"%d",&(muls.displayProgInterval));
 	}
+	// seconds between checkpoints of a STEM run (0 = no checkpoints)
+	muls.checkpointInterval = 0;
+	if (readparam("checkpoint interval:",buf,1)) sscanf(buf,"%d",&(muls.checkpointInterval));
+	// print live/peak memory per allocation tag when the run is done
+	muls.memoryReport = (muls.printLevel >= 3);
+	if (readparam("memory report:",buf,1)) {
+		sscanf(buf," %s",answer);
+		muls.memoryReport = (tolower(answer[0]) == (int)'y');
+	}
 	muls.displayPotCalcInterval = 100000; // RAM: default, but normally read-in by .CFG file in next code fragment
 	if ( readparam( "potential progress interval:", buf, 1 ) )
 	{
@@ -1101,6 +1417,7 @@ void readFile() {
 	dE_E0 = sqrt(muls.dE_E*muls.dE_E+
 		muls.dI_I*muls.dI_I+
 		muls.dV_V*muls.dV_V);
+	muls.energySpread = dE_E0;
 	muls.dE_EArray = (double *)malloc((muls.avgRuns+1)*sizeof(double));
 	muls.dE_EArray[0] = 0.0;
 	/***********************************************************
@@ -1239,6 +1556,27 @@ void readFile() {
 	if (!readparam("alpha:",buf,1)) exit(0); 
 	sscanf(buf,"%g",&(muls.alpha)); /* in mrad */
 
+	/* TEM defocus series: from, to, step in nm (see tem_imaging.h) */
+	muls.imageDefoci.clear();
+	if (readparam("image defocus series:",buf,1)) {
+		double from=0,to=0,step=0;
+		if ((sscanf(buf,"%lf %lf %lf",&from,&to,&step) < 3) || (step == 0) || ((to-from)/step < 0)) {
+			printf("Error: invalid defocus series %s\n",buf);
+			exit(0);
+		}
+		for (i=0;i<=(int)floor((to-from)/step+1e-6);i++) muls.imageDefoci.push_back(10.0*(from+i*step));
+	}
+	muls.imageCoherence = IMAGE_ENVELOPE;
+	if (readparam("image coherence:",buf,1)) {
+		sscanf(buf," %s",answer);
+		if (tolower(answer[0]) == 'q') muls.imageCoherence = IMAGE_QUADRATURE;
+	}
+	/* Gauss-Hermite points for the focal spread: STEM probes (instead of one
+	 * energy deviation per TDS run) and TEM images with quadrature coherence */
+	muls.focalSpreadPoints = 0;
+	if (readparam("focal spread points:",buf,1)) sscanf(buf,"%d",&(muls.focalSpreadPoints));
+	if (readparam("objective aperture:",buf,1)) sscanf(buf,"%g",&(muls.aobj)); /* in mrad */
+
 	muls.aAIS = 0;  // initialize AIS aperture to 0 A
 	if (readparam("AIS aperture:",buf,1)) 
 		sscanf(buf,"%g",&(muls.aAIS)); /* in A */
@@ -1258,6 +1596,35 @@ void readFile() {
 	muls.sourceRadius = 0;
 	if (readparam("Source Size (diameter):",buf,1)) 
 		muls.sourceRadius = atof(buf)/2.0;
+	muls.sourceDistribution = SOURCE_GAUSSIAN;
+	muls.sourceLorentzFraction = 0.5;
+	if (readparam("source distribution:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		muls.sourceDistribution = parseSourceDistribution(answer);
+		if (muls.sourceDistribution == SOURCE_MIXED) {
+			sscanf(buf,"%*s %g",&(muls.sourceLorentzFraction));
+			if ((muls.sourceLorentzFraction < 0) || (muls.sourceLorentzFraction > 1)) {
+				printf("source distribution: Lorentzian fraction %g must be between 0 and 1\n",muls.sourceLorentzFraction);
+				exit(0);
+			}
+		}
+	}
+	muls.sourcePoints = 0;
+	if (readparam("source size points:",buf,1)) sscanf(buf,"%d",&(muls.sourcePoints));
+
+	muls.pedAngle = 0;
+	muls.pedTilts = 32;
+	muls.pedSaveTilts = 0;
+	if (readparam("precession angle:",buf,1)) sscanf(buf,"%g",&(muls.pedAngle)); /* in mrad */
+	if (readparam("precession tilts:",buf,1)) sscanf(buf,"%d",&(muls.pedTilts));
+	if (readparam("precession tilt patterns:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		muls.pedSaveTilts = (tolower(answer[0]) == (int)'y');
+	}
+	if ((muls.mode == PED) && (muls.pedTilts < 1)) {
+		printf("precession tilts: %d, must be at least 1\n",muls.pedTilts);
+		exit(0);
+	}
 
 	if (readparam("smooth:",buf,1)) sscanf(buf,"%s",answer);
 	muls.ismoth = (tolower(answer[0]) == (int)'y');
@@ -1412,7 +1779,7 @@ void readFile() {
 		muls.scatFactor = CUSTOM;
 		// we already have the kinds of atoms stored in 
 		// int *muls.Znums and int muls.atomKinds
-		readSFactLUT();
+		readSFactLUT(muls);
 		break;
 	default:
 		muls.scatFactor = DOYLE_TURNER;
@@ -1524,29 +1891,36 @@ void readFile() {
 		printf( "DEBUG: tilt/tds default filename made = %s \n", muls.cfgFile );
 	}
 
-	/* allocate memory for wave function */
+	/* threads work either on independent probe positions or share the 
+	   FFTs of a single wave function, this must be set before planning */
+	muls.waveThreads = 0;
+	if (readparam("wave threads:",buf,1)) sscanf(buf,"%d",&(muls.waveThreads));
+	initWaveThreads(&muls);
 
-	potDimensions[0] = muls.potNx;
-	potDimensions[1] = muls.potNy;
-#if FLOAT_PRECISION == 1
-	muls.trans = complex3Df(muls.slices,muls.potNx,muls.potNy,"trans");
-	// printf("allocated trans %d %d %d\n",muls.slices,muls.potNx,muls.potNy);
-	muls.fftPlanPotForw = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
-#else
+	/* precision of the wave functions: single (default) or double, e.g. to 
+	 * validate single precision results.  Potentials stay single precision. */
+	muls.precision = 1;
+	if (readparam("precision:",buf,1)) {
+		sscanf(buf," %s",answer);
+		if ((tolower(answer[0]) == 'd') || (atoi(answer) == 64)) muls.precision = 2;
+	}
 
-	muls.trans = complex3D(muls.slices,muls.potNx,muls.potNy,"trans");
-	muls.fftPlanPotForw = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
-#endif
+	/* FFTW planner rigor (estimate, measure, patient or exhaustive) of the
+	 * wave, potential slice and single atom potential plans.  Anything
+	 * but estimate is stored as wisdom in the wisdom folder for later runs. */
+	if (readparam("fft plan wave:",buf,1)) setPlanRigor(PLAN_WAVE,parsePlanRigor(buf));
+	if (readparam("fft plan potential:",buf,1)) setPlanRigor(PLAN_POTENTIAL,parsePlanRigor(buf));
+	if (readparam("fft plan atom:",buf,1)) setPlanRigor(PLAN_ATOM,parsePlanRigor(buf));
+	if ((planRigor(PLAN_WAVE) != FFTW_ESTIMATE) || (planRigor(PLAN_POTENTIAL) != FFTW_ESTIMATE) ||
+		(planRigor(PLAN_ATOM) != FFTW_ESTIMATE)) {
+		sprintf(wisdomFolder,".");
+		if (readparam("fft wisdom folder:",buf,1)) sscanf(buf," %s",wisdomFolder);
+		if (loadWisdom(wisdomFolder) && (muls.printLevel >= 2))
+			printf("Read FFTW wisdom from %s\n",wisdomFolder);
+	}
+
+	/* allocate memory for wave function */
+	allocateTrans(muls);
 
 	////////////////////////////////////
 	if (muls.printLevel >= 4) 
@@ -1555,34 +1929,143 @@ void readFile() {
 
 	// printf("%d %d %d %d\n",muls.nx,muls.ny,sizeof(fftw_complex),(int)(&muls.wave[2][2])-(int)(&muls.wave[2][1]));
 
+	/* keep the stacking sequences, so that the simulation itself does not 
+	 * need the parameter file any more */
+	muls.sequences.clear();
+	resetParamFile();
+	while (readparam("sequence: ",buf,0)) muls.sequences.push_back(std::string(buf));
+
+	/* optics sweep, e.g.
+	 * sweep: df0 -60 -50 -40       (values)
+	 * sweep: Cs 1.0e7:1.4e7:0.2e7  (from:to:step)
+	 * runs the simulation for every combination of the values */
+	muls.sweeps.clear();
+	resetParamFile();
+	while (readparam("sweep: ",buf,0)) readSweep(muls,buf);
+	muls.sweepCacheMB = 1024;
+	if (readparam("sweep cache:",buf,1))
+		sscanf(buf,"%d",&(muls.sweepCacheMB));
 
 } /* end of readFile() */
 
+/* name of the file that keeps the wave of scan pixel (ix,iy) between slabs:
+ * probe q of nq (focal spread) and, with checkpoints, one of two files (alt >= 0) */
+static void probeWaveName(MULS &muls, char *fileName, int ix, int iy, int q, int nq, int alt) {
+	sprintf(fileName,"%s/mulswav_%d_%d",muls.folder,ix,iy);
+	if (nq > 1) sprintf(fileName+strlen(fileName),"_q%d",q);
+	if (alt >= 0) sprintf(fileName+strlen(fileName),"_%d",alt);
+	strcat(fileName,".img");
+}
+
+/* copies stacking sequence iseq (a 'sequence:' line of the parameter file)
+ * to buf and advances iseq, returns 0 if there are no more sequences */
+static int nextSequence(MULS &muls, int &iseq, char *buf) {
+	if (iseq >= (int)muls.sequences.size()) return 0;
+	strncpy(buf,muls.sequences[iseq++].c_str(),BUF_LEN-1);
+	buf[BUF_LEN-1] = '\0';
+	return 1;
+}
+
+
+/************************************************************************
+* buildSlices builds the potential slices (make3DSlices or, for custom
+* scattering factors, make3DSlicesFT if useFT is set) and the transmission
+* functions in muls.trans.
+* Without thermal diffuse scattering, partial occupancies and stacking
+* sequences, and if all slabs are equal, the transmission functions only
+* depend on the structure and the sampling, so a simulation that is run
+* again (pyqstem, stem3 --daemon) keeps the ones of the previous run.
+* setInputAtoms() invalidates them.
+* With TDS the configuration of a run only depends on the run and the
+* temperature (counter_rng.h), and a slab only on its position in the
+* unit cell (divCount of make3DSlices), so during a sweep the transmission
+* functions of the cellDiv slabs of every run are kept in st->runTrans for
+* the next points.  Only complete runs are used, so that make3DSlices never
+* continues with the structure of another run.
+***********************************************************************/
+static void buildSlices(MULS &muls, int useFT) {
+	SimState *st = simState(&muls);
+	int reusable,perRun,next=0,i;
+	size_t slabBytes = muls.trans.Size()*sizeof(fftwf_complex);
+	std::map<int,std::vector<boost::shared_ptr<Array3D<fftwf_complex> > > >::iterator run;
+
+	reusable = !muls.tds && muls.equalDivs && muls.sequences.empty();
+	if (reusable && st->transReady && !muls.trans.Empty()) {
+		if (muls.printLevel > 1) printf("reusing transmission functions of the previous run\n");
+		return;
+	}
+	perRun = muls.tds && !useFT && (st->runTransLimit > 0) && !muls.trans.Empty();
+	if (perRun) {
+		if (st->runTransTemp != muls.tds_temp) {
+			st->runTrans.clear();
+			st->runTransTemp = muls.tds_temp;
+		}
+		// the slab that make3DSlices would make next
+		next = ((st->divCount == 0) ? muls.cellDiv : st->divCount)-1;
+		run = st->runTrans.find(muls.avgCount);
+		if ((run != st->runTrans.end()) && ((int)run->second.size() == muls.cellDiv)) {
+			if (muls.printLevel > 1) printf("reusing transmission functions of run %d\n",muls.avgCount);
+			memcpy(muls.trans.Data(),run->second[muls.cellDiv-1-next]->Data(),slabBytes);
+			st->divCount = next;
+			return;
+		}
+	}
+	if (useFT && (muls.scatFactor == CUSTOM))
+		make3DSlicesFT(&muls);
+	else
+		make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
+	initSTEMSlices(&muls,muls.slices);
+	for (i=0;(reusable || perRun) && (i<muls.natom);i++) if (muls.atoms[i].occ < 1) reusable = perRun = 0;
+	st->transReady = reusable;
+	if (!perRun) return;
+	// a run is kept if all its slabs fit, starting with the first one
+	if ((next == muls.cellDiv-1) && (st->runTrans.find(muls.avgCount) == st->runTrans.end()) &&
+		((st->runTrans.size()+1)*muls.cellDiv*slabBytes <= st->runTransLimit))
+		st->runTrans[muls.avgCount].clear();
+	run = st->runTrans.find(muls.avgCount);
+	if ((run != st->runTrans.end()) && ((int)run->second.size() == muls.cellDiv-1-next))
+		run->second.push_back(boost::shared_ptr<Array3D<fftwf_complex> >(new Array3D<fftwf_complex>(muls.trans)));
+}
+
 
 
 /************************************************************************
 * doTOMO performs a Diffraction Tomography simulation
 *
-* This routine creates a script file which can then be run by a separate 
-* command.
+* The super cell is rotated about the y-axis by the tilts
+* tomoStart+k*tomoStep (k=0..tomoCount-1, in mrad) and put into the
+* center of a box that holds it at every tilt (the box is divided by
+* the zoom factor).  Every tilt is a CBED simulation of the rotated
+* atoms in this process (see setInputAtoms), with the probe in the
+* center of the box, so the potential lookup tables and FFT plans are
+* made once for the whole series.  Tilt k writes its files to
+* folder/tomo_<k>; the averaged patterns of all tilts are written to
+* one stack, folder/tomo_stack.img (pattern j in rows j*nx..(j+1)*nx-1,
+* parameters: 1/lambda and the tilt of every pattern in mrad), listed in
+* folder/tomo.txt.
+* With --shard i/N only every N-th tilt starting at tilt i is done,
+* and the stack of these tilts is tomo_stack_<i>.img (tomo_<i>.txt).
 * For now this routine will only allow tomography about the y-axis.
 * To do anything else one can start with a previously rotated super-cell.
 *
 * Important parameters: tomoStart, tomoStep, tomoCount, zoomFactor
 ***********************************************************************/
-void doTOMO() {
+void doTOMO(MULS &muls) {
+	if (muls.streamAtoms) {
+		printf("TOMO rotates the whole model, please set stream atoms: no\n");
+		exit(0);
+	}
 	double boxXmin=0,boxXmax=0,boxYmin=0,boxYmax=0,boxZmin=0,boxZmax=0;
-	double mAx,mBy,mCz;
-	int ix,iy,iz,iTheta,i;
-	double u[3],**Mm = NULL;
+	int ix,iy,iz,iTheta,i,j;
+	double u[3];
 	double theta = 0;
-	atom *atoms = NULL;
-	char cfgFile[512],stemFile[512],scriptFile[64],diffAnimFile[64];
-	FILE *fpScript,*fpDiffAnim;
-
-
-	Mm = muls.Mm;
-	atoms = (atom *)malloc(muls.natom*sizeof(atom));
+	char folder[512],fileName[512],suffix[32],systStr[600];
+	FILE *fp;
+	std::vector<atom> atoms(muls.natom);
+	std::vector<int> tilts;
+	std::vector<double> params;
+	Array3D<float_tt> stack;
+	MULS t = muls;   // the simulation of one tilt
 
 	boxXmin = boxXmax = muls.ax/2.0;
 	boxYmin = boxYmax = muls.by/2.0;
@@ -1607,6 +2090,8 @@ void doTOMO() {
 			boxZmin = boxZmin>u[2] ? u[2] : boxZmin; boxZmax = boxZmax<u[2] ? u[2] : boxZmax; 
 
 		}
+		// tilts of this process
+		if ((iTheta % muls.shardCount) == muls.shardIndex) tilts.push_back(iTheta);
 	} /* for iTheta ... */
 
 	// find max. box size:
@@ -1623,75 +2108,93 @@ void doTOMO() {
 	boxYmin = 0.5*boxYmax;
 	boxZmin = 0.5*boxZmax;
 
-	// We have to save the original unit cell dimensions
-	mAx = muls.ax; mBy = muls.by; mCz = muls.c;
-	muls.ax=boxXmax; muls.by=boxYmax; muls.c=boxZmax;
-
-	printf("Will use box sizes: %g x %g x %gA (kept original aspect ratio). \n"
-		"Writing structure files now, please wait ...\n",
-		boxXmax,boxYmax,boxZmax);
-
-	// open the script file and write the stem instructions in there
-	sprintf(scriptFile,"%s/run_tomo",muls.folder);
-	if ((fpScript=fopen(scriptFile,"w")) == NULL) {
-		printf("doTOMO: unable to open scriptFile %s for writing\n",scriptFile);
-		exit(0);
-	}
-	fprintf(fpScript,"#!/bin/bash\n\n");
-
-	// open the diffraction animation file 
-	sprintf(diffAnimFile,"%s/diff_anim",muls.folder);
-	if ((fpDiffAnim=fopen(diffAnimFile,"w")) == NULL) {
-		printf("doTOMO: unable to open diffraction animation %s for writing\n",diffAnimFile);
-		exit(0);
-	}
-	fprintf(fpDiffAnim,"#!/bin/bash\n\n");
-
-
-	// We will now rotate all the unit cell and write the answer to
-	// separate structure output files.
-	for (iTheta = 0;iTheta < muls.tomoCount;iTheta++) {
-		theta = muls.tomoStart + iTheta*muls.tomoStep; // theta in mrad
-		muls.tomoTilt = theta;
-
-		// rotate the structure and write result to local atom array
+	printf("Will use box sizes: %g x %g x %gA (kept original aspect ratio), %d of %d tilts\n",
+		boxXmax,boxYmax,boxZmax,(int)tilts.size(),muls.tomoCount);
+	if (tilts.empty()) return;
+
+	/* the same box for all tilts: a non-periodic CBED simulation of the
+	 * box as super cell, with the probe in its center */
+	t.state.reset();   // own atoms, phonon statistics and transmission functions
+	simState(&t)->rng.seed = randomSeed(&muls);
+	t.mode = CBED;
+	t.ax = boxXmax; t.by = boxYmax; t.c = boxZmax;
+	t.nCellX = t.nCellY = 1;
+	t.nCellZ = t.cellDiv;
+	t.resolutionX = t.ax/(double)t.nx;
+	t.resolutionY = t.by/(double)t.ny;
+	t.slices = (int)(t.c/(t.cellDiv*t.sliceThickness)+0.99)+t.centerSlices;
+	if (t.slices < 1) t.slices = 1;
+	t.outputInterval = t.slices;
+	t.equalDivs = ((!t.tds) && (fabs(t.slices*t.sliceThickness-t.c/t.cellDiv) < 1e-5));
+	t.nonPeriod = t.nonPeriodZ = 1;
+	t.scanXStart = t.scanXStop = 0.5*t.ax;
+	t.scanYStart = t.scanYStop = 0.5*t.by;
+	t.scanXN = t.scanYN = 1;
+	t.potNx = t.nx;
+	t.potNy = t.ny;
+	t.potSizeX = t.potNx*t.resolutionX;
+	t.potSizeY = t.potNy*t.resolutionY;
+	t.potOffsetX = t.scanXStart-0.5*t.potSizeX;
+	t.potOffsetY = t.scanYStart-0.5*t.potSizeY;
+	t.lbeams = 0;
+	t.cz = NULL;
+	t.keepPatterns = 1;
+	t.patterns.Free();
+	allocateTrans(t);
+
+	strcpy(folder,muls.folder);
+	if (muls.shardCount > 1) sprintf(suffix,"_%d",muls.shardIndex);
+	else suffix[0] = '\0';
+	stack.Resize((int)tilts.size(),muls.nx,muls.ny,"tomography stack");
+	params.resize(1+tilts.size());
+	params[0] = 1.0/wavelength(muls.v0);
+
+	for (j=0;j<(int)tilts.size();j++) {
+		theta = muls.tomoStart + tilts[j]*muls.tomoStep; // theta in mrad
+		t.tomoTilt = theta;
+		params[1+j] = theta;
+
+		// rotate the structure about the center of the box
 		for(i=0;i<(muls.natom);i++) {	
-			u[0] = muls.atoms[i].x - mAx/2.0; 
-			u[1] = muls.atoms[i].y - mBy/2.0; 
-			u[2] = muls.atoms[i].z - mCz/2.0; 
+			u[0] = muls.atoms[i].x - muls.ax/2.0; 
+			u[1] = muls.atoms[i].y - muls.by/2.0; 
+			u[2] = muls.atoms[i].z - muls.c/2.0; 
 			rotateVect(u,u,0,theta*1e-3,0);
+			atoms[i] = muls.atoms[i];
 			atoms[i].x = u[0]+boxXmin;
 			atoms[i].y = u[1]+boxYmin; 
 			atoms[i].z = u[2]+boxZmin; 
-			atoms[i].Znum = muls.atoms[i].Znum;
-			atoms[i].occ = muls.atoms[i].occ;
-			atoms[i].dw = muls.atoms[i].dw;
 		}
+		setInputAtoms(&t,&atoms[0],muls.natom);
 
-		sprintf(cfgFile,"%s/tomo_%dmrad.cfg",muls.folder,(int)theta);
-		sprintf(stemFile,"%s/tomo_%dmrad.dat",muls.folder,(int)theta);
-		printf("Writing file %s | ",cfgFile);
-		writeCFG(atoms,muls.natom,cfgFile,&muls);
-		sprintf(cfgFile,"tomo_%dmrad.cfg",(int)theta);
-		writeSTEMinput(stemFile,cfgFile,&muls);
-
-		// add to script files:
-		fprintf(fpScript,"stem tomo_%dmrad.dat\n",(int)theta);
-	}
-	muls.ax = mAx; muls.by = mBy; muls.c = mCz;
-	sprintf(stemFile,"copy fparams.dat %s/",muls.folder);
-	system(stemFile);
-
-	// close script files again
-	fprintf(fpDiffAnim,"convert -delay 20 diff*.jpg diff.gif\n");  
-	fclose(fpScript);
-	fclose(fpDiffAnim);
-	sprintf(stemFile,"chmod +x %s",scriptFile);
-	system(stemFile);
-	sprintf(stemFile,"chmod +x %s",diffAnimFile);
-	system(stemFile);
-
-	exit(0);
+		sprintf(t.folder,"%s/tomo_%d",folder,tilts[j]);
+		if (!DirExists(t.folder)) {
+			sprintf(systStr,"mkdir %s",t.folder);
+			system(systStr);
+		}
+		printf("Tilt %d (%g mrad) of %d\n",tilts[j],theta,muls.tomoCount);
+		if (t.precision == 2) doCBED<double>(t); else doCBED<float>(t);
+		memcpy(stack[j].Data(),t.patterns.Data(),(size_t)muls.nx*muls.ny*sizeof(float_tt));
+	}
+	lockPlanner();
+	fftwf_destroy_plan(t.fftPlanPotForw);
+	fftwf_destroy_plan(t.fftPlanPotInv);
+	unlockPlanner();
+	fftw_free(t.cz);
+
+	CImageIO imageIO((int)tilts.size()*muls.nx,muls.ny,0,1.0/(muls.nx*t.resolutionX),1.0/(muls.ny*t.resolutionY),
+		params,"Tomography stack of averaged diffraction patterns, unit: 1/A");
+	sprintf(fileName,"%s/tomo_stack%s.img",folder,suffix);
+	imageIO.WriteRealImage((void **)stack.Rows(0),fileName);
+
+	sprintf(fileName,"%s/tomo%s.txt",folder,suffix);
+	if ((fp = fopen(fileName,"w")) == NULL) printf("Warning: cannot write %s\n",fileName);
+	else {
+		fprintf(fp,"# pattern tilt tilt[mrad] folder\n");
+		for (j=0;j<(int)tilts.size();j++) 
+			fprintf(fp,"%d %d %g tomo_%d\n",j,tilts[j],params[1+j],tilts[j]);
+		fclose(fp);
+	}
 }
 
 /************************************************************************
@@ -1699,7 +2202,7 @@ void doTOMO() {
 * including phonons.
 *
 ***********************************************************************/
-void doMSCBED() {
+void doMSCBED(MULS &muls) {
 
 
 }
@@ -1713,7 +2216,8 @@ void doMSCBED() {
 *
 ***********************************************************************/
 
-void doNBED() 
+template <typename T>
+void doNBED(MULS &muls)
 {
 	// RAM: image reading is found in imagelib_fftw3
 	// Basic idea is to use the writeIMG function in Matlab and use it to pass in a complex-value probe to stem3.exe which can be rastered like a CBED probe
@@ -1721,7 +2225,7 @@ void doNBED()
 	// FIXME: With phonon calcs the original WavePtr is not being reloaded for each series, which produces some funky results.
 
 
-	int ix, iy, i, pCount, result;
+	int ix, iy, i, pCount, result, iseq;
 	FILE *avgFp, *fpWave, *fpPos, *fpNBED, *fpTest = 0;
 	double timer, timerTot;
 	double probeCenterX, probeCenterY, probeOffsetX, probeOffsetY;
@@ -1730,10 +2234,12 @@ void doNBED()
 	real **avgPendelloesung = NULL;
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
-	long iseed = 0;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+	counterRng source;   // offsets of the source (counter_rng.h)
+	double g[4];
+	boost::shared_ptr<WaveFunction<T> > wave(new WaveFunction<T>(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
 	std::vector<double> params(2);
+	TdsConvergence convergence(muls.nx*muls.ny,muls.sampling);
 
 	//printf("Debug doNBED: wavefile: %s\n",muls.fileWaveIn);
 
@@ -1749,7 +2255,8 @@ void doNBED()
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 
-	if (iseed == 0) iseed = -(long)time(NULL);
+	initCounterRng(&source,randomSeed(&muls),RNG_STREAM_SOURCE);
+	source.sampling = muls.sampling;   // the offsets are sampled like the displacements
 
 	if (muls.lbeams) {
 		muls.pendelloesung = NULL;
@@ -1763,16 +2270,13 @@ void doNBED()
 	probeCenterY = muls.scanYStart;
 
 	timerTot = 0; /* cputim();*/
-	displayProgress(-1);
+	displayProgress(muls,-1);
 
 	for (muls.avgCount = 0; muls.avgCount < muls.avgRuns; muls.avgCount++) {
 		muls.totalSliceCount = 0;
 		pCount = 0;
-		/* make sure we start at the beginning of the file
-		so we won't miss any line that contains a sequence,
-		because we will not do any EOF wrapping
-		*/
-		resetParamFile();
+		/* start with the first stacking sequence */
+		iseq = 0;
 
 		/* probe(&muls,xpos,ypos); */
 		/* make incident probe wave function with probe exactly in the center */
@@ -1780,8 +2284,9 @@ void doNBED()
 		* then also be adjusted, so that it is off-center
 		*/
 
-		probeOffsetX = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
-		probeOffsetY = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
+		counterGauss4(&source,muls.avgCount,0,0,g);
+		probeOffsetX = muls.sourceRadius*g[0]*SQRT_2;
+		probeOffsetY = muls.sourceRadius*g[1]*SQRT_2;
 		muls.scanXStart = probeCenterX + probeOffsetX;
 		muls.scanYStart = probeCenterY + probeOffsetY;
 
@@ -1822,7 +2327,7 @@ void doNBED()
 		}
 		//muls.nslic0 = 0;
 
-		result = readparam("sequence: ", buf, 0);
+		result = nextSequence(muls,iseq,buf);
 		while (result) {
 			if (((buf[0] < 'a') || (buf[0] > 'z')) &&
 				((buf[0] < '1') || (buf[0] > '9')) &&
@@ -1865,11 +2370,7 @@ void doNBED()
 			*exit(0);
 			************************************************/
 			if (muls.equalDivs) {
-				if (muls.scatFactor == CUSTOM)
-					make3DSlicesFT(&muls);
-				else
-					make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
-				initSTEMSlices(&muls, muls.slices);
+				buildSlices(muls,1);
 			}
 
 			muls.saveFlag = 0;
@@ -1883,11 +2384,7 @@ void doNBED()
 				* build the potential slices from atomic configuration
 				******************************************************/
 				if (!muls.equalDivs) {
-					if (muls.scatFactor == CUSTOM)
-						make3DSlicesFT(&muls);
-					else
-						make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
-					initSTEMSlices(&muls, muls.slices);
+					buildSlices(muls,1);
 				}
 
 				timer = cputim();
@@ -1908,7 +2405,7 @@ void doNBED()
 					muls.totalSliceCount += muls.slices;
 
 			} // end of for pCount = 0... 
-			result = readparam("sequence: ", buf, 0);
+			result = nextSequence(muls,iseq,buf);
 		}
 		/*    printf("Total CPU time = %f sec.\n", cputim()-timerTot ); */
 
@@ -1934,6 +2431,7 @@ void doNBED()
 
 		
 
+		convergence.Add(wave->diffpat.Data());
 		if (muls.avgCount == 0) {
 			memcpy((void *)wave->avgArray[0], (void *)wave->diffpat[0],
 				(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
@@ -1986,6 +2484,7 @@ void doNBED()
 					}
 					fclose(avgFp);
 				}
+				convergence.Write(muls.folder);
 			}
 			/*************************************************************/
 
@@ -2032,8 +2531,9 @@ void doNBED()
 				printf("Could not open file for pendelloesung plot\n");
 			}
 		} /* end of if lbemas ... */
-		displayProgress(1);
+		displayProgress(muls,1);
 	} /* end of for muls.avgCount=0.. */
+	if (muls.printLevel > 0) convergence.Print();
 	//delete(wave);
 }
 /************************************************************************
@@ -2045,8 +2545,9 @@ void doNBED()
 *
 ***********************************************************************/
 
-void doCBED() {
-	int ix,iy,i,pCount,result;
+template <typename T>
+void doCBED(MULS &muls) {
+	int ix,iy,i,k,pCount,result,iseq,nSrc;
 	FILE *avgFp, *fpCBED, *fpPos = 0, *fpTest = 0;
 	double timer,timerTot;
 	double probeCenterX,probeCenterY,probeOffsetX,probeOffsetY;
@@ -2055,14 +2556,20 @@ void doCBED() {
 	real **avgPendelloesung = NULL;
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
-	long iseed=0;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny, muls.resolutionX, muls.resolutionY));
+	counterRng source;   // offsets of the source (counter_rng.h)
+	double g[4];
+	boost::shared_ptr<WaveFunction<T> > wave(new WaveFunction<T>(muls.nx,muls.ny, muls.resolutionX, muls.resolutionY));
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
 	std::vector<double> params(2);
+	std::vector<double> srcX,srcW,srcOffX,srcOffY,srcWeight;
+	Array3D<typename FFTW<T>::complex> probeStates;
+	size_t waveBytes = wave->wave.Size()*sizeof(*wave->wave.Data());
+	TdsConvergence convergence(muls.nx*muls.ny,muls.sampling);
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 
-	if (iseed == 0) iseed = -(long) time( NULL );
+	initCounterRng(&source,randomSeed(&muls),RNG_STREAM_SOURCE);
+	source.sampling = muls.sampling;   // the offsets are sampled like the displacements
 
 	if (muls.lbeams) {
 		muls.pendelloesung = NULL;
@@ -2075,17 +2582,33 @@ void doCBED() {
 	probeCenterX = muls.scanXStart;
 	probeCenterY = muls.scanYStart;
 
+	/* source size quadrature: instead of one randomly shifted probe per run,
+	 * the probes shifted to the sourcePoints x sourcePoints Gauss-Hermite nodes
+	 * of the (Gaussian) source pass the same slices, and collectIntensity()
+	 * adds their patterns with the product weights (see WaveFunction::weight). */
+	nSrc = ((muls.sourcePoints > 1) && (muls.sourceRadius > 0)) ? muls.sourcePoints*muls.sourcePoints : 1;
+	if (nSrc > 1) {
+		srcX.resize(muls.sourcePoints);
+		srcW.resize(muls.sourcePoints);
+		gaussHermite(muls.sourcePoints,&srcX[0],&srcW[0]);
+		for (k=0;k<nSrc;k++) {
+			srcOffX.push_back(muls.sourceRadius*SQRT_2*srcX[k/muls.sourcePoints]);
+			srcOffY.push_back(muls.sourceRadius*SQRT_2*srcX[k%muls.sourcePoints]);
+			srcWeight.push_back(srcW[k/muls.sourcePoints]*srcW[k%muls.sourcePoints]);
+		}
+		probeStates.Resize(nSrc,muls.nx,muls.ny,"source size probes");
+		if (muls.sourceDistribution != SOURCE_GAUSSIAN)
+			printf("Warning: the source size quadrature of CBED assumes a Gaussian source\n");
+	}
+
 	timerTot = 0; /* cputim();*/
-	displayProgress(-1);
+	displayProgress(muls,-1);
 
 	for (muls.avgCount = 0;muls.avgCount < muls.avgRuns;muls.avgCount++) {
 		muls.totalSliceCount = 0;
 		pCount = 0;
-		/* make sure we start at the beginning of the file 
-		so we won't miss any line that contains a sequence,
-		because we will not do any EOF wrapping
-		*/
-		resetParamFile();
+		/* start with the first stacking sequence */
+		iseq = 0;
 
 		/* probe(&muls,xpos,ypos); */
 		/* make incident probe wave function with probe exactly in the center */
@@ -2093,11 +2616,22 @@ void doCBED() {
 		* then also be adjusted, so that it is off-center
 		*/
 
-		probeOffsetX = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
-		probeOffsetY = muls.sourceRadius*gasdev(&iseed)*SQRT_2;
-		muls.scanXStart = probeCenterX+probeOffsetX;
-		muls.scanYStart = probeCenterY+probeOffsetY;
-		probe(&muls, wave,muls.scanXStart-muls.potOffsetX,muls.scanYStart-muls.potOffsetY);
+		if (nSrc > 1) {
+			muls.scanXStart = probeCenterX;
+			muls.scanYStart = probeCenterY;
+			for (k=0;k<nSrc;k++) {
+				probe(&muls, wave,probeCenterX+srcOffX[k]-muls.potOffsetX,probeCenterY+srcOffY[k]-muls.potOffsetY);
+				memcpy(probeStates.Data()+(size_t)k*muls.nx*muls.ny,wave->wave.Data(),waveBytes);
+			}
+		}
+		else {
+			counterGauss4(&source,muls.avgCount,0,0,g);
+			probeOffsetX = muls.sourceRadius*g[0]*SQRT_2;
+			probeOffsetY = muls.sourceRadius*g[1]*SQRT_2;
+			muls.scanXStart = probeCenterX+probeOffsetX;
+			muls.scanYStart = probeCenterY+probeOffsetY;
+			probe(&muls, wave,muls.scanXStart-muls.potOffsetX,muls.scanYStart-muls.potOffsetY);
+		}
 		if (muls.saveLevel > 2) {
 			sprintf(systStr,"%s/wave_probe.img",muls.folder);
 			wave->WriteWave(systStr);
@@ -2117,7 +2651,10 @@ void doCBED() {
 				printf("Was unable to open file probepos.dat for writing\n");
 			}
 			else {
-				fprintf(fpPos,"%g %g\n",muls.scanXStart,muls.scanYStart);
+				if (nSrc > 1) for (k=0;k<nSrc;k++)
+					fprintf(fpPos,"%g %g\n",probeCenterX+srcOffX[k],probeCenterY+srcOffY[k]);
+				else
+					fprintf(fpPos,"%g %g\n",muls.scanXStart,muls.scanYStart);
 				fclose(fpPos);
 			}
 		}
@@ -2131,7 +2668,7 @@ void doCBED() {
 		}
 		//muls.nslic0 = 0;
 
-		result = readparam("sequence: ",buf,0);
+		result = nextSequence(muls,iseq,buf);
 		while (result) {
 			if (((buf[0] < 'a') || (buf[0] > 'z')) && 
 				((buf[0] < '1') || (buf[0] > '9')) &&
@@ -2174,11 +2711,7 @@ void doCBED() {
 			*exit(0);
 			************************************************/
 			if (muls.equalDivs) {
-				if (muls.scatFactor == CUSTOM)
-					make3DSlicesFT(&muls);
-				else
-					make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-				initSTEMSlices(&muls,muls.slices);
+				buildSlices(muls,1);
 			}
 
 			muls.saveFlag = 0;
@@ -2192,16 +2725,23 @@ void doCBED() {
 				* build the potential slices from atomic configuration
 				******************************************************/
 				if (!muls.equalDivs) {
-					if (muls.scatFactor == CUSTOM)
-						make3DSlicesFT(&muls);
-					else
-						make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-					initSTEMSlices(&muls,muls.slices);
+					buildSlices(muls,1);
 				}
 
 				timer = cputim();
-				// what probe should runMulsSTEM use here?
-				runMulsSTEM(&muls,wave); 
+				if (nSrc > 1) {
+					/* propagate every shifted probe through this slab */
+					for (k=0;k<nSrc;k++) {
+						memcpy(wave->wave.Data(),probeStates.Data()+(size_t)k*muls.nx*muls.ny,waveBytes);
+						wave->weight = srcWeight[k];
+						wave->lastProbe = (k == nSrc-1);
+						runMulsSTEM(&muls,wave); 
+						memcpy(probeStates.Data()+(size_t)k*muls.nx*muls.ny,wave->wave.Data(),waveBytes);
+					}
+				}
+				else {
+					runMulsSTEM(&muls,wave); 
+				}
 
 				printf("Thickness: %gA, int.=%g, time: %gsec\n",
 					wave->thickness,wave->intIntensity,cputim()-timer);
@@ -2217,7 +2757,7 @@ void doCBED() {
 				muls.totalSliceCount += muls.slices;
 
 			} // end of for pCount = 0... 
-			result = readparam("sequence: ",buf,0);
+			result = nextSequence(muls,iseq,buf);
 		}
 		/*    printf("Total CPU time = %f sec.\n", cputim()-timerTot ); */
 
@@ -2240,6 +2780,7 @@ void doCBED() {
 		// RAM: old code
 		//wave->ReadDiffPat(avgName);
 
+		convergence.Add(wave->diffpat.Data());
 		if (muls.avgCount == 0) {
 			memcpy((void *)wave->avgArray[0],(void *)wave->diffpat[0],
 				(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
@@ -2292,6 +2833,7 @@ void doCBED() {
 					}
 					fclose(avgFp);
 				}
+				convergence.Write(muls.folder);
 			}
 			/*************************************************************/
 
@@ -2338,8 +2880,15 @@ void doCBED() {
 				printf("Could not open file for pendelloesung plot\n");
 			}  
 		} /* end of if lbemas ... */
-		displayProgress(1);
+		// averaged pattern in memory, for library users and doTOMO
+		if (muls.keepPatterns) {
+			if ((muls.patterns.Nz() != 1) || (muls.patterns.Nx() != muls.nx) || (muls.patterns.Ny() != muls.ny))
+				muls.patterns.Resize(1,muls.nx,muls.ny,"patterns");
+			memcpy(muls.patterns.Data(),wave->avgArray.Data(),(size_t)muls.nx*muls.ny*sizeof(float_tt));
+		}
+		displayProgress(muls,1);
 	} /* end of for muls.avgCount=0.. */
+	if (muls.printLevel > 0) convergence.Print();
 	//delete(wave);
 }
 /************************************************************************
@@ -2351,12 +2900,13 @@ void doCBED() {
 *
 ***********************************************************************/
 
-void doTEM() {
+template <typename T>
+void doTEM(MULS &muls) {
 	const double pi=3.1415926535897;
-	int ix,iy,i,pCount,result;
+	int ix,iy,i,pCount,result,iseq;
 	FILE *avgFp,*fpTEM; // *fpPos=0;
 	double timer,timerTot;
-	double x,y,ktx,kty;
+	double x,y,ktx,kty,wr;
 	char buf[BUF_LEN],avgName[256],systStr[512];
 	char *comment;
 	real t;
@@ -2365,8 +2915,10 @@ void doTEM() {
 	int oldMulsRepeat2 = 1;
 	long iseed=0;
 	std::vector<double> params;
-	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny,muls.resolutionX,muls.resolutionY));
-	fftwf_complex **imageWave = NULL;
+	boost::shared_ptr<WaveFunction<T> > wave(new WaveFunction<T>(muls.nx,muls.ny,muls.resolutionX,muls.resolutionY));
+	typename FFTW<T>::complex **imageWave = NULL;
+	Array3D<float_tt> imageSeries;   // defocus series (tem_imaging.h)
+	TdsConvergence convergence(muls.nx*muls.ny,muls.sampling);
 
 	if (iseed == 0) iseed = -(long) time( NULL );
 
@@ -2382,12 +2934,12 @@ void doTEM() {
 	}
 
 	timerTot = 0; /* cputim();*/
-	displayProgress(-1);
+	displayProgress(muls,-1);
 	for (muls.avgCount = 0;muls.avgCount < muls.avgRuns;muls.avgCount++) {
 		muls.totalSliceCount = 0;
 
 		pCount = 0;
-		resetParamFile();
+		iseq = 0;
 
 		/* make incident probe wave function with probe exactly in the center */
 		/* if the potential array is not big enough, the probe can 
@@ -2412,14 +2964,14 @@ void doTEM() {
 			for (ix=0;ix<muls.nx;ix++) {
 				x = muls.resolutionX*(ix-muls.nx/2);
 				for (iy=0;iy<muls.ny;iy++) {
-					y = muls.resolutionY*(ix-muls.nx/2);
-					wave->wave[ix][iy][0] = (float)cos(ktx*x+kty*y);	
-					wave->wave[ix][iy][1] = (float)sin(ktx*x+kty*y);
+					y = muls.resolutionY*(iy-muls.ny/2);
+					wave->wave[ix][iy][0] = (T)cos(ktx*x+kty*y);	
+					wave->wave[ix][iy][1] = (T)sin(ktx*x+kty*y);
 				}
 			}
 		}
 
-		result = readparam("sequence: ",buf,0);
+		result = nextSequence(muls,iseq,buf);
 		while (result) {
 			if (((buf[0] < 'a') || (buf[0] > 'z')) && 
 				((buf[0] < '1') || (buf[0] > '9')) &&
@@ -2462,8 +3014,7 @@ void doTEM() {
 			************************************************/
 			if (muls.equalDivs) {
 				if (muls.printLevel > 1) printf("found equal unit cell divisions\n");
-				make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-				initSTEMSlices(&muls,muls.slices);
+				buildSlices(muls,0);
 			}
 
 			muls.saveFlag = 0;
@@ -2477,8 +3028,7 @@ void doTEM() {
 				******************************************************/
 				// if ((muls.tds) || (muls.nCellZ % muls.cellDiv != 0)) {
 				if (!muls.equalDivs) {
-					make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-					initSTEMSlices(&muls,muls.slices);
+					buildSlices(muls,0);
 				}
 
 				timer = cputim();
@@ -2501,9 +3051,11 @@ void doTEM() {
 						for (ix=0;ix<muls.nx;ix++) {
 							x = muls.resolutionX*(ix-muls.nx/2);
 							for (iy=0;iy<muls.ny;iy++) {
-								y = muls.resolutionY*(ix-muls.nx/2);
-								wave->wave[ix][iy][0] *= cos(ktx*x+kty*y);	
-								wave->wave[ix][iy][1] *= sin(ktx*x+kty*y);
+								y = muls.resolutionY*(iy-muls.ny/2);
+								// multiply by exp(i(ktx*x+kty*y))
+								wr = wave->wave[ix][iy][0];
+								wave->wave[ix][iy][0] = (T)(wr*cos(ktx*x+kty*y)-wave->wave[ix][iy][1]*sin(ktx*x+kty*y));
+								wave->wave[ix][iy][1] = (T)(wr*sin(ktx*x+kty*y)+wave->wave[ix][iy][1]*cos(ktx*x+kty*y));
 							}
 						}
 						if (muls.printLevel > 1) printf("** Applied beam tilt compensation **\n");
@@ -2534,7 +3086,7 @@ void doTEM() {
 #endif 
 
 			} 
-			result = readparam("sequence: ",buf,0);
+			result = nextSequence(muls,iseq,buf);
 		} 
 		/////////////////////////////////////////////////////////////////////////////
 		// finished propagating through whole sample, we're at the exit surface now.
@@ -2542,10 +3094,13 @@ void doTEM() {
 		// and diffraction patterns.
 		//////////////////////////////////////////////////////////////////////////////
 
+		if (!muls.imageDefoci.empty()) temImageSeries(muls,*wave,imageSeries);
+
 		sprintf(avgName,"%s/diff.img",muls.folder);
 
 		wave->ReadDiffPat(avgName);
 
+		convergence.Add(wave->diffpat.Data());
 		if (muls.avgCount == 0) {
 			/***********************************************************
 			* Save the diffraction pattern
@@ -2578,15 +3133,15 @@ void doTEM() {
 			* all the different defoci, inverse FFT and save each image.
 			* diffArray will be overwritten with the image.
 			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
+			if (imageWave == NULL) imageWave = FFTW<T>::Complex2D(muls.nx,muls.ny,"imageWave");
 			// multiply wave (in rec. space) with transfer function and write result to imagewave
-			fftwf_execute(wave->fftPlanWaveForw);
+			wave->FFTForward();
 			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
 				// here, we apply the CTF:
 				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
 				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
 			}
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
+			executePlan(wave->fftPlanWaveInv,imageWave[0]);
 			// get the amplitude squared:
 			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
 				wave->diffpat[ix][iy] = imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1];
@@ -2619,6 +3174,7 @@ void doTEM() {
 				}
 				fclose(avgFp);
 			}
+			convergence.Write(muls.folder);
 			/*************************************************************/
 
 			/***********************************************************
@@ -2640,23 +3196,15 @@ void doTEM() {
 			* all the different defoci, inverse FFT and save each image.
 			* diffArray will be overwritten with the image.
 			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
+			if (imageWave == NULL) imageWave = FFTW<T>::Complex2D(muls.nx,muls.ny,"imageWave");
 			// multiply wave (in rec. space) with transfer function and write result to imagewave
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
-#elif FLOAT_PRECISION == 2
-			fftw_execute(wave->fftPlanWaveForw);
-#endif
+			wave->FFTForward();
 
 			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
 				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
 				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
 			}
-#if FLOAT_PRECISION == 1
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-#elif FLOAT_PRECISION == 2
-			fftw_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-#endif
+			executePlan(wave->fftPlanWaveInv,imageWave[0]);
 
 			// save the amplitude squared:
 			sprintf(avgName,"%s/image.img",muls.folder); 
@@ -2705,8 +3253,9 @@ void doTEM() {
 				printf("Could not open file for pendelloesung plot\n");
 			}	
 		} /* end of if lbemas ... */		 
-		displayProgress(1);
+		displayProgress(muls,1);
 	} /* end of for muls.avgCount=0.. */  
+	if (muls.printLevel > 0) convergence.Print();
 }
 /************************************************************************
 * end of doTEM
@@ -2714,52 +3263,266 @@ void doTEM() {
 
 
 
+/************************************************************************
+* doPED performs a precession electron diffraction calculation.
+* The tilts of the precession cone (see precession.h) pass every slab
+* of the potential together, their de-tilted diffraction patterns are
+* averaged over the tilts and TDS runs and written to ped.img, with
+* 'precession tilt patterns: yes' also per tilt to ped_<k>.img.
+***********************************************************************/
+template <typename T>
+void doPED(MULS &muls) {
+	int i,k,ix,pCount,result,iseq,nTilts;
+	double timer,sum,t;
+	char buf[BUF_LEN],fileName[512];
+	FILE *fp;
+	std::vector<precessionTilt> tilts;
+	std::vector<double> params(2);
+	Array3D<typename FFTW<T>::complex> waves;
+	Array3D<float_tt> patterns,avgTilts;
+
+	precessionTilts(muls,tilts);
+	nTilts = (int)tilts.size();
+	Array2D<float_tt> avgPattern(muls.nx,muls.ny,"precession pattern");
+	Array2D<float_tt> runPattern(muls.nx,muls.ny,"precession pattern of one run");
+	TdsConvergence convergence(muls.nx*muls.ny,muls.sampling);
+	if (muls.pedSaveTilts) avgTilts.Resize(nTilts,muls.nx,muls.ny,"precession tilt patterns");
+	CImageIO imageIO(muls.nx,muls.ny,0,1.0/(muls.nx*muls.resolutionX),1.0/(muls.ny*muls.resolutionY));
+	params[0] = muls.pedAngle;
+	params[1] = 1.0/wavelength(muls.v0);
+	imageIO.SetParams(params);
+
+	sprintf(fileName,"%s/pedTilts.txt",muls.folder);
+	if ((fp = fopen(fileName,"w")) == NULL) printf("Warning: cannot write %s\n",fileName);
+	else {
+		fprintf(fp,"# tilt tiltX[mrad] tiltY[mrad] beam pixel (x,y), de-tilt shift (x,y)\n");
+		for (k=0;k<nTilts;k++)
+			fprintf(fp,"%d %g %g %d %d %d %d\n",k,1000*tilts[k].tiltX,1000*tilts[k].tiltY,
+				tilts[k].beamX,tilts[k].beamY,tilts[k].shiftX,tilts[k].shiftY);
+		fclose(fp);
+	}
+
+	muls.chisq = std::vector<double>(muls.avgRuns);
+	displayProgress(muls,-1);
+	for (muls.avgCount = 0;muls.avgCount < muls.avgRuns;muls.avgCount++) {
+		muls.totalSliceCount = 0;
+		iseq = 0;
+		precessionIncidentWaves<T>(muls,tilts,waves);
+
+		result = nextSequence(muls,iseq,buf);
+		while (result) {
+			if (((buf[0] < 'a') || (buf[0] > 'z')) && 
+				((buf[0] < '1') || (buf[0] > '9')) &&
+				((buf[0] < 'A') || (buf[0] > 'Z'))) {
+					printf("Can only work with old stacking sequence\n");
+					break;
+			}
+			muls.mulsRepeat1 = 1;
+			muls.mulsRepeat2 = 1;
+			sscanf(buf,"%d %d",&muls.mulsRepeat1,&muls.mulsRepeat2);
+			for (i=0;i<(int)strlen(buf);i++) buf[i] = 0;
+			if (muls.mulsRepeat2 < 1) muls.mulsRepeat2 = 1;
+			sprintf(muls.cin2,"%d",muls.mulsRepeat1);
+
+			/* one potential for all tilts */
+			if (muls.equalDivs) buildSlices(muls,0);
+			for (pCount=0;pCount<muls.mulsRepeat2*muls.cellDiv;pCount++) {
+				if (!muls.equalDivs) buildSlices(muls,0);
+				timer = cputim();
+				precessionSlab<T>(muls,waves);
+				muls.totalSliceCount += muls.slices*muls.mulsRepeat1;
+				if (muls.printLevel > 0)
+					printf("t=%gA, %d tilts, time: %gsec (avgCount=%d)\n",
+						muls.totalSliceCount*muls.sliceThickness,nTilts,cputim()-timer,muls.avgCount);
+			}
+			result = nextSequence(muls,iseq,buf);
+		}
+
+		/* average the de-tilted patterns over the tilts and TDS runs */
+		precessionPatterns<T>(muls,tilts,waves,patterns);
+		for (ix=0;ix<muls.nx*muls.ny;ix++) {
+			t = 0;
+			for (k=0;k<nTilts;k++) t += patterns[k].Data()[ix];
+			runPattern[0][ix] = (float_tt)(t/nTilts);
+		}
+		convergence.Add(runPattern.Data());
+		sum = 0;
+		for (ix=0;ix<muls.nx*muls.ny;ix++) {
+			t = (muls.avgCount*avgPattern[0][ix]+runPattern[0][ix])/(muls.avgCount+1);
+			sum += (avgPattern[0][ix]-t)*(avgPattern[0][ix]-t);
+			avgPattern[0][ix] = (float_tt)t;
+		}
+		if (muls.avgCount > 0) muls.chisq[muls.avgCount-1] = sum/(double)(muls.nx*muls.ny);
+		imageIO.SetThickness(muls.totalSliceCount*muls.sliceThickness);
+		imageIO.SetComment("Precession averaged diffraction pattern, unit: 1/A");
+		sprintf(fileName,"%s/ped.img",muls.folder);
+		imageIO.WriteRealImage((void **)avgPattern.Rows(),fileName);
+		if (muls.pedSaveTilts) {
+			imageIO.SetComment("De-tilted diffraction pattern of one precession tilt, unit: 1/A");
+			for (k=0;k<nTilts;k++) {
+				float_tt *avg = avgTilts[k].Data();
+				const float_tt *pattern = patterns[k].Data();
+				for (ix=0;ix<muls.nx*muls.ny;ix++) avg[ix] = (muls.avgCount*avg[ix]+pattern[ix])/(muls.avgCount+1);
+				sprintf(fileName,"%s/ped_%d.img",muls.folder,k);
+				imageIO.WriteRealImage((void **)avgTilts.Rows(k),fileName);
+			}
+		}
+		if (muls.avgCount > 0) {
+			sprintf(fileName,"%s/avgresults.dat",muls.folder);
+			if ((fp = fopen(fileName,"w")) == NULL)
+				printf("Sorry, could not open data file for averaging\n");
+			else {
+				for (ix=0;ix<muls.avgCount;ix++) fprintf(fp,"%d %g\n",ix+1,muls.chisq[ix]);
+				fclose(fp);
+			}
+			convergence.Write(muls.folder);
+		}
+		displayProgress(muls,1);
+	}
+	if (muls.printLevel > 0) convergence.Print();
+}
+/************************************************************************
+* end of doPED
+***********************************************************************/
+
+
+
 /************************************************************************
 * doSTEM performs a STEM calculation
 *
 ***********************************************************************/
 
-void doSTEM() {
-	int ix=0,iy=0,i,pCount,picts,ixa,iya,totalRuns;
+template <typename T>
+void doSTEM(MULS &muls) {
+	int ix=0,iy=0,i,it,pCount,picts,ixa,iya,shardPixels,iseq;
+	int slab,firstAvgCount,resumeAvgCount=-1,resumeSlab=-1;
+	int adaptive,pixelMode,runPixels,done;
+	double resumeIntensity=0;
 	double timer, total_time=0;
 	char buf[BUF_LEN];
 	real t;
-	static real **avgArray=NULL;
 	double collectedIntensity;
+	int q,nq,randomEnergy,converge,n;
+	double focalSpread,g[4];
+	std::vector<double> qx,qw;
+	counterRng energy;   // energy deviations of adaptive runs (counter_rng.h)
+	std::vector<float_tt> lastMeans,runImages;
+	size_t scanPixels = (size_t)muls.scanXN*muls.scanYN,j;
 
-	std::vector<WavePtr> waves;
-	WavePtr wave;
+	std::vector<boost::shared_ptr<WaveFunction<T> > > waves;
+	boost::shared_ptr<WaveFunction<T> > wave;
 
 	//pre-allocate several waves (enough for one row of the scan.  
-	for (int th=0; th<omp_get_max_threads(); th++)
+	// With wave-level parallelism all threads share a single wave.
+	for (int th=0; th<((muls.waveThreads > 1) ? 1 : omp_get_max_threads()); th++)
 	{
-		waves.push_back(WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY)));
+		waves.push_back(boost::shared_ptr<WaveFunction<T> >(new WaveFunction<T>(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY)));
 	}
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
-	totalRuns = muls.avgRuns;
+	/* with --shard-runs only one block of the TDS runs is done by this process */
+	muls.avgStart = (muls.runShardIndex*muls.avgRuns)/muls.runShardCount;
+	muls.avgStop = ((muls.runShardIndex+1)*muls.avgRuns)/muls.runShardCount;
+	if (muls.keepPatterns && ((muls.patterns.Nz() != muls.scanXN*muls.scanYN) ||
+		(muls.patterns.Nx() != muls.nx) || (muls.patterns.Ny() != muls.ny)))
+		muls.patterns.Resize(muls.scanXN*muls.scanYN,muls.nx,muls.ny,"patterns");
+	/* with --shard only every shardCount-th scan pixel is done */
+	shardPixels = (muls.scanXN*muls.scanYN-muls.shardIndex+muls.shardCount-1)/muls.shardCount;
 	timer = cputim();
 
+	/* continue from the last checkpoint: this restores the detector images, 
+	 * and tells us which run, slab and pixels are already done */
+	firstAvgCount = muls.avgStart;
+	if (muls.resume && readCheckpoint(&muls,&resumeAvgCount,&resumeSlab,&resumeIntensity)) {
+		if ((resumeAvgCount >= muls.avgStart) && (resumeAvgCount < muls.avgStop))
+			firstAvgCount = resumeAvgCount;
+		else resumeAvgCount = -1;
+	}
+
+	/* adaptive number of runs: stop once the detector images have converged.
+	 * The images of a shard only hold part of the runs or pixels, and the
+	 * checkpoints assume that every run does all pixels. */
+	adaptive = muls.tds && (muls.tdsStopError > 0) && (muls.shardCount == 1) && (muls.runShardCount == 1);
+	if (muls.tds && (muls.tdsStopError > 0) && !adaptive)
+		printf("Warning: tds stop error is ignored for sharded runs, doing all %d runs\n",muls.avgRuns);
+	pixelMode = adaptive && muls.tdsStopPixels;
+	if (pixelMode && (muls.resume || (muls.checkpointInterval > 0))) {
+		printf("Warning: tds stop pixels does not work with checkpoints, stopping all pixels at once\n");
+		pixelMode = 0;
+	}
+	TdsStopping stop(muls.scanXN*muls.scanYN,muls.tdsStopError,muls.tdsMinRuns,pixelMode);
+	if (firstAvgCount > muls.avgStart) stop.SetRuns(firstAvgCount-muls.avgStart);
+	simState(&muls)->tdsStop = pixelMode ? &stop : NULL;
+
+	/* focal spread: Gauss-Hermite quadrature over the defocus of the probes 
+	 * of every pixel, instead of one energy deviation per TDS run (dE_EArray) */
+	focalSpread = muls.Cc*muls.energySpread;
+	nq = ((muls.focalSpreadPoints > 1) && (focalSpread > 0)) ? muls.focalSpreadPoints : 1;
+	qx.resize(nq);
+	qw.resize(nq);
+	gaussHermite(nq,&qx[0],&qw[0]);
+	if ((nq > 1) && (muls.printLevel > 0)) 
+		printf("Focal spread %g A: %d probes per pixel\n",focalSpread,nq);
+	/* The ladder of energy deviations in dE_EArray is made for avgRuns runs,
+	 * from the centre out, so a run that stops early would average over a
+	 * too narrow energy spread.  With adaptive stopping every run draws its
+	 * own deviation instead, with the width of the ladder. */
+	randomEnergy = adaptive && (nq == 1) && (muls.energySpread > 0);
+	if (randomEnergy) {
+		initCounterRng(&energy,randomSeed(&muls),RNG_STREAM_ENERGY);
+		energy.sampling = muls.sampling;
+		printf("Warning: tds stop error with an energy spread: dE/E is random for every run (focal spread points > 1 averages it exactly)\n");
+	}
+
+	/* convergence of the detector images of the final thickness
+	 * (convergence.dat).  The images hold the average over the runs, so
+	 * the image of a run is taken from the averages before and after it.
+	 * Not done if the pixels stop one by one, for shards, or when
+	 * continuing from a checkpoint, since then the images do not hold
+	 * whole runs. */
+	TdsConvergence convergence(scanPixels*muls.detectorNum,muls.sampling);
+	converge = muls.tds && !pixelMode && (muls.shardCount == 1) && (muls.runShardCount == 1) &&
+		(firstAvgCount == muls.avgStart) && (resumeAvgCount < 0);
+	if (converge) {
+		lastMeans.resize(scanPixels*muls.detectorNum);
+		runImages.resize(scanPixels*muls.detectorNum);
+	}
+
 	/* average over several runs of for TDS */
-	displayProgress(-1);
+	displayProgress(muls,-1);
 
-	for (muls.avgCount = 0;muls.avgCount < totalRuns; muls.avgCount++) {
+	for (muls.avgCount = firstAvgCount;muls.avgCount < muls.avgStop; muls.avgCount++) {
 		total_time = 0;
 		collectedIntensity = 0;
+		if (muls.avgCount == resumeAvgCount) {
+			// rebuild the same potential as in the interrupted run
+			checkpointRestoreRandomState(&muls);
+			collectedIntensity = resumeIntensity;
+		}
+		checkpointRunStart(&muls);
+		runPixels = pixelMode ? stop.ActivePixels() : shardPixels;
+		slab = 0;
 		muls.totalSliceCount = 0;
-		muls.dE_E = muls.dE_EArray[muls.avgCount];
+		if (nq > 1) muls.dE_E = 0;
+		else if (randomEnergy) {
+			counterGauss4(&energy,muls.avgCount,0,0,g);
+			muls.dE_E = g[0]*muls.energySpread*sqrt(2.0)/PI;
+		}
+		else muls.dE_E = muls.dE_EArray[muls.avgCount];
+		// number of runs already averaged into the detector images:
+		for (it=0;it<(int)muls.detectors.size();it++) for (i=0;i<muls.detectorNum;i++)
+			muls.detectors[it][i]->Navg = muls.avgCount-muls.avgStart;
+		for (i=0;converge && (i<muls.detectorNum);i++) 
+			memcpy(&lastMeans[i*scanPixels],muls.detectors.back()[i]->image.Data(),scanPixels*sizeof(float_tt));
 
 
 		/****************************************
 		* do the (big) loop
 		*****************************************/
 		pCount = 0;
-		/* make sure we start at the beginning of the file 
-		so we won't miss any line that contains a sequence,
-		because we will not do any EOF wrapping
-		*/
-		resetParamFile();
-		while (readparam("sequence: ",buf,0)) {
+		/* start with the first stacking sequence */
+		iseq = 0;
+		while (nextSequence(muls,iseq,buf)) {
 			if (((buf[0] < 'a') || (buf[0] > 'z')) && 
 				((buf[0] < '1') || (buf[0] > '9')) &&
 				((buf[0] < 'A') || (buf[0] > 'Z'))) {
@@ -2793,23 +3556,28 @@ void doSTEM() {
 			picts *= muls.cellDiv;
 
 			if (muls.equalDivs) {
-				make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
-				initSTEMSlices(&muls, muls.slices);
+				buildSlices(muls,0);
 				timer = cputim();
 			}
 
 			/****************************************
 			* do the (small) loop over slabs
 			*****************************************/
-			for (pCount=0;pCount<picts;pCount++) {
+			for (pCount=0;pCount<picts;pCount++,slab++) {
 				/*******************************************************
 				* build the potential slices from atomic configuration
 				******************************************************/
 				if (!muls.equalDivs) {
-					make3DSlices(&muls,muls.slices,muls.atomPosFile,NULL);
-					initSTEMSlices(&muls,muls.slices);
+					buildSlices(muls,0);
 					timer = cputim();
 				}
+				/* slabs that were finished before the checkpoint only need to 
+				 * build their potential, to keep the random sequence in step */
+				if ((muls.avgCount == resumeAvgCount) && (slab < resumeSlab)) {
+					muls.totalSliceCount += muls.slices;
+					continue;
+				}
+				checkpointSlabStart(&muls,slab);
 
 				muls.complete_pixels=0;
 				/**************************************************
@@ -2818,12 +3586,15 @@ void doSTEM() {
 				// default(none) forces us to specify all of the variables that are used in the parallel section.  
 				//    Otherwise, they are implicitly shared (and this was cause of several bugs.)
 #pragma omp parallel \
-	private(ix, iy, ixa, iya, wave, t, timer) \
-	shared(pCount, picts, muls, collectedIntensity, total_time, waves) \
-	default(none)
+	private(ix, iy, ixa, iya, wave, t, timer, q) \
+	shared(pCount, picts, muls, collectedIntensity, total_time, waves, nq, qx, qw, focalSpread, stop) \
+	default(none) if (muls.waveThreads <= 1)
 #pragma omp for
 				for (i=0; i < (muls.scanXN * muls.scanYN); i++)
 				{
+					if ((i % muls.shardCount) != muls.shardIndex) continue;
+					if (checkpointPixelIsDone(&muls,i)) continue;
+					if (!stop.Active(i)) continue;
 					timer=cputim();
 					ix = i / muls.scanYN;
 					iy = i % muls.scanYN;
@@ -2832,31 +3603,6 @@ void doSTEM() {
 							
 					//printf("Scanning: %d %d %d %d\n",ix,iy,pCount,muls.nx);
 
-					/* if this is run=0, create the inc. probe wave function */
-					if (pCount == 0) 
-					{
-						probe(&muls, wave, muls.nx/2*muls.resolutionX, muls.ny/2*muls.resolutionY);
-
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = 0;
-						//wave->thickness = 0.0;
-					}
-                                          
-					else 
-					{
-						/* load incident wave function and then propagate it */
-						sprintf(wave->fileStart, "%s/mulswav_%d_%d.img", muls.folder, ix, iy);
-						readStartWave(wave);  /* this also sets the thickness!!! */
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = pCount;
-					}
-					/* run multislice algorithm
-					   and save exit wave function for this position 
-					   (done by runMulsSTEM), 
-					   but we need to define the file name */
-					sprintf(wave->fileout,"%s/mulswav_%d_%d.img",muls.folder,ix,iy);
-					muls.saveFlag = 1;
-
 					wave->iPosX =(int)(ix*(muls.scanXStop-muls.scanXStart)/
 									  ((float)muls.scanXN*muls.resolutionX));
 					wave->iPosY = (int)(iy*(muls.scanYStop-muls.scanYStart)/
@@ -2874,18 +3620,52 @@ void doSTEM() {
 					wave->detPosX=ix;
 					wave->detPosY=iy;
 
-					runMulsSTEM(&muls,wave); 
-
-
-					/***************************************************************
-					* In order to save some disk space we will add the diffraction 
-					* patterns to their averages now.  The diffraction pattern 
-					* should be stored in wave->diffpat (which each thread has independently), 
-					* if collectIntensity() has been executed correctly.
-					***************************************************************/
+					/* the probes of the focal spread quadrature (one without it) pass
+					 * the same slices, their signals are added with weights qw.
+					 * They run one after the other through the wave of this thread
+					 * and its FFT plans, which are made once per thread.  Batching
+					 * them through one plan (fftw_plan_many_dft) would need nq wave
+					 * buffers per thread and a runMulsSTEM that propagates several
+					 * waves at once; the threads are already kept busy by the pixels. */
+					for (q=0;q<nq;q++) {
+						wave->defocusOffset = qx[q]*focalSpread;
+						wave->weight = qw[q];
+						wave->lastProbe = (q == nq-1);
+
+						/* if this is run=0, create the inc. probe wave function */
+						if (pCount == 0) 
+						{
+							probe(&muls, wave, muls.nx/2*muls.resolutionX, muls.ny/2*muls.resolutionY);
+						}
+						else 
+						{
+							/* load incident wave function and then propagate it.
+							 * With checkpoints the slabs alternate between two files, so that
+							 * a pixel repeated after a restart still finds the wave of the 
+							 * previous slab. */
+							probeWaveName(muls,wave->fileStart,ix,iy,q,nq,(muls.checkpointInterval > 0) ? (pCount-1)%2 : -1);
+							readStartWave(wave);  /* this also sets the thickness!!! */
+						}
+						/* run multislice algorithm
+						   and save exit wave function for this position 
+						   (done by runMulsSTEM), 
+						   but we need to define the file name */
+						probeWaveName(muls,wave->fileout,ix,iy,q,nq,
+							((muls.checkpointInterval > 0) && (pCount < picts-1)) ? pCount%2 : -1);
+						muls.saveFlag = 1;
+
+						runMulsSTEM(&muls,wave); 
+
+						/***************************************************************
+						* In order to save some disk space we will add the diffraction 
+						* patterns to their averages now.  The diffraction pattern 
+						* should be stored in wave->diffpat (which each thread has independently), 
+						* if collectIntensity() has been executed correctly.
+						***************************************************************/
 
-					#pragma omp atomic
-					collectedIntensity += wave->intIntensity;
+						#pragma omp atomic
+						collectedIntensity += qw[q]*wave->intIntensity;
+					}
 
 					if (pCount == picts-1)  /* if this is the last slice ... */
 					{
@@ -2894,7 +3674,7 @@ void doSTEM() {
 
 						if (muls.saveLevel > 0) 
 						{
-							if (muls.avgCount == 0)  
+							if (muls.avgCount == muls.avgStart)  
 							{
 								// initialize the avgArray from the diffpat
 								for (ixa=0;ixa<muls.nx;ixa++) 
@@ -2910,8 +3690,8 @@ void doSTEM() {
 								// printf("Will read image %d %d\n",muls.nx, muls.ny);	
 								wave->ReadAvgArray(wave->avgName);
 								for (ixa=0;ixa<muls.nx;ixa++) for (iya=0;iya<muls.ny;iya++) {
-									t = ((real)muls.avgCount * wave->avgArray[ixa][iya] +
-										wave->diffpat[ixa][iya]) / ((real)(muls.avgCount + 1));
+									t = ((real)(muls.avgCount-muls.avgStart) * wave->avgArray[ixa][iya] +
+										wave->diffpat[ixa][iya]) / ((real)(muls.avgCount-muls.avgStart + 1));
 									if (muls.avgCount>1)
 									{
 										#pragma omp atomic
@@ -2927,6 +3707,13 @@ void doSTEM() {
 							else {
 								if (muls.avgCount > 0)	muls.chisq[muls.avgCount-1] = 0.0;
 							}
+						// average of the patterns of this pixel in memory, for library users
+						if (muls.keepPatterns) {
+							Array2DView<float_tt> pattern = muls.patterns[i];
+							for (ixa=0;ixa<muls.nx;ixa++) for (iya=0;iya<muls.ny;iya++)
+								pattern[ixa][iya] = ((muls.avgCount-muls.avgStart)*pattern[ixa][iya]+
+									wave->diffpat[ixa][iya])/(muls.avgCount-muls.avgStart+1);
+						}
 					} /* end of if pCount == picts, i.e. conditional code, if this
 						  * was the last slice
 						  */
@@ -2943,20 +3730,45 @@ void doSTEM() {
 							(total_time)/muls.complete_pixels);
 						timer=cputim();
 					}
+					checkpointPixelDone(&muls,i,collectedIntensity);
 				} /* end of looping through STEM image pixels */
-				/* save STEM images in img files */
-				saveSTEMImages(&muls);
+				/* save STEM images in img files, or the partial 
+				 * accumulators if this is only one shard of the scan */
+				if ((muls.shardCount > 1) || (muls.runShardCount > 1))
+					saveSTEMShard(&muls);
+				else
+					saveSTEMImages(&muls);
+				checkpointSlabDone(&muls,collectedIntensity);
 				muls.totalSliceCount += muls.slices;
 			} /* end of loop through thickness (pCount) */
-		} /* end of  while (readparam("sequence: ",buf,0)) */
+		} /* end of  while (nextSequence(muls,iseq,buf)) */
 		// printf("Total CPU time = %f sec.\n", cputim()-timerTot ); 
 
 		/*************************************************************/
 		if (muls.avgCount>1)
 			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-		muls.intIntensity = collectedIntensity/(muls.scanXN*muls.scanYN);
-		displayProgress(1);
+		muls.intIntensity = collectedIntensity/runPixels;
+		displayProgress(muls,1);
+		if (converge) {
+			n = muls.avgCount-muls.avgStart;
+			for (i=0;i<muls.detectorNum;i++) {
+				const float_tt *image = muls.detectors.back()[i]->image.Data();
+				for (j=0;j<scanPixels;j++) 
+					runImages[i*scanPixels+j] = (n+1)*image[j]-n*lastMeans[i*scanPixels+j];
+			}
+			convergence.Add(&runImages[0]);
+			if (convergence.Runs() > 1) convergence.Write(muls.folder);
+		}
+		if (adaptive) {
+			done = stop.Update(muls.detectors);
+			stop.Write(muls.folder);
+			if (muls.printLevel > 0) stop.Print();
+			if (done) break;
+		}
 	} /* end of loop over muls.avgCount */
+	if (converge && (muls.printLevel > 0)) convergence.Print();
+	simState(&muls)->tdsStop = NULL;
+	finishCheckpoints(&muls);
 
 }
 
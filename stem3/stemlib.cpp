@@ -29,6 +29,17 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "tiffsubs.h"
 #include "imagelib_fftw3.h"
 #include "fileio_fftw3.h"
+#include "stem_shard.h"
+#include "source_size.h"
+#include "fft_plans.h"
+#include "memory_arena.h"
+#include "sim_state.h"
+#include "atom_stream.h"
+#include "tds_stop.h"
+#include "lib_lock.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 // #include "floatdef.h"
 // #include "imagelib.h"
 
@@ -141,163 +152,221 @@ double scatPar[N_ELEM][N_SF] = {{0.0000,0.0500,0.1000,0.1500,0.2000,0.2500,0.300
 0.0957,0.0727,0.0569,0.0369,0.0258,0,0,0}};
 #endif  // USE_REZ_SFACTS
 /****************************************************************************
-* function: atomBoxLookUp
-*
-* Znum = element
-* x,y,z = real space position (in A)
-* B = Debye-Waller factor, B=8 pi^2 <u^2>
+* The projected potential boxes of atomBoxLookUp() for one sampling. 
+* They only depend on the sampling and are shared by all simulations,
+* for every element there is one box per Debye-Waller factor.
 ***************************************************************************/
-void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,double z,double B) {
-	static int boxNx,boxNy,boxNz;
-	static double dx,dy,dz,ddx,ddy,ddz;
-	static atomBox *aBox = NULL;
-	static int ix,iy,iz; // idz, intSteps;
-	// static double x2,y2,z2,r2;
-	// static int avgSteps,maxSteps,stepCount,maxStepCount;
-	static double maxRadius2;
-	static char fileName[256],systStr[256];
-	static fftw_complex sum;
-	static int tZ, tnx, tny, tnz, tzOversample;  
-	static double tdx, tdy, tdz, tv0, tB;
+typedef struct atomBoxEntryStruct {
+	atomBox box;
+	struct atomBoxEntryStruct *next;
+} atomBoxEntry;
+
+struct atomBoxLUT {
+	double atomRadius,resolutionX,resolutionY,sliceThickness,v0;
+	int potential3D;
+	int boxNx,boxNy,boxNz;
+	double ddx,ddy,ddz,maxRadius2;
+	atomBoxEntry *boxes[NZMAX+1];   // entries are never changed after they are added
+	atomBoxLUT *next;
+};
+
+static atomBoxLUT *atomBoxLUTs = NULL;
+// the tables are shared by all simulations of the process, new ones are added under this lock
+static LibLock potentialLUTLock;
+
+static atomBoxLUT *findAtomBoxLUT(MULS *muls) {
+	SimState *st = simState(muls);
+	atomBoxLUT *lut = st->boxLUT;
+	int ix;
+
+	if (lut != NULL) return lut;
+	{
+		ScopedLock lock(potentialLUTLock);
+		for (lut=atomBoxLUTs;lut!=NULL;lut=lut->next) {
+			if ((lut->atomRadius == muls->atomRadius) && (lut->resolutionX == muls->resolutionX) &&
+				(lut->resolutionY == muls->resolutionY) && (lut->sliceThickness == muls->sliceThickness) &&
+				(lut->potential3D == muls->potential3D) && (lut->v0 == muls->v0)) break;
+		}
+		if (lut == NULL) {
+			lut = new atomBoxLUT;
+			lut->atomRadius = muls->atomRadius;
+			lut->resolutionX = muls->resolutionX;
+			lut->resolutionY = muls->resolutionY;
+			lut->sliceThickness = muls->sliceThickness;
+			lut->potential3D = muls->potential3D;
+			lut->v0 = muls->v0;
+			for (ix=0;ix<=NZMAX;ix++) lut->boxes[ix] = NULL;
+
+			lut->ddx = muls->resolutionX/(double)OVERSAMPLING;
+			lut->ddy = muls->resolutionY/(double)OVERSAMPLING;
+			lut->ddz = muls->sliceThickness/(double)OVERSAMPLINGZ;
+			lut->maxRadius2 = muls->atomRadius*muls->atomRadius;
+			/* For now we don't care, if the box has only small 
+			* prime factors, because we will not fourier transform it
+			* especially not very often.
+			*/
+			lut->boxNx = (int)(muls->atomRadius/lut->ddx+2.0);  
+			lut->boxNy = (int)(muls->atomRadius/lut->ddy+2.0);  
+			lut->boxNz = (int)(muls->atomRadius/lut->ddz+2.0);     
+			if (muls->potential3D == 0)
+				lut->boxNz = 1;
+
+			if (muls->printLevel > 2)
+				printf("Atombox has real space resolution of %g x %g x %gA (%d x %d x %d pixels)\n",
+				lut->ddx,lut->ddy,lut->ddz,lut->boxNx,lut->boxNy,lut->boxNz);
+			lut->next = atomBoxLUTs;
+			atomBoxLUTs = lut;
+		}
+	}
+	st->boxLUT = lut;
+	return lut;
+}
+
+/* reads the projected potential of element Znum for the Debye-Waller
+ * factor B, creates it with scatpot, if necessary */
+static void readAtomBox(atomBoxLUT *lut,MULS *muls,int Znum,double B,atomBox *aBox) {
+	int boxNx = lut->boxNx, boxNy = lut->boxNy, boxNz = lut->boxNz;
+	double ddx = lut->ddx, ddy = lut->ddy, ddz = lut->ddz;
+	char fileName[256],systStr[256];
+	int tZ, tnx, tny, tnz, tzOversample;  
+	double tdx, tdy, tdz, tv0, tB;
 	FILE *fpBox;
 	int numRead = 0,dummy;
 
+	aBox->B = B;
+	aBox->potential = NULL;
+	aBox->rpotential = NULL;
+	/* Open the file with the projected potential for this particular element
+	*/
+	sprintf(fileName,"potential_%d_B%d.prj",Znum,(int)(100.0*B));
+	if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
+		sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
+			fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
+		if (muls->printLevel > 2) {
+			printf("Could not find precalculated potential for Z=%d,"
+				" will calculate now.\n",Znum);
+			printf("Calling: %s\n",systStr);
+		}
+		system(systStr);
+		for (dummy=0;dummy < 10000;dummy++);
+		if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
+			if (muls->printLevel >0)
+				printf("cannot calculate projected potential using scatpot - exit!\n");
+			exit(0);
+		}  
 
-	(*vlu)[0] = 0.0;
-	(*vlu)[1] = 0.0;
-
-	/* initialize all the atoms to non-used */
-	if (aBox == NULL) {
-		aBox = (atomBox *)malloc(sizeof(atomBox)*(NZMAX+1));
-		for (ix=0;ix<=NZMAX;ix++) {
-			aBox[ix].potential = NULL;
-			aBox[ix].rpotential = NULL;
-			aBox[ix].B = -1.0;
-		}
-		dx = (*muls).resolutionX;    ddx = dx/(double)OVERSAMPLING;
-		dy = (*muls).resolutionY;    ddy = dy/(double)OVERSAMPLING;
-		dz = (*muls).sliceThickness; ddz = dz/(double)OVERSAMPLINGZ;
-		maxRadius2 = (*muls).atomRadius*(*muls).atomRadius;
-		/* For now we don't care, if the box has only small 
-		* prime factors, because we will not fourier transform it
-		* especially not very often.
-		*/
-		boxNx = (int)((*muls).atomRadius/ddx+2.0);  
-		boxNy = (int)((*muls).atomRadius/ddy+2.0);  
-		boxNz = (int)((*muls).atomRadius/ddz+2.0);     
-		if ((*muls).potential3D == 0)
-			boxNz = 1;
-
-		if (muls->printLevel > 2)
-			printf("Atombox has real space resolution of %g x %g x %gA (%d x %d x %d pixels)\n",
-			ddx,ddy,ddz,boxNx,boxNy,boxNz);
 	}
-	// printf("Debugging: %d %g %g: %g\n",Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B));
-
-	/* Creating/Reading a atombox for every new kind of atom, but only as needed */
-	if (fabs(aBox[Znum].B - B) > 1e-6) {
-		//  printf("Debugging 1 (%d: %.7g-%.7g= %.7g), %d\n",
-		//	   Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B),fabs(aBox[Znum].B - B) > 1e-6);
-		aBox[Znum].B = B;
-		/* Open the file with the projected potential for this particular element
-		*/
-		sprintf(fileName,"potential_%d_B%d.prj",Znum,(int)(100.0*B));
-		if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-			sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-				fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
+	fgets( systStr, 250, fpBox );
+	sscanf(systStr,"%d %le %d %d %d %le %le %le %d %le\n",
+		&tZ, &tB, &tnx, &tny, &tnz, &tdx, &tdy, &tdz, &tzOversample, &tv0);
+	/* If the parameters in the file don't match the current ones,
+	* we need to create a new potential file
+	*/
+	if ((tZ != Znum) || (fabs(tB-B)>1e-6) || (tnx != boxNx) || (tny != boxNy) || (tnz != boxNz) ||
+		(fabs(tdx-ddx) > 1e-5) || (fabs(tdy-ddy) > 1e-5) || (fabs(tdz-ddz) > 1e-5) || 
+		(tzOversample != OVERSAMPLINGZ) || (tv0 != muls->v0)) {
 			if (muls->printLevel > 2) {
-				printf("Could not find precalculated potential for Z=%d,"
-					" will calculate now.\n",Znum);
-				printf("Calling: %s\n",systStr);
+				printf("Potential input file %s has the wrong parameters\n",fileName);
+				printf("Parameters:\n"
+					"file:    Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
+					"program: Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
+					"will create new potential file, please wait ...\n",
+					tZ,tB,tnx,tny,tnz,tdx,tdy,tdz,tzOversample,tv0,
+					Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
+				/* printf("%d %d %d %d %d %d %d %d %d %d\n",
+				(tZ != Znum),(tB != B),(tnx != boxNx),(tny != boxNy),(tnz != boxNz),
+				(fabs(tdx-ddx) > 1e-5),(fabs(tdy-ddy) > 1e-5),(fabs(tdz-ddz) > 1e-5), 
+				(tzOversample != OVERSAMPLINGZ),(tv0 != muls->v0));
+				*/
 			}
+			/* Close the old file, Create a new potential file now 
+			*/
+			fclose( fpBox );
+			sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
+				fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
 			system(systStr);
-			for (dummy=0;dummy < 10000;dummy++);
 			if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
 				if (muls->printLevel >0)
 					printf("cannot calculate projected potential using scatpot - exit!\n");
 				exit(0);
 			}  
+			fgets( systStr, 250, fpBox );
+	}
 
-		}
-		fgets( systStr, 250, fpBox );
-		sscanf(systStr,"%d %le %d %d %d %le %le %le %d %le\n",
-			&tZ, &tB, &tnx, &tny, &tnz, &tdx, &tdy, &tdz, &tzOversample, &tv0);
-		/* If the parameters in the file don't match the current ones,
-		* we need to create a new potential file
-		*/
-		if ((tZ != Znum) || (fabs(tB-B)>1e-6) || (tnx != boxNx) || (tny != boxNy) || (tnz != boxNz) ||
-			(fabs(tdx-ddx) > 1e-5) || (fabs(tdy-ddy) > 1e-5) || (fabs(tdz-ddz) > 1e-5) || 
-			(tzOversample != OVERSAMPLINGZ) || (tv0 != muls->v0)) {
-				if (muls->printLevel > 2) {
-					printf("Potential input file %s has the wrong parameters\n",fileName);
-					printf("Parameters:\n"
-						"file:    Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"program: Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"will create new potential file, please wait ...\n",
-						tZ,tB,tnx,tny,tnz,tdx,tdy,tdz,tzOversample,tv0,
-						Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-					/* printf("%d %d %d %d %d %d %d %d %d %d\n",
-					(tZ != Znum),(tB != B),(tnx != boxNx),(tny != boxNy),(tnz != boxNz),
-					(fabs(tdx-ddx) > 1e-5),(fabs(tdy-ddy) > 1e-5),(fabs(tdz-ddz) > 1e-5), 
-					(tzOversample != OVERSAMPLINGZ),(tv0 != muls->v0));
-					*/
-				}
-				/* Close the old file, Create a new potential file now 
-				*/
-				fclose( fpBox );
-				sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-					fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-				system(systStr);
-				if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-					if (muls->printLevel >0)
-						printf("cannot calculate projected potential using scatpot - exit!\n");
-					exit(0);
-				}  
-				fgets( systStr, 250, fpBox );
-		}
-
-		/* Finally we can read in the projected potential
-		*/
-		if (B == 0) {
-			aBox[Znum].rpotential = float3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].rpotential[0][0],sizeof(real),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
-		}
-		else {
-#if FLOAT_PRECISION == 1
-			aBox[Znum].potential = complex3Df(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftwf_complex),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
-#else
-			aBox[Znum].potential = complex3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftw_complex),
-				(size_t)(boxNx*boxNy*boxNz),fpBox);	
-#endif
-		}
+	/* Finally we can read in the projected potential
+	*/
+	if (B == 0) {
+		aBox->rpotential = float3D(boxNz,boxNx,boxNy,"atomBox");
+		numRead = fread(aBox->rpotential[0][0],sizeof(real),
+			(size_t)(boxNx*boxNy*boxNz), fpBox );
+	}
+	else {
+		aBox->potential = complex3Df(boxNz,boxNx,boxNy,"atomBox");
+		numRead = fread(aBox->potential[0][0],sizeof(fftwf_complex),
+			(size_t)(boxNx*boxNy*boxNz), fpBox );
+	}
 
-		/* writeImage_old(aBox[Znum].potential[0],boxNx,boxNy, 0.0,"potential.img");
-		system("showimage potential.img");
-		*/
-		fclose( fpBox );
+	/* writeImage_old(aBox->potential[0],boxNx,boxNy, 0.0,"potential.img");
+	system("showimage potential.img");
+	*/
+	fclose( fpBox );
 
-		if (numRead == boxNx*boxNy*boxNz) {
-			if (muls->printLevel > 1)
-				printf("Sucessfully read in the projected potential\n");
-		}
-		else {
-			if (muls->printLevel > 0)
-				printf("error while reading potential file %s: read %d of %d values\n",
-				fileName,numRead,boxNx*boxNy*boxNz);
-			exit(0);
+	if (numRead == boxNx*boxNy*boxNz) {
+		if (muls->printLevel > 1)
+			printf("Sucessfully read in the projected potential\n");
+	}
+	else {
+		if (muls->printLevel > 0)
+			printf("error while reading potential file %s: read %d of %d values\n",
+			fileName,numRead,boxNx*boxNy*boxNz);
+		exit(0);
+	}
+}
+
+/****************************************************************************
+* function: atomBoxLookUp
+*
+* Znum = element
+* x,y,z = real space position (in A)
+* B = Debye-Waller factor, B=8 pi^2 <u^2>
+***************************************************************************/
+void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,double z,double B) {
+	atomBoxLUT *lut = findAtomBoxLUT(muls);
+	double ddx = lut->ddx, ddy = lut->ddy, ddz = lut->ddz;
+	double dx,dy,dz;
+	int ix,iy,iz;
+	atomBoxEntry *entry;
+	atomBox *aBox;
+	fftw_complex sum;
+
+	(*vlu)[0] = 0.0;
+	(*vlu)[1] = 0.0;
+
+	/* Creating/Reading a atombox for every new kind of atom, but only as needed */
+	for (entry=lut->boxes[Znum];entry!=NULL;entry=entry->next)
+		if (fabs(entry->box.B - B) <= 1e-6) break;
+	if (entry == NULL) {
+		{
+			ScopedLock lock(potentialLUTLock);
+			for (entry=lut->boxes[Znum];entry!=NULL;entry=entry->next)
+				if (fabs(entry->box.B - B) <= 1e-6) break;
+			if (entry == NULL) {
+				entry = new atomBoxEntry;
+				readAtomBox(lut,muls,Znum,B,&entry->box);
+				entry->next = lut->boxes[Znum];
+#pragma omp flush
+				lut->boxes[Znum] = entry;
+			}
 		}
 	}
+	aBox = &entry->box;
 
 	/***************************************************************
 	* Do the trilinear interpolation
 	*/
 	sum[0] = 0.0;
 	sum[1] = 0.0;
-	if (x*x+y*y+z*z > maxRadius2) {
+	if (x*x+y*y+z*z > lut->maxRadius2) {
 		return;
 	}
 	x = fabs(x);
@@ -319,51 +388,51 @@ void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,doubl
 
 
 	if ((*muls).potential3D) {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][0]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][0]));
-			sum[1] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][1]));
+		if (aBox->B > 0) {
+			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox->potential[iz][ix][iy][0]+
+				dx*aBox->potential[iz][ix+1][iy][0])+
+				dy*((1.0-dx)*aBox->potential[iz][ix][iy+1][0]+
+				dx*aBox->potential[iz][ix+1][iy+1][0]))+
+				dz*((1.0-dy)*((1.0-dx)*aBox->potential[iz+1][ix][iy][0]+
+				dx*aBox->potential[iz+1][ix+1][iy][0])+
+				dy*((1.0-dx)*aBox->potential[iz+1][ix][iy+1][0]+
+				dx*aBox->potential[iz+1][ix+1][iy+1][0]));
+			sum[1] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox->potential[iz][ix][iy][1]+
+				dx*aBox->potential[iz][ix+1][iy][1])+
+				dy*((1.0-dx)*aBox->potential[iz][ix][iy+1][1]+
+				dx*aBox->potential[iz][ix+1][iy+1][1]))+
+				dz*((1.0-dy)*((1.0-dx)*aBox->potential[iz+1][ix][iy][1]+
+				dx*aBox->potential[iz+1][ix+1][iy][1])+
+				dy*((1.0-dx)*aBox->potential[iz+1][ix][iy+1][1]+
+				dx*aBox->potential[iz+1][ix+1][iy+1][1]));
 		}
 		else {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy+1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy+1]));
+			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox->rpotential[iz][ix][iy]+
+				dx*aBox->rpotential[iz][ix+1][iy])+
+				dy*((1.0-dx)*aBox->rpotential[iz][ix][iy+1]+
+				dx*aBox->rpotential[iz][ix+1][iy+1]))+
+				dz*((1.0-dy)*((1.0-dx)*aBox->rpotential[iz+1][ix][iy]+
+				dx*aBox->rpotential[iz+1][ix+1][iy])+
+				dy*((1.0-dx)*aBox->rpotential[iz+1][ix][iy+1]+
+				dx*aBox->rpotential[iz+1][ix+1][iy+1]));
 		}
 	}
 	else {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][0]);
-			sum[1] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][1]);
+		if (aBox->B > 0) {
+			sum[0] = (1.0-dy)*((1.0-dx)*aBox->potential[0][ix][iy][0]+
+				dx*aBox->potential[0][ix+1][iy][0])+
+				dy*((1.0-dx)*aBox->potential[0][ix][iy+1][0]+
+				dx*aBox->potential[0][ix+1][iy+1][0]);
+			sum[1] = (1.0-dy)*((1.0-dx)*aBox->potential[0][ix][iy][1]+
+				dx*aBox->potential[0][ix+1][iy][1])+
+				dy*((1.0-dx)*aBox->potential[0][ix][iy+1][1]+
+				dx*aBox->potential[0][ix+1][iy+1][1]);
 		}
 		else {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy+1]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy+1]);
+			sum[0] = (1.0-dy)*((1.0-dx)*aBox->rpotential[0][ix][iy]+
+				dx*aBox->rpotential[0][ix+1][iy])+
+				dy*((1.0-dx)*aBox->rpotential[0][ix][iy+1]+
+				dx*aBox->rpotential[0][ix+1][iy+1]);
 		}
 	}
 	(*vlu)[0] = sum[0];
@@ -380,6 +449,8 @@ void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,doubl
 * Call this function with center = NULL, if you don't
 * want the array to be shifted.
 ****************************************************/
+static void addAbsorptivePotential(MULS *muls,atom *atoms,int natom,int nlayer,int divCount);
+
 void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	// FILE *fpu2;
 	char fileOut[512]; // RAM: this is terrible, why is fileName a function argument and here we have filename?  FIXED: rename function argument to fileIn and this to fileOut
@@ -400,19 +471,14 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	FILE *sliceFp;
 	real minX,maxX,minY,maxY,minZ,maxZ;
 	double atomRadius2;
+	double zShift,zSlabMin,zSlabMax;
 	time_t time0,time1;
 	float s11,s12,s21,s22;
 	fftwf_complex	*atPotPtr;
 	float *potPtr=NULL, *ptr;
-	static int divCount = 0;
-	static real **tempPot = NULL;
-#if FLOAT_PRECISION == 1
-	static fftwf_complex ***oldTrans = NULL;
-	static fftwf_complex ***oldTrans0 = NULL;
-#else
-	static fftw_complex ***oldTrans = NULL;
-	static fftw_complex ***oldTrans0 = NULL;
-#endif
+	SimState *st = simState(muls);
+	int &divCount = st->divCount;
+	Array2D<real> tempPot;
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
 				muls->sliceThickness,muls->resolutionX,muls->resolutionY));
 	fftw_complex dPot;
@@ -423,26 +489,11 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	fftwf_complex	*atPotOffsPtr;
 #endif
 
-	if (muls->trans == NULL) {
+	if (muls->trans.Empty()) {
 		printf("Severe error: trans-array not allocated - exit!\n");
 		exit(0);
 	}
 
-	if (oldTrans0 == NULL) {
-#if FLOAT_PRECISION == 1
-		oldTrans0 = (fftwf_complex ***)fftw_malloc(nlayer * sizeof(fftwf_complex**));
-#else
-		oldTrans0 = (fftw_complex ***)fftw_malloc(nlayer * sizeof(fftw_complex**));
-#endif
-		for (i=0;i<nlayer;i++) {
-			// printf("%d %d\n",i,(int)(muls->trans));
-			oldTrans0[i] = muls->trans[i]; 
-		}
-		oldTrans = muls->trans;
-	}
-	if (oldTrans != muls->trans)
-		printf("Warning: Transmission function pointer has changed!\n");
-
 	/* return, if there is nothing to do */
 	if (nlayer <1)
 		return;
@@ -462,13 +513,52 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	/* we only want to reread and shake the atoms, if we have finished the 
 	* current unit cell.
 	*/
-	if (divCount == muls->cellDiv-1) {
-		if (muls->avgCount == 0) {
+	if (st->atomSource.get() != NULL) {
+		/* streamed structure (see atom_stream.h): only the atoms of this
+		* slab, already sorted in z, are made for every slab.  Atoms are
+		* not moved to center.
+		*/
+		c = muls->sliceThickness * muls->slices;
+		zShift = c*(real)(muls->cellDiv-divCount-1) - muls->czOffset
+			+ 0.5*muls->sliceThickness*(1-muls->centerSlices);
+		if (muls->nonPeriodZ) {
+			// the atoms whose potential reaches into the slab
+			zSlabMin = zShift-muls->atomRadius-2.0*muls->sliceThickness;
+			zSlabMax = zShift+c+muls->atomRadius+2.0*muls->sliceThickness;
+		}
+		else {
+			// every atom in exactly one slab
+			zSlabMin = (divCount == muls->cellDiv-1) ? -1e30 : zShift;
+			zSlabMax = (divCount == 0) ? 1e30 : zShift+c;
+		}
+		st->atomSource->Slab(zSlabMin,zSlabMax,muls->avgCount,st->slabAtoms);
+		natom = (int)st->slabAtoms.size();
+		atoms = st->slabAtoms.empty() ? NULL : &st->slabAtoms[0];
+		muls->natom = natom;
+		muls->atoms = atoms;
+		if (muls->printLevel >= 3)
+			printf("%d atoms in slab %g .. %g A\n",natom,zSlabMin,zSlabMax);
+	}
+	else if (divCount == muls->cellDiv-1) {
+		if (!muls->inputAtoms.empty()) {
+			// atoms given by the caller (see simulation.h)
+			atoms = displaceInputAtoms(&natom,muls);
+			muls->natom = natom;
+			muls->atoms = atoms;
+		}
+		else if ((muls->avgCount == 0) && !muls->tds) {
 			// if this is the first run, the atoms have already been
-			// read during initialization
+			// read during initialization (with TDS they may be those of
+			// the last run of the previous sweep point)
 			natom = (*muls).natom;
 			atoms = (*muls).atoms;
 		}
+		else if (st->trajectory.get() != NULL) {
+			// frame avgCount of a MD trajectory, read ahead during the last run
+			atoms = trajectoryConfiguration(&natom,muls);
+			muls->natom = natom;
+			muls->atoms = atoms;
+		}
 		else {
 			/* 
 			the following function makes an array of natom atoms from
@@ -477,7 +567,10 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			// the last parameter is handleVacancies.  If it is set to 1 vacancies 
 
 			// and multiple occupancies will be handled. 
-			atoms = readUnitCell(&natom,fileIn,muls,1);
+			// A new configuration of the structure read last, if it can be
+			// reused, the file is only read again otherwise.
+			atoms = nextConfiguration(&natom,muls);
+			if (atoms == NULL) atoms = readUnitCell(&natom,fileIn,muls,1);
 			if (muls->printLevel>=3)
 				printf("Read %d atoms from %s, tds: %d\n",natom,fileIn,muls->tds);
 			muls->natom = natom;
@@ -587,24 +680,12 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	/*******************************************************
 	* initializing slicPos, cz, and transr
 	*************************************************************/
-	if (oldTrans0[0] != muls->trans[0]) {
-		printf("Warning: transmision array pointers have changed!\n");
-		for (i=0;i<nlayer;i++)
-			muls->trans[i] = oldTrans0[i];
-	}
-	/*
-	if (oldTrans0[0][0] != muls->trans[0][0]) {
-	printf("Warning: transmision array pointers have changed!\n");
-	for (i=0;i<nlayer;i++)
-	muls->trans[i] = oldTrans0[i];
-	}
-	*/
 	if ((*muls).cz == NULL) {
 		(*muls).cz = float1D(nlayer,"cz");
 	}
 	// sliceFp = fopen(sliceFile,"r");
 	sliceFp = NULL;
-	slicePos = float1D(nlayer,"slicePos");
+	slicePos = (real *)st->arena.Alloc("slicePos",nlayer*sizeof(real));
 
 
 	if (muls->sliceThickness == 0)
@@ -626,7 +707,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		slicePos[i] = slicePos[i-1]+(*muls).cz[i-1]/2.0+(*muls).cz[i]/2.0;
 	}
 
-	memset(muls->trans[0][0],0,nlayer*nx*ny*sizeof(fftwf_complex));
+	memset(muls->trans.Data(),0,nlayer*nx*ny*sizeof(fftwf_complex));
 	/* check whether we have constant slice thickness */
 
 	if (muls->fftpotential) {
@@ -639,9 +720,10 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	* read the potential that has been created externally!
 	*/
 	if (muls->readPotential) {
+		tempPot.Resize(nx,ny,"potential slice");
 		for (i=(divCount+1)*muls->slices-1,j=0;i>=(divCount)*muls->slices;i--,j++) {
 			sprintf(buf,"%s/potential_%d.img",muls->folder,i);
-			imageIO->ReadImage((void **)tempPot,nx,ny,buf);
+			imageIO->ReadImage((void **)tempPot.Rows(),nx,ny,buf);
 			for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
 				(*muls).trans[j][ix][iy][0] = tempPot[ix][iy];
 				(*muls).trans[j][ix][iy][1] = 0.0;
@@ -651,13 +733,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 	}
 
 	// reset the potential to zero:  
-#if FLOAT_PRECISION == 1
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftwf_complex));
-#else
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftw_complex));
-#endif
+	muls->trans.Zero();
 	nyAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
 	nxyAtBox  = nyAtBox*(2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX));
 	nyAtBox2  = 2*nyAtBox;
@@ -1267,6 +1343,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			////////////////////////////////////////////////////////////////////
 		} /* end of if (fftpotential) */
 	} /* for iatom =0 ... */
+	if (muls->absorptive) addAbsorptivePotential(muls,atoms,natom,nlayer,divCount);
 	time(&time1);
 	if (iatom > 0)
 	if (muls->printLevel) printf("%g sec used for real space potential calculation (%g sec per atom)\n",difftime(time1,time0),difftime(time1,time0)/iatom);
@@ -1301,11 +1378,11 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			imageIO->SetThickness(muls->sliceThickness);
 			sprintf(buf,"Projected Potential (slice %d)",iz);		 
 			imageIO->SetComment(buf);
-			imageIO->WriteComplexImage( (void **)muls->trans[iz], fileOut );
+			imageIO->WriteComplexImage( (void **)muls->trans.Rows(iz), fileOut );
 		} // loop through all slices
 	} /* end of if savePotential ... */
 	if (muls->saveTotalPotential) {
-		if (tempPot == NULL) tempPot = float2D(muls->potNx,muls->potNy,"total projected potential");
+		tempPot.Resize(muls->potNx,muls->potNy,"total projected potential");
 
 		for (ix=0;ix<muls->potNx;ix++) for (iy=0;iy<muls->potNy;iy++) {
 			tempPot[ix][iy] = 0;
@@ -1328,43 +1405,125 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		imageIO->SetThickness(nlayer*muls->sliceThickness);
 		sprintf(buf,"Projected Potential (sum of %d slices)",muls->slices);
 		imageIO->SetComment(buf);
-		imageIO->WriteRealImage( (void **)tempPot, fileOut );
+		imageIO->WriteRealImage( (void **)tempPot.Rows(), fileOut );
 	}
 
 } // end of make3DSlices
 
 
 
+/********************************************************************************
+* Lookup tables of getAtomPotential3D(), getAtomPotentialOffset3D() and 
+* getAtomPotential2D().  A table only depends on the sampling (atom radius,
+* resolution and slice thickness), so all simulations with the same sampling
+* share it.  Every table has its own copy of the scattering factors, whose
+* angular range is adjusted to the sampling.  The potential of an element is
+* created once and never changed after ready[Znum] has been set.
+********************************************************************************/
+struct atomPotentialLUT {
+	int kind;                      // POTENTIAL_LUT_3D, ...
+	double atomRadius,resolutionX,resolutionY,sliceThickness;
+	int nx,ny,nz,nzPerSlice;       // nx == 0: sampling not set up yet
+	double kmax2,smax2,dkx,dky,dkz;
+	double scatPar[N_ELEM][N_SF];
+	fftwf_complex *atPot[NZMAX+1];
+	int ready[NZMAX+1];
+	atomPotentialLUT *next;
+};
+
+static atomPotentialLUT *potentialLUTs = NULL;
+
+static atomPotentialLUT *findPotentialLUT(int kind,MULS *muls) {
+	SimState *st = simState(muls);
+	atomPotentialLUT *lut = st->potentialLUT[kind];
+	int ix;
+
+	if (lut != NULL) return lut;
+	{
+		ScopedLock lock(potentialLUTLock);
+		for (lut=potentialLUTs;lut!=NULL;lut=lut->next) {
+			if ((lut->kind == kind) && (lut->atomRadius == muls->atomRadius) && 
+				(lut->resolutionX == muls->resolutionX) && (lut->resolutionY == muls->resolutionY) &&
+				(lut->sliceThickness == muls->sliceThickness)) break;
+		}
+		if (lut == NULL) {
+			lut = new atomPotentialLUT;
+			memset(lut,0,sizeof(atomPotentialLUT));
+			lut->kind = kind;
+			lut->atomRadius = muls->atomRadius;
+			lut->resolutionX = muls->resolutionX;
+			lut->resolutionY = muls->resolutionY;
+			lut->sliceThickness = muls->sliceThickness;
+#if USE_REZ_SFACTS
+			if (kind == POTENTIAL_LUT_OFFSET_3D) memcpy(lut->scatPar,scatParOffs,sizeof(lut->scatPar));
+			else 
+#endif
+			memcpy(lut->scatPar,scatPar,sizeof(lut->scatPar));
+			for (ix=0;ix<=NZMAX;ix++) lut->atPot[ix] = NULL;
+			lut->next = potentialLUTs;
+			potentialLUTs = lut;
+		}
+	}
+	st->potentialLUT[kind] = lut;
+	return lut;
+}
+
+static int potentialReady(atomPotentialLUT *lut,int Znum) {
+	int ready = lut->ready[Znum];
+	// make sure the table is read after the flag
+#pragma omp flush
+	return ready;
+}
+
+/* releases the lookup tables of all simulations, no simulation may be running */
+void freePotentialLUTs() {
+	atomPotentialLUT *lut;
+	atomBoxLUT *boxLUT;
+	atomBoxEntry *entry;
+	int ix;
+
+	while (potentialLUTs != NULL) {
+		lut = potentialLUTs;
+		potentialLUTs = lut->next;
+		for (ix=0;ix<=NZMAX;ix++) if (lut->atPot[ix] != NULL) fftwf_free(lut->atPot[ix]);
+		delete lut;
+	}
+	while (atomBoxLUTs != NULL) {
+		boxLUT = atomBoxLUTs;
+		atomBoxLUTs = boxLUT->next;
+		for (ix=0;ix<=NZMAX;ix++) while (boxLUT->boxes[ix] != NULL) {
+			entry = boxLUT->boxes[ix];
+			boxLUT->boxes[ix] = entry->next;
+			delete entry;
+		}
+		delete boxLUT;  // the arrays of the boxes (memory_fftw3) are not released
+	}
+}
+
 /********************************************************************************
 * Create Lookup table for 3D potential due to neutral atoms
 ********************************************************************************/
 #define PHI_SCALE 47.87658
-fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut) {
+static void makeAtomPotential3D(atomPotentialLUT *lut,int Znum, MULS *muls,double B) {
 	int ix,iy,iz,iiz,ind3d,iKind,izOffset;
 	double zScale,kzmax,zPos,xPos;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,smax2,kx,kz,dkx,dky,dkz; // ,dx2,dy2,dz2;
-	static int nx,ny,nz,nzPerSlice;
-	static fftwf_complex **atPot = NULL;
-	static fftwf_complex *temp = NULL;
+	double f,phase,s2,s3,kx,kz; // ,dx2,dy2,dz2;
+	double &kmax2 = lut->kmax2, &smax2 = lut->smax2, &dkx = lut->dkx, &dky = lut->dky, &dkz = lut->dkz;
+	int &nx = lut->nx, &ny = lut->ny, &nz = lut->nz, &nzPerSlice = lut->nzPerSlice;
+	fftwf_complex **atPot = lut->atPot;
+	double (*scatPar)[N_SF] = lut->scatPar;
+	fftwf_complex *temp;
 #if SHOW_SINGLE_POTENTIAL == 1
 	ImageIOPtr imageio = ImageIOPtr();
-	static fftwf_complex *ptr = NULL;
-	static char fileName[256];
+	fftwf_complex *ptr = NULL;
+	char fileName[256];
 #endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
+	double splinb[N_SF],splinc[N_SF],splind[N_SF];
 
 
 	// scattering factors in:
 	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
-
-
+	if (nx == 0) {
 		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
 		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
 		// The FFT-resolution in the z-direction must be high enough to avoid 
@@ -1413,10 +1572,6 @@ fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *
 		}	// end of if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3])
 		smax2 *= smax2;
 		kmax2 *= kmax2;
-		// allocate a list of pointers for the element-specific potential lookup table
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-		temp  = (fftwf_complex*) fftwf_malloc(nx*nz*sizeof(fftwf_complex));
 	}
 	// initialize this atom, if it has not been done yet:
 	if (atPot[Znum] == NULL) {
@@ -1427,6 +1582,7 @@ fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *
 
 		// allocate a 3D array:
 		atPot[Znum] = (fftwf_complex*) fftwf_malloc(nx*nz/4*sizeof(fftwf_complex));
+		temp  = (fftwf_complex*) fftwf_malloc(nx*nz*sizeof(fftwf_complex));
 		memset(temp,0,nx*nz*sizeof(fftwf_complex));
 		kzmax	  = dkz*nz/2.0; 
 		// define x-and z-position of atom center:
@@ -1489,9 +1645,7 @@ fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *
 		imageio->WriteComplexImage((void**)temp, fileName);
 #endif	  
 		// This converts the 2D kx-kz  map of the scattering factor to a 2D real space map.
-		plan = fftwf_plan_dft_2d(nz,nx,temp,temp,FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
+		executePlan(sharedPlan2D<float>(PLAN_ATOM,nz,nx,FFTW_BACKWARD),temp);
 		// dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
 		// dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
 		// dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
@@ -1533,11 +1687,26 @@ fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *
 #endif	  
 		if (muls->printLevel > 1) printf("Created 3D (r-z) %d x %d potential array for Z=%d (%d, B=%g, dkx=%g, dky=%g. dkz=%g,sps=%d)\n",
 			nx/2,nz/2,Znum,iKind,B,dkx,dky,dkz,izOffset);
+		fftwf_free(temp);
 	}
-	*Nz_lut = nz/2;
-	*nzSub  = nzPerSlice;
-	*Nr	  = nx/2;
-	return atPot[Znum];
+#pragma omp flush
+	lut->ready[Znum] = 1;
+}
+
+fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut) {
+	atomPotentialLUT *lut = findPotentialLUT(POTENTIAL_LUT_3D,muls);
+
+	// initialize this atom, if it has not been done yet:
+	if (!potentialReady(lut,Znum)) {
+		{
+			ScopedLock lock(potentialLUTLock);
+			if (!lut->ready[Znum]) makeAtomPotential3D(lut,Znum,muls,B);
+		}
+	}
+	*Nz_lut = lut->nz/2;
+	*nzSub  = lut->nzPerSlice;
+	*Nr	  = lut->nx/2;
+	return lut->atPot[Znum];
 }
 
 
@@ -1545,36 +1714,28 @@ fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *
 /********************************************************************************
 * Lookup function for 3D potential offset due to charged atoms (ions)
 ********************************************************************************/
-fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut,float q) {
+// the qy-integration uses the scattering factors of neutral atoms of lut3D
+static void makeAtomPotentialOffset3D(atomPotentialLUT *lut,atomPotentialLUT *lut3D,int Znum, MULS *muls,double B) {
 	int ix,iy,iz,iiz,ind3d,iKind,izOffset;
 	double zScale,kzmax,zPos,xPos;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,kx,kz,dkx,dky,dkz; // ,dx2,dy2,dz2;
-	static int nx,ny,nz,nzPerSlice;
-	static fftwf_complex **atPot = NULL;
-	static fftwf_complex *temp = NULL;
+	double f,phase,s2,s3,kx,kz; // ,dx2,dy2,dz2;
+	double &kmax2 = lut->kmax2, &dkx = lut->dkx, &dky = lut->dky, &dkz = lut->dkz;
+	int &nx = lut->nx, &ny = lut->ny, &nz = lut->nz, &nzPerSlice = lut->nzPerSlice;
+	fftwf_complex **atPot = lut->atPot;
+	double (*scatParOffs)[N_SF] = lut->scatPar;
+	double (*scatPar)[N_SF] = lut3D->scatPar;
+	fftwf_complex *temp;
 #if SHOW_SINGLE_POTENTIAL == 1
 	ImageIOPtr imageio = ImageIOPtr();
-	static fftwf_complex *ptr = NULL;
-	static char fileName[256];
+	fftwf_complex *ptr = NULL;
+	char fileName[256];
 #endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
-
-
-	// if there is no charge to this atom, return NULL:
-	if (q == 0) return NULL;
+	double splinb[N_SF],splinc[N_SF],splind[N_SF];
 
 
 	// scattering factors in:
 	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
-
-
+	if (nx == 0) {
 		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
 		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
 		// The FFT-resolution in the z-direction must be high enough to avoid 
@@ -1619,10 +1780,6 @@ fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub
 				scatParOffs[0][N_SF-4-ix]);
 		}  // end of if (scatParOffs[0][N_SF-4] > scatParOffs[0][N_SF-3])
 		kmax2 *= kmax2;
-
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-		temp  = (fftwf_complex*)fftwf_malloc(nx*nz*sizeof(fftwf_complex));
 	}
 	// initialize this atom, if it has not been done yet:
 	if (atPot[Znum] == NULL) {
@@ -1638,6 +1795,7 @@ fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub
 		splinh(scatParOffs[0],scatParOffs[iKind],splinb,splinc,splind,N_SF);
 
 		atPot[Znum] = (fftwf_complex*)fftwf_malloc(nx*nz/4*sizeof(fftwf_complex));
+		temp  = (fftwf_complex*)fftwf_malloc(nx*nz*sizeof(fftwf_complex));
 		memset(temp,0,nx*nz*sizeof(fftwf_complex));
 		kzmax	 = dkz*nz/2.0; 
 		// define x-and z-position of atom center:
@@ -1695,9 +1853,7 @@ fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub
 		imageio->WriteComplexImage((void**)temp, fileName);
 #endif	  
 
-		plan = fftwf_plan_dft_2d(nz,nx,temp,temp,FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
+		executePlan(sharedPlan2D<float>(PLAN_ATOM,nz,nx,FFTW_BACKWARD),temp);
 		// dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
 		// dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
 		// dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
@@ -1733,11 +1889,31 @@ fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub
 #endif	  
 		if (muls->printLevel > 1) printf("Created 3D (r-z) %d x %d potential offset array for Z=%d (%d, B=%g, dkx=%g, dky=%g. dkz=%g,sps=%d)\n",
 			nx/2,nz/2,Znum,iKind,B,dkx,dky,dkz,izOffset);
+		fftwf_free(temp);
+	}
+#pragma omp flush
+	lut->ready[Znum] = 1;
+}
+
+fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut,float q) {
+	atomPotentialLUT *lut,*lut3D;
+
+	// if there is no charge to this atom, return NULL:
+	if (q == 0) return NULL;
+
+	lut = findPotentialLUT(POTENTIAL_LUT_OFFSET_3D,muls);
+	// initialize this atom, if it has not been done yet:
+	if (!potentialReady(lut,Znum)) {
+		lut3D = findPotentialLUT(POTENTIAL_LUT_3D,muls);
+		{
+			ScopedLock lock(potentialLUTLock);
+			if (!lut->ready[Znum]) makeAtomPotentialOffset3D(lut,lut3D,Znum,muls,B);
+		}
 	}
-	*Nz_lut = nz/2;
-	*nzSub = nzPerSlice;
-	*Nr	 = nx/2;
-	return atPot[Znum];
+	*Nz_lut = lut->nz/2;
+	*nzSub = lut->nzPerSlice;
+	*Nr	 = lut->nx/2;
+	return lut->atPot[Znum];
 }
 // #undef SHOW_SINGLE_POTENTIAL
 // end of fftwf_complex *getAtomPotential3D(...)
@@ -1747,29 +1923,24 @@ fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub
 ////////////////////////////////////////////////////////////////////////////
 // This function should be used yet, because it computes the projected
 // potential wrongly, since it doe not yet perform the projection!!!
-fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
+static void makeAtomPotential2D(atomPotentialLUT *lut,int Znum, MULS *muls,double B) {
 	int ix,iy,iz,ind,iKind;
 	double min;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,kx,ky,dkx,dky;
-	static int nx,ny;
-	static fftwf_complex **atPot = NULL;
+	double f,phase,s2,s3,kx,ky;
+	double &kmax2 = lut->kmax2, &dkx = lut->dkx, &dky = lut->dky;
+	int &nx = lut->nx, &ny = lut->ny;
+	fftwf_complex **atPot = lut->atPot;
+	double (*scatPar)[N_SF] = lut->scatPar;
 #if SHOW_SINGLE_POTENTIAL == 1
 	ImageIOPtr imageio = ImageIOPtr();
-	static char fileName[256];
+	char fileName[256];
 #endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
+	double splinb[N_SF],splinc[N_SF],splind[N_SF];
 
 
 	// scattering factors in:
 	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
-
+	if (nx == 0) {
 		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
 		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
 		dkx = 0.5*OVERSAMP_X/((nx)*muls->resolutionX);  
@@ -1795,11 +1966,6 @@ fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
 				scatPar[0][N_SF-4-ix]);
 		}  // end of if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3])
 		kmax2 *= kmax2;
-
-
-
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
 	}
 	// initialize this atom, if it has not been done yet:
 	if (atPot[Znum] == NULL) {
@@ -1835,9 +2001,7 @@ fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
 		imageio->SetThickness(muls->sliceThickness);
 		imageio->WriteComplexImage((void**)atPot[Znum], fileName);
 #endif    
-		plan = fftwf_plan_dft_2d(nx,ny,atPot[Znum],atPot[Znum],FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
+		executePlan(sharedPlan2D<float>(PLAN_ATOM,nx,ny,FFTW_BACKWARD),atPot[Znum]);
 		for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
 				atPot[Znum][iy+ix*ny][0] *= dkx*dky*(OVERSAMP_X*OVERSAMP_X);  
 		}
@@ -1853,11 +2017,250 @@ fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
 #endif    
 		printf("Created 2D %d x %d potential array for Z=%d (%d, B=%g A^2)\n",nx,ny,Znum,iKind,B);
 	}
-	return atPot[Znum];
+#pragma omp flush
+	lut->ready[Znum] = 1;
+}
+
+fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
+	atomPotentialLUT *lut = findPotentialLUT(POTENTIAL_LUT_2D,muls);
+
+	// initialize this atom, if it has not been done yet:
+	if (!potentialReady(lut,Znum)) {
+		{
+			ScopedLock lock(potentialLUTLock);
+			if (!lut->ready[Znum]) makeAtomPotential2D(lut,Znum,muls,B);
+		}
+	}
+	return lut->atPot[Znum];
 }
 #undef PHI_SCALE
 #undef SHOW_SINGLE_POTENTIAL
 
+/********************************************************************************
+* Absorptive potential of thermal diffuse scattering.
+* Without frozen phonons (tds: no) the potential of every atom is smeared out by
+* its Debye-Waller factor, and the intensity that the thermal vibrations would
+* scatter diffusely is simply missing.  It can be removed from the elastic wave
+* by an imaginary potential V' whose form factor at the scattering vector q
+* (1/A, B is the Debye-Waller factor of the atom) is (Hall and Hirsch, 
+* Proc. Roy. Soc. A 286 (1965) 158)
+*   f'(q) = gamma*lambda/2 Int d^2q' f(|q/2+q'|) f(|q/2-q'|) 
+*           [exp(-B q^2/4) - exp(-B (|q/2+q'|^2+|q/2-q'|^2)/4)]
+* 2 gamma lambda f'(0) is the TDS cross section of the atom.  The integral uses 
+* the whole range of the tabulated scattering factors, since the diffuse 
+* scattering is not limited by the sampling of the slices.
+* The lookup table holds the projected potential Int d^2q f'(q) exp(2 pi i q.r)
+* divided by gamma*lambda (so that it does not depend on the high voltage) as a
+* function of r in steps of resolutionX/OVERSAMP_X up to the atom radius.
+********************************************************************************/
+#define ABSORPTIVE_NQ   256   /* q-points of f'(q) for the Hankel transform */
+#define ABSORPTIVE_NRHO 200   /* radial and angular steps of the integral over q' */
+#define ABSORPTIVE_NPHI 24
+
+/* scattering factor of Znum at the scattering vector q (1/A), the tables are
+ * in s = q/2 = sin(theta/2)/lambda.  Zero beyond the end of the table */
+static double tableScatteringFactor(int Znum, double q, double *b, double *c, double *d) {
+	if (0.5*q >= scatPar[0][N_SF-4]) return 0;
+	return seval(scatPar[0],scatPar[Znum],b,c,d,N_SF,0.5*q);
+}
+
+/* f'(q)/(gamma lambda) of Znum with Debye-Waller factor B, the integrand is even in phi */
+static double absorptiveFormFactor(int Znum, double B, double q, double *b, double *c, double *d) {
+	int ir,ip;
+	double qMax = 2*scatPar[0][N_SF-4];
+	double dRho = qMax/ABSORPTIVE_NRHO, dPhi = PI/ABSORPTIVE_NPHI;
+	double dw = exp(-0.25*B*q*q);
+	double rho,qc,q1,q2,sum = 0;
+
+	for (ir=0;ir<ABSORPTIVE_NRHO;ir++) {
+		rho = (ir+0.5)*dRho;
+		for (ip=0;ip<ABSORPTIVE_NPHI;ip++) {
+			qc = q*rho*cos((ip+0.5)*dPhi);
+			q1 = 0.25*q*q+rho*rho+qc;  // |q/2+q'|^2
+			q2 = 0.25*q*q+rho*rho-qc;  // |q/2-q'|^2
+			if (q2 < 0) q2 = 0;
+			sum += rho*tableScatteringFactor(Znum,sqrt(q1),b,c,d)*tableScatteringFactor(Znum,sqrt(q2),b,c,d)*
+				(dw-exp(-0.25*B*(q1+q2)));
+		}
+	}
+	// 0.5 * 2 (phi = 0..pi)
+	return sum*dRho*dPhi;
+}
+
+/* f'(q)/(gamma lambda) of Znum with its own spline of the scattering factors */
+double absorptiveFormFactor(int Znum, double B, double q) {
+	double b[N_SF],c[N_SF],d[N_SF];
+
+	splinh(scatPar[0],scatPar[Znum],b,c,d,N_SF);
+	return absorptiveFormFactor(Znum,B,q,b,c,d);
+}
+
+/* TDS cross section of Znum between the scattering vectors k0 and k1 (1/A),
+ * in units of (gamma lambda)^2 */
+double tdsCrossSection(int Znum, double B, double k0, double k1) {
+	const int n = 1000;
+	int i;
+	double b[N_SF],c[N_SF],d[N_SF];
+	double q,f,dq,sum = 0;
+
+	if (k1 > 2*scatPar[0][N_SF-4]) k1 = 2*scatPar[0][N_SF-4];
+	if (k1 <= k0) return 0;
+	splinh(scatPar[0],scatPar[Znum],b,c,d,N_SF);
+	dq = (k1-k0)/n;
+	for (i=0;i<n;i++) {
+		q = k0+(i+0.5)*dq;
+		f = tableScatteringFactor(Znum,q,b,c,d);
+		sum += q*f*f*(1-exp(-0.5*B*q*q));
+	}
+	return 2*PI*sum*dq;
+}
+
+static void makeAbsorptivePotential(atomPotentialLUT *lut,int Znum, MULS *muls,double B) {
+	int ir,iq;
+	int &Nr = lut->nx;
+	double &dr = lut->dkx, &dq = lut->dky;
+	double b[N_SF],c[N_SF],d[N_SF];
+	double fq[ABSORPTIVE_NQ];
+	double qMax,sum,r,q;
+
+	if (Nr == 0) {
+		dr = muls->resolutionX/OVERSAMP_X;
+		Nr = (int)ceil(muls->atomRadius/dr)+2;
+		// f' vanishes beyond twice the range of the table, finer details are not sampled by the slices
+		qMax = 0.5/(muls->resolutionX < muls->resolutionY ? muls->resolutionX : muls->resolutionY);
+		if (qMax > 4*scatPar[0][N_SF-4]) qMax = 4*scatPar[0][N_SF-4];
+		dq = qMax/ABSORPTIVE_NQ;
+	}
+	if (lut->atPot[Znum] == NULL) {
+		splinh(scatPar[0],scatPar[Znum],b,c,d,N_SF);
+		for (iq=0;iq<ABSORPTIVE_NQ;iq++)
+			fq[iq] = absorptiveFormFactor(Znum,B,(iq+0.5)*dq,b,c,d);
+		lut->atPot[Znum] = (fftwf_complex*) fftwf_malloc(Nr*sizeof(fftwf_complex));
+		// projection of the radially symmetric f'(q): 2 pi Int q f'(q) J0(2 pi q r) dq
+		for (ir=0;ir<Nr;ir++) {
+			r = ir*dr;
+			for (sum=0,iq=0;iq<ABSORPTIVE_NQ;iq++) {
+				q = (iq+0.5)*dq;
+				sum += q*fq[iq]*bessj0(2*PI*q*r);
+			}
+			lut->atPot[Znum][ir][0] = (float)(2*PI*sum*dq);
+			lut->atPot[Znum][ir][1] = 0;
+		}
+		if (muls->printLevel > 1)
+			printf("Created absorptive potential for Z=%d (B=%g A^2, f'(0)/(gamma lambda)=%g A^2)\n",
+				Znum,B,absorptiveFormFactor(Znum,B,0,b,c,d));
+	}
+#pragma omp flush
+	lut->ready[Znum] = 1;
+}
+
+/* radial table of the absorptive potential of Znum (see above), Nr steps of dr */
+fftwf_complex *getAbsorptivePotential(int Znum, MULS *muls,double B,int *Nr,double *dr) {
+	atomPotentialLUT *lut = findPotentialLUT(POTENTIAL_LUT_ABSORPTIVE,muls);
+
+	if (!potentialReady(lut,Znum)) {
+		{
+			ScopedLock lock(potentialLUTLock);
+			if (!lut->ready[Znum]) makeAbsorptivePotential(lut,Znum,muls,B);
+		}
+	}
+	*Nr = lut->nx;
+	*dr = lut->dkx;
+	return lut->atPot[Znum];
+}
+
+/********************************************************************************
+* adds gamma*lambda times the absorptive potential of the atoms of this slab to
+* the imaginary part of the slices (initSTEMSlices multiplies it by gamma*lambda
+* again), every atom to the slice that contains its center, as for the 2D 
+* potential.  The table of an element is made with the Debye-Waller factor of
+* its first atom.
+* With muls->absorbedToDetectors the absorbed intensity is shared among the 
+* detectors like the TDS cross sections of the atoms of the slab: 
+* absorbedFraction of a detector is sum_Z n_Z sigma_Z(detector)/sum_Z n_Z sigma_Z.
+* This ignores that a probe on a column absorbs mostly from the atoms of that 
+* column, and that the diffusely scattered electrons are scattered again.
+********************************************************************************/
+static void addAbsorptivePotential(MULS *muls,atom *atoms,int natom,int nlayer,int divCount) {
+	int iatom,iz,ix,iy,iax,iay,iAtomX,iAtomY,iRadX,iRadY,Nr,ir,Znum,i;
+	int count[NZMAX+1];
+	double B[NZMAX+1];
+	double gl,c,zShift,atomX,atomY,x,y,r,ddr,dr;
+	fftwf_complex *pot;
+
+	gl = (1.0+muls->v0/511.0)*wavelength(muls->v0);
+	c = muls->sliceThickness*muls->slices;
+	zShift = c*(real)(muls->cellDiv-divCount-1) - muls->czOffset
+		+ 0.5*muls->sliceThickness*(1-muls->centerSlices);
+	iRadX = (int)ceil(muls->atomRadius/muls->resolutionX);
+	iRadY = (int)ceil(muls->atomRadius/muls->resolutionY);
+	memset(count,0,sizeof(count));
+
+	for (iatom=0;iatom<natom;iatom++) {
+		Znum = atoms[iatom].Znum;
+		if ((Znum < 1) || (Znum > NZMAX)) continue;
+		iz = (int)floor((atoms[iatom].z-zShift)/muls->sliceThickness+0.5);
+		if ((iz < 0) || (iz >= nlayer)) {
+			// atoms of other slabs, or of the periodic images of this one
+			if (muls->nonPeriodZ || (muls->cellDiv > 1)) continue;
+			iz = (iz % nlayer+nlayer) % nlayer;
+		}
+		if (count[Znum]++ == 0) B[Znum] = atoms[iatom].dw;
+		pot = getAbsorptivePotential(Znum,muls,B[Znum],&Nr,&dr);
+
+		atomX = atoms[iatom].x-muls->potOffsetX;
+		atomY = atoms[iatom].y-muls->potOffsetY;
+		iAtomX = (int)floor(atomX/muls->resolutionX);
+		iAtomY = (int)floor(atomY/muls->resolutionY);
+		for (iax=iAtomX-iRadX;iax<=iAtomX+iRadX+1;iax++) {
+			if (muls->nonPeriod && ((iax < 0) || (iax >= muls->potNx))) continue;
+			ix = (iax % muls->potNx+muls->potNx) % muls->potNx;
+			x = iax*muls->resolutionX-atomX;
+			for (iay=iAtomY-iRadY;iay<=iAtomY+iRadY+1;iay++) {
+				if (muls->nonPeriod && ((iay < 0) || (iay >= muls->potNy))) continue;
+				iy = (iay % muls->potNy+muls->potNy) % muls->potNy;
+				y = iay*muls->resolutionY-atomY;
+				r = sqrt(x*x+y*y);
+				if (r > muls->atomRadius) continue;
+				ddr = r/dr;
+				ir = (int)ddr;
+				if (ir >= Nr-1) continue;
+				ddr -= ir;
+				muls->trans[iz][ix][iy][1] += (float)(gl*((1-ddr)*pot[ir][0]+ddr*pot[ir+1][0]));
+			}
+		}
+	}
+
+	absorbedFractions(muls,count,B);
+	if ((muls->printLevel > 1) && muls->absorbedToDetectors && (muls->avgCount == 0) && (divCount == muls->cellDiv-1))
+		for (i=0;i<muls->detectorNum;i++)
+			printf("Absorbed intensity to detector %s: %.3f\n",muls->detectors[0][i]->name,
+				muls->detectors[0][i]->absorbedFraction);
+}
+
+/* sets Detector::absorbedFraction of all detectors for count[Z] atoms of 
+ * element Z (Debye-Waller factor B[Z]), see addAbsorptivePotential.  Leaves 
+ * the fractions alone (0) without the absorptive potential */
+void absorbedFractions(MULS *muls,const int *count,const double *B) {
+	int i,t,Znum;
+	double num,den,k0,k1;
+
+	if (!muls->absorptive || !muls->absorbedToDetectors || muls->detectors.empty()) return;
+	for (i=0;i<muls->detectorNum;i++) {
+		k0 = sqrt(muls->detectors[0][i]->k2Inside);
+		k1 = sqrt(muls->detectors[0][i]->k2Outside);
+		for (num=0,den=0,Znum=1;Znum<=NZMAX;Znum++) if (count[Znum] > 0) {
+			num += count[Znum]*tdsCrossSection(Znum,B[Znum],k0,k1);
+			den += count[Znum]*tdsCrossSection(Znum,B[Znum],0,2*scatPar[0][N_SF-4]);
+		}
+		for (t=0;t<(int)muls->detectors.size();t++)
+			muls->detectors[t][i]->absorbedFraction = (den > 0) ? (float_tt)(num/den) : 0;
+	}
+}
+#undef ABSORPTIVE_NQ
+#undef ABSORPTIVE_NRHO
+#undef ABSORPTIVE_NPHI
+
 void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz) {
 	real *sparam;
 	real rmin,rmax;
@@ -1938,7 +2341,8 @@ void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz) {
 
 #define SMOOTH_EDGE 5 // make a smooth edge on AIS aperture over +/-SMOOTH_EDGE pixels
 
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny)
+template <typename T>
+void probeShiftAndCrop(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, double dx, double dy, double cnx, double cny)
 {
 	// Robert A. McLeod
 	// 09 April 2014
@@ -1949,7 +2353,8 @@ void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cn
 	printf("Debug: probeShiftAndCrop does nothing at present\n");
 }
 
-void probe(MULS *muls, WavePtr wave, double dx, double dy)
+template <typename T>
+void probe(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, double dx, double dy)
 {
 	// static char *plotFile = "probePlot.dat",systStr[32];
 	int ix, iy, nx, ny, ixmid, iymid;
@@ -1971,6 +2376,7 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	ny = (*muls).ny;
 	ax = nx*(*muls).resolutionX; 
 	by = ny*(*muls).resolutionY; 
+	wave->absorbed = 0;
 	dx = ax-dx;
 	dy = by-dy;
 	gaussScale = (*muls).gaussScale;
@@ -1987,10 +2393,10 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	* dI_I = dI/I = lens current fluctuations
 	* delta defocus in Angstroem (Cc in A)
 	*******************************************************/
-	delta = muls->Cc*muls->dE_E;
+	delta = muls->Cc*muls->dE_E+wave->defocusOffset;
 	if (muls->printLevel > 2) printf("defocus offset: %g nm (Cc = %g)\n",delta,muls->Cc);
 
-	if (wave->wave == NULL) {
+	if (wave->wave.Empty()) {
 		printf("Error in probe(): Wave not allocated!\n");
 		exit(0);
 	}
@@ -2091,12 +2497,12 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 
 			if ( ( (*muls).ismoth != 0) && 
 				( fabs(k2-k2max) <= pixel)) {
-					wave->wave[ix][iy][0]= (float) ( 0.5*scale * cos(chi));
-					wave->wave[ix][iy][1]= (float) (-0.5*scale* sin(chi));
+					wave->wave[ix][iy][0]= (T) ( 0.5*scale * cos(chi));
+					wave->wave[ix][iy][1]= (T) (-0.5*scale* sin(chi));
 			} 
 			else if ( k2 <= k2max ) {
-				wave->wave[ix][iy][0]= (float)  scale * cos(chi);
-				wave->wave[ix][iy][1]= (float) -scale * sin(chi);
+				wave->wave[ix][iy][0]= (T)  scale * cos(chi);
+				wave->wave[ix][iy][1]= (T) -scale * sin(chi);
 			} 
 			else {
 				wave->wave[ix][iy][0] = wave->wave[ix][iy][1] = 0.0f;
@@ -2105,11 +2511,7 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	}
 	/* Fourier transform into real space */
 	// fftwnd_one(muls->fftPlanInv, &(muls->wave[0][0]), NULL);
-#if FLOAT_PRECISION == 1
-	fftwf_execute(wave->fftPlanWaveInv);
-#else
-	fftw_execute(wave->fftPlanWaveInv);
-#endif
+	wave->FFTInverse();
 	/**********************************************************
 	* display cross section of probe intensity
 	*/
@@ -2119,8 +2521,8 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 		for( ix=0; ix<nx; ix++) {
 			for( iy=0; iy<ny; iy++) {
 				r = exp(-((ix-nx/2)*(ix-nx/2)+(iy-ny/2)*(iy-ny/2))/(nx*nx*gaussScale));
-				wave->wave[ix][iy][0] *= (float)r;
-				wave->wave[ix][iy][1] *= (float)r;
+				wave->wave[ix][iy][0] *= (T)r;
+				wave->wave[ix][iy][1] *= (T)r;
 			}
 		}  
 	}
@@ -2160,8 +2562,8 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 
 	for( ix=0; ix<nx; ix++) 
 		for( iy=0; iy<ny; iy++) {
-			wave->wave[ix][iy][0] *= (float) scale;
-			wave->wave[ix][iy][1] *= (float) scale;
+			wave->wave[ix][iy][0] *= (T) scale;
+			wave->wave[ix][iy][1] *= (T) scale;
 		}
 
 		/*  Output results and find min and max to echo
@@ -2203,7 +2605,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	double scale,vz,vzscale,mm0,wavlen;
 	int nx,ny,ix,iy; // iz;
 	real temp,k2max,k2,kx,ky;
-	static real *kx2= NULL,*ky2 = NULL; /* *kx= NULL,*ky= NULL, */
+	std::vector<real> kx2,ky2; /* kx,ky */
 	real pi;
 	double fftScale;
 	double timer1,timer2,time2=0,time1=0;
@@ -2216,9 +2618,9 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 
 	/**************************************************/
 	/* Setup all the reciprocal lattice vector arrays */
-	if ((kx2 == NULL)||(ky2 == NULL)) {
-		kx2    = float1D(nx, "kx2" );
-		ky2    = float1D(ny, "ky2" );
+	{
+		kx2.resize(nx);
+		ky2.resize(ny);
 		/*
 		kx     = float1D(nx, "kx" );
 		ky     = float1D(ny, "ky" );
@@ -2261,7 +2663,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	k2max = k2max*k2max;
 	(*muls).k2max = k2max;
 
-	if(muls->trans==NULL) {
+	if(muls->trans.Empty()) {
 		printf("Memory for trans has not been allocated\n");
 		exit(0);
 	}
@@ -2292,10 +2694,10 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 		for( iy=0; iy<ny; iy++) for( ix=0; ix<nx; ix++) {
 			vz= muls->trans[ilayer][ix][iy][0]*scale;  // scale = lambda*gamma
 			// include absorption:
-			// vzscale= exp(-(*muls).trans[ilayer][ix][iy][1]*scale);
+			if (muls->absorptive) vzscale= exp(-muls->trans[ilayer][ix][iy][1]*scale);
 			/* printf("vz(%d %d) = %g\n",ix,iy,vz); */
-			muls->trans[ilayer][ix][iy][0] =  cos(vz);
-			muls->trans[ilayer][ix][iy][1] =  sin(vz);
+			muls->trans[ilayer][ix][iy][0] =  vzscale*cos(vz);
+			muls->trans[ilayer][ix][iy][1] =  vzscale*sin(vz);
 		}
 	}
 
@@ -2304,11 +2706,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	*******************************************************************/ 
 	if (muls->bandlimittrans) {
 		timer2 = cputim();    
-#if FLOAT_PRECISION == 1
 		fftwf_execute(muls->fftPlanPotForw);
-#else
-		fftw_execute(muls->fftPlanPotForw);
-#endif
 		time2 = cputim()-timer2;
 		//     printf("%g sec used for 1st set of FFTs\n",time2);  
 		for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
@@ -2327,11 +2725,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 		}  /* end for(ilayer=... */
 		timer2 = cputim();    
 		// old code: fftwnd_one((*muls).fftPlanPotInv, (*muls).trans[ilayer][0], NULL);
-#if FLOAT_PRECISION == 1
 		fftwf_execute(muls->fftPlanPotInv);
-#else
-		fftw_execute(muls->fftPlanPotInv);
-#endif
 		time2 += cputim()-timer2;
 	}  /* end of ... if bandlimittrans */
 	time1 = cputim()-timer1;
@@ -2372,7 +2766,8 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 * waver, wavei are expected to contain incident wave function 
 * they will be updated at return
 *****************************************************************/
-int runMulsSTEM(MULS *muls, WavePtr wave) {
+template <typename T>
+int runMulsSTEM(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave) {
 	int printFlag = 0; 
 	int showEverySlice=1;
 	int islice,i,ix,iy,mRepeat;
@@ -2409,38 +2804,34 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 			// if ((muls->cubez > 0) && (muls->thickness >= muls->cubez)) break;
 			//  else if ((muls->cubez == 0) && (muls->thickness >= muls->c)) break;
 
+			// the intensity that the absorptive potential takes out of the wave:
+			if (muls->absorbedToDetectors)
+				wave->absorbed += fftScale*absorbedIntensity<T>(wave->wave.View(),
+					muls->trans[islice].Window(wave->iPosX,wave->iPosY,muls->nx,muls->ny));
 			/***********************************************************************
 			* Transmit is a simple multiplication of wave with trans in real space
 			**********************************************************************/
-			transmit((void **)wave->wave, (void **)(muls->trans[islice]), muls->nx,muls->ny, wave->iPosX, wave->iPosY);
+			transmit<T>(wave->wave.View(), muls->trans[islice].Window(wave->iPosX,wave->iPosY,muls->nx,muls->ny));
 			//    writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavet.img");      
 			/***************************************************** 
 			* remember: prop must be here to anti-alias
 			* propagate is a simple multiplication of wave with prop
 			* but it also takes care of the bandwidth limiting
 			*******************************************************/
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
-#else
-			fftw_execute(wave->fftPlanWaveForw);
-#endif
-			propagate_slow((void **)wave->wave, muls->nx, muls->ny, muls);
+			wave->FFTForward();
+			propagate_slow<T>(wave->wave.View(), muls->nx, muls->ny, muls);
 
 			collectIntensity(muls, wave, muls->totalSliceCount+islice*(1+mRepeat));
 
-			if (muls->mode != STEM) {
+			if ((muls->mode != STEM) && wave->lastProbe) {
 				/* write pendelloesung plots, if this is not STEM */
 				writeBeams(muls,wave,islice, absolute_slice);
 			}
 
 			// go back to real space:
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveInv);
-#else
-			fftw_execute(wave->fftPlanWaveInv);
-#endif
+			wave->FFTInverse();
 			// old code: fftwnd_one((*muls).fftPlanInv,(fftw_complex *)wave[0][0], NULL);
-			fft_normalize((void **)wave->wave,muls->nx,muls->ny);
+			fft_normalize<T>(wave->wave.View(),muls->nx,muls->ny);
 
 			/*
 			sprintf(outStr,"wave%d.img",islice);
@@ -2477,8 +2868,9 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 				// TODO (MCS 2013/04): this restructure probably broke this file saving - 
 				//   need to rewrite a function to save things for TEM/CBED?
 				// This used to call interimWave(muls,wave,muls->totalSliceCount+islice*(1+mRepeat));
+				// the intensities of this slice have been collected above, in
+				// reciprocal space - the wave is in real space here
 				interimWave(muls,wave,absolute_slice*(1+mRepeat)); 
-				collectIntensity(muls,wave,absolute_slice*(1+mRepeat));
 			}
 		} /* end for(islice...) */
 		// collect intensity at the final slice
@@ -2525,7 +2917,10 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 	}
 	if (muls->saveFlag) {
 		if ((muls->saveLevel > 1) || (muls->cellDiv > 1)) {
-			wave->WriteWave(wave->fileout);
+			// the next slab continues with the intensity absorbed so far
+			std::vector<double> params;
+			if (muls->absorbedToDetectors) params.push_back(wave->absorbed);
+			wave->WriteWave(wave->fileout,"Wavefunction",params);
 			if (printFlag)
 				printf("Created complex image file %s\n",(*wave).fileout);    
 		}
@@ -2536,7 +2931,8 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 
 ////////////////////////////////////////////////////////////////
 // save the current wave function at this intermediate thickness:
-void interimWave(MULS *muls,WavePtr wave,int slice) {
+template <typename T>
+void interimWave(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int slice) {
 	int t;
 	char fileName[256]; 
 	std::vector<double> params(9);
@@ -2573,11 +2969,12 @@ void interimWave(MULS *muls,WavePtr wave,int slice) {
 * muls->slices*muls->cellDiv/muls->outputInterval 
 * There are muls->detectorNum different detectors
 *******************************************************************/
-void collectIntensity(MULS *muls, WavePtr wave, int slice) 
+template <typename T>
+void collectIntensity(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int slice) 
 {
 	int i,ix,iy,ixs,iys,t;
 	real k2;
-	double intensity,scale,scaleCBED,scaleDiff,intensity_save;
+	double intensity,scale,scaleCBED,scaleDiff,intensityShift;
 	char fileName[256],avgName[256]; 
 	float_tt **diffpatAvg = NULL;
 	int tCount = 0;
@@ -2594,73 +2991,110 @@ void collectIntensity(MULS *muls, WavePtr wave, int slice)
 	//    each thread is accessing different pixels in the output images.
 	detectors = muls->detectors;
 
-	if (muls->outputInterval == 0) t = 0;
-	else if (slice < ((muls->slices*muls->cellDiv)-1))
-	{
-		t = (int)((slice) / muls->outputInterval);
-		//if (t > tCount)
-		//{
-			// printf("t = %d, which is greater than tCount (%d)\n",t,tCount);
-			//t = tCount-1;
-		//}
-	}
-	else
-	{
-		t = tCount;
-	}
-
 	int position_offset = wave->detPosY * muls->scanXN + wave->detPosX;
 
+	// Only the last slice before an output adds to the detector images, so that
+	// Navg counts TDS runs, not slices (same condition as in interimWave).  If
+	// the last slice also ends an interval, slot tCount-1 gets a copy of tCount:
+	int slots[2];
+	int slotCount = detectorSlots(slice,muls->slices*muls->cellDiv,muls->outputInterval,slots);
+	int collectFlag = (slotCount > 0);
+	t = collectFlag ? slots[0] : slice/muls->outputInterval;
+	// the probes of a pixel (see WaveFunction::weight) are summed in wave->detectorSum,
+	// the last one adds the sum to the images:
+	int addFlag = collectFlag && wave->lastProbe;
+
+	// runs already averaged into this pixel, if converged pixels drop out of the
+	// later TDS runs (see tds_stop.h), otherwise Navg of the detector:
+	TdsStopping *stop = simState(muls)->tdsStop;
+	int pixelRuns = ((stop != NULL) && stop->PixelMode()) ? stop->Runs(wave->detPosX*muls->scanYN+wave->detPosY) : -1;
+	int navg;
+
 	// Multiply each image by its number of averages and divide by it later again:
-	for (i=0;i<muls->detectorNum;i++) 
+	if (addFlag) for (i=0;i<muls->detectorNum;i++) 
 	{
-		detectors[t][i]->image[wave->detPosX][wave->detPosY]  *= detectors[t][i]->Navg;	
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] *= detectors[t][i]->Navg;	
+		navg = (pixelRuns >= 0) ? pixelRuns : detectors[t][i]->Navg;
+		detectors[t][i]->image[wave->detPosX][wave->detPosY]  *= navg;	
+		detectors[t][i]->image2[wave->detPosX][wave->detPosY] *= navg;	
 		detectors[t][i]->error = 0;
 	}
 	/* add the intensities in the already 
-	fourier transformed wave function */
-	for (ix = 0; ix < muls->nx; ix++) 
+	fourier transformed wave function.  The rows are split among threads
+	when a single wave is worked on by all of them (wave-level parallelism),
+	each thread sums its own detector contributions which are added up at the end */
+	std::vector<double> detSum(muls->detectorNum,0.0);
+#pragma omp parallel private(ix,iy,i,k2,intensity,intensityShift,ixs,iys) if (!omp_in_parallel())
 	{
-		for (iy = 0; iy < muls->ny; iy++) 
+		std::vector<double> partSum(muls->detectorNum,0.0);
+#pragma omp for
+		for (ix = 0; ix < muls->nx; ix++) 
 		{
-			k2 = muls->kx2[ix]+muls->ky2[iy];
-			intensity = (wave->wave[ix][iy][0]*wave->wave[ix][iy][0]+
-				wave->wave[ix][iy][1]*wave->wave[ix][iy][1]);
-			wave->diffpat[(ix+muls->nx/2)%muls->nx][(iy+muls->ny/2)%muls->ny] = intensity*scaleDiff;
-			intensity *= scale;
-			for (i=0;i<muls->detectorNum;i++) {
-				if ((k2 >= detectors[t][i]->k2Inside) && (k2 <= detectors[t][i]->k2Outside)) 
-				{
-					// detector in center of diffraction pattern:
-					if ((detectors[t][i]->shiftX == 0) && (detectors[t][i]->shiftY == 0)) 
-					{
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// misuse the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-					}
-					/* special case for shifted detectors: */		
-					else 
+			for (iy = 0; iy < muls->ny; iy++) 
+			{
+				k2 = muls->kx2[ix]+muls->ky2[iy];
+				intensity = (wave->wave[ix][iy][0]*wave->wave[ix][iy][0]+
+					wave->wave[ix][iy][1]*wave->wave[ix][iy][1]);
+				wave->diffpat[(ix+muls->nx/2)%muls->nx][(iy+muls->ny/2)%muls->ny] = intensity*scaleDiff;
+				intensity *= scale;
+				for (i=0;i<muls->detectorNum;i++) {
+					if ((k2 >= detectors[t][i]->k2Inside) && (k2 <= detectors[t][i]->k2Outside)) 
 					{
-						intensity_save = intensity;
-						ixs = (ix+(int)detectors[t][i]->shiftX+muls->nx) % muls->nx;
-						iys = (iy+(int)detectors[t][i]->shiftY+muls->ny) % muls->ny;	    
-						intensity = scale * (wave->wave[ixs][iys][0]*wave->wave[ixs][iys][0]+
-							wave->wave[ixs][iys][1]*wave->wave[ixs][iys][1]);
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// repurpose the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-						/* restore intensity, so that it will not be shifted for the other detectors */
-						intensity = intensity_save;
-					}
-				} /* end of if k2 ... */
-			} /* end of for i=0 ... detectorNum */
-		} /* end of for iy=0... */
-	} /* end of for ix = ... */
+						// detector in center of diffraction pattern:
+						if ((detectors[t][i]->shiftX == 0) && (detectors[t][i]->shiftY == 0)) 
+						{
+							partSum[i] += intensity;
+						}
+						/* special case for shifted detectors: */		
+						else 
+						{
+							ixs = (ix+(int)detectors[t][i]->shiftX+muls->nx) % muls->nx;
+							iys = (iy+(int)detectors[t][i]->shiftY+muls->ny) % muls->ny;	    
+							intensityShift = scale * (wave->wave[ixs][iys][0]*wave->wave[ixs][iys][0]+
+								wave->wave[ixs][iys][1]*wave->wave[ixs][iys][1]);
+							partSum[i] += intensityShift;
+						}
+					} /* end of if k2 ... */
+				} /* end of for i=0 ... detectorNum */
+			} /* end of for iy=0... */
+		} /* end of for ix = ... */
+#pragma omp critical
+		for (i=0;i<muls->detectorNum;i++) detSum[i] += partSum[i];
+	}
+	// the part of the intensity absorbed so far that TDS would scatter into the detectors
+	if (muls->absorbedToDetectors) for (i=0;i<muls->detectorNum;i++)
+		detSum[i] += muls->electronScale*wave->absorbed*detectors[t][i]->absorbedFraction;
+	if (collectFlag && ((wave->weight != 1) || !wave->lastProbe)) {
+		size_t n = (size_t)muls->nx*muls->ny;
+		float_tt *pSum;
+		if (wave->diffpatSums.size() < (tCount+1)*n) wave->diffpatSums.resize((tCount+1)*n,0);
+		pSum = &wave->diffpatSums[t*n];
+		for (ix=0;ix<(int)n;ix++) pSum[ix] += (float_tt)wave->weight*wave->diffpat[0][ix];
+		if (wave->lastProbe) {
+			memcpy(wave->diffpat.Data(),pSum,n*sizeof(float_tt));
+			memset(pSum,0,n*sizeof(float_tt));
+		}
+	}
+	if (collectFlag) {
+		if ((int)wave->detectorSum.size() < (tCount+1)*muls->detectorNum)
+			wave->detectorSum.resize((tCount+1)*muls->detectorNum,0.0);
+		for (i=0;i<muls->detectorNum;i++) {
+			wave->detectorSum[t*muls->detectorNum+i] += wave->weight*detSum[i];
+			if (addFlag) {
+				detSum[i] = wave->detectorSum[t*muls->detectorNum+i];
+				wave->detectorSum[t*muls->detectorNum+i] = 0;
+			}
+		}
+	}
+	if (addFlag) for (i=0;i<muls->detectorNum;i++) 
+	{
+		detectors[t][i]->image[wave->detPosX][wave->detPosY] += detSum[i];
+		// misuse the error number for collecting this pixels raw intensity
+		detectors[t][i]->error = detSum[i];
+	}
 
 	////////////////////////////////////////////////////////////////////////////
 	// write the diffraction pattern to disc in case we are working in CBED mode
-	if ((muls->mode == CBED) && (muls->saveLevel > 0)) {
+	if ((muls->mode == CBED) && (muls->saveLevel > 0) && collectFlag && wave->lastProbe) {
 		sprintf(avgName,"%s/diff_%d.img",muls->folder,t);
 		// for (ix=0;ix<muls->nx*muls->ny;ix++) wave->diffpat[0][ix] *= scaleCBED;
 		if (muls->avgCount == 0) {
@@ -2676,13 +3110,19 @@ void collectIntensity(MULS *muls, WavePtr wave, int slice)
 	}
 
 	// Divide each image by its number of averages again:
-	for (i=0;i<muls->detectorNum;i++) {
+	if (addFlag) for (i=0;i<muls->detectorNum;i++) {
+		navg = (pixelRuns >= 0) ? pixelRuns : detectors[t][i]->Navg;
 		// add intensity squared to image2 for this detector and pixel, then rescale:
 		detectors[t][i]->image2[wave->detPosX][wave->detPosY] += detectors[t][i]->error*detectors[t][i]->error;
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
+		detectors[t][i]->image2[wave->detPosX][wave->detPosY] /= navg+1;	
 
 		// do the rescaling for the average image:
-		detectors[t][i]->image[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
+		detectors[t][i]->image[wave->detPosX][wave->detPosY] /= navg+1;	
+
+		if (slotCount > 1) {
+			detectors[slots[1]][i]->image[wave->detPosX][wave->detPosY] = detectors[t][i]->image[wave->detPosX][wave->detPosY];
+			detectors[slots[1]][i]->image2[wave->detPosX][wave->detPosY] = detectors[t][i]->image2[wave->detPosX][wave->detPosY];
+		}
 	}
 }
 
@@ -2694,9 +3134,10 @@ void saveSTEMImages(MULS *muls)
 {
 	int i, ix, islice;
 	double intensity;
-	static char fileName[256]; 
+	char fileName[256]; 
 	//imageStruct *header = NULL;
 	std::vector<DetectorPtr> detectors;
+	std::vector<float_tt> pointSource;
 	float t;
 
 	int tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
@@ -2743,55 +3184,156 @@ void saveSTEMImages(MULS *muls)
 			{
 				detectors[i]->SetParameter(2+ix, (double)detectors[i]->image2[0][ix]);
 			}
+			// the images of a point source keep accumulating TDS runs, only
+			// the written images are convolved with the source distribution:
+			if (muls->sourceRadius > 0) {
+				pointSource.assign(detectors[i]->image.Data(),detectors[i]->image.Data()+detectors[i]->image.Size());
+				convolveSourceSize(detectors[i]->image.Data(),muls->scanXN,muls->scanYN,
+					(muls->scanXStop-muls->scanXStart)/(double)muls->scanXN,
+					(muls->scanYStop-muls->scanYStart)/(double)muls->scanYN,
+					muls->sourceRadius,muls->sourceDistribution,muls->sourceLorentzFraction);
+			}
 			detectors[i]->WriteImage(fileName);
+			if (muls->sourceRadius > 0)
+				memcpy(detectors[i]->image.Data(),&pointSource[0],pointSource.size()*sizeof(float_tt));
+		}
+	}
+}
+
+/*****  saveSTEMShard *******/
+// Saves the partial detector accumulators of this shard of a STEM scan
+// (see --shard and --shard-runs) to muls->folder/shard_<i>_<j>.qsh
+// The file is rewritten after every slab, qstem-merge combines the
+// files of all shards into the images saveSTEMImages would write.
+void saveSTEMShard(MULS *muls)
+{
+	int i, t, k, p;
+	char fileName[512];
+	STEMShard shard;
+
+	int tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
+
+	shard.scanXN = muls->scanXN;
+	shard.scanYN = muls->scanYN;
+	shard.detectorNum = muls->detectorNum;
+	shard.nThick = tCount+1;
+	shard.shardIndex = muls->shardIndex;
+	shard.shardCount = muls->shardCount;
+	shard.runShardIndex = muls->runShardIndex;
+	shard.runShardCount = muls->runShardCount;
+	shard.runs = muls->avgCount-muls->avgStart+1;
+	shard.avgRuns = muls->avgRuns;
+	shard.resX = (muls->scanXStop-muls->scanXStart)/(double)muls->scanXN;
+	shard.resY = (muls->scanYStop-muls->scanYStart)/(double)muls->scanYN;
+	shard.Resize();
+
+	for (t=0; t<=tCount; t++)
+	{
+		if (t<tCount)
+			shard.thickness[t] = ((t+1) * muls->outputInterval ) * muls->sliceThickness;
+		else
+			shard.thickness[t] = muls->slices*muls->cellDiv*muls->sliceThickness;
+		for (i=0; i<muls->detectorNum; i++) 
+		{
+			shard.names[i] = muls->detectors[t][i]->name;
+			// images hold averages over shard.runs TDS runs, store the sums:
+			for (k=0,p=muls->shardIndex; p<muls->scanXN*muls->scanYN; k++,p+=muls->shardCount)
+			{
+				shard.sum[shard.Index(t,i,k)]  = shard.runs*muls->detectors[t][i]->image[0][p];
+				shard.sum2[shard.Index(t,i,k)] = shard.runs*muls->detectors[t][i]->image2[0][p];
+			}
 		}
 	}
+	sprintf(fileName,"%s/shard_%d_%d.qsh",muls->folder,muls->shardIndex,muls->runShardIndex);
+	if (shard.Write(fileName) && (muls->printLevel > 1))
+		printf("Saved partial detector sums (%d runs) to %s\n",shard.runs,fileName);
 }
 
-void readStartWave(WavePtr wave) {
+template <typename T>
+void readStartWave(boost::shared_ptr<WaveFunction<T> > wave) {
 	wave->ReadWave(wave->fileStart);
+	// written by runMulsSTEM with the absorbed intensity, 0 otherwise
+	wave->absorbed = wave->GetParameter(0);
 }
 
 
+/******************************************************************
+* initWaveThreads() 
+* decides whether the available threads work on independent waves 
+* (one probe position per thread, scan-level parallelism) or share
+* the FFTs and pixel loops of a single wave (wave-level parallelism).
+* The latter is used whenever there are fewer independent waves than 
+* threads, e.g. for TEM and CBED, or for very small STEM scans.
+* muls->waveThreads may be preset (wave threads: in the .dat file),
+* a value < 1 selects automatically.
+* Must be called before any FFTW plan is created.
+*****************************************************************/
+void initWaveThreads(MULS *muls) {
+	int nThreads = 1, nWaves = 1;
+
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	if (muls->mode == STEM) nWaves = muls->scanXN*muls->scanYN;
+	if (muls->waveThreads < 1)
+		muls->waveThreads = (nWaves < nThreads) ? nThreads : 1;
+
+#ifdef _OPENMP
+	// for scan-level parallelism the pixel loops are called from within the
+	// parallel scan loop and stay serial, nothing to set up here.
+	if ((muls->waveThreads > 1) || (nWaves == 1)) omp_set_num_threads(muls->waveThreads);
+#endif
+#ifdef FFTW_THREADS
+	if (muls->waveThreads > 1) {
+		if ((fftwf_init_threads() == 0) || (fftw_init_threads() == 0)) {
+			printf("Could not initialize threaded FFTs\n");
+		}
+		else {
+			// single and double precision plans (see "precision:")
+			fftwf_plan_with_nthreads(muls->waveThreads);
+			fftw_plan_with_nthreads(muls->waveThreads);
+		}
+	}
+#endif
+	if (muls->printLevel > 1) {
+		if (muls->waveThreads > 1)
+			printf("Wave-level parallelism: %d threads per wave function\n",muls->waveThreads);
+		else
+			printf("Scan-level parallelism: %d threads, one wave function each\n",nThreads);
+	}
+}
+
 /******************************************************************
 * propagate_slow() 
 * replicates the original way, mulslice did it:
 *****************************************************************/
-void propagate_slow(void **w,int nx, int ny,MULS *muls)
+template <typename T>
+void propagate_slow(Array2DView<typename FFTW<T>::complex> wave, int nx, int ny, MULS *muls)
 {
 	int ixa, iya;
-	real wr, wi, tr, ti,ax,by;
+	T wr, wi, tr, ti;
+	real ax,by;
 	real scale,t,dz; 
-	static real dzs=0;
-	static real *propxr=NULL,*propyr=NULL;
-	static real *propxi=NULL,*propyi=NULL;
-	static real *kx2,*ky2;
-	static real *kx,*ky;
-	static real k2max=0,wavlen;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **wave;
-	wave = (fftwf_complex **)w;
-#else
-	fftw_complex **wave;
-	wave = (fftw_complex **)w;
-#endif
+	real wavlen;
+	// the propagator of this simulation, shared by all threads working on it
+	propagatorState<T> &p = simState(muls)->propagator<T>();
+	int ready;
 
 	ax = (*muls).resolutionX*nx;
 	by = (*muls).resolutionY*ny;
 	dz = (*muls).cz[0];
 
-	if (dz != dzs) {
-		if (propxr == NULL) {
-			propxr = float1D(nx, "propxr" );
-			propxi = float1D(nx, "propxi" );
-			propyr = float1D(ny, "propyr" );
-			propyi = float1D(ny, "propyi" );
-			kx2    = float1D(nx, "kx2" );
-			kx     = float1D(nx, "kx" );
-			ky2    = float1D(ny, "ky2" );
-			ky     = float1D(ny, "ky" );
-		}
-		dzs = dz;
+	ready = (dz == p.dzs) && (nx == p.nx) && (ny == p.ny);
+#pragma omp flush
+	if (!ready) {
+#pragma omp critical(propagator)
+	if ((dz != p.dzs) || (nx != p.nx) || (ny != p.ny)) {
+		std::vector<T> &propxr = p.propxr, &propxi = p.propxi, &propyr = p.propyr, &propyi = p.propyi;
+		std::vector<real> &kx2 = p.kx2, &ky2 = p.ky2, &kx = p.kx, &ky = p.ky;
+		real &k2max = p.k2max;
+
+		propxr.resize(nx); propxi.resize(nx); kx2.resize(nx); kx.resize(nx);
+		propyr.resize(ny); propyi.resize(ny); ky2.resize(ny); ky.resize(ny);
 		scale = dz*PI;
 		wavlen = wavelength((*muls).v0);
 
@@ -2800,8 +3342,8 @@ void propagate_slow(void **w,int nx, int ny,MULS *muls)
 				(real)ixa/ax;
 			kx2[ixa] = kx[ixa]*kx[ixa];
 			t = scale * (kx2[ixa]*wavlen);
-			propxr[ixa] = (real)  cos(t);
-			propxi[ixa] = (real) -sin(t);
+			propxr[ixa] = (T)  cos(t);
+			propxi[ixa] = (T) -sin(t);
 		}
 		for( iya=0; iya<ny; iya++) {
 			ky[iya] = (iya>ny/2) ? 
@@ -2809,25 +3351,35 @@ void propagate_slow(void **w,int nx, int ny,MULS *muls)
 			(real)iya/by;
 			ky2[iya] = ky[iya]*ky[iya];
 			t = scale * (ky2[iya]*wavlen);
-			propyr[iya] = (real)  cos(t);
-			propyi[iya] = (real) -sin(t);
+			propyr[iya] = (T)  cos(t);
+			propyi[iya] = (T) -sin(t);
 		}
 		k2max = nx/(2.0F*ax);
 		if (ny/(2.0F*by) < k2max ) k2max = ny/(2.0F*by);
 		k2max = 2.0/3.0 * k2max;
-		// TODO: modifying shared value from multiple threads?
 		k2max = k2max*k2max;
-		(*muls).kx2=kx2;
-		(*muls).ky2=ky2;
-		(*muls).kx=kx;
-		(*muls).ky=ky;
+		(*muls).kx2=&kx2[0];
+		(*muls).ky2=&ky2[0];
+		(*muls).kx=&kx[0];
+		(*muls).ky=&ky[0];
+		p.nx = nx;
+		p.ny = ny;
+		// set last, threads that see the new dzs use the new arrays
+#pragma omp flush
+		p.dzs = dz;
 	} 
+	}
 	/* end of: if dz != dzs */
 	/*************************************************************/
+	const T *propxr = &p.propxr[0], *propxi = &p.propxi[0];
+	const T *propyr = &p.propyr[0], *propyi = &p.propyi[0];
+	const real *kx2 = &p.kx2[0], *ky2 = &p.ky2[0];
+	real k2max = p.k2max;
 
 	/*************************************************************
 	* Propagation
 	************************************************************/
+#pragma omp parallel for private(iya,wr,wi,tr,ti) if (!omp_in_parallel())
 	for( ixa=0; ixa<nx; ixa++) {
 		if( kx2[ixa] < k2max ) {
 			for( iya=0; iya<ny; iya++) {
@@ -2855,50 +3407,68 @@ void propagate_slow(void **w,int nx, int ny,MULS *muls)
 transmit the wavefunction thru one layer 
 (simply multiply wave by transmission function)
 
-waver,i[ix][iy]  = real and imaginary parts of wavefunction
-transr,i[ix][iy] = real and imag parts of transmission functions
-
-nx, ny = size of array
+w[ix][iy]  = wavefunction (nx x ny)
+t[ix][iy]  = window of the transmission function at the probe position,
+             e.g. trans[islice].Window(posx,posy,nx,ny)
 
 on entrance waver,i and transr,i are in real space
 
 only waver,i will be changed by this routine
 */
-void transmit(void **wave, void **trans,int nx, int ny,int posx,int posy) {
-	int ix, iy;
+template <typename T>
+void transmit(Array2DView<typename FFTW<T>::complex> w, Array2DView<fftwf_complex> t) {
+	int ix, iy, nx = w.Nx(), ny = w.Ny();
 	double wr, wi, tr, ti;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **w, **t;
-	w = (fftwf_complex **)wave;
-	t = (fftwf_complex **)trans;
-#else
-	fftw_complex **w,**t;
-	w = (fftw_complex **)wave;
-	t = (fftw_complex **)trans;
-#endif
-	/*  trans += posx; */
-	for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
-		wr = w[ix][iy][0];
-		wi = w[ix][iy][1];
-		tr = t[ix+posx][iy+posy][0];
-		ti = t[ix+posx][iy+posy][1];
-		w[ix][iy][0] = wr*tr - wi*ti;
-		w[ix][iy][1] = wr*ti + wi*tr;
+	typename FFTW<T>::complex *wRow;
+	fftwf_complex *tRow;
+	/* t is the window of trans under the wave (starting at posx,posy),
+	 * both are contiguous along y */
+#pragma omp parallel for private(iy,wr,wi,tr,ti,wRow,tRow) if (!omp_in_parallel())
+	for( ix=0; ix<nx; ix++) {
+		wRow = w[ix];
+		tRow = t[ix];
+		for( iy=0; iy<ny; iy++) {
+			wr = wRow[iy][0];
+			wi = wRow[iy][1];
+			tr = tRow[iy][0];
+			ti = tRow[iy][1];
+			wRow[iy][0] = wr*tr - wi*ti;
+			wRow[iy][1] = wr*ti + wi*tr;
+		}
 	} /* end for(iy.. ix .) */
 } /* end transmit() */
 
-void fft_normalize(void **array,int nx, int ny) {
+/*------------------------ absorbedIntensity() ------------------------*/
+/*
+returns sum |w|^2 (1-|t|^2), the intensity that the transmission 
+function t (e.g. trans[islice].Window(posx,posy,nx,ny)) takes out
+of the wave w
+*/
+template <typename T>
+double absorbedIntensity(Array2DView<typename FFTW<T>::complex> w, Array2DView<fftwf_complex> t) {
+	int ix, iy, nx = w.Nx(), ny = w.Ny();
+	double sum = 0;
+	typename FFTW<T>::complex *wRow;
+	fftwf_complex *tRow;
+#pragma omp parallel for private(iy,wRow,tRow) reduction(+:sum) if (!omp_in_parallel())
+	for( ix=0; ix<nx; ix++) {
+		wRow = w[ix];
+		tRow = t[ix];
+		for( iy=0; iy<ny; iy++) {
+			sum += ((double)wRow[iy][0]*wRow[iy][0]+(double)wRow[iy][1]*wRow[iy][1])*
+				(1.0-((double)tRow[iy][0]*tRow[iy][0]+(double)tRow[iy][1]*tRow[iy][1]));
+		}
+	}
+	return sum;
+} /* end absorbedIntensity() */
+
+template <typename T>
+void fft_normalize(Array2DView<typename FFTW<T>::complex> carray, int nx, int ny) {
 	int ix,iy;
 	double fftScale;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **carray;
-	carray = (fftwf_complex **)array;
-#else
-	fftw_complex **carray;
-	carray = (fftw_complex **)array;
-#endif
 
 	fftScale = 1.0/(double)(nx*ny);
+#pragma omp parallel for private(iy) if (!omp_in_parallel())
 	for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
 		carray[ix][iy][0] *= fftScale;
 		carray[ix][iy][1] *= fftScale;
@@ -2910,7 +3480,7 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 	char systStr[256];
 	FILE *fpPot;
 	int ix,iz;
-	static fftw_complex *data = NULL;
+	fftw_complex *data;
 	int length;
 	float r;
 
@@ -2920,8 +3490,7 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 	*/
 	length = (nx < ny) ? nx : ny ;
 	length +=2;
-	if (data == NULL)
-		data = (fftw_complex *)malloc(length * sizeof(fftw_complex));
+	data = (fftw_complex *)malloc(length * sizeof(fftw_complex));
 
 	/* 
 	copy data to array
@@ -2939,6 +3508,7 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 
 	if ( (fpPot = fopen( fileName, "w" )) == NULL ) {
 		printf("Could not open %s for writing!\n",fileName);
+		free(data);
 		return;
 	}
 	for (ix=0;ix<nx;ix++) {
@@ -2953,6 +3523,7 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 		fprintf( fpPot, "\n" );
 	}
 	fclose( fpPot );
+	free(data);
 
 	sprintf(systStr,"xmgr -nxy %s &",fileName);
 	system(systStr);
@@ -2963,16 +3534,19 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 * This function will write a data file with the pendeloesungPlot 
 * for selected beams
 ****************************************************************/
-void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
-	static char fileAmpl[32];
-	static char filePhase[32];
-	static char fileBeam[32];
-	static FILE *fp1 = NULL,*fpAmpl = NULL,*fpPhase=NULL;
+template <typename T>
+void writeBeams(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int ilayer, int absolute_slice) {
+	// the beam files stay open until writeBeams is called with ilayer < 0
+	beamState &st = simState(muls)->beams;
+	char *fileAmpl = st.fileAmpl;
+	char *filePhase = st.filePhase;
+	char *fileBeam = st.fileBeam;
+	FILE *&fp1 = st.fp1,*&fpAmpl = st.fpAmpl,*&fpPhase = st.fpPhase;
 	int ib;
-	static int *hbeam=NULL,*kbeam=NULL;
-	static real zsum = 0.0f,scale;
+	int *&hbeam = st.hbeam,*&kbeam = st.kbeam;
+	real &zsum = st.zsum,&scale = st.scale;
 	real rPart,iPart,ampl,phase;
-	static char systStr[64];
+	char systStr[600];
 	// static int counter=0;
 
 	if (!muls->lbeams)
@@ -3094,196 +3668,21 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 
 
 
-//////////////////////////////////////////////////////////////////////////////////
-// DO NOT use this function, gives wrong results.
-// 
-// This method of sampling z at the slice interval gives very wrong HOLZ results,
-// since this means a linear interpolation of a highly non-linear function.  Atoms 
-// are quasi split up into two layers.  This causes a cutting in half of the z-periodicity
-// for some unit cells (e.g. STO sampled 2 slices per unit cell)
-//
-#define S_SCALE 0.5
-#define PHI_SCALE 47.87658
-#define SHOW_SINGLE_POTENTIAL 1
-fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B) {
-	int ix,iy,iz,iiz,ind3d,ind3dd,iKind;
-	double zScale,kzmax,kzborder;
-	fftwf_plan plan;
-	static double f,phase,s2,kmax2,kx,ky,kz,dkx,dky,dkz,dx2,dy2,dz2;
-	static int nx,ny,nz;
-	static fftwf_complex **atPot = NULL;
-#if SHOW_SINGLE_POTENTIAL == 1
-	//static imageStruct *header = NULL;
-
-	fftwf_complex *ptr = NULL;
-	char fileName[256];
-	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
-				muls->sliceThickness,muls->resolutionX/OVERSAMP_X,
-				muls->resolutionY/OVERSAMP_X));;
-#endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
-
-
-	// scattering factors in:
-	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(30, "splinb" );
-		splinc = double1D(30, "splinc" );
-		splind = double1D(30, "splind" );
-
-
-		// Why do I use nx+2 and make dkx=1/nx? ... don't know anymore. :(    
-		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX)+2;
-		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY)+2;
-		// make the atom sphere have an even number of slices in z-direction
-		// the 2 center slices will be equal.
-		// The FFT-resolution in the z-direction must be high enough to avoid 
-		// artifacts due to premature cutoff of the rec. space scattering factor 
-		nz = 2*OVERSAMP_Z*(int)ceil(muls->atomRadius/muls->sliceThickness);  
-		dkx = OVERSAMP_X/((nx-2)*muls->resolutionX);  // 0.5-factor s->k
-		dky = OVERSAMP_X/((ny-2)*muls->resolutionY);
-		dkz = OVERSAMP_Z/(double)(nz*muls->sliceThickness);
-		// if (nz<=2) dkz=0;
-		// else dkz = 1/((nz-2)*muls->sliceThickness);
-		kmax2 = 0.5*nx*dkx/(double)OVERSAMP_X;  // largest k that we'll admit
-
-		printf("Cutoff scattering angle:kmax=%g, smax=%g (1/A)\n",kmax2,S_SCALE*kmax2);
-		scatPar[0][29] = 1.2*S_SCALE*kmax2;
-		scatPar[0][28] = 1.1*S_SCALE*kmax2;
-		scatPar[0][27] = S_SCALE*kmax2;
-		if (scatPar[0][26] > scatPar[0][27]) {
-			// set additional scattering parameters to zero:
-			for (ix = 0;ix < 20;ix++) {
-				if (scatPar[0][26-ix] < scatPar[0][27]-0.1*(ix+1)) break;
-				scatPar[0][26-ix] = scatPar[0][27]-0.1*(ix+1);
-				for (iy=1; iy<=8;iy++) scatPar[iy][26-ix] = 0;	
-			}
-			if (muls->printLevel > 1)
-				printf("getAtomPotential3D: reduced angular range of scattering factor to %g/A!\n",scatPar[0][26-ix]);
-		} 
-		kmax2 *= kmax2;
-
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-	}
-	// initialize this atom, if it has not been done yet:
-	if (atPot[Znum] == NULL) {
-		switch (Znum) {
-	case 38: iKind = 1; break;  // Sr
-	case 22: iKind = 2; break;  // Ti
-	case  8: iKind = 3; break;  // O
-	case 49: iKind = 4; break;  // In
-	case 15: iKind = 5; break;  // P
-	case  2: iKind = 6; break;  // He
-	case 17: iKind = 7; break;  // Cl
-	case 14: iKind = 8; break;  // Si
-	case 20: iKind = 9; break;  // Ca
-	case 56: iKind = 10; break;  // Ba
-	case 26: iKind = 11; break;  // Fe
-	default: 
-		printf("This atom kind (%d) is not supported yet - sorry!\n",Znum);
-		exit(0);
-		}
-
-
-		// setup cubic spline interpolation:
-		splinh(scatPar[0],scatPar[iKind],splinb,splinc,splind,30);
-
-		atPot[Znum] = (fftwf_complex*)fftwf_malloc(nx*ny*nz*sizeof(fftwf_complex));
-		memset(atPot[Znum],0,nx*ny*nz*sizeof(fftwf_complex));
-		kzmax    = dkz*nz/2.0; 
-		kzborder = dkz*(nz/(2*OVERSAMP_Z) -1); 
-		for (iz=0;iz<nz;iz++) {
-			kz = dkz*(iz<nz/2 ? iz : iz-nz);    
-			// We also need to taper off the potential in z-direction
-			// in order to avoid cutoff artifacts.
-			zScale = fabs(kz) <= kzborder ? 1.0 : 
-				0.5+0.5*cos(PI*(fabs(kz)-kzborder)/(kzmax-kzborder));
-			// printf("iz=%d, kz=%g, zScale=%g ",iz,kz,zScale);
-			for (ix=0;ix<nx;ix++) {
-				kx = dkx*(ix<nx/2 ? ix : ix-nx);      
-				for (iy=0;iy<ny;iy++) {
-					ky = dky*(iy<ny/2 ? iy : iy-ny);      
-					s2 = S_SCALE*S_SCALE*(kx*kx+ky*ky+kz*kz);
-					// if this is within the allowed circle:
-					if (s2<S_SCALE*S_SCALE*kmax2) {
-						ind3d = iy+ix*ny+iz*nx*ny;
-						// f = fe3D(Znum,k2,muls->tds,1.0,muls->scatFactor);
-						// multiply scattering factor with Debye-Waller factor:
-						// printf("k2=%g,B=%g, exp(-k2B)=%g\n",k2,B,exp(-k2*B));
-						f = seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,30,sqrt(s2))*exp(-s2*B);
-						// note that the factor 2 is missing in the phase (2pi k*r)
-						// this places the atoms in the center of the box.
-						phase = PI*(kx*muls->resolutionX*nx/(OVERSAMP_X)+ky*muls->resolutionY*ny/(OVERSAMP_X));
-						phase += PI*kz/OVERSAMP_Z*(muls->sliceThickness*(nz+1));
-						atPot[Znum][ind3d][0] = zScale*f*cos(phase);
-						atPot[Znum][ind3d][1] = zScale*f*sin(phase);
-						// if ((kx==0) && (ky==0)) printf(" f=%g (%g, [%g, %g])\n",f,f*zScale,atPot[Znum][ind3d][0],atPot[Znum][ind3d][1]);
-					}
-				}
-			}
-		}
 
-		plan = fftwf_plan_dft_3d(nz,nx,ny,atPot[Znum],atPot[Znum],FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
-		dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
-		dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
-		dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
-		// Here we make sure that our atom is not bigger than the desired radius, i.e. that 
-		// we really have round blobs.
-		// We also make sure that the potential touches zero at least somewhere.  This will avoid 
-		// sharp edges that could produce ringing artifacts.  
-		// It is certainly debatable whether this is a good apprach, or not. 
-		// printf("Setting up %d x %d x %d potential for Znum=%d, (atom kind %d), Omega=%g\n",nx,ny,nz,Znum,iKind,dkx*dky*dkz);
-		// min = atPot[Znum][ny/2+nx/2*ny+nz/2*nx*ny][0];
-		for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) for (iz=0;iz<nz/OVERSAMP_Z;iz++) {
-			ind3d = iy+ix*ny+iz*nx*ny;
-			// Integrate over 3 neighboring layers here:::::::::
-			for (zScale=0,iiz=0;iiz<OVERSAMP_Z;iiz++) {
-				ind3dd = iy+ix*ny+(OVERSAMP_Z*iz+iiz)*nx*ny;
-				// if (sqrt((ix-nx/2)*(ix-nx/2)*dx2+(iy-ny/2)*(iy-ny/2)*dy2+(iz-0.5-nz/2)*(iz-0.5-nz/2)*dz2) > muls->atomRadius) {
-				if ((sqrt((ix-nx/2)*(ix-nx/2)*dx2+(iy-ny/2)*(iy-ny/2)*dy2+
-					(OVERSAMP_Z*iz+iiz+0.5-nz/2)*(OVERSAMP_Z*iz+iiz+0.5-nz/2)*dz2)) > muls->atomRadius) {
-						// atPot[Znum][ind3d][0] *= dkx*dky*dkz;
-						atPot[Znum][ind3dd][0] = 0;
-				}
-				zScale += atPot[Znum][ind3dd][0];
-			}
-			// assign the iz-th slice the sum of the 3 other slices:
-			// and divide by unit cell area (volume, if in 3D):
-			atPot[Znum][ind3d][0] = zScale*dkx*dky/nz;	
-			if (atPot[Znum][ind3d][0] < 0) atPot[Znum][ind3d][0] = 0;
-			// if (atPot[Znum][ind3d][0] < min) min = atPot[Znum][ind3d][0];
 
-			atPot[Znum][ind3d][1]= 0;
-		}
-		// printf("Found minimum potential value of %g ... subtracting it from 3D potential.\n",min);
-		for (zScale = 0,ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++)  for (iz=0;iz<nz/OVERSAMP_Z;iz++){
-			if ((sqrt((ix-nx/2)*(ix-nx/2)*dx2+(iy-ny/2)*(iy-ny/2)*dy2+
-				(iz+0.5-nz/(2*OVERSAMP_Z))*(iz+0.5-nz/(2*OVERSAMP_Z))*dz2)) <= muls->atomRadius) {
-					//      if (sqrt((ix-nx/2)*(ix-nx/2)*dx2+(iy-ny/2)*(iy-ny/2)*dy2+(iz-nz/2)*(iz-nz/2)*dz2) <= muls->atomRadius) {	
-					ind3d = iy+ix*ny+iz*nx*ny;
-					if ((ix == nx/2) && (iy == ny/2)) zScale += atPot[Znum][ind3d][0];
-					// atPot[Znum][ind3d][0] -= min;
-			}
-		}
-		// make sure we don't produce negative potential:
-		// if (min < 0) for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) atPot[Znum][iy+ix*ny][0] -= min;
-#if SHOW_SINGLE_POTENTIAL == 1
-		for (iz=0;iz<nz/OVERSAMP_Z;iz++) {
-			sprintf(fileName,"potential_%d_%d.img",Znum,iz);
-			imageIO->SetThickness(iz);
-			ptr = &(atPot[Znum][iz*nx*ny]);
-			imageIO->WriteRealImage((void **)ptr,fileName);
-		}
-#endif    
-		if (muls->printLevel > 0)
-			printf("Created 3D %d x %d x %d potential array for Z=%d (%d, B=%g, sum=%g)\n",nx,ny,nz/OVERSAMP_Z,Znum,iKind,B,zScale);
-	}
-	return atPot[Znum];
-}
-#undef SHOW_SINGLE_POTENTIAL
+/* instantiate the wave function routines for both precisions */
+#define INSTANTIATE_WAVE_ROUTINES(T) \
+	template void probeShiftAndCrop<T>(MULS *, boost::shared_ptr<WaveFunction<T> >, double, double, double, double); \
+	template void probe<T>(MULS *, boost::shared_ptr<WaveFunction<T> >, double, double); \
+	template int runMulsSTEM<T>(MULS *, boost::shared_ptr<WaveFunction<T> >); \
+	template void interimWave<T>(MULS *, boost::shared_ptr<WaveFunction<T> >, int); \
+	template void collectIntensity<T>(MULS *, boost::shared_ptr<WaveFunction<T> >, int); \
+	template void readStartWave<T>(boost::shared_ptr<WaveFunction<T> >); \
+	template void writeBeams<T>(MULS *, boost::shared_ptr<WaveFunction<T> >, int, int); \
+	template void transmit<T>(Array2DView<FFTW<T>::complex>, Array2DView<fftwf_complex>); \
+	template double absorbedIntensity<T>(Array2DView<FFTW<T>::complex>, Array2DView<fftwf_complex>); \
+	template void propagate_slow<T>(Array2DView<FFTW<T>::complex>, int, int, MULS *); \
+	template void fft_normalize<T>(Array2DView<FFTW<T>::complex>, int, int);
 
+INSTANTIATE_WAVE_ROUTINES(float)
+INSTANTIATE_WAVE_ROUTINES(double)
@@ -26,34 +26,63 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "data_containers.h"
 
 
+/**********************************************
+ * The functions working on wave functions are templates
+ * over the precision T of the wave function (float or 
+ * double), they are instantiated for both in stemlib.cpp.
+ *********************************************/
+
 /**********************************************
  * This function creates a incident STEM probe 
  * at position (dx,dy)
  * with parameters given in muls
  *********************************************/
 // int probe(MULS *muls,double dx, double dy);
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny);
-void probe(MULS *muls, WavePtr wave, double dx, double dy);
+template <typename T>
+void probeShiftAndCrop(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, double dx, double dy, double cnx, double cny);
+template <typename T>
+void probe(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, double dx, double dy);
 void probePlot(MULS *muls, WavePtr wave);
 
 void initSTEMSlices(MULS *muls, int nlayer);
-void interimWave(MULS *muls,WavePtr wave,int slice);
-void collectIntensity(MULS *muls, WavePtr wave, int slices);
+template <typename T>
+void interimWave(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int slice);
+template <typename T>
+void collectIntensity(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int slices);
 //void detectorCollect(MULS *muls, WavePtr wave);
 void saveSTEMImages(MULS *muls);
+void saveSTEMShard(MULS *muls);
 
 void make3DSlices(MULS *muls,int nlayer,char *fileName,atom *center);
 void make3DSlicesFFT(MULS *muls,int nlayer,char *fileName,atom *center);
 void createAtomBox(MULS *muls, int Znum, atomBox *aBox);
-void transmit(void **wave,void **trans,int nx, int ny,int posx,int posy);
-void propagate_slow(void** wave,int nx, int ny,MULS *muls);
-fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B);
+void initWaveThreads(MULS *muls);
+template <typename T>
+void transmit(Array2DView<typename FFTW<T>::complex> wave, Array2DView<fftwf_complex> trans);
+template <typename T>
+double absorbedIntensity(Array2DView<typename FFTW<T>::complex> wave, Array2DView<fftwf_complex> trans);
+template <typename T>
+void propagate_slow(Array2DView<typename FFTW<T>::complex> wave, int nx, int ny, MULS *muls);
 fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut);
 fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut,float q);
 fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B);
+/* radial table (Nr steps of dr) of the absorptive potential of TDS, see muls->absorptive */
+fftwf_complex *getAbsorptivePotential(int Znum, MULS *muls,double B,int *Nr,double *dr);
+/* absorptive form factor f'(q)/(gamma lambda) and TDS cross section between the
+ * scattering vectors k0 and k1 (1/A, in units of (gamma lambda)^2) of Znum with
+ * Debye-Waller factor B */
+double absorptiveFormFactor(int Znum, double B, double q);
+double tdsCrossSection(int Znum, double B, double k0, double k1);
+/* shares the absorbed intensity among the detectors, count[Z] and B[Z] (Z = 1..103)
+ * are the number and Debye-Waller factor of the atoms of element Z */
+void absorbedFractions(MULS *muls,const int *count,const double *B);
+/* the atom potential lookup tables are shared by all simulations
+ * with the same sampling, this releases them at the end of the program */
+void freePotentialLUTs();
 
 WAVEFUNC initWave(int nx, int ny);
-void readStartWave(WavePtr wave);
+template <typename T>
+void readStartWave(boost::shared_ptr<WaveFunction<T> > wave);
 /******************************************************************
  * runMulsSTEM() - do the multislice propagation in STEM mode
  *
@@ -61,14 +90,17 @@ void readStartWave(WavePtr wave);
  * the will be updated at return
  *****************************************************************/
 int runMulsSTEM_old(MULS *muls,int lstart);
-int runMulsSTEM(MULS *muls, WavePtr wave);
+template <typename T>
+int runMulsSTEM(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave);
 void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz);
-void fft_normalize(void **array,int nx, int ny);
+template <typename T>
+void fft_normalize(Array2DView<typename FFTW<T>::complex> array, int nx, int ny);
 void showPotential(fftw_complex ***pot,int nz,int nx,int ny,
 		   double dx,double dy,double dz);
 void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,
 			   double z,double B);
-void writeBeams(MULS *muls, WavePtr wave,int ilayer, int absolute_slice);
+template <typename T>
+void writeBeams(MULS *muls, boost::shared_ptr<WaveFunction<T> > wave, int ilayer, int absolute_slice);
 
 /***********************************************************************************
  * old image read/write functions, may soon be outdated
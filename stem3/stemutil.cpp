@@ -36,6 +36,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "matrixlib.h"
 #include "readparams.h"
 #include "fileio_fftw3.h"
+#include "sim_state.h"
 // #include "fileio.h"
 // #include "floatdef.h"
 
@@ -378,6 +379,48 @@ void saveSTEMimages(MULS *muls) {
 
 }  /* end bessi0() */
 
+/*-------------------- bessj0() ---------------*/
+/*
+    Bessel function J0(x)
+    see Abramowitz and Stegun page 369 (9.4.1 and 9.4.3),
+    absolute error < 5e-8
+
+    x = (double) real arguments
+ */
+ double bessj0( double x )
+ {
+ 	int i;
+ 	double ax, sum, t, theta;
+
+ 	double j0a[] = { 1.0, -2.2499997, 1.2656208, -0.3163866,
+		0.0444479, -0.0039444, 0.0002100 };
+
+ 	double j0f[] = { 0.79788456, -0.00000077, -0.00552740,
+ 		-0.00009512, 0.00137237, -0.00072805, 0.00014476 };
+
+ 	double j0t[] = { -0.78539816, -0.04166397, -0.00003954,
+ 		0.00262573, -0.00054125, -0.00029333, 0.00013558 };
+
+	ax = fabs( x );
+	if( ax <= 3.0 ) {
+		t = ax / 3.0;
+		t = t * t;
+		sum = j0a[6];
+		for( i=5; i>=0; i--) sum = sum*t + j0a[i];
+	} else {
+		t = 3.0 / ax;
+		sum = j0f[6];
+		theta = j0t[6];
+		for( i=5; i>=0; i--) {
+			sum = sum*t + j0f[i];
+			theta = theta*t + j0t[i];
+		}
+		sum = sum * cos( ax + theta ) / sqrt( ax );
+	}
+	return( sum );
+
+}  /* end bessj0() */
+
 /*-------------------- bessk0() ---------------*/
 /*
     modified Bessel function K0(x)
@@ -767,7 +810,7 @@ double rangauss( unsigned long *iseed )
 {
   double ranflat( unsigned long* );
   double x1, x2, y;
-  static double tpi=2.0*3.141592654;
+  const double tpi=2.0*3.141592654;
   
   /* be careful to avoid taking log(0) */
   do{
@@ -782,6 +825,54 @@ double rangauss( unsigned long *iseed )
   
 }  /* end rangauss() */
 
+/*-------------------- gaussHermite() -------------------------- */
+/*
+  Nodes x[0..n-1] and weights w[0..n-1] of the n-point Gauss-Hermite
+  quadrature for the standard normal distribution:
+  <f(X)> = sum_i w[i]*f(x[i]) (exact for polynomials up to degree 2n-1)
+  
+  ref.  Numerical Recipes, 2nd edit. page 154 (gauher), nodes scaled 
+  by sqrt(2) and weights by 1/sqrt(pi) for a unit variance gaussian
+*/
+void gaussHermite( int n, double *x, double *w )
+{
+  int i, its, j, m;
+  double p1, p2, p3, pp=1, z=0, z1;
+  const double pim4=0.7511255444649425, eps=3.0e-14;
+  
+  m = (n+1)/2;
+  for( i=0; i<m; i++ ) {
+    /* initial guesses for the largest roots */
+    if( i == 0 ) z = sqrt( (double)(2*n+1) ) - 1.85575*pow( (double)(2*n+1), -0.16667 );
+    else if( i == 1 ) z -= 1.14*pow( (double)n, 0.426 )/z;
+    else if( i == 2 ) z = 1.86*z - 0.86*x[0];
+    else if( i == 3 ) z = 1.91*z - 0.91*x[1];
+    else z = 2.0*z - x[i-2];
+    /* refine by Newton's method */
+    for( its=0; its<10; its++ ) {
+      p1 = pim4;
+      p2 = 0.0;
+      for( j=1; j<=n; j++ ) {
+        p3 = p2;
+        p2 = p1;
+        p1 = z*sqrt( 2.0/j )*p2 - sqrt( ((double)(j-1))/j )*p3;
+      }
+      pp = sqrt( (double)(2*n) )*p2;
+      z1 = z;
+      z = z1 - p1/pp;
+      if( fabs( z-z1 ) <= eps ) break;
+    }
+    x[i] = z;
+    x[n-1-i] = -z;
+    w[i] = 2.0/(pp*pp);
+    w[n-1-i] = w[i];
+  }
+  for( i=0; i<n; i++ ) {
+    x[i] *= sqrt( 2.0 );
+    w[i] /= sqrt( 3.141592653589793 );
+  }
+}  /* end gaussHermite() */
+
 /*************************************************************/
 /*--------------------- ReadfeTable() -----------------------*/
 /*
@@ -1101,7 +1192,7 @@ double seval( double *x, double *y, double *b, double *c,
 */
 double ranflat( unsigned long *iseed )
 {
-  static unsigned long a=1366, c=150889L, m=714025L;
+  const unsigned long a=1366, c=150889L, m=714025L;
   
   *iseed = ( a * (*iseed) + c ) % m;
   
@@ -1428,14 +1519,15 @@ double sfLUT(double s,int atKind, MULS *muls)
 {
    int i;
    double sf;
-   static double *splinx=NULL;
-   static double **spliny=NULL;
-   static double **splinb=NULL;
-   static double **splinc=NULL;
-   static double **splind=NULL;
-   static int sfSize = 0;
-   static int atKinds = 0;
-   static double maxK = 0;
+   sfSplineState &sp = simState(muls)->sf;
+   double *&splinx = sp.splinx;
+   double **&spliny = sp.spliny;
+   double **&splinb = sp.splinb;
+   double **&splinc = sp.splinc;
+   double **&splind = sp.splind;
+   int &sfSize = sp.sfSize;
+   int &atKinds = sp.atKinds;
+   double &maxK = sp.maxK;
 
    if(splinx == NULL) {
      // splinx = s;
@@ -1475,9 +1567,9 @@ double sfLUT(double s,int atKind, MULS *muls)
  */ 
 #define FX (ptr[xi-1]*x0 + ptr[xi]*x1 + ptr[xi+1]*x2 + ptr[xi+2]*x)
 double bicubic(double **ff,int Nz, int Nx,double z,double x) {
-  static double x0,x1,x2,f;
-  static double *ptr;
-  static int xi,zi;
+  double x0,x1,x2,f;
+  double *ptr;
+  int xi,zi;
 
   // Now interpolate using computationally efficient algorithm.
   // s and t are the x- and y- coordinates of the points we are looking for
@@ -55,7 +55,7 @@ typedef struct timezone timez;
 
 int writeCFG(atom *atoms,int natoms,char *fileName, MULS *muls);
 int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
-		       int icz,int atomCount,double dw,int maxAtom, int Znum);
+		       int icz,size_t site,int atomCount,double dw,int maxAtom, int Znum);
 
 void *memcopy(void *dest, const void *src, size_t n);
 // void saveSTEMimages(MULS *muls);
@@ -72,10 +72,12 @@ double vzatom( int Z, double radius,int tdsFlag,int scatFlag);
 
 double gasdev(long *idum);
 double rangauss( unsigned long *iseed );
+void gaussHermite( int n, double *x, double *w );
 int ReadfeTable(int scatFlag );
 int ReadLine( FILE* fpRead, char* cRead, int cMax, const char *mesg );
 int getZNumber(char *element);
 double sigma( double kev );
+double bessj0( double x );
 void splinh( double x[], double y[],
 	     double b[], double c[], double d[], int n);
 double seval( double *x, double *y, double *b, double *c,
@@ -0,0 +1,182 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>	/*  ANSI-C libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include "data_containers.h"
+#include "imagelib_fftw3.h"
+#include "fft_plans.h"
+#include "stemutil.h"
+#include "tem_imaging.h"
+
+/* aberration function chi(kx,ky) for defocus df (A), as in probe() */
+static double aberrationPhase(const MULS &muls, double kx, double ky, double df, double wavlen) {
+	double theta2,theta,thetaN,phi,chi;
+	const double pi=3.1415926535897;
+
+	theta2 = (kx*kx+ky*ky)*wavlen*wavlen;
+	theta = sqrt(theta2);
+	phi = atan2(ky,kx);
+	chi = theta2*(df+muls.astigMag*cos(2.0*(phi-muls.astigAngle)))/2.0;
+	thetaN = theta2*theta;  // theta^3
+	chi += thetaN*(muls.a33*cos(3.0*(phi-muls.phi33))+muls.a31*cos(phi-muls.phi31))/3.0;
+	thetaN *= theta;        // theta^4
+	chi += thetaN*(muls.a44*cos(4.0*(phi-muls.phi44))+muls.a42*cos(2.0*(phi-muls.phi42))+muls.Cs)/4.0;
+	thetaN *= theta;        // theta^5
+	chi += thetaN*(muls.a55*cos(5.0*(phi-muls.phi55))+muls.a53*cos(3.0*(phi-muls.phi53))+muls.a51*cos(phi-muls.phi51))/5.0;
+	thetaN *= theta;        // theta^6
+	chi += thetaN*(muls.a66*cos(6.0*(phi-muls.phi66))+muls.a64*cos(4.0*(phi-muls.phi64))+muls.a62*cos(2.0*(phi-muls.phi62))+muls.C5)/6.0;
+	return chi*2.0*pi/wavlen;
+}
+
+template <typename T>
+void temImageSeries(MULS &muls, WaveFunction<T> &wave, Array3D<float_tt> &series) {
+	typedef typename FFTW<T>::complex complex;
+	const double pi=3.1415926535897;
+	int nx = muls.nx, ny = muls.ny;
+	int nDf = (int)muls.imageDefoci.size();
+	int nq,nFFT,nBatch,first,b,f,idf,ix,iy,n[2];
+	double wavlen,delta,alpha,k2max,kx,ky,k2,dk,chi,gx,gy,env,norm,df;
+	std::vector<double> qx,qw;
+	char fileName[1024],comment[64];
+	std::vector<double> params(9+nDf);
+	FILE *fp;
+
+	if (nDf == 0) return;
+	wavlen = wavelength(muls.v0);
+	delta = muls.Cc*muls.energySpread;
+	alpha = 0.001*muls.alpha;
+	k2max = (muls.aobj > 0) ? sin(0.001*muls.aobj)/wavlen : 0;
+	k2max *= k2max;
+
+	/* defocus offsets (in units of delta) and weights of the focal spread */
+	nq = 1;
+	if ((muls.imageCoherence == IMAGE_QUADRATURE) && (delta > 0))
+		nq = (muls.focalSpreadPoints > 0) ? muls.focalSpreadPoints : 7;
+	qx.resize(nq);
+	qw.resize(nq);
+	gaussHermite(nq,&qx[0],&qw[0]);
+
+	/* spectrum of the exit wave */
+	Array2D<complex> spectrum(nx,ny,"image spectrum");
+	memcpy(spectrum.Data(),wave.wave.Data(),spectrum.Size()*sizeof(complex));
+	executePlan(wave.fftPlanWaveForw,spectrum.Data());
+
+	if (series.Nz() != nDf) series.Resize(nDf,nx,ny,"image series");
+	Array3D<float_tt> current(nDf,nx,ny,"image series");
+
+	/* all defoci (and focal spread points) in batches of IMAGE_BATCH FFTs */
+	nFFT = nDf*nq;
+	nBatch = (nFFT < IMAGE_BATCH) ? nFFT : IMAGE_BATCH;
+	n[0] = nx; n[1] = ny;
+	typename FFTW<T>::plan plan = sharedPlan<T>(PLAN_WAVE,2,n,nBatch,FFTW_BACKWARD);
+	Array3D<complex> batch(nBatch,nx,ny,"image batch");
+	dk = 1e-3/(nx*muls.resolutionX);  // step for the gradient of chi
+	norm = 1.0/((double)nx*(double)ny);
+	norm *= norm;
+
+	for (first=0;first<nFFT;first+=nBatch) {
+		for (b=0;b<nBatch;b++) {
+			complex *out = batch[b].Data();
+			f = first+b;
+			if (f >= nFFT) {
+				memset(out,0,(size_t)nx*ny*sizeof(complex));
+				continue;
+			}
+			df = muls.imageDefoci[f/nq]+qx[f%nq]*delta;
+#pragma omp parallel for private(iy,kx,ky,k2,chi,gx,gy,env)
+			for (ix=0;ix<nx;ix++) {
+				kx = ((ix > nx/2) ? ix-nx : ix)/(nx*muls.resolutionX);
+				for (iy=0;iy<ny;iy++) {
+					ky = ((iy > ny/2) ? iy-ny : iy)/(ny*muls.resolutionY);
+					k2 = kx*kx+ky*ky;
+					if ((k2max > 0) && (k2 > k2max)) {
+						out[ix*ny+iy][0] = out[ix*ny+iy][1] = 0;
+						continue;
+					}
+					chi = aberrationPhase(muls,kx,ky,df,wavlen);
+					env = 1;
+					if (alpha > 0) {
+						gx = (aberrationPhase(muls,kx+dk,ky,df,wavlen)-aberrationPhase(muls,kx-dk,ky,df,wavlen))/(2*dk);
+						gy = (aberrationPhase(muls,kx,ky+dk,df,wavlen)-aberrationPhase(muls,kx,ky-dk,df,wavlen))/(2*dk);
+						env *= exp(-alpha*alpha/(4*wavlen*wavlen)*(gx*gx+gy*gy));
+					}
+					if ((nq == 1) && (delta > 0)) env *= exp(-0.5*pi*pi*wavlen*wavlen*delta*delta*k2*k2);
+					out[ix*ny+iy][0] = (T)(env*(spectrum[ix][iy][0]*cos(chi)+spectrum[ix][iy][1]*sin(chi)));
+					out[ix*ny+iy][1] = (T)(env*(spectrum[ix][iy][1]*cos(chi)-spectrum[ix][iy][0]*sin(chi)));
+				}
+			}
+		}
+		executePlan(plan,batch.Data());
+		for (b=0;(b<nBatch) && (first+b<nFFT);b++) {
+			const complex *in = batch[b].Data();
+			float_tt *image = current[(first+b)/nq].Data();
+			env = qw[(first+b)%nq]*norm;
+			for (ix=0;ix<nx*ny;ix++) image[ix] += (float_tt)(env*(in[ix][0]*in[ix][0]+in[ix][1]*in[ix][1]));
+		}
+	}
+
+	/* average over the TDS runs and write the series */
+	for (idf=0;idf<nDf;idf++) {
+		float_tt *avg = series[idf].Data();
+		const float_tt *image = current[idf].Data();
+		for (ix=0;ix<nx*ny;ix++) avg[ix] = (muls.avgCount*avg[ix]+image[ix])/(muls.avgCount+1);
+		params[9+idf] = muls.imageDefoci[idf];
+	}
+	params[0] = muls.v0;
+	params[1] = muls.Cs;
+	params[3] = muls.astigMag;
+	params[4] = muls.astigAngle;
+	params[5] = delta;
+	params[6] = muls.alpha;
+	params[7] = muls.btiltx;
+	params[8] = muls.btilty;
+	params[2] = muls.imageDefoci[0];
+	CImageIO stackIO(nDf*nx,ny,wave.thickness,muls.resolutionX,muls.resolutionY,params,
+		"Defocus series of image intensities, defoci in A from parameter 9 on");
+	sprintf(fileName,"%s/defocus_stack.img",muls.folder);
+	stackIO.WriteRealImage((void **)series.Rows(0),fileName);
+	params.resize(9);
+	CImageIO imageIO(nx,ny,wave.thickness,muls.resolutionX,muls.resolutionY);
+	for (idf=0;(muls.saveLevel > 0) && (idf<nDf);idf++) {
+		params[2] = muls.imageDefoci[idf];
+		imageIO.SetParams(params);
+		sprintf(comment,"Image intensity, defocus %g nm",0.1*muls.imageDefoci[idf]);
+		imageIO.SetComment(comment);
+		sprintf(fileName,"%s/defocus_%d.img",muls.folder,idf);
+		imageIO.WriteRealImage((void **)series.Rows(idf),fileName);
+	}
+	sprintf(fileName,"%s/defocusSeries.txt",muls.folder);
+	if ((fp = fopen(fileName,"w")) == NULL) {
+		printf("Warning: cannot write %s\n",fileName);
+		return;
+	}
+	fprintf(fp,"# defocus_stack.img (%s, %d TDS runs)\n",(nq > 1) ? "focal spread quadrature" : "envelopes",muls.avgCount+1);
+	fprintf(fp,"# image defocus[nm]\n");
+	for (idf=0;idf<nDf;idf++) fprintf(fp,"%d %g\n",idf,0.1*muls.imageDefoci[idf]);
+	fclose(fp);
+}
+
+template void temImageSeries<float>(MULS &muls, WaveFunction<float> &wave, Array3D<float_tt> &series);
+template void temImageSeries<double>(MULS &muls, WaveFunction<double> &wave, Array3D<float_tt> &series);
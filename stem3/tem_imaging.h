@@ -0,0 +1,62 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TEM_IMAGING_H
+#define TEM_IMAGING_H
+
+#include "data_containers.h"
+
+/**************************************************************
+ * Imaging stage of doTEM: a defocus series from one exit wave.
+ *
+ * The exit wave is Fourier transformed once.  For every defocus
+ * of muls->imageDefoci the objective transfer function
+ * exp(-i chi(k)) (C1 = defocus, astigmatism, Cs, C5, a33..a66 as
+ * in probe()), the objective aperture muls->aobj (mrad, 0: none)
+ * and the partial coherence are applied, and the images of up to
+ * IMAGE_BATCH defoci are transformed back by one batched FFT.
+ * Partial coherence (focal spread Delta = Cc*muls->energySpread,
+ * illumination semi-angle alpha):
+ *  IMAGE_ENVELOPE    quasi-coherent, the spectrum is damped by
+ *                    Et(k) = exp(-0.5*(pi*lambda*Delta*k^2)^2) and
+ *                    Es(k) = exp(-(alpha/(2*lambda))^2*|grad chi|^2)
+ *  IMAGE_QUADRATURE  the image intensities of focalSpreadPoints
+ *                    (default 7) defoci df+x*Delta are added with
+ *                    the weights of the Gauss-Hermite quadrature
+ *                    (gaussHermite(), Es as above)
+ * The images are averaged over the TDS runs and written to one
+ * stack, muls->folder/defocus_stack.img (image k in rows
+ * k*nx..(k+1)*nx-1, parameters: v0, Cs, the first defocus,
+ * astigMag, astigAngle, focal spread, alpha, btiltx, btilty,
+ * then the defocus of every image in A), listed in
+ * muls->folder/defocusSeries.txt.  With save level > 0 image k
+ * is also written to muls->folder/defocus_<k>.img.
+ **************************************************************/
+
+#define IMAGE_ENVELOPE   0
+#define IMAGE_QUADRATURE 1
+#define IMAGE_BATCH      8
+
+/* adds the images of the exit wave (real space, not changed) of run
+ * muls->avgCount to series [defocus][x][y] and writes the series */
+template <typename T>
+void temImageSeries(MULS &muls, WaveFunction<T> &wave, Array3D<float_tt> &series);
+
+#endif // TEM_IMAGING_H
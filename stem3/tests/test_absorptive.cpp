@@ -0,0 +1,77 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stemlib.h"
+#include "stemutil.h"
+#include <math.h>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE (TestAbsorptive)
+
+BOOST_AUTO_TEST_CASE (testBessj0)
+{
+  // Abramowitz and Stegun, table 9.1 and the first zero
+  BOOST_CHECK_SMALL(bessj0(0.0)-1.0, 1e-7);
+  BOOST_CHECK_SMALL(bessj0(1.0)-0.7651976866, 1e-7);
+  BOOST_CHECK_SMALL(bessj0(-1.0)-0.7651976866, 1e-7);
+  BOOST_CHECK_SMALL(bessj0(2.404825557695773), 1e-7);
+  BOOST_CHECK_SMALL(bessj0(5.0)+0.1775967713, 1e-7);
+  BOOST_CHECK_SMALL(bessj0(10.0)+0.2459357645, 1e-7);
+}
+
+BOOST_AUTO_TEST_CASE (testCrossSectionIsForwardFormFactor)
+{
+  // 2 gamma lambda f'(0) is the TDS cross section of the atom (Hall and Hirsch)
+  const int Z[] = {6, 14, 79};
+  int i;
+
+  for (i=0;i<3;i++) {
+    double f0 = absorptiveFormFactor(Z[i], 0.5, 0);
+    BOOST_CHECK(f0 > 0);
+    BOOST_CHECK_CLOSE(tdsCrossSection(Z[i], 0.5, 0, 100), 2*f0, 1.0);
+  }
+  // no vibrations, no diffuse scattering
+  BOOST_CHECK_SMALL(absorptiveFormFactor(14, 0, 0), 1e-12);
+  BOOST_CHECK_EQUAL(tdsCrossSection(14, 0.5, 2, 1), 0);
+}
+
+BOOST_AUTO_TEST_CASE (testAbsorbedIntensity)
+{
+  Array2D<fftw_complex> w(4, 4);
+  Array2D<fftwf_complex> t(4, 4);
+  int ix, iy;
+
+  // |w|^2 = 1/16, |t|^2 = 0.25: three quarters of the intensity are absorbed
+  for (ix=0;ix<4;ix++) for (iy=0;iy<4;iy++) {
+    w[ix][iy][0] = 0.25*cos(0.3*ix);  w[ix][iy][1] = 0.25*sin(0.3*ix);
+    t[ix][iy][0] = 0.3f;  t[ix][iy][1] = 0.4f;
+  }
+  BOOST_CHECK_CLOSE(absorbedIntensity<double>(w.View(), t.View()), 0.75, 1e-4);
+}
+
+BOOST_AUTO_TEST_CASE (testAbsorbedFractions)
+{
+  MULS muls = MULS();
+  std::vector<int> count(104, 0);
+  std::vector<double> B(104, 0);
+
+  muls.detectorNum = 1;
+  muls.detectors.resize(1);
+  muls.detectors[0].push_back(DetectorPtr(new Detector(2, 2, 1.0f, 1.0f)));
+  muls.detectors[0][0]->k2Inside = 0.5f*0.5f;
+  muls.detectors[0][0]->k2Outside = 3.0f*3.0f;
+  count[14] = 8;
+  B[14] = 0.5;
+
+  // without the absorptive potential nothing is added to the detectors
+  muls.absorptive = 0;
+  muls.absorbedToDetectors = 1;
+  absorbedFractions(&muls, &count[0], &B[0]);
+  BOOST_CHECK_EQUAL(muls.detectors[0][0]->absorbedFraction, 0);
+
+  muls.absorptive = 1;
+  absorbedFractions(&muls, &count[0], &B[0]);
+  BOOST_CHECK_CLOSE(muls.detectors[0][0]->absorbedFraction,
+                    tdsCrossSection(14, 0.5, 0.5, 3)/tdsCrossSection(14, 0.5, 0, 100), 1e-3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()